@@ -0,0 +1,104 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <folly/container/F14Map.h>
+
+namespace dwarfs {
+
+class filesystem_v2;
+
+/**
+ * Ordered list of paths, usually in the order in which they were
+ * first read from a mounted image
+ *
+ * The text representation has one path per line, relative to the root
+ * of the file system and using `/` as separator. Empty lines and lines
+ * starting with `#` are ignored.
+ */
+class access_profile {
+ public:
+  static access_profile parse(std::istream& is);
+  static access_profile load(std::string const& path);
+
+  /**
+   * Append a path, unless it is already part of the profile
+   */
+  void add(std::string_view path);
+
+  /**
+   * Position of a path in the profile, if present
+   */
+  std::optional<size_t> rank(std::string const& path) const;
+
+  std::vector<std::string> const& paths() const { return paths_; }
+  size_t size() const { return paths_.size(); }
+  bool empty() const { return paths_.empty(); }
+
+  void write(std::ostream& os) const;
+
+ private:
+  std::vector<std::string> paths_;
+  folly::F14FastMap<std::string, size_t> rank_;
+};
+
+/**
+ * Records the order in which inodes of a file system are first read
+ *
+ * `record()` is safe to call concurrently. After the first read of an
+ * inode, it is only a single relaxed atomic load.
+ */
+class access_recorder {
+ public:
+  explicit access_recorder(size_t num_inodes);
+
+  void record(uint32_t inode);
+
+  std::vector<uint32_t> inodes() const;
+
+  /**
+   * Build a profile by resolving the recorded inodes to paths
+   *
+   * Inodes with multiple names (hardlinks) are represented by the
+   * first name found.
+   */
+  access_profile profile(filesystem_v2 const& fs) const;
+
+ private:
+  std::unique_ptr<std::atomic<bool>[]> seen_;
+  size_t num_inodes_;
+  std::mutex mutable mx_;
+  std::vector<uint32_t> order_;
+};
+
+} // namespace dwarfs
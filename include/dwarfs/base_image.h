@@ -0,0 +1,139 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "dwarfs/fstypes.h"
+
+namespace dwarfs {
+
+class filesystem_writer;
+class inode;
+class logger;
+class mmif;
+
+struct file_stat;
+
+struct base_image_options {
+  double reuse_threshold{0.9};
+  uint32_t time_resolution_sec{1};
+  // reference the base image's blocks instead of copying them
+  bool delta{false};
+  // base images of the base image, if it is a delta image itself
+  std::vector<std::shared_ptr<mmif>> base_images;
+};
+
+/**
+ * An existing image whose blocks can be reused when building a new image
+ *
+ * Files are matched against the base image by path, size and mtime.
+ * A block of the base image is reused verbatim if at least a fraction
+ * of `reuse_threshold` of the data referenced from that block belongs
+ * to files that are unchanged in the new image. Unchanged files whose
+ * data is stored in reused blocks don't need to be read, segmented or
+ * compressed again; all other files are scanned as usual.
+ *
+ * Reused blocks are written before any new blocks, so block `i` of
+ * the new image is the `i`-th reused block of the base image.
+ *
+ * In `delta` mode, no blocks are copied. Instead, the new image
+ * references all blocks of the base image (including those of its own
+ * base images), which must be available when the new image is used.
+ * The new image's own blocks are numbered after `block_offset()` base
+ * blocks, and all base images are listed by `layers()`.
+ */
+class base_image {
+ public:
+  base_image(logger& lgr, std::shared_ptr<mmif> mm,
+             base_image_options const& opts);
+
+  size_t block_size() const { return impl_->block_size(); }
+
+  /**
+   * Look up an unchanged regular file by its path relative to the root
+   *
+   * Returns the inode number of the file in the base image if a file
+   * with the same size and mtime exists at the same path.
+   */
+  std::optional<uint32_t>
+  find_unchanged(std::string const& path, file_stat const& st) const {
+    return impl_->find_unchanged(path, st);
+  }
+
+  /**
+   * Select the blocks to reuse given the inodes of all unchanged files
+   *
+   * Must be called exactly once, before any of the methods below.
+   */
+  void select_blocks(std::span<uint32_t const> inodes) {
+    impl_->select_blocks(inodes);
+  }
+
+  bool can_reuse(uint32_t inode) const { return impl_->can_reuse(inode); }
+
+  /**
+   * Add the chunks of a reusable inode to `ino`, with block numbers
+   * relative to the new image
+   */
+  void add_chunks(uint32_t inode, dwarfs::inode& ino) const {
+    impl_->add_chunks(inode, ino);
+  }
+
+  void copy_blocks(filesystem_writer& fsw) const { impl_->copy_blocks(fsw); }
+
+  /**
+   * Number of blocks preceding the blocks written to the new image
+   */
+  size_t block_offset() const { return impl_->block_offset(); }
+
+  /**
+   * Base images the new image depends on, in block number order
+   */
+  std::vector<base_image_info> layers() const { return impl_->layers(); }
+
+  class impl {
+   public:
+    virtual ~impl() = default;
+
+    virtual size_t block_size() const = 0;
+    virtual std::optional<uint32_t>
+    find_unchanged(std::string const& path, file_stat const& st) const = 0;
+    virtual void select_blocks(std::span<uint32_t const> inodes) = 0;
+    virtual bool can_reuse(uint32_t inode) const = 0;
+    virtual void add_chunks(uint32_t inode, dwarfs::inode& ino) const = 0;
+    virtual void copy_blocks(filesystem_writer& fsw) const = 0;
+    virtual size_t block_offset() const = 0;
+    virtual std::vector<base_image_info> layers() const = 0;
+  };
+
+ private:
+  std::unique_ptr<impl> impl_;
+};
+
+} // namespace dwarfs
@@ -27,6 +27,7 @@
 #include <future>
 #include <memory>
 
+#include "dwarfs/block_cache_stats.h"
 #include "dwarfs/block_compressor.h"
 #include "dwarfs/block_range.h"
 #include "dwarfs/fstypes.h"
@@ -39,16 +40,25 @@ struct cache_tidy_config;
 class fs_section;
 class logger;
 class mmif;
+class performance_monitor;
 
 class block_cache {
  public:
   block_cache(logger& lgr, std::shared_ptr<mmif> mm,
-              const block_cache_options& options);
+              const block_cache_options& options,
+              std::shared_ptr<performance_monitor const> perfmon = nullptr);
 
   size_t block_count() const { return impl_->block_count(); }
 
   void insert(fs_section const& section) { impl_->insert(section); }
 
+  /**
+   * Insert a block stored in a different image, e.g. a base image
+   */
+  void insert(fs_section const& section, std::shared_ptr<mmif> mm) {
+    impl_->insert(section, std::move(mm));
+  }
+
   void set_block_size(size_t size) { impl_->set_block_size(size); }
 
   void set_num_workers(size_t num) { impl_->set_num_workers(num); }
@@ -62,17 +72,22 @@ class block_cache {
     return impl_->get(block_no, offset, size);
   }
 
+  block_cache_stats get_stats() const { return impl_->get_stats(); }
+
   class impl {
    public:
     virtual ~impl() = default;
 
     virtual size_t block_count() const = 0;
     virtual void insert(fs_section const& section) = 0;
+    virtual void
+    insert(fs_section const& section, std::shared_ptr<mmif> mm) = 0;
     virtual void set_block_size(size_t size) = 0;
     virtual void set_num_workers(size_t num) = 0;
     virtual void set_tidy_config(cache_tidy_config const& cfg) = 0;
     virtual std::future<block_range>
     get(size_t block_no, size_t offset, size_t length) const = 0;
+    virtual block_cache_stats get_stats() const = 0;
   };
 
  private:
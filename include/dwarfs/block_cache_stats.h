@@ -0,0 +1,50 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace dwarfs {
+
+struct block_cache_stats {
+  uint64_t range_requests{0};
+  uint64_t active_hits_fast{0};
+  uint64_t active_hits_slow{0};
+  uint64_t cache_hits_fast{0};
+  uint64_t cache_hits_slow{0};
+  uint64_t blocks_created{0};
+  uint64_t blocks_evicted{0};
+  uint64_t blocks_verified{0};
+  uint64_t blocks_tidied{0};
+  uint64_t sets_merged{0};
+  uint64_t partially_decompressed{0};
+  uint64_t bytes_decompressed{0};
+  uint64_t cached_blocks{0};
+  uint64_t max_cached_blocks{0};
+  uint64_t active_blocks{0};
+  uint64_t num_shards{0};
+  uint64_t num_workers{0};
+  uint64_t queue_depth{0};
+  double worker_cpu_time{0.0};
+};
+
+} // namespace dwarfs
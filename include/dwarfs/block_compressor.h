@@ -63,6 +63,20 @@ class block_compressor {
     return impl_->compress(std::move(data));
   }
 
+  /**
+   * Compress `data` using up to `num_threads` threads
+   *
+   * This is only used by compressors configured for multithreaded
+   * compression (e.g. `zstd:mt`), all other compressors ignore
+   * `num_threads`. The output of a multithreaded compressor does not
+   * depend on the number of threads actually used, so `num_threads`
+   * can safely be chosen based on the current load.
+   */
+  std::vector<uint8_t>
+  compress(std::vector<uint8_t> const& data, size_t num_threads) const {
+    return impl_->compress(data, num_threads);
+  }
+
   compression_type type() const { return impl_->type(); }
 
   class impl {
@@ -75,6 +89,10 @@ class block_compressor {
     compress(const std::vector<uint8_t>& data) const = 0;
     virtual std::vector<uint8_t>
     compress(std::vector<uint8_t>&& data) const = 0;
+    virtual std::vector<uint8_t>
+    compress(const std::vector<uint8_t>& data, size_t /*num_threads*/) const {
+      return compress(data);
+    }
 
     virtual compression_type type() const = 0;
   };
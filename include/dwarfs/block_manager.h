@@ -23,10 +23,20 @@
 
 #include <cstddef>
 #include <memory>
+#include <optional>
 #include <vector>
 
+#include "dwarfs/entropy.h"
+#include "dwarfs/types.h"
+
 namespace dwarfs {
 
+namespace thrift::metadata {
+
+class chunk;
+
+} // namespace thrift::metadata
+
 class filesystem_writer;
 class inode;
 class logger;
@@ -42,21 +52,30 @@ class block_manager {
     size_t memory_limit{256 << 20};
     unsigned block_size_bits{22};
     unsigned bloom_filter_size{4};
+    std::optional<double> incompressible_threshold;
+    size_t incompressible_min_size{entropy_estimator::min_file_size};
   };
 
   block_manager(logger& lgr, progress& prog, const config& cfg,
-                std::shared_ptr<os_access> os, filesystem_writer& fsw);
+                std::shared_ptr<os_access> os, filesystem_writer& fsw,
+                fragment_category category);
 
   void add_inode(std::shared_ptr<inode> ino) { impl_->add_inode(ino); }
 
   void finish_blocks() { impl_->finish_blocks(); }
 
+  void map_logical_blocks(std::vector<thrift::metadata::chunk>& vec) const {
+    impl_->map_logical_blocks(vec);
+  }
+
   class impl {
    public:
     virtual ~impl() = default;
 
     virtual void add_inode(std::shared_ptr<inode> ino) = 0;
     virtual void finish_blocks() = 0;
+    virtual void
+    map_logical_blocks(std::vector<thrift::metadata::chunk>& vec) const = 0;
   };
 
  private:
@@ -41,6 +41,9 @@ class block_range {
   auto end() const { return span_.end(); }
   auto size() const { return span_.size(); }
 
+  // a range within this range, keeping the underlying block alive
+  block_range subrange(size_t offset, size_t size) const;
+
  private:
   std::span<uint8_t const> span_;
   std::shared_ptr<cached_block const> block_;
@@ -0,0 +1,98 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dwarfs/types.h"
+
+namespace dwarfs {
+
+class mmif;
+
+struct categorizer_options;
+
+/**
+ * A categorizer assigns a category to a file based on its contents
+ *
+ * Files of different categories will be stored in separate streams
+ * of blocks, each of which can use a different compressor.
+ */
+class categorizer {
+ public:
+  virtual ~categorizer() = default;
+
+  virtual std::string_view name() const = 0;
+  virtual std::span<std::string_view const> categories() const = 0;
+
+  /**
+   * Returns an index into `categories()`, or `std::nullopt` if this
+   * categorizer doesn't know how to categorize the file.
+   */
+  virtual std::optional<size_t>
+  categorize(std::filesystem::path const& path, mmif const& mm) const = 0;
+};
+
+class categorizer_manager {
+ public:
+  static constexpr fragment_category default_category{0};
+
+  categorizer_manager();
+
+  static std::vector<std::string_view> const& builtin_categorizers();
+
+  static std::unique_ptr<categorizer>
+  create_builtin(std::string_view name, categorizer_options const& opts);
+
+  void add(std::unique_ptr<categorizer> c);
+
+  /**
+   * Categorize a file
+   *
+   * The categorizers are asked in the order they were added and the
+   * first match wins. If there's no match, the default category will
+   * be returned.
+   */
+  fragment_category
+  categorize(std::filesystem::path const& path, mmif const* mm) const;
+
+  size_t num_categories() const { return names_.size(); }
+
+  std::string_view category_name(fragment_category c) const;
+  std::optional<fragment_category> category_value(std::string_view name) const;
+
+  std::vector<std::string> const& category_names() const { return names_; }
+
+ private:
+  std::vector<std::unique_ptr<categorizer>> categorizers_;
+  std::vector<fragment_category> first_category_;
+  std::vector<std::string> names_;
+};
+
+} // namespace dwarfs
@@ -0,0 +1,69 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+namespace dwarfs {
+
+/**
+ * Picks one of a range of compression levels based on the load of the
+ * compression workers
+ *
+ * Levels are numbered from fastest (0) to strongest, and the controller
+ * starts with the strongest level. The load is the number of sections
+ * waiting for or undergoing compression. It is averaged over a number of
+ * blocks before the level is changed by a single step, to avoid
+ * oscillating.
+ */
+class compression_level_controller {
+ public:
+  explicit compression_level_controller(size_t num_levels);
+
+  /**
+   * Record the load at the time a block is submitted
+   *
+   * \param active    Sections waiting for or undergoing compression.
+   * \param workers   Number of compression workers.
+   * \param capacity  Number of sections that fit into the queue before
+   *                  submitting a block has to wait.
+   *
+   * \returns The level to use for the block.
+   */
+  size_t update(size_t active, size_t workers, size_t capacity);
+
+  size_t level() const { return level_; }
+
+  /**
+   * Average load over the last completed sampling period
+   */
+  double last_average() const { return last_average_; }
+
+ private:
+  size_t const num_levels_;
+  size_t level_;
+  size_t samples_{0};
+  size_t active_sum_{0};
+  double last_average_{0.0};
+};
+
+} // namespace dwarfs
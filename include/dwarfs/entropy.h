@@ -0,0 +1,80 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+namespace dwarfs {
+
+class mmif;
+
+/**
+ * Fast order-0 entropy estimator
+ *
+ * This only looks at the byte distribution of the data, so it won't
+ * detect redundancy in the form of repeated sequences. It is, however,
+ * good enough to spot data that has already been compressed or
+ * encrypted, which is what it's used for.
+ */
+class entropy_estimator {
+ public:
+  /**
+   * Smallest file size for which an estimate is worth computing
+   *
+   * Below this, the estimate is unreliable and there's little to gain
+   * from treating a file as incompressible.
+   */
+  static constexpr size_t min_file_size = 64 << 10;
+
+  /**
+   * Estimated entropy of a whole file in bits per byte
+   *
+   * Returns std::nullopt if the file is smaller than `min_size`.
+   */
+  static std::optional<double>
+  estimate(mmif const& mm, size_t min_size = min_file_size);
+
+  void update(uint8_t const* data, size_t size);
+
+  /**
+   * Update the estimator with samples spread evenly across a file
+   *
+   * If the file is small enough, all of its data will be used.
+   */
+  void update_sampled(mmif const& mm, size_t max_bytes = 1 << 20);
+
+  size_t size() const { return size_; }
+
+  /**
+   * Estimated entropy in bits per byte, between 0 and 8
+   */
+  double bits_per_byte() const;
+
+ private:
+  std::array<uint64_t, 256> hist_{};
+  size_t size_{0};
+};
+
+} // namespace dwarfs
@@ -69,17 +69,22 @@ class entry : public entry_interface {
  public:
   enum type_t { E_FILE, E_DIR, E_LINK, E_DEVICE, E_OTHER };
 
-  entry(std::filesystem::path const& path, std::shared_ptr<entry> parent,
-        file_stat const& st);
-
-  bool has_parent() const;
-  std::shared_ptr<entry> parent() const;
-  void set_name(std::string const& name);
+  /**
+   * `name` must outlive the entry, it is usually interned by the
+   * `entry_factory` creating the entry
+   */
+  entry(std::string const& name, entry* parent, file_stat const& st);
+
+  bool has_parent() const { return parent_ != nullptr; }
+  entry* parent() const { return parent_; }
+  void clear_name();
   std::filesystem::path fs_path() const;
   std::string path_as_string() const override;
   std::string dpath() const override;
   std::string unix_dpath() const override;
-  std::string const& name() const override { return name_; }
+  // path relative to the root entry, using `/` as separator
+  std::string unix_relpath() const;
+  std::string const& name() const override { return *name_; }
   bool less_revpath(entry const& rhs) const;
   size_t size() const override { return stat_.size; }
   virtual type_t type() const = 0;
@@ -92,7 +97,7 @@ class entry : public entry_interface {
   void update(global_entry_data& data) const;
   virtual void accept(entry_visitor& v, bool preorder = false) = 0;
   virtual void scan(os_access& os, progress& prog) = 0;
-  file_stat const& status() const { return stat_; }
+  file_stat status() const;
   void set_entry_index(uint32_t index) { entry_index_ = index; }
   std::optional<uint32_t> const& entry_index() const { return entry_index_; }
   uint64_t raw_inode_num() const { return stat_.ino; }
@@ -117,11 +122,25 @@ class entry : public entry_interface {
   void override_size(size_t size) { stat_.size = size; }
 
  private:
+  // only the parts of `file_stat` that end up in the metadata or are
+  // needed for hardlink detection
+  struct packed_stat {
+    file_stat::ino_type ino;
+    file_stat::off_type size;
+    file_stat::time_type atime;
+    file_stat::time_type mtime;
+    file_stat::time_type ctime;
+    file_stat::mode_type mode;
+    file_stat::uid_type uid;
+    file_stat::gid_type gid;
+    uint32_t nlink;
+  };
+
   std::u8string u8name() const;
 
-  std::string name_;
-  std::weak_ptr<entry> parent_;
-  file_stat stat_;
+  std::string const* name_;
+  entry* parent_;
+  packed_stat stat_;
   std::optional<uint32_t> entry_index_;
 };
 
@@ -131,6 +150,7 @@ class file : public entry {
 
   type_t type() const override;
   std::string_view hash() const;
+  void set_hash(std::string_view hash);
   void set_inode(std::shared_ptr<inode> ino);
   std::shared_ptr<inode> get_inode() const;
   void accept(entry_visitor& v, bool preorder) override;
@@ -219,7 +239,7 @@ class link : public entry {
  */
 class device : public entry {
  public:
-  using entry::entry;
+  device(std::string const& name, entry* parent, file_stat const& st);
 
   type_t type() const override;
   void accept(entry_visitor& v, bool preorder) override;
@@ -232,9 +252,17 @@ class device : public entry {
   }
 
  private:
+  file_stat::dev_type rdev_;
   std::optional<uint32_t> inode_num_;
 };
 
+/**
+ * Creates entries for the input tree
+ *
+ * The factory owns the memory of all entries it creates (as well as
+ * their interned names), so it must outlive them. Entries must only be
+ * created from a single thread.
+ */
 class entry_factory {
  public:
   static std::unique_ptr<entry_factory> create();
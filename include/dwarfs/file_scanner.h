@@ -44,6 +44,14 @@ class file_scanner {
                std::optional<std::string> const& hash_algo, progress& prog);
 
   void scan(file* p) { impl_->scan(p); }
+
+  /**
+   * Decide which files found unchanged in the base image can be reused
+   *
+   * Must be called once after all files have been passed to `scan()`.
+   * Files that cannot be reused are scanned as usual.
+   */
+  void reuse_base_files() { impl_->reuse_base_files(); }
   void finalize(uint32_t& inode_num) { impl_->finalize(inode_num); }
   uint32_t num_unique() const { return impl_->num_unique(); }
 
@@ -52,6 +60,7 @@ class file_scanner {
     virtual ~impl() = default;
 
     virtual void scan(file* p) = 0;
+    virtual void reuse_base_files() = 0;
     virtual void finalize(uint32_t& inode_num) = 0;
     virtual uint32_t num_unique() const = 0;
   };
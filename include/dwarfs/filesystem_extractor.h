@@ -35,6 +35,7 @@ class logger;
 
 struct filesystem_extractor_options {
   size_t max_queued_bytes{4096};
+  size_t num_disk_writers{1};
   bool continue_on_error{false};
   folly::Function<void(std::string_view, uint64_t, uint64_t) const> progress;
 };
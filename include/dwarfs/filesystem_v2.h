@@ -31,13 +31,16 @@
 #include <span>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <folly/Expected.h>
 #include <folly/dynamic.h>
 
+#include "dwarfs/block_cache_stats.h"
 #include "dwarfs/block_range.h"
 #include "dwarfs/fstypes.h"
 #include "dwarfs/metadata_types.h"
+#include "dwarfs/read_request.h"
 #include "dwarfs/types.h"
 
 namespace dwarfs {
@@ -71,7 +74,8 @@ class filesystem_v2 {
   static int
   identify(logger& lgr, std::shared_ptr<mmif> mm, std::ostream& os,
            int detail_level = 0, size_t num_readers = 1,
-           bool check_integrity = false, file_off_t image_offset = 0);
+           bool check_integrity = false, file_off_t image_offset = 0,
+           std::vector<std::shared_ptr<mmif>> const& base_images = {});
 
   static std::optional<std::span<uint8_t const>>
   header(std::shared_ptr<mmif> mm);
@@ -158,19 +162,89 @@ class filesystem_v2 {
     return impl_->readv(inode, size, offset);
   }
 
+  /**
+   * Read many (usually small) ranges from many files at once
+   *
+   * All requests are grouped by the blocks they need, so each block is
+   * requested from the block cache only once per batch. `cb` is called
+   * from the calling thread for each request as soon as all of its blocks
+   * are available, so the order of calls is not the order of requests.
+   * This function returns after all callbacks have been called.
+   */
+  void read_batch(std::span<read_request const> requests,
+                  read_batch_callback const& cb) const {
+    impl_->read_batch(requests, cb);
+  }
+
   std::optional<std::span<uint8_t const>> header() const {
     return impl_->header();
   }
 
   void set_num_workers(size_t num) { return impl_->set_num_workers(num); }
+
+  /**
+   * Start background initialization tasks
+   *
+   * This builds the derived metadata tables (with `lazy_init`) and
+   * verifies demand-paged metadata (with `demand_paged`). Must be called
+   * after forking, e.g. from the FUSE init callback. If the verification
+   * fails, all subsequent metadata accesses fail with `EIO`.
+   */
+  void start_background_init() { return impl_->start_background_init(); }
+
   void set_cache_tidy_config(cache_tidy_config const& cfg) {
     return impl_->set_cache_tidy_config(cfg);
   }
 
+  block_cache_stats get_cache_stats() const {
+    return impl_->get_cache_stats();
+  }
+
   size_t num_blocks() const { return impl_->num_blocks(); }
 
   bool has_symlinks() const { return impl_->has_symlinks(); }
 
+  std::optional<chunk_range> get_chunks(int inode) const {
+    return impl_->get_chunks(inode);
+  }
+
+  /**
+   * Checksum identifying this image when it is used as a base image
+   *
+   * This is derived from the checksums of all block sections, which is
+   * all a delta image depends on. Throws for images without checksums.
+   */
+  std::string image_checksum() const { return impl_->image_checksum(); }
+
+  /**
+   * Base images referenced by a delta image, in block number order
+   */
+  std::vector<base_image_info> base_images() const {
+    return impl_->base_images();
+  }
+
+  /**
+   * Adaptive compression used for each block of the image itself
+   *
+   * For each block, this is the compression chosen by adaptive
+   * compression, or an empty string if the block was not compressed
+   * adaptively. Empty if the image was built without adaptive
+   * compression.
+   */
+  std::vector<std::string> block_compression() const {
+    return impl_->block_compression();
+  }
+
+  /**
+   * Write a copy of the given blocks, in ascending order, to `writer`
+   *
+   * The blocks are copied verbatim, i.e. without recompressing them.
+   */
+  void copy_blocks(filesystem_writer& writer,
+                   std::span<size_t const> blocks) const {
+    impl_->copy_blocks(writer, blocks);
+  }
+
   class impl {
    public:
     virtual ~impl() = default;
@@ -205,11 +279,21 @@ class filesystem_v2 {
                           file_off_t offset) const = 0;
     virtual folly::Expected<std::vector<std::future<block_range>>, int>
     readv(uint32_t inode, size_t size, file_off_t offset) const = 0;
+    virtual void read_batch(std::span<read_request const> requests,
+                            read_batch_callback const& cb) const = 0;
     virtual std::optional<std::span<uint8_t const>> header() const = 0;
     virtual void set_num_workers(size_t num) = 0;
+    virtual void start_background_init() = 0;
     virtual void set_cache_tidy_config(cache_tidy_config const& cfg) = 0;
+    virtual block_cache_stats get_cache_stats() const = 0;
     virtual size_t num_blocks() const = 0;
     virtual bool has_symlinks() const = 0;
+    virtual std::optional<chunk_range> get_chunks(int inode) const = 0;
+    virtual void copy_blocks(filesystem_writer& writer,
+                             std::span<size_t const> blocks) const = 0;
+    virtual std::string image_checksum() const = 0;
+    virtual std::vector<base_image_info> base_images() const = 0;
+    virtual std::vector<std::string> block_compression() const = 0;
   };
 
  private:
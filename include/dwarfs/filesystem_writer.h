@@ -26,15 +26,18 @@
 #include <memory>
 #include <ostream>
 #include <span>
+#include <string>
 #include <utility>
+#include <vector>
 
+#include "dwarfs/block_compressor.h"
 #include "dwarfs/fstypes.h"
 #include "dwarfs/options.h"
+#include "dwarfs/types.h"
 #include "dwarfs/worker_group.h"
 
 namespace dwarfs {
 
-class block_compressor;
 class block_data;
 class logger;
 class progress;
@@ -59,8 +62,92 @@ class filesystem_writer {
     impl_->copy_header(header);
   }
 
+  /**
+   * Write the image as a delta image
+   *
+   * Delta images use a newer minor version, so that older versions
+   * refuse to read them rather than failing on every file stored in
+   * a base image. Must be called before any section is written.
+   */
+  void set_delta_image() { impl_->set_delta_image(); }
+
+  /**
+   * Merge blocks from the given categories in a reproducible order
+   *
+   * If this is used, block managers must report each inode they will
+   * process via `inode_dispatched()` and `inode_processed()` and must
+   * call `finish_category()` after writing their last block.
+   */
+  void configure(std::vector<fragment_category> const& categories) {
+    impl_->configure(categories);
+  }
+
+  void add_category_compressor(fragment_category cat, block_compressor bc) {
+    impl_->add_category_compressor(cat, std::move(bc));
+  }
+
+  /**
+   * Adapt the compression of blocks to the current load
+   *
+   * Blocks that would be compressed with the default compressor will
+   * instead use one of the compressors built from `specs`, which must
+   * be ordered from fastest to strongest. Starting with the strongest,
+   * a weaker compressor is picked whenever the compression workers
+   * can't keep up and a stronger one whenever they are idle. As this
+   * depends on timing, the resulting image is not reproducible.
+   */
+  void set_adaptive_compression(std::vector<std::string> const& specs) {
+    impl_->set_adaptive_compression(specs);
+  }
+
+  void inode_dispatched(fragment_category cat) {
+    impl_->inode_dispatched(cat);
+  }
+
+  void inode_processed(fragment_category cat) { impl_->inode_processed(cat); }
+
   void write_block(std::shared_ptr<block_data>&& data) {
-    impl_->write_block(std::move(data));
+    impl_->write_block(0, std::move(data));
+  }
+
+  void write_block(fragment_category cat, std::shared_ptr<block_data>&& data) {
+    impl_->write_block(cat, std::move(data));
+  }
+
+  void write_uncompressed_block(fragment_category cat,
+                                std::shared_ptr<block_data>&& data) {
+    impl_->write_uncompressed_block(cat, std::move(data));
+  }
+
+  void finish_category(fragment_category cat) { impl_->finish_category(cat); }
+
+  /**
+   * Returns the number of the `index`-th block written for a category
+   */
+  size_t get_physical_block(fragment_category cat, size_t index) const {
+    return impl_->get_physical_block(cat, index);
+  }
+
+  std::vector<fragment_category> get_block_categories() const {
+    return impl_->get_block_categories();
+  }
+
+  /**
+   * Returns the specs passed to set_adaptive_compression()
+   */
+  std::vector<std::string> get_adaptive_compression() const {
+    return impl_->get_adaptive_compression();
+  }
+
+  /**
+   * Returns the adaptive compression level of each block
+   *
+   * The level is an index into get_adaptive_compression(), or the size
+   * of that list for blocks that were not compressed adaptively. This
+   * is empty unless adaptive compression is enabled.
+   */
+  std::vector<uint32_t> get_block_compression_levels() const {
+    return impl_->get_block_compression_levels();
   }
 
   void write_metadata_v2_schema(std::shared_ptr<block_data>&& data) {
@@ -87,7 +174,26 @@ class filesystem_writer {
     virtual ~impl() = default;
 
     virtual void copy_header(std::span<uint8_t const> header) = 0;
-    virtual void write_block(std::shared_ptr<block_data>&& data) = 0;
+    virtual void set_delta_image() = 0;
+    virtual void
+    configure(std::vector<fragment_category> const& categories) = 0;
+    virtual void
+    add_category_compressor(fragment_category cat, block_compressor bc) = 0;
+    virtual void
+    set_adaptive_compression(std::vector<std::string> const& specs) = 0;
+    virtual void inode_dispatched(fragment_category cat) = 0;
+    virtual void inode_processed(fragment_category cat) = 0;
+    virtual void write_block(fragment_category cat,
+                             std::shared_ptr<block_data>&& data) = 0;
+    virtual void
+    write_uncompressed_block(fragment_category cat,
+                             std::shared_ptr<block_data>&& data) = 0;
+    virtual void finish_category(fragment_category cat) = 0;
+    virtual size_t
+    get_physical_block(fragment_category cat, size_t index) const = 0;
+    virtual std::vector<fragment_category> get_block_categories() const = 0;
+    virtual std::vector<std::string> get_adaptive_compression() const = 0;
+    virtual std::vector<uint32_t> get_block_compression_levels() const = 0;
     virtual void
     write_metadata_v2_schema(std::shared_ptr<block_data>&& data) = 0;
     virtual void write_metadata_v2(std::shared_ptr<block_data>&& data) = 0;
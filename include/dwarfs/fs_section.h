@@ -46,9 +46,15 @@ class fs_section {
   std::string description() const { return impl_->description(); }
   bool check_fast(mmif const& mm) const { return impl_->check_fast(mm); }
   bool verify(mmif const& mm) const { return impl_->verify(mm); }
+  bool check_and_verify(mmif const& mm) const {
+    return impl_->check_and_verify(mm);
+  }
   std::span<uint8_t const> data(mmif const& mm) const {
     return impl_->data(mm);
   }
+  std::span<uint8_t const> sha2_512_256_digest() const {
+    return impl_->sha2_512_256_digest();
+  }
 
   size_t end() const { return start() + length(); }
 
@@ -64,7 +70,9 @@ class fs_section {
     virtual std::string description() const = 0;
     virtual bool check_fast(mmif const& mm) const = 0;
     virtual bool verify(mmif const& mm) const = 0;
+    virtual bool check_and_verify(mmif const& mm) const = 0;
     virtual std::span<uint8_t const> data(mmif const& mm) const = 0;
+    virtual std::span<uint8_t const> sha2_512_256_digest() const = 0;
   };
 
  private:
@@ -32,7 +32,11 @@
 namespace dwarfs {
 
 constexpr uint8_t MAJOR_VERSION = 2;
-constexpr uint8_t MINOR_VERSION = 5;
+constexpr uint8_t MINOR_VERSION = 6;
+
+// Only delta images need minor version 6, all other images are still
+// written with minor version 5 so that older versions can read them.
+constexpr uint8_t MINOR_VERSION_NO_DELTA = 5;
 
 enum class section_type : uint16_t {
   BLOCK = 0,
@@ -87,6 +91,11 @@ struct filesystem_info {
   uint64_t uncompressed_metadata_size{0};
 };
 
+struct base_image_info {
+  std::string checksum; // binary SHA2-512/256 image checksum
+  uint64_t block_count{0};
+};
+
 bool is_valid_compression_type(compression_type type);
 
 bool is_valid_section_type(section_type type);
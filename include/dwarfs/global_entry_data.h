@@ -33,6 +33,7 @@
 namespace dwarfs {
 
 struct scanner_options;
+class worker_group;
 
 class global_entry_data {
  public:
@@ -58,8 +59,13 @@ class global_entry_data {
   void add_link(std::string const& link) { symlinks_.emplace(link, 0); }
 
   void index() {
-    index(names_);
-    index(symlinks_);
+    index(names_, nullptr);
+    index(symlinks_, nullptr);
+  }
+
+  void index(worker_group& wg) {
+    index(names_, &wg);
+    index(symlinks_, &wg);
   }
 
   size_t get_uid_index(uid_type uid) const;
@@ -89,7 +95,10 @@ class global_entry_data {
   template <typename T, typename U>
   std::vector<T> get_vector(map_type<T, U> const& map) const;
 
-  static void index(map_type<std::string, uint32_t>& map);
+  static void index(map_type<std::string, uint32_t>& map, worker_group* wg);
+
+  static std::vector<std::string>
+  get_indexed_vector(map_type<std::string, uint32_t> const& map);
 
   template <typename T>
   void add(T val, map_type<T, T>& map, T& next_index) {
@@ -29,6 +29,7 @@
 
 #include "dwarfs/nilsimsa.h"
 #include "dwarfs/object.h"
+#include "dwarfs/types.h"
 
 namespace dwarfs {
 
@@ -37,7 +38,6 @@ class chunk;
 }
 
 class file;
-class mmif;
 
 struct inode_options;
 
@@ -47,7 +47,13 @@ class inode : public object {
 
   virtual void set_files(files_vector&& fv) = 0;
   virtual void set_similarity_valid(inode_options const& opts) = 0;
-  virtual void scan(mmif* mm, inode_options const& options) = 0;
+  virtual void set_similarity_hash(uint32_t hash) = 0;
+  virtual void
+  set_nilsimsa_similarity_hash(nilsimsa::hash_type const& hash) = 0;
+  virtual void set_category(fragment_category cat) = 0;
+  virtual fragment_category category() const = 0;
+  virtual void set_reused() = 0;
+  virtual bool reused() const = 0;
   virtual void set_num(uint32_t num) = 0;
   virtual uint32_t num() const = 0;
   virtual uint32_t similarity_hash() const = 0;
@@ -31,6 +31,7 @@ class inode;
 class logger;
 class progress;
 class script;
+class worker_group;
 
 struct file_order_options;
 
@@ -39,7 +40,7 @@ class inode_manager {
   using inode_cb = std::function<void(std::shared_ptr<inode> const&)>;
   using order_cb = std::function<int64_t(std::shared_ptr<inode> const&)>;
 
-  inode_manager(logger& lgr, progress& prog);
+  inode_manager(logger& lgr, progress& prog, worker_group& wg);
 
   std::shared_ptr<inode> create_inode() { return impl_->create_inode(); }
 
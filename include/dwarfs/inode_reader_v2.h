@@ -24,12 +24,16 @@
 #include <cstddef>
 #include <iosfwd>
 #include <memory>
+#include <optional>
+#include <span>
 #include <string>
 
 #include <folly/Expected.h>
 
+#include "dwarfs/block_cache_stats.h"
 #include "dwarfs/block_range.h"
 #include "dwarfs/metadata_types.h"
+#include "dwarfs/read_request.h"
 #include "dwarfs/types.h"
 
 namespace dwarfs {
@@ -65,6 +69,16 @@ class inode_reader_v2 {
     return impl_->readv(inode, size, offset, chunks);
   }
 
+  /**
+   * `chunks` must hold the chunks for each request, or `std::nullopt`
+   * if the inode is not a regular file
+   */
+  void read_batch(std::span<read_request const> requests,
+                  std::span<std::optional<chunk_range> const> chunks,
+                  read_batch_callback const& cb) const {
+    impl_->read_batch(requests, chunks, cb);
+  }
+
   void
   dump(std::ostream& os, const std::string& indent, chunk_range chunks) const {
     impl_->dump(os, indent, chunks);
@@ -78,6 +92,10 @@ class inode_reader_v2 {
 
   size_t num_blocks() const { return impl_->num_blocks(); }
 
+  block_cache_stats get_cache_stats() const {
+    return impl_->get_cache_stats();
+  }
+
   class impl {
    public:
     virtual ~impl() = default;
@@ -89,11 +107,16 @@ class inode_reader_v2 {
     virtual folly::Expected<std::vector<std::future<block_range>>, int>
     readv(uint32_t inode, size_t size, file_off_t offset,
           chunk_range chunks) const = 0;
+    virtual void
+    read_batch(std::span<read_request const> requests,
+               std::span<std::optional<chunk_range> const> chunks,
+               read_batch_callback const& cb) const = 0;
     virtual void dump(std::ostream& os, const std::string& indent,
                       chunk_range chunks) const = 0;
     virtual void set_num_workers(size_t num) = 0;
     virtual void set_cache_tidy_config(cache_tidy_config const& cfg) = 0;
     virtual size_t num_blocks() const = 0;
+    virtual block_cache_stats get_cache_stats() const = 0;
   };
 
  private:
@@ -0,0 +1,146 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include <folly/lang/Bits.h>
+
+namespace dwarfs {
+
+/**
+ * Log-linear latency histogram
+ *
+ * Values below `2^(sub_bucket_bits + 1)` are recorded exactly. Above that,
+ * each power of two is split into `2^sub_bucket_bits` linear sub-buckets,
+ * which bounds the relative error of any percentile estimate to about 6%.
+ *
+ * Each histogram has exactly one writer thread, so samples are recorded
+ * using relaxed loads and stores rather than read-modify-write atomics.
+ * Readers may observe a slightly stale, but never torn, state.
+ */
+class latency_histogram {
+ public:
+  static constexpr unsigned const sub_bucket_bits = 4;
+  static constexpr size_t const sub_bucket_count = size_t(1)
+                                                   << sub_bucket_bits;
+  static constexpr size_t const num_buckets =
+      (64 - sub_bucket_bits - 1) * sub_bucket_count + 2 * sub_bucket_count;
+
+  class snapshot {
+   public:
+    void merge(latency_histogram const& h) {
+      for (size_t i = 0; i < num_buckets; ++i) {
+        auto n = h.buckets_[i].load(std::memory_order_relaxed);
+        buckets_[i] += n;
+        count_ += n;
+      }
+      sum_ += h.sum_.load(std::memory_order_relaxed);
+      max_ = std::max(max_, h.max_.load(std::memory_order_relaxed));
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t sum() const { return sum_; }
+    uint64_t max() const { return max_; }
+
+    uint64_t percentile(double p) const {
+      if (count_ == 0) {
+        return 0;
+      }
+
+      auto rank = std::max<uint64_t>(
+          1, std::ceil(p * static_cast<double>(count_)));
+      uint64_t cumulative = 0;
+
+      for (size_t i = 0; i < num_buckets; ++i) {
+        cumulative += buckets_[i];
+        if (cumulative >= rank) {
+          return std::min(bucket_upper_bound(i), max_);
+        }
+      }
+
+      return max_;
+    }
+
+    // number of samples strictly less than `2^log2_value`, i.e. less than
+    // or equal to `2^log2_value - 1`
+    uint64_t count_below_pow2(unsigned log2_value) const {
+      if (log2_value >= 64) {
+        return count_;
+      }
+      auto end = bucket_index(UINT64_C(1) << log2_value);
+      uint64_t cumulative = 0;
+      for (size_t i = 0; i < end; ++i) {
+        cumulative += buckets_[i];
+      }
+      return cumulative;
+    }
+
+   private:
+    std::array<uint64_t, num_buckets> buckets_{};
+    uint64_t count_{0};
+    uint64_t sum_{0};
+    uint64_t max_{0};
+  };
+
+  static size_t bucket_index(uint64_t value) {
+    auto bits = folly::findLastSet(value);
+    if (bits <= sub_bucket_bits + 1) {
+      return value;
+    }
+    auto shift = bits - sub_bucket_bits - 1;
+    return shift * sub_bucket_count + (value >> shift);
+  }
+
+  static uint64_t bucket_upper_bound(size_t index) {
+    if (index < 2 * sub_bucket_count) {
+      return index;
+    }
+    auto shift = index / sub_bucket_count - 1;
+    auto mantissa = index % sub_bucket_count + sub_bucket_count;
+    return ((mantissa + 1) << shift) - 1;
+  }
+
+  void add(uint64_t value) {
+    increment(buckets_[bucket_index(value)], 1);
+    increment(sum_, value);
+    if (value > max_.load(std::memory_order_relaxed)) {
+      max_.store(value, std::memory_order_relaxed);
+    }
+  }
+
+ private:
+  static void increment(std::atomic<uint64_t>& v, uint64_t n) {
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  std::array<std::atomic<uint64_t>, num_buckets> buckets_{};
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<uint64_t> max_{0};
+};
+
+} // namespace dwarfs
@@ -22,6 +22,8 @@
 #pragma once
 
 #include <functional>
+#include <mutex>
+#include <optional>
 #include <variant>
 
 namespace dwarfs {
@@ -51,4 +53,31 @@ class lazy_value {
   std::variant<function_type, T> v_;
 };
 
+/**
+ * A thread-safe version of `lazy_value`
+ *
+ * The value is computed exactly once, on first access from any thread.
+ * Concurrent callers block until it is available.
+ */
+template <typename T>
+class concurrent_lazy_value {
+ public:
+  using function_type = std::function<T()>;
+
+  concurrent_lazy_value(function_type f)
+      : f_{std::move(f)} {}
+
+  T const& get() const {
+    std::call_once(once_, [this] { v_.emplace(f_()); });
+    return *v_;
+  }
+
+  T const& operator()() const { return get(); }
+
+ private:
+  function_type f_;
+  mutable std::once_flag once_;
+  mutable std::optional<T> v_;
+};
+
 } // namespace dwarfs
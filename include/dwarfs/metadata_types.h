@@ -35,6 +35,7 @@
 
 #include "dwarfs/file_stat.h"
 #include "dwarfs/file_type.h"
+#include "dwarfs/lazy_value.h"
 #include "dwarfs/string_table.h"
 
 #include "dwarfs/gen-cpp2/metadata_layouts.h"
@@ -67,14 +68,16 @@ class global_metadata {
 
   string_table const& names() const { return names_; }
 
+  // Unpacked directories, or empty if the directories table isn't packed.
+  // Unpacking happens on first use.
   std::vector<thrift::metadata::directory> const& directories() const {
-    return directories_storage_;
+    return directories_.get();
   }
 
  private:
   Meta const* const meta_;
-  std::vector<thrift::metadata::directory> const directories_storage_;
-  thrift::metadata::directory const* const directories_;
+  concurrent_lazy_value<std::vector<thrift::metadata::directory>> const
+      directories_;
   string_table const names_;
 };
 
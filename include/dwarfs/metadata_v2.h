@@ -41,6 +41,7 @@ namespace dwarfs {
 
 class logger;
 
+struct base_image_info;
 struct metadata_options;
 struct filesystem_info;
 struct file_stat;
@@ -134,6 +135,19 @@ class metadata_v2 {
 
   bool has_symlinks() const { return impl_->has_symlinks(); }
 
+  std::vector<base_image_info> base_images() const;
+
+  std::vector<std::string> block_compression() const;
+
+  /**
+   * Start building the derived tables in a background thread
+   *
+   * This is a no-op unless `lazy_init` is set. It is not done in the
+   * constructor, as the thread wouldn't survive the FUSE driver forking
+   * into the background.
+   */
+  void start_background_init() { impl_->start_background_init(); }
+
   static std::pair<std::vector<uint8_t>, std::vector<uint8_t>>
   freeze(const thrift::metadata::metadata& data);
 
@@ -188,6 +202,12 @@ class metadata_v2 {
     virtual size_t block_size() const = 0;
 
     virtual bool has_symlinks() const = 0;
+
+    virtual std::vector<base_image_info> base_images() const = 0;
+
+    virtual std::vector<std::string> block_compression() const = 0;
+
+    virtual void start_background_init() = 0;
   };
 
  private:
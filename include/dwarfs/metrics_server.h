@@ -0,0 +1,62 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace dwarfs {
+
+class logger;
+
+/**
+ * Serves metrics over HTTP on a local (unix domain) socket
+ *
+ * Each request is answered by calling `metrics_function` and returning
+ * its result as an OpenMetrics text document. The server runs on its
+ * own thread and is shut down when the object is destroyed.
+ */
+class metrics_server {
+ public:
+  using metrics_function = std::function<std::string()>;
+
+  metrics_server(logger& lgr, std::filesystem::path const& socket_path,
+                 metrics_function func);
+
+  std::filesystem::path const& socket_path() const {
+    return impl_->socket_path();
+  }
+
+  class impl {
+   public:
+    virtual ~impl() = default;
+
+    virtual std::filesystem::path const& socket_path() const = 0;
+  };
+
+ private:
+  std::unique_ptr<impl> impl_;
+};
+
+} // namespace dwarfs
@@ -43,6 +43,7 @@ class mmap : public mmif {
   std::error_code lock(file_off_t offset, size_t size) override;
   std::error_code release(file_off_t offset, size_t size) override;
   std::error_code release_until(file_off_t offset) override;
+  std::error_code advise(advice adv, file_off_t offset, size_t size) override;
 
   std::filesystem::path const& path() const override;
 
@@ -32,6 +32,8 @@
 
 namespace dwarfs {
 
+enum class advice { NORMAL, RANDOM, SEQUENTIAL, WILLNEED };
+
 class mmif : public boost::noncopyable {
  public:
   virtual ~mmif() = default;
@@ -58,6 +60,7 @@ class mmif : public boost::noncopyable {
   virtual std::error_code lock(file_off_t offset, size_t size) = 0;
   virtual std::error_code release(file_off_t offset, size_t size) = 0;
   virtual std::error_code release_until(file_off_t offset) = 0;
+  virtual std::error_code advise(advice adv, file_off_t offset, size_t size) = 0;
 
   virtual std::filesystem::path const& path() const = 0;
 };
@@ -0,0 +1,78 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace dwarfs {
+
+/**
+ * Writes metrics in the OpenMetrics text exposition format
+ *
+ * All samples belonging to a metric family must be written immediately
+ * after the call to `family()` that announces it. Family names are
+ * automatically prefixed with `dwarfs_`. The output must be terminated
+ * by calling `finish()`.
+ */
+class openmetrics_writer {
+ public:
+  using label_list = std::vector<std::pair<std::string_view, std::string>>;
+
+  static constexpr std::string_view content_type{
+      "application/openmetrics-text; version=1.0.0; charset=utf-8"};
+
+  explicit openmetrics_writer(std::ostream& os);
+
+  void family(std::string_view name, std::string_view type,
+              std::string_view help, std::string_view unit = {});
+
+  void sample(std::string_view suffix, label_list const& labels,
+              uint64_t value);
+  void sample(std::string_view suffix, label_list const& labels, double value);
+
+  void counter(std::string_view name, std::string_view help, uint64_t value,
+               std::string_view unit = {});
+  void counter(std::string_view name, std::string_view help, double value,
+               std::string_view unit = {});
+  void gauge(std::string_view name, std::string_view help, uint64_t value,
+             std::string_view unit = {});
+  void gauge(std::string_view name, std::string_view help, double value,
+             std::string_view unit = {});
+
+  void finish();
+
+  static std::string format_value(double value);
+
+ private:
+  void write_name_and_labels(std::string_view suffix,
+                             label_list const& labels);
+
+  std::ostream& os_;
+  std::string family_;
+};
+
+} // namespace dwarfs
@@ -25,14 +25,21 @@
 #include <cstddef>
 #include <functional>
 #include <iosfwd>
+#include <memory>
 #include <optional>
+#include <vector>
 
 #include "dwarfs/file_stat.h"
 #include "dwarfs/types.h"
 
 namespace dwarfs {
 
+class access_profile;
+class base_image;
+class categorizer_manager;
+class pipeline_profile;
 class entry;
+class mmif;
 
 enum class mlock_mode { NONE, TRY, MUST };
 
@@ -41,6 +48,7 @@ enum class cache_tidy_strategy { NONE, EXPIRY_TIME, BLOCK_SWAPPED_OUT };
 struct block_cache_options {
   size_t max_bytes{0};
   size_t num_workers{0};
+  size_t num_shards{0};
   double decompress_ratio{1.0};
   bool mm_release{true};
   bool init_workers{true};
@@ -57,6 +65,8 @@ struct metadata_options {
   bool enable_nlink{false};
   bool readonly{false};
   bool check_consistency{false};
+  bool lazy_init{false};
+  bool demand_paged{false};
 };
 
 struct filesystem_options {
@@ -66,6 +76,8 @@ struct filesystem_options {
   file_off_t image_offset{0};
   block_cache_options block_cache;
   metadata_options metadata;
+  // candidate images to resolve the base images of a delta image
+  std::vector<std::shared_ptr<mmif>> base_images;
 };
 
 struct filesystem_writer_options {
@@ -74,10 +86,26 @@ struct filesystem_writer_options {
   bool no_section_index{false};
 };
 
+struct categorizer_options {
+  double incompressible_threshold{7.9};
+};
+
 struct inode_options {
   bool with_similarity{false};
   bool with_nilsimsa{false};
   std::optional<size_t> max_similarity_scan_size;
+  // Files of at least this size that turn out not to be duplicates are
+  // scanned for similarity while they are hashed. For duplicates, this
+  // wastes some CPU time, but it saves re-reading a non-duplicate. That
+  // only pays off once re-reading a file is likely to hit the disk again
+  // rather than the page cache, hence the rather large default.
+  std::optional<size_t> speculative_scan_min_size{size_t(256) << 20};
+  // files of at least this size are hashed as a tree of fixed-size
+  // leaves, which can be hashed in parallel
+  std::optional<size_t> tree_hash_min_size;
+  size_t tree_hash_leaf_size{size_t(32) << 20};
+  std::shared_ptr<categorizer_manager const> categorizer_mgr;
+  std::shared_ptr<base_image> base;
 
   bool needs_scan(size_t size) const {
     return (with_similarity || with_nilsimsa) &&
@@ -86,13 +114,31 @@ struct inode_options {
   }
 };
 
-enum class file_order_mode { NONE, PATH, SCRIPT, SIMILARITY, NILSIMSA };
+enum class file_order_mode {
+  NONE,
+  PATH,
+  SCRIPT,
+  SIMILARITY,
+  NILSIMSA,
+  NILSIMSA_INDEX,
+  PROFILE
+};
 
 struct file_order_options {
   file_order_mode mode{file_order_mode::NONE};
   int nilsimsa_depth{20000};
   int nilsimsa_min_depth{1000};
   int nilsimsa_limit{255};
+  int nilsimsa_neighbours{16};
+  // only used with `file_order_mode::PROFILE`
+  std::shared_ptr<access_profile const> profile;
+
+  // `PROFILE` falls back to nilsimsa ordering for files not in the profile
+  bool needs_nilsimsa() const {
+    return mode == file_order_mode::NILSIMSA ||
+           mode == file_order_mode::NILSIMSA_INDEX ||
+           mode == file_order_mode::PROFILE;
+  }
 };
 
 struct scanner_options {
@@ -119,6 +165,7 @@ struct scanner_options {
   bool force_pack_string_tables{false};
   bool no_create_timestamp{true};
   std::optional<std::function<void(bool, entry const*)>> debug_filter_function;
+  std::shared_ptr<pipeline_profile> profile;
 };
 
 struct rewrite_options {
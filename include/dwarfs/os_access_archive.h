@@ -0,0 +1,68 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <optional>
+
+#include "dwarfs/os_access.h"
+
+namespace dwarfs {
+
+class logger;
+class mmif;
+
+struct os_access_archive_options {
+  std::optional<std::filesystem::path> spool_dir;
+};
+
+/**
+ * Presents the contents of an archive (e.g. tar or cpio) as a file system
+ *
+ * The whole archive is read on construction, as archives can only be
+ * read sequentially. File contents are kept in memory, or spooled to
+ * a temporary file in `spool_dir` if set. Paths are interpreted relative
+ * to the root of the archive. An archive path of `-` reads from stdin.
+ */
+class os_access_archive : public os_access {
+ public:
+  os_access_archive(logger& lgr, std::filesystem::path const& archive,
+                    os_access_archive_options const& opts = {});
+  ~os_access_archive() override;
+
+  std::shared_ptr<dir_reader>
+  opendir(std::filesystem::path const& path) const override;
+  file_stat symlink_info(std::filesystem::path const& path) const override;
+  std::filesystem::path
+  read_symlink(std::filesystem::path const& path) const override;
+  std::shared_ptr<mmif>
+  map_file(std::filesystem::path const& path, size_t size) const override;
+  int access(std::filesystem::path const& path, int mode) const override;
+
+ private:
+  class impl;
+
+  std::unique_ptr<impl> impl_;
+};
+
+} // namespace dwarfs
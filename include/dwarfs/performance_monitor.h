@@ -21,30 +21,111 @@
 
 #pragma once
 
+#include <chrono>
 #include <cstdint>
 #include <iosfwd>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <unordered_set>
+#include <vector>
 
 namespace dwarfs {
 
+class openmetrics_writer;
+
 class performance_monitor {
  public:
   using timer_id = size_t;
   using time_type = uint64_t;
 
+  /**
+   * Breakdown of all monitored sections of a single request
+   *
+   * Sections are recorded into the trace that is current for the
+   * calling thread. A trace can be attached to other threads (e.g.
+   * decompression workers), so it may be updated concurrently.
+   */
+  class trace {
+   public:
+    struct event {
+      timer_id id;
+      time_type start;
+      time_type end;
+    };
+
+    trace(uint64_t request_id, time_type start)
+        : request_id_{request_id}
+        , start_{start} {}
+
+    uint64_t request_id() const { return request_id_; }
+    time_type start() const { return start_; }
+
+    void add_event(timer_id id, time_type start, time_type end) {
+      std::lock_guard lock(mx_);
+      events_.push_back({id, start, end});
+    }
+
+    std::vector<event> events() const {
+      std::lock_guard lock(mx_);
+      return events_;
+    }
+
+   private:
+    uint64_t const request_id_;
+    time_type const start_;
+    std::vector<event> events_;
+    std::mutex mutable mx_;
+  };
+
+  /**
+   * Makes a trace current for the calling thread until the end of scope
+   *
+   * If constructed from a monitor, a new trace is started and handed to
+   * the monitor when the scope ends, which keeps it if the request was
+   * slow. Otherwise, an existing trace is just attached to this thread.
+   */
+  class scoped_trace {
+   public:
+    scoped_trace() = default;
+    explicit scoped_trace(performance_monitor const* mon);
+    explicit scoped_trace(std::shared_ptr<trace> t);
+    ~scoped_trace();
+
+    scoped_trace(scoped_trace const&) = delete;
+    scoped_trace& operator=(scoped_trace const&) = delete;
+
+   private:
+    performance_monitor const* mon_{nullptr};
+    std::shared_ptr<trace> trace_;
+    std::shared_ptr<trace> prev_;
+  };
+
+  /**
+   * If `trace_threshold` is set, requests wrapped in a `scoped_trace`
+   * that take at least this long are kept and can be dumped using
+   * `dump_traces()`.
+   */
   static std::unique_ptr<performance_monitor>
-  create(std::unordered_set<std::string> const& enabled_namespaces);
+  create(std::unordered_set<std::string> const& enabled_namespaces,
+         std::optional<std::chrono::nanoseconds> trace_threshold =
+             std::nullopt);
+
+  static std::shared_ptr<trace> const& current_trace();
 
   virtual ~performance_monitor() = default;
 
   virtual time_type now() const = 0;
   virtual void add_sample(timer_id id, time_type start) const = 0;
   virtual void summarize(std::ostream& os) const = 0;
+  virtual void write_openmetrics(openmetrics_writer& w) const = 0;
   virtual bool is_enabled(std::string const& ns) const = 0;
   virtual timer_id
   setup_timer(std::string const& ns, std::string const& name) const = 0;
+  virtual std::shared_ptr<trace> start_trace() const = 0;
+  virtual void finish_trace(std::shared_ptr<trace> t) const = 0;
+  virtual void dump_traces(std::ostream& os) const = 0;
 };
 
 class performance_monitor_proxy {
@@ -84,6 +165,20 @@ class performance_monitor_proxy {
     return mon_ ? section_timer(mon_.get(), id) : section_timer();
   }
 
+  performance_monitor::scoped_trace scoped_trace() const {
+    return mon_ ? performance_monitor::scoped_trace(mon_.get())
+                : performance_monitor::scoped_trace();
+  }
+
+  performance_monitor::time_type now() const { return mon_ ? mon_->now() : 0; }
+
+  void add_sample(performance_monitor::timer_id id,
+                  performance_monitor::time_type start) const {
+    if (mon_) {
+      mon_->add_sample(id, start);
+    }
+  }
+
  private:
   std::shared_ptr<performance_monitor const> mon_;
   std::string namespace_;
@@ -125,6 +220,8 @@ class performance_monitor_proxy {
           (scope).perfmon_##id##_id_);
 #define PERFMON_EXT_PROXY_SETUP(scope, monitor, name_space)                    \
   PERFMON_PROXY_SETUP((scope).PERFMON_PROXY_INSTNAME, monitor, name_space)
+#define PERFMON_EXT_SCOPED_TRACE(scope)                                        \
+  auto perfmon_scoped_trace_ = (scope).PERFMON_PROXY_INSTNAME.scoped_trace();
 
 #define PERFMON_CLS_PROXY_DECL PERFMON_PROXY_DECL(PERFMON_PROXY_INSTNAME)
 #define PERFMON_CLS_PROXY_INIT(monitor, name_space)                            \
@@ -134,6 +231,9 @@ class performance_monitor_proxy {
   PERFMON_TIMER_INIT(PERFMON_PROXY_INSTNAME, id)
 #define PERFMON_CLS_SCOPED_SECTION(id)                                         \
   PERFMON_SCOPED_SECTION(PERFMON_PROXY_INSTNAME, id)
+#define PERFMON_CLS_NOW() PERFMON_PROXY_INSTNAME.now()
+#define PERFMON_CLS_ADD_SAMPLE(id, start)                                      \
+  PERFMON_PROXY_INSTNAME.add_sample(perfmon_##id##_id_, start);
 
 #else
 
@@ -152,12 +252,15 @@ class performance_monitor_proxy {
 #define PERFMON_EXT_TIMER_SETUP(scope, id)
 #define PERFMON_EXT_SCOPED_SECTION(scope, id)
 #define PERFMON_EXT_PROXY_SETUP(scope, monitor, name_space)
+#define PERFMON_EXT_SCOPED_TRACE(scope)
 
 #define PERFMON_CLS_PROXY_DECL
 #define PERFMON_CLS_PROXY_INIT(monitor, name_space)
 #define PERFMON_CLS_TIMER_DECL(id)
 #define PERFMON_CLS_TIMER_INIT(id)
 #define PERFMON_CLS_SCOPED_SECTION(id)
+#define PERFMON_CLS_NOW() performance_monitor::time_type(0)
+#define PERFMON_CLS_ADD_SAMPLE(id, start)
 
 #endif
 
@@ -0,0 +1,136 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <folly/dynamic.h>
+
+namespace dwarfs {
+
+class progress;
+class worker_group;
+
+/**
+ * Machine-readable profile of the mkdwarfs pipeline
+ *
+ * The profile records the sequential stages of a build (wall and CPU
+ * time, plus the change of all relevant progress counters during each
+ * stage) and periodically samples queue depths, counters and worker
+ * utilisation from a background thread. The result can be written as
+ * JSON once the build is complete.
+ */
+class pipeline_profile {
+ public:
+  pipeline_profile(progress const& prog,
+                   std::chrono::milliseconds interval =
+                       std::chrono::milliseconds(250));
+  ~pipeline_profile() noexcept;
+
+  /**
+   * Track the CPU time of a worker group
+   *
+   * The worker group must outlive the profile, or at least the call
+   * to `stop()`.
+   */
+  void add_worker_group(std::string name, worker_group const& wg);
+
+  /**
+   * Start a new stage, ending the current stage, if any
+   */
+  void begin_stage(std::string_view name);
+
+  void end_stage();
+
+  /**
+   * Attach an additional value to the current stage
+   */
+  void add_stage_value(std::string_view key, double value);
+
+  /**
+   * Stop sampling, ending the current stage, if any
+   */
+  void stop();
+
+  folly::dynamic as_dynamic() const;
+
+  void write_json(std::ostream& os) const;
+
+ private:
+  using clock_type = std::chrono::steady_clock;
+
+  struct counters {
+    std::vector<uint64_t> values;
+  };
+
+  struct stage {
+    std::string name;
+    double start;
+    double wall_time{0.0};
+    double cpu_time{0.0};
+    counters counters_begin;
+    counters counters_end;
+    std::vector<std::pair<std::string, double>> values;
+  };
+
+  struct tracked_worker_group {
+    std::string name;
+    worker_group const* wg;
+    double cpu_time_begin;
+    double cpu_time_last;
+  };
+
+  double elapsed() const;
+  counters read_counters() const;
+  void end_stage_locked();
+  void sample_locked();
+  void run();
+
+  progress const& prog_;
+  std::chrono::milliseconds const interval_;
+  clock_type::time_point const start_;
+  double const cpu_time_start_;
+  mutable std::mutex mx_;
+  std::condition_variable cond_;
+  std::vector<stage> stages_;
+  std::optional<size_t> current_stage_;
+  std::vector<tracked_worker_group> worker_groups_;
+  double last_sample_{0.0};
+  folly::dynamic samples_;
+  double wall_time_{0.0};
+  double cpu_time_{0.0};
+  bool running_{true};
+  std::thread thread_;
+};
+
+} // namespace dwarfs
@@ -87,6 +87,18 @@ class progress {
   std::atomic<uint64_t> similarity_bytes{0};
   std::atomic<size_t> hash_scans{0};
   std::atomic<uint64_t> hash_bytes{0};
+  std::atomic<size_t> fused_scans{0};
+  std::atomic<size_t> tree_hash_scans{0};
+  std::atomic<uint64_t> hash_bytes_read{0};
+  std::atomic<uint64_t> similarity_bytes_read{0};
+  std::atomic<uint64_t> fused_bytes_read{0};
+  std::atomic<size_t> incompressible_files{0};
+  std::atomic<uint64_t> incompressible_bytes{0};
+  std::atomic<size_t> incompressible_blocks{0};
+  std::atomic<size_t> bad_compression_blocks{0};
+  std::atomic<uint64_t> bad_compression_bytes{0};
+  std::atomic<uint64_t> compressor_input_bytes{0};
+  std::atomic<uint64_t> compressor_time_ns{0};
 
  private:
   std::atomic<bool> running_;
@@ -0,0 +1,55 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <folly/Expected.h>
+
+#include "dwarfs/block_range.h"
+#include "dwarfs/types.h"
+
+namespace dwarfs {
+
+/**
+ * A single read request as part of a batch
+ */
+struct read_request {
+  uint32_t inode{0};
+  size_t size{0};
+  file_off_t offset{0};
+};
+
+/**
+ * Called exactly once for each request of a batch read
+ *
+ * On success, the data is returned as a sequence of block ranges,
+ * which may be shorter than requested at the end of a file. On
+ * failure, a negative error code is returned.
+ */
+using read_batch_callback = std::function<void(
+    size_t index, folly::Expected<std::vector<block_range>, int> data)>;
+
+} // namespace dwarfs
@@ -33,6 +33,7 @@
 namespace dwarfs {
 
 class logger;
+class worker_group;
 
 class string_table {
  public:
@@ -78,6 +79,26 @@ class string_table {
     return pack(std::span(input.data(), input.size()), options);
   }
 
+  /**
+   * Pack a string table using multiple threads
+   *
+   * The output is identical to that of the single-threaded version,
+   * no matter how many workers are in the group.
+   */
+  static thrift::metadata::string_table
+  pack(worker_group& wg, std::span<std::string const> input,
+       pack_options const& options = pack_options());
+
+  static thrift::metadata::string_table
+  pack(worker_group& wg, std::span<std::string_view const> input,
+       pack_options const& options = pack_options());
+
+  static thrift::metadata::string_table
+  pack(worker_group& wg, std::vector<std::string> const& input,
+       pack_options const& options = pack_options()) {
+    return pack(wg, std::span(input.data(), input.size()), options);
+  }
+
   template <size_t N>
   static thrift::metadata::string_table
   pack(std::array<std::string_view, N> const& input,
@@ -98,7 +119,8 @@ class string_table {
  private:
   template <typename T>
   static thrift::metadata::string_table
-  pack_generic(std::span<T const> input, pack_options const& options);
+  pack_generic(std::span<T const> input, pack_options const& options,
+               worker_group* wg);
 
   std::unique_ptr<impl const> impl_;
 };
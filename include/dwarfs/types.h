@@ -28,6 +28,7 @@
 namespace dwarfs {
 
 using file_off_t = int64_t;
+using fragment_category = uint32_t;
 
 #ifdef _MSC_VER
 using sys_char = wchar_t;
@@ -24,6 +24,7 @@
 #include <chrono>
 #include <cstddef>
 #include <filesystem>
+#include <optional>
 #include <string>
 
 #include "dwarfs/types.h"
@@ -62,4 +63,6 @@ std::filesystem::path canonical_path(std::filesystem::path p);
 
 bool getenv_is_enabled(char const* var);
 
+std::optional<size_t> peak_rss();
+
 } // namespace dwarfs
@@ -22,15 +22,28 @@
 #pragma once
 
 #include <cstddef>
+#include <functional>
 #include <future>
 #include <limits>
 #include <memory>
+#include <optional>
 #include <utility>
+#include <vector>
 
 #include <folly/Function.h>
 
 namespace dwarfs {
 
+class logger;
+
+enum class worker_group_scheduler { SHARED_QUEUE, WORK_STEALING };
+
+struct worker_group_options {
+  worker_group_scheduler scheduler{worker_group_scheduler::SHARED_QUEUE};
+  std::vector<int> cpus;
+  std::optional<int> numa_node;
+};
+
 /**
  * A group of worker threads
  *
@@ -52,6 +65,27 @@ class worker_group {
       size_t max_queue_len = std::numeric_limits<size_t>::max(),
       int niceness = 0);
 
+  /**
+   * Create a worker group with a specific scheduler
+   *
+   * The shared queue scheduler dispatches all jobs through a single
+   * queue. The work stealing scheduler keeps a queue per worker thread,
+   * with jobs submitted from within a worker going to that worker's
+   * lock-free local queue, and idle workers stealing jobs from their
+   * peers. This scales much better with many small jobs and many cores,
+   * but does not preserve the order in which jobs are started.
+   *
+   * If `cpus` or `numa_node` are given in the options, all worker
+   * threads will be restricted to run on these CPUs (or the CPUs of
+   * the NUMA node, respectively). This is currently only supported
+   * on Linux and ignored on other platforms. If the affinity cannot
+   * be set, a warning is logged through `lgr`, which must outlive the
+   * worker group.
+   */
+  worker_group(logger& lgr, const char* group_name, size_t num_workers,
+               size_t max_queue_len, int niceness,
+               worker_group_options const& options);
+
   worker_group() = default;
   ~worker_group() = default;
 
@@ -73,6 +107,16 @@ class worker_group {
     return add_job([task = std::move(task)]() mutable { task(); });
   }
 
+  /**
+   * Run `fn(i)` for each `i` in `[0, count)` and wait for completion
+   *
+   * The calling thread takes part in the work, so it is safe to call
+   * this from within a job running on the same worker group. If any
+   * call to `fn` throws, the first exception is rethrown once all
+   * calls have completed.
+   */
+  void parallel_for(size_t count, std::function<void(size_t)> const& fn);
+
   class impl {
    public:
     virtual ~impl() = default;
@@ -0,0 +1,138 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <fstream>
+#include <istream>
+#include <ostream>
+
+#include "dwarfs/access_profile.h"
+#include "dwarfs/error.h"
+#include "dwarfs/filesystem_v2.h"
+#include "dwarfs/metadata_types.h"
+
+namespace dwarfs {
+
+access_profile access_profile::parse(std::istream& is) {
+  access_profile prof;
+  std::string line;
+
+  while (std::getline(is, line)) {
+    std::string_view path{line};
+
+    if (path.ends_with('\r')) {
+      path.remove_suffix(1);
+    }
+
+    if (path.empty() || path.front() == '#') {
+      continue;
+    }
+
+    while (path.starts_with('/')) {
+      path.remove_prefix(1);
+    }
+
+    if (!path.empty()) {
+      prof.add(path);
+    }
+  }
+
+  return prof;
+}
+
+access_profile access_profile::load(std::string const& path) {
+  std::ifstream ifs{path};
+
+  if (!ifs) {
+    DWARFS_THROW(runtime_error, "failed to open access profile: " + path);
+  }
+
+  return parse(ifs);
+}
+
+void access_profile::add(std::string_view path) {
+  if (rank_.try_emplace(std::string(path), paths_.size()).second) {
+    paths_.emplace_back(path);
+  }
+}
+
+std::optional<size_t> access_profile::rank(std::string const& path) const {
+  if (auto it = rank_.find(path); it != rank_.end()) {
+    return it->second;
+  }
+  return std::nullopt;
+}
+
+void access_profile::write(std::ostream& os) const {
+  os << "# dwarfs access profile\n";
+  for (auto const& p : paths_) {
+    os << p << '\n';
+  }
+}
+
+access_recorder::access_recorder(size_t num_inodes)
+    : seen_{std::make_unique<std::atomic<bool>[]>(num_inodes)}
+    , num_inodes_{num_inodes} {}
+
+void access_recorder::record(uint32_t inode) {
+  if (inode >= num_inodes_ ||
+      seen_[inode].load(std::memory_order_relaxed) ||
+      seen_[inode].exchange(true)) {
+    return;
+  }
+
+  std::lock_guard lock(mx_);
+  order_.push_back(inode);
+}
+
+std::vector<uint32_t> access_recorder::inodes() const {
+  std::lock_guard lock(mx_);
+  return order_;
+}
+
+access_profile access_recorder::profile(filesystem_v2 const& fs) const {
+  auto order = inodes();
+  folly::F14FastMap<uint32_t, size_t> index;
+  std::vector<std::string> paths(order.size());
+
+  for (size_t i = 0; i < order.size(); ++i) {
+    index.emplace(order[i], i);
+  }
+
+  fs.walk([&](dir_entry_view e) {
+    if (auto it = index.find(e.inode().inode_num()); it != index.end()) {
+      if (auto& p = paths[it->second]; p.empty()) {
+        p = e.unix_path();
+      }
+    }
+  });
+
+  access_profile prof;
+
+  for (auto const& p : paths) {
+    if (!p.empty()) {
+      prof.add(p);
+    }
+  }
+
+  return prof;
+}
+
+} // namespace dwarfs
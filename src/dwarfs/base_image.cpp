@@ -0,0 +1,276 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include <folly/container/F14Set.h>
+
+#include "dwarfs/base_image.h"
+#include "dwarfs/error.h"
+#include "dwarfs/file_stat.h"
+#include "dwarfs/filesystem_v2.h"
+#include "dwarfs/inode.h"
+#include "dwarfs/logger.h"
+#include "dwarfs/mmif.h"
+#include "dwarfs/options.h"
+#include "dwarfs/util.h"
+#include "dwarfs/vfs_stat.h"
+
+namespace dwarfs {
+
+namespace {
+
+filesystem_options make_fs_options(base_image_options const& opts) {
+  filesystem_options fsopts;
+  fsopts.base_images = opts.base_images;
+  return fsopts;
+}
+
+template <typename LoggerPolicy>
+class base_image_ final : public base_image::impl {
+ public:
+  base_image_(logger& lgr, std::shared_ptr<mmif> mm,
+              base_image_options const& opts)
+      : LOG_PROXY_INIT(lgr)
+      , fs_(lgr, std::move(mm), make_fs_options(opts))
+      , opts_{opts} {
+    vfs_stat st;
+    fs_.statvfs(&st);
+    block_size_ = st.bsize;
+
+    if (!opts_.delta && !fs_.base_images().empty()) {
+      DWARFS_THROW(runtime_error,
+                   "blocks can only be copied from a self-contained image, "
+                   "use delta mode for delta base images");
+    }
+  }
+
+  size_t block_size() const override { return block_size_; }
+
+  std::optional<uint32_t>
+  find_unchanged(std::string const& path, file_stat const& st) const override {
+    auto iv = fs_.find(path.c_str());
+
+    if (!iv || !iv->is_regular_file()) {
+      return std::nullopt;
+    }
+
+    file_stat base_st;
+
+    if (fs_.getattr(*iv, &base_st) != 0) {
+      return std::nullopt;
+    }
+
+    // the base image only stores mtimes with the configured resolution
+    auto const mtime = st.mtime - st.mtime % opts_.time_resolution_sec;
+
+    if (base_st.size != st.size || base_st.mtime != mtime) {
+      return std::nullopt;
+    }
+
+    return iv->inode_num();
+  }
+
+  void select_blocks(std::span<uint32_t const> inodes) override;
+
+  bool can_reuse(uint32_t inode) const override {
+    return reused_.find(inode) != reused_.end();
+  }
+
+  void add_chunks(uint32_t inode, dwarfs::inode& ino) const override {
+    DWARFS_CHECK(can_reuse(inode), "inode cannot be reused");
+    for_each_chunk(inode, [&](chunk_view const& c) {
+      ino.add_chunk(opts_.delta ? c.block() : block_map_.at(c.block()),
+                    c.offset(), c.size());
+    });
+  }
+
+  void copy_blocks(filesystem_writer& fsw) const override {
+    if (!blocks_.empty()) {
+      auto ti = LOG_TIMED_INFO;
+      fs_.copy_blocks(fsw, blocks_);
+      ti << "copied " << blocks_.size() << " blocks from base image";
+    }
+  }
+
+  size_t block_offset() const override {
+    return opts_.delta ? fs_.num_blocks() : 0;
+  }
+
+  std::vector<base_image_info> layers() const override {
+    std::vector<base_image_info> rv;
+
+    if (opts_.delta) {
+      rv = fs_.base_images();
+      uint64_t base_blocks = 0;
+      for (auto const& b : rv) {
+        base_blocks += b.block_count;
+      }
+      rv.push_back({fs_.image_checksum(), fs_.num_blocks() - base_blocks});
+    }
+
+    return rv;
+  }
+
+ private:
+  static constexpr size_t const kNoBlock{std::numeric_limits<size_t>::max()};
+
+  template <typename F>
+  void for_each_chunk(uint32_t inode, F&& func) const {
+    auto chunks = fs_.get_chunks(inode);
+
+    if (!chunks) {
+      DWARFS_THROW(runtime_error,
+                   fmt::format("cannot read chunks for base inode {}", inode));
+    }
+
+    for (auto const& c : *chunks) {
+      func(c);
+    }
+  }
+
+  LOG_PROXY_DECL(LoggerPolicy);
+  filesystem_v2 fs_;
+  base_image_options const opts_;
+  size_t block_size_{0};
+  folly::F14FastSet<uint32_t> reused_;
+  std::vector<size_t> blocks_;
+  std::vector<size_t> block_map_;
+};
+
+/**
+ * Block Selection
+ *
+ * Reusing only blocks that exclusively hold data of unchanged files
+ * doesn't work well in practice: files frequently span multiple blocks,
+ * so a single changed file would not only invalidate the blocks holding
+ * its own data, but also those of all files sharing a block with it,
+ * and so on. We therefore keep a block as long as enough of the data
+ * referenced from it is still alive.
+ *
+ * An unchanged file can only be reused if all of its blocks are kept.
+ * If it isn't reused, the data it references is no longer alive, which
+ * may in turn cause more blocks to be dropped. This is repeated until
+ * no more blocks are dropped.
+ */
+template <typename LoggerPolicy>
+void base_image_<LoggerPolicy>::select_blocks(
+    std::span<uint32_t const> inodes) {
+  auto ti = LOG_TIMED_INFO;
+
+  if (opts_.delta) {
+    // all base blocks are referenced, so every unchanged file is reused
+    reused_.insert(inodes.begin(), inodes.end());
+    ti << "referencing " << fs_.num_blocks() << " base image blocks for "
+       << inodes.size() << " unchanged inodes";
+    return;
+  }
+
+  auto const num_blocks = fs_.num_blocks();
+  std::vector<uint64_t> total_bytes(num_blocks, 0);
+  std::vector<uint64_t> live_bytes(num_blocks, 0);
+  std::vector<std::vector<uint32_t>> live_inodes(num_blocks);
+  std::vector<bool> dropped(num_blocks, false);
+
+  {
+    folly::F14FastSet<uint32_t> seen;
+
+    fs_.walk([&](dir_entry_view de) {
+      auto iv = de.inode();
+      if (iv.is_regular_file() && seen.insert(iv.inode_num()).second) {
+        for_each_chunk(iv.inode_num(), [&](chunk_view const& c) {
+          total_bytes.at(c.block()) += c.size();
+        });
+      }
+    });
+  }
+
+  reused_.insert(inodes.begin(), inodes.end());
+
+  for (auto ino : inodes) {
+    for_each_chunk(ino, [&](chunk_view const& c) {
+      live_bytes[c.block()] += c.size();
+      live_inodes[c.block()].push_back(ino);
+    });
+  }
+
+  auto is_alive = [&](size_t block) {
+    return live_bytes[block] > 0 &&
+           live_bytes[block] >= opts_.reuse_threshold * total_bytes[block];
+  };
+
+  std::vector<size_t> drop_queue;
+
+  for (size_t block = 0; block < num_blocks; ++block) {
+    if (!is_alive(block)) {
+      dropped[block] = true;
+      drop_queue.push_back(block);
+    }
+  }
+
+  while (!drop_queue.empty()) {
+    auto block = drop_queue.back();
+    drop_queue.pop_back();
+
+    for (auto ino : live_inodes[block]) {
+      if (reused_.erase(ino) > 0) {
+        for_each_chunk(ino, [&](chunk_view const& c) {
+          auto b = c.block();
+          live_bytes[b] -= c.size();
+          if (!dropped[b] && !is_alive(b)) {
+            dropped[b] = true;
+            drop_queue.push_back(b);
+          }
+        });
+      }
+    }
+  }
+
+  block_map_.assign(num_blocks, kNoBlock);
+  uint64_t reused_bytes = 0;
+
+  for (size_t block = 0; block < num_blocks; ++block) {
+    if (!dropped[block]) {
+      block_map_[block] = blocks_.size();
+      blocks_.push_back(block);
+      reused_bytes += live_bytes[block];
+    }
+  }
+
+  ti << "selected " << blocks_.size() << "/" << num_blocks
+     << " blocks for reuse, holding " << size_with_unit(reused_bytes)
+     << " of data from " << reused_.size() << "/" << inodes.size()
+     << " unchanged inodes";
+}
+
+} // namespace
+
+base_image::base_image(logger& lgr, std::shared_ptr<mmif> mm,
+                       base_image_options const& opts)
+    : impl_(make_unique_logging_object<impl, base_image_, logger_policies>(
+          lgr, std::move(mm), opts)) {}
+
+} // namespace dwarfs
@@ -48,6 +48,7 @@
 #include "dwarfs/logger.h"
 #include "dwarfs/mmif.h"
 #include "dwarfs/options.h"
+#include "dwarfs/performance_monitor.h"
 #include "dwarfs/worker_group.h"
 
 namespace dwarfs {
@@ -87,7 +88,8 @@ class block_request_set {
   block_request_set(std::shared_ptr<cached_block> block, size_t block_no)
       : range_end_(0)
       , block_(std::move(block))
-      , block_no_(block_no) {}
+      , block_no_(block_no)
+      , trace_(performance_monitor::current_trace()) {}
 
   ~block_request_set() { assert(queue_.empty()); }
 
@@ -126,23 +128,59 @@ class block_request_set {
 
   size_t block_no() const { return block_no_; }
 
+  // work done on behalf of this set is attributed to the request
+  // that created it
+  std::shared_ptr<performance_monitor::trace> const& trace() const {
+    return trace_;
+  }
+
+  void set_queued_at(performance_monitor::time_type t) { queued_at_ = t; }
+
+  performance_monitor::time_type queued_at() const { return queued_at_; }
+
  private:
   std::vector<block_request> queue_;
   size_t range_end_;
   std::shared_ptr<cached_block> block_;
   const size_t block_no_;
+  std::shared_ptr<performance_monitor::trace> const trace_;
+  performance_monitor::time_type queued_at_{0};
 };
 
-// multi-threaded block cache
+/**
+ * Multi-threaded block cache
+ *
+ * To keep lock contention low with many concurrent readers, the cache
+ * is split into shards keyed by block number. Each shard has its own
+ * lock, its own slice of the LRU cache and its own set of active
+ * requests, so requests for different blocks rarely ever contend.
+ */
 template <typename LoggerPolicy>
 class block_cache_ final : public block_cache::impl {
  public:
+  static constexpr size_t kDefaultNumShards{16};
+  static constexpr size_t kMinBlocksPerShard{4};
+
   block_cache_(logger& lgr, std::shared_ptr<mmif> mm,
-               block_cache_options const& options)
-      : cache_(0)
-      , mm_(std::move(mm))
+               block_cache_options const& options,
+               std::shared_ptr<performance_monitor const> perfmon
+               [[maybe_unused]])
+      : mm_(std::move(mm))
       , LOG_PROXY_INIT(lgr)
+      // clang-format off
+      PERFMON_CLS_PROXY_INIT(perfmon, "block_cache")
+      PERFMON_CLS_TIMER_INIT(get)
+      PERFMON_CLS_TIMER_INIT(queue_wait)
+      PERFMON_CLS_TIMER_INIT(process_job)
+      PERFMON_CLS_TIMER_INIT(decompress) // clang-format on
       , options_(options) {
+    shards_.resize(options.num_shards > 0 ? options.num_shards
+                                          : kDefaultNumShards);
+
+    for (auto& shard : shards_) {
+      shard = std::make_unique<cache_shard>();
+    }
+
     if (options.init_workers) {
       wg_ =
           worker_group("blkcache", std::max(options.num_workers > 0
@@ -169,11 +207,13 @@ class block_cache_ final : public block_cache::impl {
 
     LOG_DEBUG << "cached blocks:";
 
-    for (const auto& cb : cache_) {
-      LOG_DEBUG << "  block " << cb.first << ", decompression ratio = "
-                << double(cb.second->range_end()) /
-                       double(cb.second->uncompressed_size());
-      update_block_stats(*cb.second);
+    for (auto const& shard : shards_) {
+      for (const auto& cb : shard->cache) {
+        LOG_DEBUG << "  block " << cb.first << ", decompression ratio = "
+                  << double(cb.second->range_end()) /
+                         double(cb.second->uncompressed_size());
+        update_block_stats(*cb.second);
+      }
     }
 
     double fast_hit_rate =
@@ -190,6 +230,7 @@ class block_cache_ final : public block_cache::impl {
     // number of evicted blocks outgrow the number of created blocks.
     LOG_INFO << "blocks created: " << blocks_created_.load();
     LOG_INFO << "blocks evicted: " << blocks_evicted_.load();
+    LOG_INFO << "blocks verified: " << blocks_verified_.load();
     LOG_INFO << "blocks tidied: " << blocks_tidied_.load();
     LOG_INFO << "request sets merged: " << sets_merged_.load();
     LOG_INFO << "total requests: " << range_requests_.load();
@@ -211,8 +252,12 @@ class block_cache_ final : public block_cache::impl {
 
   size_t block_count() const override { return block_.size(); }
 
-  void insert(fs_section const& section) override {
-    block_.emplace_back(section);
+  void insert(fs_section const& section) override { insert(section, mm_); }
+
+  void
+  insert(fs_section const& section, std::shared_ptr<mmif> mm) override {
+    block_.push_back({section, std::move(mm)});
+    block_verified_.emplace_back(false);
   }
 
   void set_block_size(size_t size) override {
@@ -226,18 +271,75 @@ class block_cache_ final : public block_cache::impl {
       max_blocks = block_.size();
     }
 
-    std::lock_guard lock(mx_);
-    cache_.~lru_type();
-    new (&cache_) lru_type(max_blocks);
-    cache_.setPruneHook(
-        [this](size_t block_no, std::shared_ptr<cached_block>&& block) {
-          LOG_DEBUG << "evicting block " << block_no
-                    << " from cache, decompression ratio = "
-                    << double(block->range_end()) /
-                           double(block->uncompressed_size());
-          ++blocks_evicted_;
-          update_block_stats(*block);
-        });
+    // Don't use more shards than we can fill with a reasonable number
+    // of blocks, otherwise the LRU slices become too small to be useful.
+    auto const num_shards = std::clamp<size_t>(max_blocks / kMinBlocksPerShard,
+                                               1, shards_.size());
+
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      auto& shard = *shards_[i];
+      size_t shard_blocks = 0;
+
+      if (i < num_shards) {
+        shard_blocks = max_blocks / num_shards +
+                       (i < max_blocks % num_shards ? 1 : 0);
+      }
+
+      std::lock_guard lock(shard.mx);
+      shard.cache.~lru_type();
+      new (&shard.cache) lru_type(shard_blocks);
+      shard.cache.setPruneHook(
+          [this](size_t block_no, std::shared_ptr<cached_block>&& block) {
+            LOG_DEBUG << "evicting block " << block_no
+                      << " from cache, decompression ratio = "
+                      << double(block->range_end()) /
+                             double(block->uncompressed_size());
+            ++blocks_evicted_;
+            update_block_stats(*block);
+          });
+    }
+
+    num_shards_ = num_shards;
+
+    LOG_DEBUG << "using " << num_shards << " cache shards for " << max_blocks
+              << " blocks";
+  }
+
+  block_cache_stats get_stats() const override {
+    block_cache_stats stats;
+
+    stats.range_requests = range_requests_.load();
+    stats.active_hits_fast = active_hits_fast_.load();
+    stats.active_hits_slow = active_hits_slow_.load();
+    stats.cache_hits_fast = cache_hits_fast_.load();
+    stats.cache_hits_slow = cache_hits_slow_.load();
+    stats.blocks_created = blocks_created_.load();
+    stats.blocks_evicted = blocks_evicted_.load();
+    stats.blocks_verified = blocks_verified_.load();
+    stats.blocks_tidied = blocks_tidied_.load();
+    stats.sets_merged = sets_merged_.load();
+    stats.partially_decompressed = partially_decompressed_.load();
+    stats.bytes_decompressed = bytes_decompressed_.load();
+
+    stats.num_shards = num_shards_.load();
+
+    for (auto const& shard : shards_) {
+      std::lock_guard lock(shard->mx);
+      stats.cached_blocks += shard->cache.size();
+      stats.max_cached_blocks += shard->cache.getMaxSize();
+      stats.active_blocks += shard->active.size();
+    }
+
+    {
+      std::shared_lock lock(mx_wg_);
+      if (wg_) {
+        stats.num_workers = wg_.size();
+        stats.queue_depth = wg_.queue_size();
+        stats.worker_cpu_time = wg_.get_cpu_time();
+      }
+    }
+
+    return stats;
   }
 
   void set_num_workers(size_t num) override {
@@ -256,9 +358,10 @@ class block_cache_ final : public block_cache::impl {
         stop_tidy_thread();
       }
     } else {
-      std::lock_guard lock(mx_);
+      std::lock_guard lock(mx_tidy_);
 
       tidy_config_ = cfg;
+      touch_blocks_ = cfg.strategy == cache_tidy_strategy::EXPIRY_TIME;
 
       if (tidy_running_) {
         tidy_cond_.notify_all();
@@ -271,6 +374,8 @@ class block_cache_ final : public block_cache::impl {
 
   std::future<block_range>
   get(size_t block_no, size_t offset, size_t size) const override {
+    PERFMON_CLS_SCOPED_SECTION(get)
+
     ++range_requests_;
 
     std::promise<block_range> promise;
@@ -285,12 +390,12 @@ class block_cache_ final : public block_cache::impl {
                                  block_no, block_.size()));
       }
 
-      auto const& section = DWARFS_NOTHROW(block_.at(block_no));
+      auto const& [section, mm] = DWARFS_NOTHROW(block_.at(block_no));
 
       if (section.compression() == compression_type::NONE) {
         LOG_TRACE << "block " << block_no
                   << " is uncompressed, bypassing cache";
-        promise.set_value(block_range(section.data(*mm_).data(), offset, size));
+        promise.set_value(block_range(section.data(*mm).data(), offset, size));
         return future;
       }
     } catch (...) {
@@ -298,17 +403,19 @@ class block_cache_ final : public block_cache::impl {
       return future;
     }
 
-    // That is a mighty long lock, let's see how it works...
-    std::lock_guard lock(mx_);
+    auto& shard = shard_for(block_no);
+
+    // That is a mighty long lock, but it only covers a single shard
+    std::lock_guard lock(shard.mx);
 
     const auto range_end = offset + size;
 
     // See if the block is currently active (about-to-be decompressed)
-    auto ia = active_.find(block_no);
+    auto ia = shard.active.find(block_no);
 
     std::shared_ptr<block_request_set> brs;
 
-    if (ia != active_.end()) {
+    if (ia != shard.active.end()) {
       LOG_TRACE << "active sets found for block " << block_no;
 
       bool add_to_set = false;
@@ -336,7 +443,7 @@ class block_cache_ final : public block_cache::impl {
       if (ia->second.empty()) {
         // No request sets left at all? M'kay.
         assert(!brs);
-        active_.erase(ia);
+        shard.active.erase(ia);
       } else if (brs) {
         // That's the one
         // Check if by any chance the block has already
@@ -376,9 +483,9 @@ class block_cache_ final : public block_cache::impl {
     }
 
     // See if it's cached (fully or partially decompressed)
-    auto ic = cache_.find(block_no);
+    auto ic = shard.cache.find(block_no);
 
-    if (ic != cache_.end()) {
+    if (ic != shard.cache.end()) {
       // Nice, at least the block is already there.
 
       LOG_TRACE << "block " << block_no << " found in cache";
@@ -397,7 +504,7 @@ class block_cache_ final : public block_cache::impl {
         brs->add(offset, range_end, std::move(promise));
         ++cache_hits_slow_;
 
-        active_[block_no].emplace_back(brs);
+        shard.active[block_no].emplace_back(brs);
         enqueue_job(std::move(brs));
       }
 
@@ -409,18 +516,29 @@ class block_cache_ final : public block_cache::impl {
     try {
       LOG_TRACE << "block " << block_no << " not found";
 
+      auto const& [section, mm] = DWARFS_NOTHROW(block_.at(block_no));
+
+      // A block only needs its checksum verified the first time it is
+      // loaded; evicted blocks can be recreated without checking again.
+      auto& verified = block_verified_[block_no];
+      bool skip_check = options_.disable_block_integrity_check ||
+                        verified.load(std::memory_order_relaxed);
+
       std::shared_ptr<cached_block> block = cached_block::create(
-          LOG_GET_LOGGER, DWARFS_NOTHROW(block_.at(block_no)), mm_,
-          options_.mm_release, options_.disable_block_integrity_check);
+          LOG_GET_LOGGER, section, mm, options_.mm_release, skip_check);
       ++blocks_created_;
 
+      if (!skip_check && !verified.exchange(true, std::memory_order_relaxed)) {
+        ++blocks_verified_;
+      }
+
       // Make a new set for the block
       brs = std::make_shared<block_request_set>(std::move(block), block_no);
 
       // Promise will be fulfilled asynchronously
       brs->add(offset, range_end, std::move(promise));
 
-      active_[block_no].emplace_back(brs);
+      shard.active[block_no].emplace_back(brs);
       enqueue_job(std::move(brs));
     } catch (...) {
       promise.set_exception(std::current_exception());
@@ -430,9 +548,15 @@ class block_cache_ final : public block_cache::impl {
   }
 
  private:
+  struct cache_shard;
+
+  cache_shard& shard_for(size_t block_no) const {
+    return *shards_[block_no % num_shards_.load(std::memory_order_relaxed)];
+  }
+
   void stop_tidy_thread() {
     {
-      std::lock_guard lock(mx_);
+      std::lock_guard lock(mx_tidy_);
       tidy_running_ = false;
     }
     tidy_cond_.notify_all();
@@ -448,6 +572,8 @@ class block_cache_ final : public block_cache::impl {
   }
 
   void enqueue_job(std::shared_ptr<block_request_set> brs) const {
+    brs->set_queued_at(PERFMON_CLS_NOW());
+
     std::shared_lock lock(mx_wg_);
 
     // Lambda needs to be mutable so we can actually move out of it
@@ -457,18 +583,23 @@ class block_cache_ final : public block_cache::impl {
   }
 
   void process_job(std::shared_ptr<block_request_set> brs) const {
+    performance_monitor::scoped_trace trace_scope(brs->trace());
+    PERFMON_CLS_ADD_SAMPLE(queue_wait, brs->queued_at())
+    PERFMON_CLS_SCOPED_SECTION(process_job)
+
     auto block_no = brs->block_no();
+    auto& shard = shard_for(block_no);
 
     LOG_TRACE << "processing block " << block_no;
 
     // Check if another worker is already processing this block
     {
-      std::lock_guard lock(mx_dec_);
+      std::lock_guard lock(shard.mx_dec);
 
-      auto di = decompressing_.find(block_no);
+      auto di = shard.decompressing.find(block_no);
 
-      if (di != decompressing_.end()) {
-        std::lock_guard lock(mx_);
+      if (di != shard.decompressing.end()) {
+        std::lock_guard lock(shard.mx);
 
         if (auto other = di->second.lock()) {
           LOG_TRACE << "merging sets for block " << block_no;
@@ -479,7 +610,7 @@ class block_cache_ final : public block_cache::impl {
         }
       }
 
-      decompressing_[block_no] = brs;
+      shard.decompressing[block_no] = brs;
     }
 
     auto block = brs->block();
@@ -490,7 +621,7 @@ class block_cache_ final : public block_cache::impl {
 
       // Fetch the next request, if any
       {
-        std::lock_guard lock(mx_);
+        std::lock_guard lock(shard.mx);
 
         if (brs->empty()) {
           // This is absolutely crucial! At this point, we can no longer
@@ -522,7 +653,12 @@ class block_cache_ final : public block_cache::impl {
                 << req.end();
 
       try {
-        block->decompress_until(range_end);
+        auto prev_end = block->range_end();
+        {
+          PERFMON_CLS_SCOPED_SECTION(decompress)
+          block->decompress_until(range_end);
+        }
+        bytes_decompressed_ += block->range_end() - prev_end;
         req.fulfill(block);
       } catch (...) {
         req.error(std::current_exception());
@@ -533,26 +669,30 @@ class block_cache_ final : public block_cache::impl {
     // in there, in which case we just promote it to the front of
     // the LRU queue.
     {
-      std::lock_guard lock(mx_);
+      std::lock_guard lock(shard.mx);
 
-      if (tidy_config_.strategy == cache_tidy_strategy::EXPIRY_TIME) {
+      if (touch_blocks_.load(std::memory_order_relaxed)) {
         block->touch();
       }
 
-      cache_.set(block_no, std::move(block));
+      shard.cache.set(block_no, std::move(block));
     }
   }
 
   template <typename Pred>
   void remove_block_if(Pred const& predicate) {
-    auto it = cache_.begin();
+    for (auto& shard : shards_) {
+      std::lock_guard lock(shard->mx);
 
-    while (it != cache_.end()) {
-      if (predicate(*it->second)) {
-        it = cache_.erase(it);
-        ++blocks_tidied_;
-      } else {
-        ++it;
+      auto it = shard->cache.begin();
+
+      while (it != shard->cache.end()) {
+        if (predicate(*it->second)) {
+          it = shard->cache.erase(it);
+          ++blocks_tidied_;
+        } else {
+          ++it;
+        }
       }
     }
   }
@@ -560,7 +700,7 @@ class block_cache_ final : public block_cache::impl {
   void tidy_thread() {
     folly::setThreadName("cache-tidy");
 
-    std::unique_lock lock(mx_);
+    std::unique_lock lock(mx_tidy_);
 
     while (tidy_running_) {
       if (tidy_cond_.wait_for(lock, tidy_config_.interval) ==
@@ -591,21 +731,30 @@ class block_cache_ final : public block_cache::impl {
   using lru_type =
       folly::EvictingCacheMap<size_t, std::shared_ptr<cached_block>>;
 
-  mutable std::mutex mx_;
-  mutable lru_type cache_;
-  mutable folly::F14FastMap<size_t,
-                            std::deque<std::weak_ptr<block_request_set>>>
-      active_;
+  // Lock order: `mx_dec` before `mx`. The two are separate so checking
+  // for concurrent decompression doesn't block lookups in the shard.
+  struct alignas(64) cache_shard {
+    std::mutex mx;
+    lru_type cache{0};
+    folly::F14FastMap<size_t, std::deque<std::weak_ptr<block_request_set>>>
+        active;
+
+    std::mutex mx_dec;
+    folly::F14FastMap<size_t, std::weak_ptr<block_request_set>> decompressing;
+  };
+
+  std::vector<std::unique_ptr<cache_shard>> shards_;
+  std::atomic<size_t> num_shards_{1};
+
+  std::mutex mx_tidy_;
   std::thread tidy_thread_;
   std::condition_variable tidy_cond_;
   bool tidy_running_{false};
-
-  mutable std::mutex mx_dec_;
-  mutable folly::F14FastMap<size_t, std::weak_ptr<block_request_set>>
-      decompressing_;
+  std::atomic<bool> touch_blocks_{false};
 
   mutable std::atomic<size_t> blocks_created_{0};
   mutable std::atomic<size_t> blocks_evicted_{0};
+  mutable std::atomic<size_t> blocks_verified_{0};
   mutable std::atomic<size_t> sets_merged_{0};
   mutable std::atomic<size_t> range_requests_{0};
   mutable std::atomic<size_t> active_hits_fast_{0};
@@ -616,19 +765,33 @@ class block_cache_ final : public block_cache::impl {
   mutable std::atomic<size_t> total_block_bytes_{0};
   mutable std::atomic<size_t> total_decompressed_bytes_{0};
   mutable std::atomic<size_t> blocks_tidied_{0};
+  mutable std::atomic<size_t> bytes_decompressed_{0};
 
   mutable std::shared_mutex mx_wg_;
   mutable worker_group wg_;
-  std::vector<fs_section> block_;
+  // blocks of base images may live in a different image file
+  struct block_section {
+    fs_section section;
+    std::shared_ptr<mmif> mm;
+  };
+
+  std::vector<block_section> block_;
+  mutable std::deque<std::atomic<bool>> block_verified_;
   std::shared_ptr<mmif> mm_;
   LOG_PROXY_DECL(LoggerPolicy);
+  PERFMON_CLS_PROXY_DECL
+  PERFMON_CLS_TIMER_DECL(get)
+  PERFMON_CLS_TIMER_DECL(queue_wait)
+  PERFMON_CLS_TIMER_DECL(process_job)
+  PERFMON_CLS_TIMER_DECL(decompress)
   const block_cache_options options_;
   cache_tidy_config tidy_config_;
 };
 
 block_cache::block_cache(logger& lgr, std::shared_ptr<mmif> mm,
-                         const block_cache_options& options)
+                         const block_cache_options& options,
+                         std::shared_ptr<performance_monitor const> perfmon)
     : impl_(make_unique_logging_object<impl, block_cache_, logger_policies>(
-          lgr, std::move(mm), options)) {}
+          lgr, std::move(mm), options, std::move(perfmon))) {}
 
 } // namespace dwarfs
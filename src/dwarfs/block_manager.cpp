@@ -23,6 +23,7 @@
 #include <cstdint>
 #include <cstring>
 #include <deque>
+#include <optional>
 #include <string>
 #include <type_traits>
 #include <utility>
@@ -42,6 +43,7 @@
 #include "dwarfs/block_manager.h"
 #include "dwarfs/compiler.h"
 #include "dwarfs/cyclic_hash.h"
+#include "dwarfs/entropy.h"
 #include "dwarfs/entry.h"
 #include "dwarfs/error.h"
 #include "dwarfs/filesystem_writer.h"
@@ -52,6 +54,8 @@
 #include "dwarfs/progress.h"
 #include "dwarfs/util.h"
 
+#include "dwarfs/gen-cpp2/metadata_types.h"
+
 namespace dwarfs {
 
 /**
@@ -75,6 +79,16 @@ namespace dwarfs {
  *
  * A single window size is sufficient. That window size should still be
  * configurable.
+ *
+ * Files that look incompressible (i.e. their estimated entropy is above a
+ * configurable threshold) bypass segmentation entirely and are added to a
+ * separate block that will be stored without compression. As blocks from
+ * both streams are written as soon as they are full, the order in which
+ * they end up in the image can differ from the order in which they were
+ * created. Also, the filesystem writer may interleave blocks from multiple
+ * block managers, one per fragment category. Chunks refer to *logical*
+ * block numbers while the image is being built and must be mapped to
+ * *physical* block numbers at the end.
  */
 
 struct bm_stats {
@@ -291,12 +305,14 @@ template <typename LoggerPolicy>
 class block_manager_ final : public block_manager::impl {
  public:
   block_manager_(logger& lgr, progress& prog, const block_manager::config& cfg,
-                 std::shared_ptr<os_access> os, filesystem_writer& fsw)
+                 std::shared_ptr<os_access> os, filesystem_writer& fsw,
+                 fragment_category category)
       : LOG_PROXY_INIT(lgr)
       , prog_{prog}
       , cfg_{cfg}
       , os_{std::move(os)}
       , fsw_{fsw}
+      , category_{category}
       , window_size_{window_size(cfg)}
       , window_step_{window_step(cfg)}
       , block_size_{block_size(cfg)}
@@ -310,6 +326,8 @@ class block_manager_ final : public block_manager::impl {
 
   void add_inode(std::shared_ptr<inode> ino) override;
   void finish_blocks() override;
+  void map_logical_blocks(
+      std::vector<thrift::metadata::chunk>& vec) const override;
 
  private:
   struct chunk_state {
@@ -322,6 +340,10 @@ class block_manager_ final : public block_manager::impl {
   }
 
   void block_ready();
+  void incompressible_block_ready();
+  void set_write_index(size_t logical_block);
+  bool is_incompressible(inode const& ino, mmif const& mm) const;
+  void add_incompressible_data(inode& ino, mmif& mm, size_t size);
   void finish_chunk(inode& ino);
   void append_to_block(inode& ino, mmif& mm, size_t offset, size_t size);
   void add_data(inode& ino, mmif& mm, size_t offset, size_t size);
@@ -352,6 +374,7 @@ class block_manager_ final : public block_manager::impl {
   const block_manager::config& cfg_;
   std::shared_ptr<os_access> os_;
   filesystem_writer& fsw_;
+  fragment_category const category_;
 
   size_t const window_size_;
   size_t const window_step_;
@@ -369,6 +392,14 @@ class block_manager_ final : public block_manager::impl {
   // All active blocks except for the last one are immutable and potentially
   // already being compressed.
   std::deque<active_block> blocks_;
+
+  // The block that incompressible data is currently being added to.
+  std::optional<active_block> incompressible_block_;
+
+  // Index of each logical block in the sequence of blocks passed to
+  // the filesystem writer
+  std::vector<size_t> write_index_;
+  size_t blocks_written_{0};
 };
 
 class segment_match {
@@ -464,7 +495,9 @@ void block_manager_<LoggerPolicy>::add_inode(std::shared_ptr<inode> ino) {
     LOG_TRACE << "adding inode " << ino->num() << " [" << ino->any()->name()
               << "] - size: " << size;
 
-    if (!segmentation_enabled() or size < window_size_) {
+    if (is_incompressible(*ino, *mm)) {
+      add_incompressible_data(*ino, *mm, size);
+    } else if (!segmentation_enabled() or size < window_size_) {
       // no point dealing with hashing, just write it out
       add_data(*ino, *mm, 0, size);
       finish_chunk(*ino);
@@ -480,6 +513,12 @@ void block_manager_<LoggerPolicy>::finish_blocks() {
     block_ready();
   }
 
+  if (incompressible_block_) {
+    incompressible_block_ready();
+  }
+
+  fsw_.finish_category(category_);
+
   auto l1_collisions = stats_.l2_collision_vec_size.computeTotalCount();
 
   if (stats_.bloom_lookups > 0) {
@@ -521,8 +560,89 @@ template <typename LoggerPolicy>
 void block_manager_<LoggerPolicy>::block_ready() {
   auto& block = blocks_.back();
   block.finalize(stats_);
-  fsw_.write_block(block.data());
+  set_write_index(block.num());
+  fsw_.write_block(category_, block.data());
+  ++prog_.block_count;
+}
+
+template <typename LoggerPolicy>
+void block_manager_<LoggerPolicy>::incompressible_block_ready() {
+  set_write_index(incompressible_block_->num());
+  fsw_.write_uncompressed_block(category_, incompressible_block_->data());
+  incompressible_block_.reset();
   ++prog_.block_count;
+  ++prog_.incompressible_blocks;
+}
+
+template <typename LoggerPolicy>
+void block_manager_<LoggerPolicy>::set_write_index(size_t logical_block) {
+  if (write_index_.size() <= logical_block) {
+    write_index_.resize(logical_block + 1);
+  }
+  write_index_[logical_block] = blocks_written_++;
+}
+
+template <typename LoggerPolicy>
+void block_manager_<LoggerPolicy>::map_logical_blocks(
+    std::vector<thrift::metadata::chunk>& vec) const {
+  for (auto& c : vec) {
+    size_t block = c.block().value();
+    DWARFS_CHECK(block < write_index_.size(),
+                 fmt::format("unexpected logical block number {}", block));
+    c.block() = fsw_.get_physical_block(category_, write_index_[block]);
+  }
+}
+
+template <typename LoggerPolicy>
+bool block_manager_<LoggerPolicy>::is_incompressible(inode const& ino,
+                                                     mmif const& mm) const {
+  if (!cfg_.incompressible_threshold) {
+    return false;
+  }
+
+  auto entropy = entropy_estimator::estimate(mm, cfg_.incompressible_min_size);
+
+  if (!entropy) {
+    return false;
+  }
+
+  LOG_TRACE << "estimated entropy for inode " << ino.num() << ": "
+            << fmt::format("{:.3f}", *entropy) << " bits/byte";
+
+  return *entropy >= *cfg_.incompressible_threshold;
+}
+
+template <typename LoggerPolicy>
+void block_manager_<LoggerPolicy>::add_incompressible_data(inode& ino,
+                                                           mmif& mm,
+                                                           size_t size) {
+  size_t offset = 0;
+
+  while (offset < size) {
+    if (!incompressible_block_) {
+      // no need for a rolling hash, this block will never be referenced
+      // by the segmenter
+      incompressible_block_.emplace(block_count_++, block_size_, 0, 1, 0);
+    }
+
+    auto& block = *incompressible_block_;
+    auto block_offset = block.size();
+    auto chunk_size = std::min(size - offset, block_size_ - block_offset);
+
+    block.append(mm.as<uint8_t>(offset), chunk_size, nullptr);
+    ino.add_chunk(block.num(), block_offset, chunk_size);
+    prog_.chunk_count++;
+    prog_.filesystem_size += chunk_size;
+    offset += chunk_size;
+
+    if (block.full()) {
+      mm.release_until(offset);
+      incompressible_block_ready();
+    }
+  }
+
+  ++prog_.incompressible_files;
+  prog_.incompressible_bytes += size;
 }
 
 template <typename LoggerPolicy>
@@ -721,8 +841,8 @@ void block_manager_<LoggerPolicy>::segment_and_add_data(inode& ino, mmif& mm,
 
 block_manager::block_manager(logger& lgr, progress& prog, const config& cfg,
                              std::shared_ptr<os_access> os,
-                             filesystem_writer& fsw)
+                             filesystem_writer& fsw, fragment_category category)
     : impl_(make_unique_logging_object<impl, block_manager_, logger_policies>(
-          lgr, prog, cfg, os, fsw)) {}
+          lgr, prog, cfg, os, fsw, category)) {}
 
 } // namespace dwarfs
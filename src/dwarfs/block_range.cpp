@@ -48,4 +48,16 @@ block_range::block_range(std::shared_ptr<cached_block const> block,
   }
 }
 
+block_range block_range::subrange(size_t offset, size_t size) const {
+  if (offset + size > span_.size()) {
+    DWARFS_THROW(runtime_error,
+                 fmt::format("block_range: subrange out of range ({0} > {1})",
+                             offset + size, span_.size()));
+  }
+
+  block_range r{*this};
+  r.span_ = span_.subspan(offset, size);
+  return r;
+}
+
 } // namespace dwarfs
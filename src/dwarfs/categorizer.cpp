@@ -0,0 +1,214 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include <fmt/format.h>
+
+#include "dwarfs/categorizer.h"
+#include "dwarfs/entropy.h"
+#include "dwarfs/error.h"
+#include "dwarfs/mmif.h"
+#include "dwarfs/options.h"
+
+namespace dwarfs {
+
+namespace {
+
+constexpr std::string_view default_category_name{"<default>"};
+
+/**
+ * Files that look like they have already been compressed or encrypted
+ */
+class incompressible_categorizer final : public categorizer {
+ public:
+  explicit incompressible_categorizer(double threshold)
+      : threshold_{threshold} {}
+
+  std::string_view name() const override { return "incompressible"; }
+
+  std::span<std::string_view const> categories() const override {
+    static constexpr std::array<std::string_view, 1> cats{"incompressible"};
+    return cats;
+  }
+
+  std::optional<size_t> categorize(std::filesystem::path const&,
+                                   mmif const& mm) const override {
+    if (auto entropy = entropy_estimator::estimate(mm);
+        entropy && *entropy >= threshold_) {
+      return 0;
+    }
+    return std::nullopt;
+  }
+
+ private:
+  double const threshold_;
+};
+
+/**
+ * Text files, which are identified by the absence of NUL bytes and
+ * only very few control characters at the start of the file
+ */
+class text_categorizer final : public categorizer {
+ public:
+  static constexpr size_t sample_size = 64 << 10;
+
+  std::string_view name() const override { return "text"; }
+
+  std::span<std::string_view const> categories() const override {
+    static constexpr std::array<std::string_view, 1> cats{"text"};
+    return cats;
+  }
+
+  std::optional<size_t> categorize(std::filesystem::path const&,
+                                   mmif const& mm) const override {
+    auto const size = std::min(mm.size(), sample_size);
+    auto const data = mm.as<uint8_t>();
+    size_t control = 0;
+
+    for (size_t i = 0; i < size; ++i) {
+      auto c = data[i];
+      if (c == 0) {
+        return std::nullopt;
+      }
+      if ((c < 0x20 && !is_text_control(c)) || c == 0x7f) {
+        ++control;
+      }
+    }
+
+    if (size > 0 && 100 * control < size) {
+      return 0;
+    }
+
+    return std::nullopt;
+  }
+
+ private:
+  static bool is_text_control(uint8_t c) {
+    return c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\b' ||
+           c == '\v' || c == 0x1b;
+  }
+};
+
+/**
+ * ELF executables, shared libraries and object files
+ */
+class elf_categorizer final : public categorizer {
+ public:
+  std::string_view name() const override { return "elf"; }
+
+  std::span<std::string_view const> categories() const override {
+    static constexpr std::array<std::string_view, 1> cats{"elf"};
+    return cats;
+  }
+
+  std::optional<size_t> categorize(std::filesystem::path const&,
+                                   mmif const& mm) const override {
+    static constexpr std::array<char, 4> magic{0x7f, 'E', 'L', 'F'};
+
+    if (mm.size() >= magic.size() &&
+        std::memcmp(mm.as<char>(), magic.data(), magic.size()) == 0) {
+      return 0;
+    }
+
+    return std::nullopt;
+  }
+};
+
+} // namespace
+
+categorizer_manager::categorizer_manager()
+    : names_{std::string(default_category_name)} {}
+
+std::vector<std::string_view> const&
+categorizer_manager::builtin_categorizers() {
+  static std::vector<std::string_view> const names{"incompressible", "text",
+                                                   "elf"};
+  return names;
+}
+
+std::unique_ptr<categorizer>
+categorizer_manager::create_builtin(std::string_view name,
+                                    categorizer_options const& opts) {
+  if (name == "incompressible") {
+    return std::make_unique<incompressible_categorizer>(
+        opts.incompressible_threshold);
+  }
+
+  if (name == "text") {
+    return std::make_unique<text_categorizer>();
+  }
+
+  if (name == "elf") {
+    return std::make_unique<elf_categorizer>();
+  }
+
+  DWARFS_THROW(runtime_error, fmt::format("unknown categorizer: {}", name));
+}
+
+void categorizer_manager::add(std::unique_ptr<categorizer> c) {
+  for (auto cat : c->categories()) {
+    if (category_value(cat)) {
+      DWARFS_THROW(runtime_error,
+                   fmt::format("duplicate category: {}", cat));
+    }
+  }
+
+  first_category_.push_back(names_.size());
+
+  for (auto cat : c->categories()) {
+    names_.emplace_back(cat);
+  }
+
+  categorizers_.push_back(std::move(c));
+}
+
+fragment_category
+categorizer_manager::categorize(std::filesystem::path const& path,
+                                mmif const* mm) const {
+  if (mm) {
+    for (size_t i = 0; i < categorizers_.size(); ++i) {
+      if (auto cat = categorizers_[i]->categorize(path, *mm)) {
+        return first_category_[i] + *cat;
+      }
+    }
+  }
+
+  return default_category;
+}
+
+std::string_view
+categorizer_manager::category_name(fragment_category c) const {
+  return names_.at(c);
+}
+
+std::optional<fragment_category>
+categorizer_manager::category_value(std::string_view name) const {
+  if (auto it = std::find(names_.begin(), names_.end(), name);
+      it != names_.end()) {
+    return std::distance(names_.begin(), it);
+  }
+  return std::nullopt;
+}
+
+} // namespace dwarfs
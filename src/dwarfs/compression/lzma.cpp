@@ -19,6 +19,8 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+
 #include <lzma.h>
 
 #include "dwarfs/block_compressor.h"
@@ -27,6 +29,11 @@
 #include "dwarfs/option_map.h"
 #include "dwarfs/types.h"
 
+// lzma_stream_encoder_mt() was introduced in 5.2.0
+#if LZMA_VERSION >= 50020002U
+#define DWARFS_LZMA_HAVE_MT 1
+#endif
+
 namespace dwarfs {
 
 namespace {
@@ -56,24 +63,30 @@ std::string lzma_error_string(lzma_ret err) {
 class lzma_block_compressor final : public block_compressor::impl {
  public:
   lzma_block_compressor(unsigned level, bool extreme,
-                        const std::string& binary_mode, unsigned dict_size);
-  lzma_block_compressor(const lzma_block_compressor& rhs) = default;
+                        const std::string& binary_mode, unsigned dict_size,
+                        bool mt, unsigned mt_block_size);
+  lzma_block_compressor(const lzma_block_compressor& rhs);
 
   std::unique_ptr<block_compressor::impl> clone() const override {
     return std::make_unique<lzma_block_compressor>(*this);
   }
 
   std::vector<uint8_t>
-  compress(const std::vector<uint8_t>& data) const override;
+  compress(const std::vector<uint8_t>& data) const override {
+    return compress(data, 1);
+  }
   std::vector<uint8_t> compress(std::vector<uint8_t>&& data) const override {
-    return compress(data);
+    return compress(data, 1);
   }
+  std::vector<uint8_t> compress(const std::vector<uint8_t>& data,
+                                size_t num_threads) const override;
 
   compression_type type() const override { return compression_type::LZMA; }
 
  private:
-  std::vector<uint8_t>
-  compress(const std::vector<uint8_t>& data, const lzma_filter* filters) const;
+  std::vector<uint8_t> compress_with(const std::vector<uint8_t>& data,
+                                     const lzma_filter* filters,
+                                     size_t num_threads) const;
 
   static uint32_t get_preset(unsigned level, bool extreme) {
     uint32_t preset = level;
@@ -105,13 +118,19 @@ class lzma_block_compressor final : public block_compressor::impl {
     return i->second;
   }
 
+  void init_filters();
+
   lzma_options_lzma opt_lzma_;
   std::array<lzma_filter, 3> filters_;
+  bool const mt_;
+  uint64_t mt_block_size_;
 };
 
 lzma_block_compressor::lzma_block_compressor(unsigned level, bool extreme,
                                              const std::string& binary_mode,
-                                             unsigned dict_size) {
+                                             unsigned dict_size, bool mt,
+                                             unsigned mt_block_size)
+    : mt_{mt} {
   if (lzma_lzma_preset(&opt_lzma_, get_preset(level, extreme))) {
     DWARFS_THROW(runtime_error, "unsupported preset, possibly a bug");
   }
@@ -120,7 +139,33 @@ lzma_block_compressor::lzma_block_compressor(unsigned level, bool extreme,
     opt_lzma_.dict_size = 1 << dict_size;
   }
 
+#ifndef DWARFS_LZMA_HAVE_MT
+  if (mt_) {
+    DWARFS_THROW(runtime_error,
+                 "LZMA library is too old for multithreaded compression");
+  }
+#endif
+
+  if (mt_block_size < 16 || mt_block_size > 30) {
+    DWARFS_THROW(runtime_error, "LZMA mt_block_size must be in [16..30]");
+  }
+
+  mt_block_size_ = UINT64_C(1) << mt_block_size;
+
   filters_[0].id = get_vli(binary_mode);
+  init_filters();
+}
+
+lzma_block_compressor::lzma_block_compressor(const lzma_block_compressor& rhs)
+    : opt_lzma_{rhs.opt_lzma_}
+    , filters_{rhs.filters_}
+    , mt_{rhs.mt_}
+    , mt_block_size_{rhs.mt_block_size_} {
+  // the filter chain points to our own copy of the options
+  init_filters();
+}
+
+void lzma_block_compressor::init_filters() {
   filters_[0].options = NULL;
   filters_[1].id = LZMA_FILTER_LZMA2;
   filters_[1].options = &opt_lzma_;
@@ -129,12 +174,33 @@ lzma_block_compressor::lzma_block_compressor(unsigned level, bool extreme,
 }
 
 std::vector<uint8_t>
-lzma_block_compressor::compress(const std::vector<uint8_t>& data,
-                                const lzma_filter* filters) const {
+lzma_block_compressor::compress_with(const std::vector<uint8_t>& data,
+                                     const lzma_filter* filters,
+                                     [[maybe_unused]] size_t num_threads) const {
   lzma_stream s = LZMA_STREAM_INIT;
+  lzma_ret ret;
+
+#ifdef DWARFS_LZMA_HAVE_MT
+  if (mt_) {
+    // The multithreaded encoder splits the input into independent blocks
+    // of `block_size` bytes. As long as the block size doesn't depend on
+    // the number of threads, neither does the output.
+    lzma_mt mt{};
+    mt.threads = static_cast<uint32_t>(std::max<size_t>(num_threads, 1));
+    mt.block_size = mt_block_size_;
+    mt.filters = filters;
+    mt.check = LZMA_CHECK_CRC64;
+
+    ret = lzma_stream_encoder_mt(&s, &mt);
+  } else
+#endif
+  {
+    ret = lzma_stream_encoder(&s, filters, LZMA_CHECK_CRC64);
+  }
 
-  if (lzma_stream_encoder(&s, filters, LZMA_CHECK_CRC64)) {
-    DWARFS_THROW(runtime_error, "lzma_stream_encoder");
+  if (ret != LZMA_OK) {
+    DWARFS_THROW(runtime_error, fmt::format("lzma_stream_encoder: {}",
+                                            lzma_error_string(ret)));
   }
 
   lzma_action action = LZMA_FINISH;
@@ -146,7 +212,12 @@ lzma_block_compressor::compress(const std::vector<uint8_t>& data,
   s.next_out = compressed.data();
   s.avail_out = compressed.size();
 
-  lzma_ret ret = lzma_code(&s, action);
+  ret = lzma_code(&s, action);
+
+  // the multithreaded encoder may return before all threads are done
+  while (ret == LZMA_OK && s.avail_out > 0) {
+    ret = lzma_code(&s, action);
+  }
 
   compressed.resize(compressed.size() - s.avail_out);
 
@@ -167,11 +238,13 @@ lzma_block_compressor::compress(const std::vector<uint8_t>& data,
 }
 
 std::vector<uint8_t>
-lzma_block_compressor::compress(const std::vector<uint8_t>& data) const {
-  std::vector<uint8_t> best = compress(data, &filters_[1]);
+lzma_block_compressor::compress(const std::vector<uint8_t>& data,
+                                size_t num_threads) const {
+  std::vector<uint8_t> best = compress_with(data, &filters_[1], num_threads);
 
   if (filters_[0].id != LZMA_VLI_UNKNOWN) {
-    std::vector<uint8_t> compressed = compress(data, &filters_[0]);
+    std::vector<uint8_t> compressed =
+        compress_with(data, &filters_[0], num_threads);
 
     if (compressed.size() < best.size()) {
       best.swap(compressed);
@@ -329,7 +402,8 @@ class lzma_compression_factory : public compression_factory {
   make_compressor(option_map& om) const override {
     return std::make_unique<lzma_block_compressor>(
         om.get<unsigned>("level", 9u), om.get<bool>("extreme", false),
-        om.get<std::string>("binary"), om.get<unsigned>("dict_size", 0u));
+        om.get<std::string>("binary"), om.get<unsigned>("dict_size", 0u),
+        om.get<bool>("mt", false), om.get<unsigned>("mt_block_size", 22u));
   }
 
   std::unique_ptr<block_decompressor::impl>
@@ -345,6 +419,8 @@ class lzma_compression_factory : public compression_factory {
       "dict_size=[12..30]",
       "extreme",
       "binary={x86,powerpc,ia64,arm,armthumb,sparc}",
+      "mt",
+      "mt_block_size=[16..30]",
   };
 };
 
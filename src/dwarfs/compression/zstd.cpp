@@ -19,6 +19,8 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <bit>
 #include <mutex>
 
 #include <zstd.h>
@@ -37,35 +39,69 @@
 #define ZSTD_MIN_LEVEL 1
 #endif
 
+#if ZSTD_VERSION_MAJOR > 1 ||                                                  \
+    (ZSTD_VERSION_MAJOR == 1 && ZSTD_VERSION_MINOR >= 4)
+#define DWARFS_ZSTD_HAVE_MT 1
+#endif
+
 namespace dwarfs {
 
 namespace {
 
 class zstd_block_compressor final : public block_compressor::impl {
  public:
-  explicit zstd_block_compressor(int level)
+  zstd_block_compressor(int level, bool mt, unsigned mt_job_size)
       : ctxmgr_(get_context_manager())
-      , level_(level) {}
+      , level_(level)
+      , mt_(mt)
+      , mt_job_size_(mt_job_size) {
+    if (mt_) {
+#ifdef DWARFS_ZSTD_HAVE_MT
+      auto bounds = ZSTD_cParam_getBounds(ZSTD_c_nbWorkers);
+      if (ZSTD_isError(bounds.error) || bounds.upperBound < 1) {
+        DWARFS_THROW(runtime_error,
+                     "ZSTD library was built without multithreading support");
+      }
+#else
+      DWARFS_THROW(runtime_error,
+                   "ZSTD library is too old for multithreaded compression");
+#endif
+    }
+
+    if (mt_job_size < 20 || mt_job_size > 30) {
+      DWARFS_THROW(runtime_error, "ZSTD mt_job_size must be in [20..30]");
+    }
+  }
 
   zstd_block_compressor(const zstd_block_compressor& rhs)
-      : level_(rhs.level_) {}
+      : ctxmgr_(rhs.ctxmgr_)
+      , level_(rhs.level_)
+      , mt_(rhs.mt_)
+      , mt_job_size_(rhs.mt_job_size_) {}
 
   std::unique_ptr<block_compressor::impl> clone() const override {
     return std::make_unique<zstd_block_compressor>(*this);
   }
 
   std::vector<uint8_t>
-  compress(const std::vector<uint8_t>& data) const override;
+  compress(const std::vector<uint8_t>& data) const override {
+    return compress(data, 1);
+  }
 
   std::vector<uint8_t> compress(std::vector<uint8_t>&& data) const override {
-    return compress(data);
+    return compress(data, 1);
   }
 
+  std::vector<uint8_t> compress(const std::vector<uint8_t>& data,
+                                size_t num_threads) const override;
+
   compression_type type() const override { return compression_type::ZSTD; }
 
  private:
   class scoped_context;
 
+  int overlap_log(size_t size) const;
+
   class context_manager {
    public:
     context_manager() = default;
@@ -132,18 +168,73 @@ class zstd_block_compressor final : public block_compressor::impl {
 
   std::shared_ptr<context_manager> ctxmgr_;
   const int level_;
+  const bool mt_;
+  const unsigned mt_job_size_;
 };
 
 std::mutex zstd_block_compressor::s_mx;
 std::weak_ptr<zstd_block_compressor::context_manager>
     zstd_block_compressor::s_ctxmgr;
 
+// The multithreaded compressor raises the job size to at least the overlap
+// between jobs, which defaults to the full window size for the strongest
+// levels. So we limit the overlap to the job size, based on an upper bound
+// of the window size that only depends on the size of the input.
+int zstd_block_compressor::overlap_log(size_t size) const {
+  static constexpr unsigned kMinWindowLog{10};
+  static constexpr unsigned kMaxLevelWindowLog{27};
+
+  auto const window_log =
+      std::clamp<unsigned>(std::bit_width(std::max<size_t>(size, 2) - 1),
+                           kMinWindowLog, kMaxLevelWindowLog);
+  auto const shift = window_log > mt_job_size_ ? window_log - mt_job_size_ : 0;
+
+  // overlap is window_size >> (9 - overlap_log); 1 means no overlap
+  return std::max(9 - static_cast<int>(shift), 1);
+}
+
 std::vector<uint8_t>
-zstd_block_compressor::compress(const std::vector<uint8_t>& data) const {
+zstd_block_compressor::compress(const std::vector<uint8_t>& data,
+                                [[maybe_unused]] size_t num_threads) const {
   std::vector<uint8_t> compressed(ZSTD_compressBound(data.size()));
   scoped_context ctx(*ctxmgr_);
-  auto size = ZSTD_compressCCtx(ctx.get(), compressed.data(), compressed.size(),
-                                data.data(), data.size(), level_);
+  size_t size;
+
+#ifdef DWARFS_ZSTD_HAVE_MT
+  if (mt_) {
+    // The output of the multithreaded compressor is the same for any
+    // number of workers >= 1 as long as the job size is fixed, so we can
+    // pick the number of workers based on the current load without
+    // affecting the resulting image. The frame content size is always
+    // stored, as the decompressor needs it.
+    auto cctx = ctx.get();
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+    size = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level_);
+    if (!ZSTD_isError(size)) {
+      size = ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers,
+                                    static_cast<int>(std::max<size_t>(
+                                        num_threads, 1)));
+    }
+    if (!ZSTD_isError(size)) {
+      size = ZSTD_CCtx_setParameter(cctx, ZSTD_c_jobSize,
+                                    static_cast<int>(1 << mt_job_size_));
+    }
+    if (!ZSTD_isError(size)) {
+      size = ZSTD_CCtx_setParameter(cctx, ZSTD_c_overlapLog,
+                                    overlap_log(data.size()));
+    }
+    if (!ZSTD_isError(size)) {
+      size = ZSTD_compress2(cctx, compressed.data(), compressed.size(),
+                            data.data(), data.size());
+    }
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+  } else
+#endif
+  {
+    size = ZSTD_compressCCtx(ctx.get(), compressed.data(), compressed.size(),
+                             data.data(), data.size(), level_);
+  }
+
   if (ZSTD_isError(size)) {
     DWARFS_THROW(runtime_error,
                  fmt::format("ZSTD: {}", ZSTD_getErrorName(size)));
@@ -221,7 +312,10 @@ class zstd_compression_factory : public compression_factory {
  public:
   zstd_compression_factory()
       : options_{
-            fmt::format("level=[{}..{}]", ZSTD_MIN_LEVEL, ZSTD_maxCLevel())} {}
+            fmt::format("level=[{}..{}]", ZSTD_MIN_LEVEL, ZSTD_maxCLevel()),
+            "mt",
+            "mt_job_size=[20..30]",
+        } {}
 
   std::string_view name() const override { return "zstd"; }
 
@@ -232,7 +326,8 @@ class zstd_compression_factory : public compression_factory {
   std::unique_ptr<block_compressor::impl>
   make_compressor(option_map& om) const override {
     return std::make_unique<zstd_block_compressor>(
-        om.get<int>("level", ZSTD_maxCLevel()));
+        om.get<int>("level", ZSTD_maxCLevel()), om.get<bool>("mt", false),
+        om.get<unsigned>("mt_job_size", 22u));
   }
 
   std::unique_ptr<block_decompressor::impl>
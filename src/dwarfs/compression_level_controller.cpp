@@ -0,0 +1,72 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include "dwarfs/compression_level_controller.h"
+#include "dwarfs/error.h"
+
+namespace dwarfs {
+
+compression_level_controller::compression_level_controller(size_t num_levels)
+    : num_levels_{num_levels}
+    , level_{num_levels > 0 ? num_levels - 1 : 0} {
+  DWARFS_CHECK(num_levels > 0, "need at least one compression level");
+}
+
+/**
+ * If the workers can't keep up, the backlog grows until the queue is
+ * full and the segmenters stall; if there are fewer active sections
+ * than workers, workers are idle waiting for blocks. The thresholds are
+ * thus relative to both the number of workers and the queue capacity.
+ * The level is lowered once the backlog occupies more than half of the
+ * queue space not taken up by sections being compressed, and raised
+ * once a quarter of the workers are idle.
+ */
+size_t compression_level_controller::update(size_t active, size_t workers,
+                                            size_t capacity) {
+  workers = std::max<size_t>(workers, 1);
+  capacity = std::max<size_t>(capacity, 1);
+
+  active_sum_ += active;
+
+  if (++samples_ >= 2 * workers) {
+    auto const busy = static_cast<double>(std::min(workers, capacity));
+    auto const lower = 0.75 * busy;
+    auto const upper = busy + 0.5 * (static_cast<double>(capacity) - busy);
+
+    last_average_ =
+        static_cast<double>(active_sum_) / static_cast<double>(samples_);
+
+    if (last_average_ > upper && level_ > 0) {
+      --level_;
+    } else if (last_average_ < lower && level_ + 1 < num_levels_) {
+      ++level_;
+    }
+
+    samples_ = 0;
+    active_sum_ = 0;
+  }
+
+  return level_;
+}
+
+} // namespace dwarfs
@@ -0,0 +1,113 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "dwarfs/entropy.h"
+#include "dwarfs/mmif.h"
+
+namespace dwarfs {
+
+namespace {
+
+constexpr size_t sample_size = 16 << 10;
+
+} // namespace
+
+void entropy_estimator::update(uint8_t const* data, size_t size) {
+  // Using four separate histograms avoids stalls when incrementing
+  // the same counter for consecutive bytes.
+  std::array<std::array<uint32_t, 256>, 4> h{};
+  size_t off = 0;
+
+  while (off < size) {
+    auto end = off + std::min<size_t>(size - off, 1 << 30);
+
+    for (; off + 4 <= end; off += 4) {
+      ++h[0][data[off + 0]];
+      ++h[1][data[off + 1]];
+      ++h[2][data[off + 2]];
+      ++h[3][data[off + 3]];
+    }
+
+    for (; off < end; ++off) {
+      ++h[0][data[off]];
+    }
+
+    for (size_t i = 0; i < hist_.size(); ++i) {
+      hist_[i] += h[0][i] + h[1][i] + h[2][i] + h[3][i];
+    }
+
+    h = {};
+  }
+
+  size_ += size;
+}
+
+void entropy_estimator::update_sampled(mmif const& mm, size_t max_bytes) {
+  auto const size = mm.size();
+  auto const data = mm.as<uint8_t>();
+
+  if (size <= max_bytes) {
+    update(data, size);
+    return;
+  }
+
+  auto const samples = std::max<size_t>(1, max_bytes / sample_size);
+  auto const stride = (size - sample_size) / std::max<size_t>(1, samples - 1);
+
+  for (size_t i = 0; i < samples; ++i) {
+    update(data + i * stride, sample_size);
+  }
+}
+
+std::optional<double>
+entropy_estimator::estimate(mmif const& mm, size_t min_size) {
+  if (mm.size() < min_size) {
+    return std::nullopt;
+  }
+
+  entropy_estimator ee;
+  ee.update_sampled(mm);
+
+  return ee.bits_per_byte();
+}
+
+double entropy_estimator::bits_per_byte() const {
+  if (size_ == 0) {
+    return 0.0;
+  }
+
+  double entropy = 0.0;
+  double const total = static_cast<double>(size_);
+
+  for (auto count : hist_) {
+    if (count > 0) {
+      double p = count / total;
+      entropy -= p * std::log2(p);
+    }
+  }
+
+  return entropy;
+}
+
+} // namespace dwarfs
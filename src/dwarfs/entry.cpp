@@ -21,10 +21,14 @@
 
 #include <algorithm>
 #include <cstring>
+#include <limits>
+#include <memory_resource>
 #include <utility>
 
 #include <fmt/format.h>
 
+#include <folly/container/F14Set.h>
+
 #include "dwarfs/checksum.h"
 #include "dwarfs/entry.h"
 #include "dwarfs/error.h"
@@ -42,39 +46,53 @@
 
 namespace dwarfs {
 
-entry::entry(std::filesystem::path const& path, std::shared_ptr<entry> parent,
-             file_stat const& st)
-    : name_{u8string_to_string(parent ? path.filename().u8string()
-                                      : path.u8string())}
-    , parent_{std::move(parent)}
-    , stat_{st} {}
-
-bool entry::has_parent() const {
-  if (parent_.lock()) {
-    return true;
-  }
-
-  return false;
+entry::entry(std::string const& name, entry* parent, file_stat const& st)
+    : name_{&name}
+    , parent_{parent}
+    , stat_{st.ino,
+            st.size,
+            st.atime,
+            st.mtime,
+            st.ctime,
+            st.mode,
+            st.uid,
+            st.gid,
+            static_cast<uint32_t>(std::min<file_stat::nlink_type>(
+                st.nlink, std::numeric_limits<uint32_t>::max()))} {}
+
+void entry::clear_name() {
+  static std::string const empty;
+  name_ = &empty;
 }
 
-std::shared_ptr<entry> entry::parent() const { return parent_.lock(); }
-
-void entry::set_name(const std::string& name) { name_ = name; }
+file_stat entry::status() const {
+  file_stat st{};
+  st.ino = stat_.ino;
+  st.nlink = stat_.nlink;
+  st.mode = stat_.mode;
+  st.uid = stat_.uid;
+  st.gid = stat_.gid;
+  st.size = stat_.size;
+  st.atime = stat_.atime;
+  st.mtime = stat_.mtime;
+  st.ctime = stat_.ctime;
+  return st;
+}
 
-std::u8string entry::u8name() const { return string_to_u8string(name_); }
+std::u8string entry::u8name() const { return string_to_u8string(name()); }
 
 std::filesystem::path entry::fs_path() const {
-  if (auto parent = parent_.lock()) {
+  if (parent_) {
 #ifdef U8STRING_AND_PATH_OK
-    return parent->fs_path() / u8name();
+    return parent_->fs_path() / u8name();
 #else
-    return parent->fs_path() / name_;
+    return parent_->fs_path() / name();
 #endif
   }
 #ifdef U8STRING_AND_PATH_OK
   return std::filesystem::path(u8name());
 #else
-  return std::filesystem::path(name_);
+  return std::filesystem::path(name());
 #endif
 }
 
@@ -91,19 +109,29 @@ std::string entry::dpath() const {
 }
 
 std::string entry::unix_dpath() const {
-  auto p = name_;
+  auto p = name();
 
   if (type() == E_DIR) {
     p += '/';
   }
 
-  if (auto parent = parent_.lock()) {
-    return parent->unix_dpath() + p;
+  if (parent_) {
+    return parent_->unix_dpath() + p;
   }
 
   return p;
 }
 
+std::string entry::unix_relpath() const {
+  auto path = name();
+
+  for (auto d = parent_; d && d->has_parent(); d = d->parent()) {
+    path = d->name() + '/' + path;
+  }
+
+  return path;
+}
+
 bool entry::less_revpath(entry const& rhs) const {
   if (name() < rhs.name()) {
     return true;
@@ -113,8 +141,8 @@ bool entry::less_revpath(entry const& rhs) const {
     return false;
   }
 
-  auto p = parent();
-  auto rhs_p = rhs.parent();
+  auto p = parent_;
+  auto rhs_p = rhs.parent_;
 
   if (p && rhs_p) {
     return p->less_revpath(*rhs_p);
@@ -124,7 +152,10 @@ bool entry::less_revpath(entry const& rhs) const {
 }
 
 std::string entry::type_string() const {
-  switch (stat_.type()) {
+  auto const type = static_cast<posix_file_type::value>(
+      stat_.mode & posix_file_type::mask);
+
+  switch (type) {
   case posix_file_type::regular:
     return "file";
   case posix_file_type::directory:
@@ -144,10 +175,12 @@ std::string entry::type_string() const {
   }
 
   DWARFS_THROW(runtime_error, fmt::format("unknown file type: {:#06x}",
-                                          fmt::underlying(stat_.type())));
+                                          fmt::underlying(type)));
 }
 
-bool entry::is_directory() const { return stat_.is_directory(); }
+bool entry::is_directory() const {
+  return (stat_.mode & posix_file_type::mask) == posix_file_type::directory;
+}
 
 void entry::walk(std::function<void(entry*)> const& f) { f(this); }
 
@@ -174,9 +207,11 @@ void entry::pack(thrift::metadata::inode_data& entry_v2,
 
 entry::type_t file::type() const { return E_FILE; }
 
-auto entry::get_permissions() const -> mode_type { return stat_.permissions(); }
+auto entry::get_permissions() const -> mode_type { return stat_.mode & 07777; }
 
-void entry::set_permissions(mode_type perm) { stat_.set_permissions(perm); }
+void entry::set_permissions(mode_type perm) {
+  stat_.mode = (stat_.mode & ~07777) | (perm & 07777);
+}
 
 auto entry::get_uid() const -> uid_type { return stat_.uid; }
 
@@ -203,6 +238,10 @@ std::string_view file::hash() const {
   return std::string_view(h.data(), h.size());
 }
 
+void file::set_hash(std::string_view hash) {
+  data_->hash.assign(hash.begin(), hash.end());
+}
+
 void file::set_inode(std::shared_ptr<inode> ino) {
   if (inode_) {
     DWARFS_THROW(runtime_error, "inode already set for file");
@@ -346,7 +385,7 @@ void dir::pack(thrift::metadata::metadata& mv2,
                global_entry_data const& data) const {
   thrift::metadata::directory d;
   if (has_parent()) {
-    auto pd = std::dynamic_pointer_cast<dir>(parent());
+    auto pd = dynamic_cast<dir const*>(parent());
     DWARFS_CHECK(pd, "unexpected parent entry (not a directory)");
     auto pe = pd->entry_index();
     DWARFS_CHECK(pe, "parent entry index not set");
@@ -431,6 +470,10 @@ void link::scan(os_access& os, progress& prog) {
   prog.symlink_size += size();
 }
 
+device::device(std::string const& name, entry* parent, file_stat const& st)
+    : entry(name, parent, st)
+    , rdev_{st.rdev} {}
+
 entry::type_t device::type() const {
   switch (status().type()) {
   case posix_file_type::character:
@@ -445,7 +488,7 @@ void device::accept(entry_visitor& v, bool) { v.visit(this); }
 
 void device::scan(os_access&, progress&) {}
 
-uint64_t device::device_id() const { return status().rdev; }
+uint64_t device::device_id() const { return rdev_; }
 
 class entry_factory_ : public entry_factory {
  public:
@@ -457,22 +500,24 @@ class entry_factory_ : public entry_factory {
         parent ? parent->fs_path() / path.filename() : path;
 
     auto st = os.symlink_info(p);
+    auto const& name = intern(u8string_to_string(
+        parent ? path.filename().u8string() : path.u8string()));
 
     switch (st.type()) {
     case posix_file_type::regular:
-      return std::make_shared<file>(path, std::move(parent), st);
+      return make_entry<file>(name, parent.get(), st);
 
     case posix_file_type::directory:
-      return std::make_shared<dir>(path, std::move(parent), st);
+      return make_entry<dir>(name, parent.get(), st);
 
     case posix_file_type::symlink:
-      return std::make_shared<link>(path, std::move(parent), st);
+      return make_entry<link>(name, parent.get(), st);
 
     case posix_file_type::character:
     case posix_file_type::block:
     case posix_file_type::fifo:
     case posix_file_type::socket:
-      return std::make_shared<device>(path, std::move(parent), st);
+      return make_entry<device>(name, parent.get(), st);
 
     default:
       // TODO: warn
@@ -481,6 +526,26 @@ class entry_factory_ : public entry_factory {
 
     return nullptr;
   }
+
+ private:
+  // Entries are never freed individually before the whole tree is
+  // destroyed, so we can get rid of the per-object heap overhead by
+  // carving them from large chunks of memory.
+  template <typename T>
+  std::shared_ptr<entry>
+  make_entry(std::string const& name, entry* parent, file_stat const& st) {
+    return std::allocate_shared<T>(std::pmr::polymorphic_allocator<T>(&arena_),
+                                   name, parent, st);
+  }
+
+  // Lots of files share the same name (think `Makefile`), so we only
+  // store each name once.
+  std::string const& intern(std::string&& name) {
+    return *names_.insert(std::move(name)).first;
+  }
+
+  std::pmr::monotonic_buffer_resource arena_{size_t(1) << 20};
+  folly::F14NodeSet<std::string> names_;
 };
 
 std::unique_ptr<entry_factory> entry_factory::create() {
@@ -19,26 +19,234 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <array>
 #include <mutex>
+#include <optional>
+#include <string>
 #include <string_view>
 #include <vector>
 
 #include <folly/container/F14Map.h>
 
+#include "dwarfs/base_image.h"
+#include "dwarfs/categorizer.h"
+#include "dwarfs/checksum.h"
 #include "dwarfs/entry.h"
+#include "dwarfs/error.h"
 #include "dwarfs/file_scanner.h"
 #include "dwarfs/inode.h"
 #include "dwarfs/inode_manager.h"
 #include "dwarfs/logger.h"
+#include "dwarfs/mmif.h"
+#include "dwarfs/nilsimsa.h"
 #include "dwarfs/options.h"
 #include "dwarfs/os_access.h"
 #include "dwarfs/progress.h"
+#include "dwarfs/similarity.h"
 #include "dwarfs/worker_group.h"
 
 namespace dwarfs::detail {
 
 namespace {
 
+/**
+ * Root digest of a file hashed as a tree with a single level of
+ * fixed-size leaves
+ *
+ * This is the hash of the file size, the leaf size and all leaf digests.
+ * Both file size and leaf size are included so the root digest cannot
+ * possibly match the plain hash of a file.
+ */
+std::string tree_root_digest(std::string const& algo, size_t size,
+                             size_t leaf_size, std::string const& leaves) {
+  // little-endian file size and leaf size
+  std::array<uint8_t, 16> header;
+  for (size_t i = 0; i < 8; ++i) {
+    header[i] = static_cast<uint8_t>(uint64_t(size) >> (8 * i));
+    header[8 + i] = static_cast<uint8_t>(uint64_t(leaf_size) >> (8 * i));
+  }
+
+  checksum cs(algo);
+  cs.update(header.data(), header.size());
+  cs.update(leaves.data(), leaves.size());
+
+  std::string digest(cs.digest_size(), '\0');
+  DWARFS_CHECK(cs.finalize(digest.data()), "checksum computation failed");
+
+  return digest;
+}
+
+/**
+ * Computes any combination of a file's content hash and its similarity
+ * hashes in a single pass over the file data
+ *
+ * If `tree_wg` is given, the content hash is a tree hash (see
+ * `tree_root_digest()`) and the leaves are hashed in parallel on
+ * `tree_wg`. The similarity hashes are computed alongside, window by
+ * window, so each part of the file is only read once.
+ */
+class fused_scanner {
+ public:
+  fused_scanner(std::optional<std::string> const& hash_algo,
+                bool with_similarity, bool with_nilsimsa,
+                worker_group* tree_wg = nullptr, size_t tree_leaf_size = 0) {
+    if (hash_algo) {
+      if (tree_wg) {
+        tree_.emplace(*tree_wg, *hash_algo, tree_leaf_size);
+      } else {
+        cs_.emplace(*hash_algo);
+      }
+    }
+    if (with_similarity) {
+      sc_.emplace();
+    }
+    if (with_nilsimsa) {
+      nc_.emplace();
+    }
+  }
+
+  void scan(mmif* mm) {
+    if (!mm) {
+      return;
+    }
+
+    // this is just a hint, so we don't care if it fails
+    mm->advise(advice::SEQUENTIAL, 0, mm->size());
+
+    if (tree_) {
+      scan_tree(*mm);
+      return;
+    }
+
+    size_t offset = 0;
+    size_t size = mm->size();
+
+    while (size >= chunk_size) {
+      update(mm->as<uint8_t>(offset), chunk_size);
+      mm->release_until(offset);
+      offset += chunk_size;
+      size -= chunk_size;
+    }
+
+    update(mm->as<uint8_t>(offset), size);
+  }
+
+  void finalize_hash(file& p) const {
+    if (tree_) {
+      p.set_hash(tree_root_digest(tree_->algo, tree_->size, tree_->leaf_size,
+                                  tree_->leaves));
+      return;
+    }
+
+    if (!cs_) {
+      return;
+    }
+
+    std::string digest(cs_->digest_size(), '\0');
+    DWARFS_CHECK(cs_->finalize(digest.data()), "checksum computation failed");
+    p.set_hash(digest);
+  }
+
+  void finalize_similarity(inode& ino) const {
+    if (sc_) {
+      ino.set_similarity_hash(sc_->finalize());
+    }
+
+    if (nc_) {
+      nilsimsa::hash_type hash;
+      nc_->finalize(hash);
+      ino.set_nilsimsa_similarity_hash(hash);
+    }
+  }
+
+ private:
+  static constexpr size_t chunk_size = 32 << 20;
+
+  struct tree_state {
+    tree_state(worker_group& wg, std::string const& algo, size_t leaf_size)
+        : wg{wg}
+        , algo{algo}
+        , leaf_size{leaf_size}
+        , digest_size{checksum(algo).digest_size()} {}
+
+    worker_group& wg;
+    std::string const algo;
+    size_t const leaf_size;
+    size_t const digest_size;
+    size_t size{0};
+    std::string leaves;
+  };
+
+  void scan_tree(mmif& mm) {
+    auto& t = *tree_;
+    auto const size = mm.size();
+    bool const sequential = sc_ || nc_;
+
+    t.size = size;
+    t.leaves.assign((size + t.leaf_size - 1) / t.leaf_size * t.digest_size,
+                    '\0');
+
+    // Without similarity hashes, all leaves can be hashed at once.
+    // Otherwise, the similarity hashes are computed by one more job
+    // alongside the leaves of a window, which is just large enough to
+    // keep all workers busy.
+    size_t const window =
+        sequential ? std::max<size_t>(1, t.wg.size()) * t.leaf_size : size;
+
+    for (size_t offset = 0; offset < size; offset += window) {
+      auto const len = std::min(window, size - offset);
+      auto const first_leaf = offset / t.leaf_size;
+      auto const num_leaves = (len + t.leaf_size - 1) / t.leaf_size;
+
+      t.wg.parallel_for(num_leaves + (sequential ? 1 : 0), [&](size_t i) {
+        if (sequential) {
+          if (i == 0) {
+            update(mm.as<uint8_t>(offset), len);
+            return;
+          }
+          --i;
+        }
+
+        auto const leaf = first_leaf + i;
+        auto const leaf_offset = leaf * t.leaf_size;
+        auto const leaf_len = std::min(t.leaf_size, size - leaf_offset);
+        checksum cs(t.algo);
+        cs.update(mm.as<void>(leaf_offset), leaf_len);
+        DWARFS_CHECK(cs.finalize(t.leaves.data() + leaf * t.digest_size),
+                     "checksum computation failed");
+
+        if (!sequential) {
+          mm.release(leaf_offset, leaf_len);
+        }
+      });
+
+      if (sequential) {
+        mm.release(offset, len);
+      }
+    }
+  }
+
+  void update(uint8_t const* data, size_t size) {
+    if (cs_) {
+      cs_->update(data, size);
+    }
+
+    if (sc_) {
+      sc_->update(data, size);
+    }
+
+    if (nc_) {
+      nc_->update(data, size);
+    }
+  }
+
+  std::optional<checksum> cs_;
+  std::optional<tree_state> tree_;
+  std::optional<similarity> sc_;
+  std::optional<nilsimsa> nc_;
+};
+
 class file_scanner_ : public file_scanner::impl {
  public:
   file_scanner_(worker_group& wg, os_access& os, inode_manager& im,
@@ -46,6 +254,7 @@ class file_scanner_ : public file_scanner::impl {
                 std::optional<std::string> const& hash_algo, progress& prog);
 
   void scan(file* p) override;
+  void reuse_base_files() override;
   void finalize(uint32_t& inode_num) override;
 
   uint32_t num_unique() const override { return num_unique_; }
@@ -66,9 +275,17 @@ class file_scanner_ : public file_scanner::impl {
     bool ready_{false};
   };
 
+  void scan_file(file* p);
   void scan_dedupe(file* p);
-  void hash_file(file* p);
-  void add_inode(file* p);
+  std::unique_ptr<fused_scanner> hash_file(file* p, bool with_similarity);
+  bool use_tree_hash(size_t size) const {
+    return hash_algo_ && ino_opts_.tree_hash_min_size && size > 0 &&
+           size >= *ino_opts_.tree_hash_min_size;
+  }
+  void add_inode(file* p, std::unique_ptr<fused_scanner> scanned = nullptr);
+  void publish_first_file(file* p, condition_barrier& cv);
+  void add_categorize_job(file* p, std::shared_ptr<inode> ino);
+  void categorize(file* p, inode& ino, mmif const* mm) const;
 
   template <typename Lookup>
   void finalize_hardlinks(Lookup&& lookup);
@@ -94,8 +311,13 @@ class file_scanner_ : public file_scanner::impl {
   folly::F14FastMap<uint64_t, inode::files_vector> unique_size_;
   folly::F14FastMap<uint64_t, std::shared_ptr<condition_barrier>>
       first_file_hashed_;
+  folly::F14FastMap<file const*, std::shared_ptr<condition_barrier>>
+      fused_pending_;
   folly::F14FastMap<uint64_t, inode::files_vector> by_raw_inode_;
   folly::F14FastMap<std::string_view, inode::files_vector> by_hash_;
+  folly::F14FastMap<uint32_t, inode::files_vector> base_candidates_;
+  folly::F14FastMap<uint32_t, inode::files_vector> by_base_inode_;
+  folly::F14FastMap<file const*, uint32_t> reused_files_;
 };
 
 // The `unique_size_` table holds an entry for each file size we
@@ -126,6 +348,18 @@ class file_scanner_ : public file_scanner::impl {
 //   stored. As long as the first file's hash has not been stored,
 //   it is still present in `unique_size_`. It will be removed
 //   from `unique_size_` after its hash has been stored.
+//
+// - To avoid reading the first file twice, its hash is computed
+//   along with its similarity hashes if it needs a similarity scan.
+//   While this scan is running, the file is kept in `fused_pending_`.
+//   If the second file shows up in the meantime, the barrier is
+//   stored in `fused_pending_` and the first file's hash will be
+//   stored as soon as the scan is complete.
+//
+// - Subsequent files that turn out not to be duplicates need a
+//   similarity scan after hashing. For large files, we speculatively
+//   compute the similarity hashes while hashing, trading a bit of
+//   CPU time for duplicates against re-reading the file.
 
 file_scanner_::file_scanner_(worker_group& wg, os_access& os, inode_manager& im,
                              inode_options const& ino_opts,
@@ -154,6 +388,20 @@ void file_scanner_::scan(file* p) {
 
   prog_.original_size += p->size();
 
+  if (auto const& base = ino_opts_.base) {
+    if (auto base_inode =
+            base->find_unchanged(p->unix_relpath(), p->status())) {
+      // This file may be reused, but we can only tell once we know
+      // all unchanged files.
+      base_candidates_[*base_inode].push_back(p);
+      return;
+    }
+  }
+
+  scan_file(p);
+}
+
+void file_scanner_::scan_file(file* p) {
   if (hash_algo_) {
     scan_dedupe(p);
   } else {
@@ -166,13 +414,69 @@ void file_scanner_::scan(file* p) {
   }
 }
 
+void file_scanner_::reuse_base_files() {
+  auto const& base = ino_opts_.base;
+
+  if (!base) {
+    return;
+  }
+
+  // needed for reproducibility
+  std::vector<std::pair<uint32_t, inode::files_vector>> candidates(
+      base_candidates_.begin(), base_candidates_.end());
+  std::sort(candidates.begin(), candidates.end(),
+            [](auto& left, auto& right) { return left.first < right.first; });
+  base_candidates_.clear();
+
+  std::vector<uint32_t> base_inodes;
+  base_inodes.reserve(candidates.size());
+
+  for (auto const& c : candidates) {
+    base_inodes.push_back(c.first);
+  }
+
+  base->select_blocks(base_inodes);
+
+  for (auto& [base_inode, files] : candidates) {
+    if (!base->can_reuse(base_inode)) {
+      for (auto p : files) {
+        scan_file(p);
+      }
+      continue;
+    }
+
+    auto inode = im_.create_inode();
+    base->add_chunks(base_inode, *inode);
+    inode->set_reused();
+    inode->set_similarity_valid(ino_opts_);
+
+    for (auto p : files) {
+      p->set_inode(inode);
+      reused_files_.emplace(p, base_inode);
+      if (p != files.front()) {
+        ++prog_.duplicate_files;
+        prog_.saved_by_deduplication += p->size();
+      }
+      ++prog_.files_scanned;
+    }
+
+    ++prog_.inodes_scanned;
+
+    by_base_inode_.emplace(base_inode, std::move(files));
+  }
+}
+
 void file_scanner_::finalize(uint32_t& inode_num) {
   uint32_t obj_num = 0;
 
   assert(first_file_hashed_.empty());
+  assert(base_candidates_.empty());
 
   if (hash_algo_) {
     finalize_hardlinks([this](file const* p) -> inode::files_vector& {
+      if (auto it = reused_files_.find(p); it != reused_files_.end()) {
+        return by_base_inode_.at(it->second);
+      }
       auto it = by_hash_.find(p->hash());
       if (it != by_hash_.end()) {
         return it->second;
@@ -183,10 +487,15 @@ void file_scanner_::finalize(uint32_t& inode_num) {
     finalize_files(by_hash_, inode_num, obj_num);
   } else {
     finalize_hardlinks([this](file const* p) -> inode::files_vector& {
+      if (auto it = reused_files_.find(p); it != reused_files_.end()) {
+        return by_base_inode_.at(it->second);
+      }
       return by_raw_inode_.at(p->raw_inode_num());
     });
     finalize_files(by_raw_inode_, inode_num, obj_num);
   }
+
+  finalize_files(by_base_inode_, inode_num, obj_num);
 }
 
 void file_scanner_::scan_dedupe(file* p) {
@@ -226,39 +535,50 @@ void file_scanner_::scan_dedupe(file* p) {
 
       cv = std::make_shared<condition_barrier>();
 
+      auto first = it->second.front();
+      bool first_pending = false;
+
       {
         std::lock_guard lock(mx_);
         first_file_hashed_.emplace(size, cv);
-      }
-
-      // Add a job for the first file
-      wg_.add_job([this, p = it->second.front(), cv] {
-        hash_file(p);
-
-        {
-          std::lock_guard lock(mx_);
 
-          auto& ref = by_hash_[p->hash()];
-
-          assert(ref.empty());
-          assert(p->get_inode());
-
-          ref.push_back(p);
+        // If the first file is still being scanned for similarity, its
+        // hash will be stored as soon as that scan is complete.
+        if (auto fp = fused_pending_.find(first); fp != fused_pending_.end()) {
+          fp->second = cv;
+          first_pending = true;
+        }
+      }
 
-          cv->set();
+      if (!first_pending) {
+        // Add a job for the first file, unless its hash has already
+        // been computed by a similarity scan
+        wg_.add_job([this, p = first, cv] {
+          if (p->hash().empty()) {
+            hash_file(p, false);
+          }
 
-          first_file_hashed_.erase(p->size());
-        }
+          {
+            std::lock_guard lock(mx_);
+            publish_first_file(p, *cv);
+          }
 
-        cv->notify();
-      });
+          cv->notify();
+        });
+      }
 
       it->second.clear();
     }
 
     // Add a job for any subsequent files
     wg_.add_job([this, p, cv] {
-      hash_file(p);
+      auto const size = p->size();
+      auto const& spec_size = ino_opts_.speculative_scan_min_size;
+      auto scanned = hash_file(p, ino_opts_.needs_scan(size) && spec_size &&
+                                      size >= *spec_size);
+
+      ++prog_.hash_scans;
+      prog_.hash_bytes += size;
 
       {
         std::unique_lock lock(mx_);
@@ -273,7 +593,7 @@ void file_scanner_::scan_dedupe(file* p) {
 
         if (ref.empty()) {
           // This is *not* a duplicate. We must allocate a new inode.
-          add_inode(p);
+          add_inode(p, std::move(scanned));
         } else {
           auto inode = ref.front()->get_inode();
           assert(inode);
@@ -289,7 +609,8 @@ void file_scanner_::scan_dedupe(file* p) {
   }
 }
 
-void file_scanner_::hash_file(file* p) {
+std::unique_ptr<fused_scanner>
+file_scanner_::hash_file(file* p, bool with_similarity) {
   auto const size = p->size();
   std::shared_ptr<mmif> mm;
 
@@ -297,25 +618,121 @@ void file_scanner_::hash_file(file* p) {
     mm = os_.map_file(p->fs_path(), size);
   }
 
+  bool const tree = use_tree_hash(size);
+
+  auto fs = std::make_unique<fused_scanner>(
+      hash_algo_, with_similarity && ino_opts_.with_similarity,
+      with_similarity && ino_opts_.with_nilsimsa, tree ? &wg_ : nullptr,
+      ino_opts_.tree_hash_leaf_size);
+
   prog_.current.store(p);
-  p->scan(mm.get(), prog_, hash_algo_);
+
+  fs->scan(mm.get());
+  fs->finalize_hash(*p);
+
+  if (tree) {
+    ++prog_.tree_hash_scans;
+  }
+
+  if (with_similarity) {
+    ++prog_.fused_scans;
+    prog_.fused_bytes_read += size;
+    return fs;
+  }
+
+  prog_.hash_bytes_read += size;
+
+  return nullptr;
 }
 
-void file_scanner_::add_inode(file* p) {
+void file_scanner_::publish_first_file(file* p, condition_barrier& cv) {
+  auto& ref = by_hash_[p->hash()];
+
+  assert(ref.empty());
+  assert(p->get_inode());
+
+  ref.push_back(p);
+
+  ++prog_.hash_scans;
+  prog_.hash_bytes += p->size();
+
+  cv.set();
+
+  first_file_hashed_.erase(p->size());
+}
+
+void file_scanner_::add_inode(file* p, std::unique_ptr<fused_scanner> scanned) {
   assert(!p->get_inode());
 
   auto inode = im_.create_inode();
 
   p->set_inode(inode);
 
-  if (ino_opts_.needs_scan(p->size())) {
-    wg_.add_job([this, p, inode = std::move(inode)] {
+  if (scanned) {
+    scanned->finalize_similarity(*inode);
+    add_categorize_job(p, std::move(inode));
+    ++prog_.similarity_scans;
+    prog_.similarity_bytes += p->size();
+    ++prog_.inodes_scanned;
+    ++prog_.files_scanned;
+  } else if (ino_opts_.needs_scan(p->size())) {
+    // `p` can only be without a hash if it's the first file of its size
+    bool const with_hash = hash_algo_ && p->hash().empty();
+
+    if (with_hash) {
+      fused_pending_.emplace(p, nullptr);
+    }
+
+    wg_.add_job([this, p, inode = std::move(inode), with_hash] {
       std::shared_ptr<mmif> mm;
       auto const size = p->size();
       if (size > 0) {
         mm = os_.map_file(p->fs_path(), size);
       }
-      inode->scan(mm.get(), ino_opts_);
+
+      bool const tree = with_hash && use_tree_hash(size);
+
+      fused_scanner fs(with_hash ? hash_algo_ : std::nullopt,
+                       ino_opts_.with_similarity, ino_opts_.with_nilsimsa,
+                       tree ? &wg_ : nullptr, ino_opts_.tree_hash_leaf_size);
+
+      categorize(p, *inode, mm.get());
+
+      fs.scan(mm.get());
+      fs.finalize_similarity(*inode);
+
+      if (tree) {
+        ++prog_.tree_hash_scans;
+      }
+
+      if (with_hash) {
+        std::shared_ptr<condition_barrier> cv;
+
+        ++prog_.fused_scans;
+        prog_.fused_bytes_read += size;
+
+        {
+          std::lock_guard lock(mx_);
+
+          fs.finalize_hash(*p);
+
+          auto it = fused_pending_.find(p);
+          assert(it != fused_pending_.end());
+          cv = std::move(it->second);
+          fused_pending_.erase(it);
+
+          if (cv) {
+            publish_first_file(p, *cv);
+          }
+        }
+
+        if (cv) {
+          cv->notify();
+        }
+      } else {
+        prog_.similarity_bytes_read += size;
+      }
+
       ++prog_.similarity_scans;
       prog_.similarity_bytes += size;
       ++prog_.inodes_scanned;
@@ -323,11 +740,30 @@ void file_scanner_::add_inode(file* p) {
     });
   } else {
     inode->set_similarity_valid(ino_opts_);
+    add_categorize_job(p, std::move(inode));
     ++prog_.inodes_scanned;
     ++prog_.files_scanned;
   }
 }
 
+void file_scanner_::add_categorize_job(file* p, std::shared_ptr<inode> ino) {
+  if (ino_opts_.categorizer_mgr) {
+    wg_.add_job([this, p, ino = std::move(ino)] {
+      std::shared_ptr<mmif> mm;
+      if (auto const size = p->size(); size > 0) {
+        mm = os_.map_file(p->fs_path(), size);
+      }
+      categorize(p, *ino, mm.get());
+    });
+  }
+}
+
+void file_scanner_::categorize(file* p, inode& ino, mmif const* mm) const {
+  if (auto const& mgr = ino_opts_.categorizer_mgr) {
+    ino.set_category(mgr->categorize(p->fs_path(), mm));
+  }
+}
+
 template <typename Lookup>
 void file_scanner_::finalize_hardlinks(Lookup&& lookup) {
   for (auto& kv : hardlinks_) {
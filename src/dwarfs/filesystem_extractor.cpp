@@ -19,11 +19,14 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <array>
 #include <condition_variable>
 #include <memory>
 #include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 // This is required to avoid Windows.h being pulled in by libarchive
 // and polluting our environment with all sorts of shit.
@@ -34,6 +37,8 @@
 #include <archive.h>
 #include <archive_entry.h>
 
+#include <fmt/format.h>
+
 #include <folly/ExceptionString.h>
 #include <folly/ScopeGuard.h>
 #include <folly/system/ThreadName.h>
@@ -79,6 +84,11 @@ class cache_semaphore {
   int64_t size_{0};
 };
 
+constexpr int const disk_extract_flags =
+    ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_TIME |
+    ARCHIVE_EXTRACT_UNLINK | ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS |
+    ARCHIVE_EXTRACT_SECURE_NODOTDOT | ARCHIVE_EXTRACT_SECURE_SYMLINKS;
+
 class archive_error : public std::runtime_error {
  public:
   using std::runtime_error::runtime_error;
@@ -140,12 +150,9 @@ class filesystem_extractor_ final : public filesystem_extractor::impl {
     }
 
     a_ = ::archive_write_disk_new();
+    disk_ = true;
 
-    check_result(::archive_write_disk_set_options(
-        a_,
-        ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_TIME |
-            ARCHIVE_EXTRACT_UNLINK | ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS |
-            ARCHIVE_EXTRACT_SECURE_NODOTDOT | ARCHIVE_EXTRACT_SECURE_SYMLINKS));
+    check_result(::archive_write_disk_set_options(a_, disk_extract_flags));
   }
 
   void close() override {
@@ -155,6 +162,8 @@ class filesystem_extractor_ final : public filesystem_extractor::impl {
       a_ = nullptr;
     }
 
+    disk_ = false;
+
     closefd(pipefd_[1]);
 
     if (iot_) {
@@ -169,6 +178,12 @@ class filesystem_extractor_ final : public filesystem_extractor::impl {
                filesystem_extractor_options const& opts) override;
 
  private:
+  bool extract_disk_parallel(filesystem_v2 const& fs,
+                             filesystem_extractor_options const& opts);
+
+  ::archive_entry*
+  create_entry(filesystem_v2 const& fs, dir_entry_view entry, size_t& linklen);
+
   void closefd(int& fd) {
     if (fd >= 0) {
       if (::close(fd) != 0) {
@@ -200,31 +215,86 @@ class filesystem_extractor_ final : public filesystem_extractor::impl {
     }
   }
 
-  void check_result(int res) {
+  void check_result(int res) { check_result(a_, res); }
+
+  void check_result(struct ::archive* a, int res) {
     switch (res) {
     case ARCHIVE_OK:
       break;
     case ARCHIVE_WARN:
-      LOG_WARN << std::string(archive_error_string(a_));
+      LOG_WARN << std::string(archive_error_string(a));
       break;
     case ARCHIVE_RETRY:
     case ARCHIVE_FAILED:
     case ARCHIVE_FATAL:
-      throw archive_error(std::string(archive_error_string(a_)));
+      throw archive_error(std::string(archive_error_string(a)));
     }
   }
 
   LOG_PROXY_DECL(debug_logger_policy);
   struct ::archive* a_{nullptr};
+  bool disk_{false};
   int pipefd_[2]{-1, -1};
   std::unique_ptr<std::thread> iot_;
 };
 
+template <typename LoggerPolicy>
+::archive_entry* filesystem_extractor_<LoggerPolicy>::create_entry(
+    filesystem_v2 const& fs, dir_entry_view entry, size_t& linklen) {
+  auto inode = entry.inode();
+
+  file_stat stbuf;
+
+  if (fs.getattr(inode, &stbuf) != 0) {
+    DWARFS_THROW(runtime_error, "getattr() failed");
+  }
+
+  auto ae = ::archive_entry_new();
+
+  struct stat st;
+
+  ::memset(&st, 0, sizeof(st));
+#ifdef _WIN32
+  copy_file_stat<false>(&st, stbuf);
+#else
+  copy_file_stat<true>(&st, stbuf);
+#endif
+
+#ifdef _WIN32
+  ::archive_entry_copy_pathname_w(ae, entry.wpath().c_str());
+#else
+  ::archive_entry_copy_pathname(ae, entry.path().c_str());
+#endif
+  ::archive_entry_copy_stat(ae, &st);
+
+  linklen = 0;
+
+  if (inode.is_symlink()) {
+    std::string link;
+    if (fs.readlink(inode, &link) != 0) {
+      LOG_ERROR << "readlink() failed";
+    }
+    linklen = link.size();
+#ifdef _WIN32
+    std::filesystem::path linkpath(string_to_u8string(link));
+    ::archive_entry_copy_symlink_w(ae, linkpath.wstring().c_str());
+#else
+    ::archive_entry_copy_symlink(ae, link.c_str());
+#endif
+  }
+
+  return ae;
+}
+
 template <typename LoggerPolicy>
 bool filesystem_extractor_<LoggerPolicy>::extract(
     filesystem_v2 const& fs, filesystem_extractor_options const& opts) {
   DWARFS_CHECK(a_, "filesystem not opened");
 
+  if (disk_ && opts.num_disk_writers > 1) {
+    return extract_disk_parallel(fs, opts);
+  }
+
   auto lr = ::archive_entry_linkresolver_new();
 
   SCOPE_EXIT { ::archive_entry_linkresolver_free(lr); };
@@ -333,44 +403,11 @@ bool filesystem_extractor_<LoggerPolicy>::extract(
     }
 
     auto inode = entry.inode();
+    size_t linklen;
+    auto ae = create_entry(fs, entry, linklen);
 
-    auto ae = ::archive_entry_new();
-    file_stat stbuf;
-
-    if (fs.getattr(inode, &stbuf) != 0) {
-      DWARFS_THROW(runtime_error, "getattr() failed");
-    }
-
-    struct stat st;
-
-    ::memset(&st, 0, sizeof(st));
-#ifdef _WIN32
-    copy_file_stat<false>(&st, stbuf);
-#else
-    copy_file_stat<true>(&st, stbuf);
-#endif
-
-#ifdef _WIN32
-    ::archive_entry_copy_pathname_w(ae, entry.wpath().c_str());
-#else
-    ::archive_entry_copy_pathname(ae, entry.path().c_str());
-#endif
-    ::archive_entry_copy_stat(ae, &st);
-
-    if (inode.is_symlink()) {
-      std::string link;
-      if (fs.readlink(inode, &link) != 0) {
-        LOG_ERROR << "readlink() failed";
-      }
-      if (opts.progress) {
-        bytes_written += link.size();
-      }
-#ifdef _WIN32
-      std::filesystem::path linkpath(string_to_u8string(link));
-      ::archive_entry_copy_symlink_w(ae, linkpath.wstring().c_str());
-#else
-      ::archive_entry_copy_symlink(ae, link.c_str());
-#endif
+    if (opts.progress) {
+      bytes_written += linklen;
     }
 
     ::archive_entry_linkify(lr, &ae, &spare);
@@ -413,6 +450,249 @@ bool filesystem_extractor_<LoggerPolicy>::extract(
   return true;
 }
 
+/**
+ * Regular files are independent of each other when extracting to disk,
+ * so they can be written concurrently, each writer thread using its own
+ * libarchive disk handle. Files are queued in data order to keep block
+ * cache hit rates high, and the amount of data in flight is bounded by
+ * the cache semaphore just like in the sequential case.
+ *
+ * To avoid writers racing to create parent directories, all directories
+ * are created in a first pass. Their permissions and timestamps will be
+ * fixed up by libarchive when the main handle is closed. Hard links,
+ * symlinks and other special files are created in a final pass, after
+ * all link targets have been written.
+ */
+template <typename LoggerPolicy>
+bool filesystem_extractor_<LoggerPolicy>::extract_disk_parallel(
+    filesystem_v2 const& fs, filesystem_extractor_options const& opts) {
+  size_t const num_writers = opts.num_disk_writers;
+
+  LOG_DEBUG << "extracting to disk using " << num_writers << " writers";
+
+  std::mutex writers_mx;
+  std::vector<struct ::archive*> writers;
+
+  SCOPE_EXIT {
+    for (auto a : writers) {
+      ::archive_write_free(a);
+    }
+  };
+
+  for (size_t i = 0; i < num_writers; ++i) {
+    auto a = ::archive_write_disk_new();
+    writers.push_back(a);
+    check_result(a, ::archive_write_disk_set_options(a, disk_extract_flags));
+  }
+
+  auto idle_writers = writers;
+
+  cache_semaphore sem;
+
+  LOG_DEBUG << "extractor semaphore size: " << opts.max_queued_bytes
+            << " bytes";
+
+  sem.post(opts.max_queued_bytes);
+
+  vfs_stat vfs;
+  fs.statvfs(&vfs);
+
+  std::atomic<size_t> hard_error{0};
+  std::atomic<size_t> soft_error{0};
+  std::atomic<uint64_t> bytes_written{0};
+  uint64_t const bytes_total{vfs.blocks};
+  std::mutex progress_mx;
+
+  auto report_progress = [&](std::string_view path, size_t bytes) {
+    if (opts.progress) {
+      auto written = bytes_written += bytes;
+      std::lock_guard lock(progress_mx);
+      opts.progress(path, written, bytes_total);
+    }
+  };
+
+  auto handle_error = [&](std::exception_ptr ep, bool fatal) {
+    if (!fatal && opts.continue_on_error) {
+      LOG_WARN << folly::exceptionStr(ep);
+      ++soft_error;
+    } else {
+      LOG_ERROR << folly::exceptionStr(ep);
+      ++hard_error;
+    }
+  };
+
+  // The writer jobs reference all of the state above, so the worker group
+  // must be declared last to be stopped before any of it is destroyed.
+  worker_group wg("writer", num_writers, 16 * num_writers);
+
+  // first pass: directories
+  fs.walk([&](auto entry) {
+    if (entry.is_root() || hard_error || !entry.inode().is_directory()) {
+      return;
+    }
+
+    size_t linklen;
+    auto ae = create_entry(fs, entry, linklen);
+    SCOPE_EXIT { ::archive_entry_free(ae); };
+
+    try {
+      check_result(::archive_write_header(a_, ae));
+    } catch (...) {
+      handle_error(std::current_exception(), true);
+    }
+  });
+
+  // second pass: regular files, in data order
+  std::vector<::archive_entry*> deferred;
+  std::unordered_map<uint32_t, dir_entry_view> first_link;
+
+  SCOPE_EXIT {
+    for (auto ae : deferred) {
+      ::archive_entry_free(ae);
+    }
+  };
+
+  fs.walk_data_order([&](auto entry) {
+    if (entry.is_root() || hard_error) {
+      return;
+    }
+
+    auto inode = entry.inode();
+
+    if (inode.is_directory()) {
+      return;
+    }
+
+    size_t linklen;
+    auto ae = create_entry(fs, entry, linklen);
+
+    if (!inode.is_regular_file()) {
+      report_progress(::archive_entry_pathname(ae), linklen);
+      deferred.push_back(ae);
+      return;
+    }
+
+    if (::archive_entry_nlink(ae) > 1) {
+      if (auto [it, inserted] = first_link.emplace(inode.inode_num(), entry);
+          !inserted) {
+#ifdef _WIN32
+        ::archive_entry_copy_hardlink_w(ae, it->second.wpath().c_str());
+#else
+        ::archive_entry_copy_hardlink(ae, it->second.path().c_str());
+#endif
+        ::archive_entry_set_size(ae, 0);
+        deferred.push_back(ae);
+        return;
+      }
+    }
+
+    wg.add_job([&, ae, inode] {
+      struct ::archive* a;
+
+      {
+        std::lock_guard lock(writers_mx);
+        a = idle_writers.back();
+        idle_writers.pop_back();
+      }
+
+      SCOPE_EXIT {
+        ::archive_entry_free(ae);
+        std::lock_guard lock(writers_mx);
+        idle_writers.push_back(a);
+      };
+
+      if (hard_error) {
+        return;
+      }
+
+      std::string_view path{::archive_entry_pathname(ae)};
+      size_t const size = ::archive_entry_size(ae);
+
+      try {
+        LOG_DEBUG << "extracting " << path << " (" << size << " bytes)";
+
+        check_result(a, ::archive_write_header(a, ae));
+
+        if (size > 0) {
+          auto fd = fs.open(inode);
+          size_t pos = 0;
+
+          while (pos < size && hard_error == 0) {
+            size_t bs = std::min(size - pos, opts.max_queued_bytes);
+
+            sem.wait(bs);
+            SCOPE_EXIT { sem.post(bs); };
+
+            auto ranges = fs.readv(fd, bs, pos);
+
+            if (!ranges) {
+              DWARFS_THROW(runtime_error,
+                           fmt::format("error reading {} bytes at offset {} "
+                                       "from inode [{}]: {}",
+                                       bs, pos, fd,
+                                       ::strerror(-ranges.error())));
+            }
+
+            for (auto& r : *ranges) {
+              auto br = r.get();
+              LOG_TRACE << "[" << pos << "] writing " << br.size()
+                        << " bytes for " << path;
+              check_result(a, ::archive_write_data(a, br.data(), br.size()));
+              report_progress(path, br.size());
+            }
+
+            pos += bs;
+          }
+        }
+
+        check_result(a, ::archive_write_finish_entry(a));
+      } catch (archive_error const&) {
+        handle_error(std::current_exception(), true);
+      } catch (...) {
+        handle_error(std::current_exception(), false);
+      }
+    });
+  });
+
+  wg.wait();
+
+  // close the writers to make sure all data has hit the disk before
+  // creating links and fixing up directories
+  for (auto a : writers) {
+    try {
+      check_result(a, ::archive_write_close(a));
+    } catch (...) {
+      handle_error(std::current_exception(), true);
+    }
+  }
+
+  // third pass: links and special files
+  for (auto ae : deferred) {
+    if (hard_error) {
+      break;
+    }
+
+    try {
+      check_result(::archive_write_header(a_, ae));
+    } catch (...) {
+      handle_error(std::current_exception(), false);
+    }
+  }
+
+  if (hard_error) {
+    DWARFS_THROW(runtime_error, "extraction aborted");
+  }
+
+  if (soft_error > 0) {
+    LOG_ERROR << "extraction finished with " << soft_error << " error(s)";
+    return false;
+  }
+
+  LOG_INFO << "extraction finished without errors";
+
+  return true;
+}
+
 filesystem_extractor::filesystem_extractor(logger& lgr)
     : impl_(make_unique_logging_object<filesystem_extractor::impl,
                                        filesystem_extractor_, logger_policies>(
@@ -20,19 +20,26 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <cstddef>
 #include <cstring>
 #include <functional>
 #include <iostream>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include <fmt/format.h>
 
+#include <folly/String.h>
+#include <folly/system/ThreadName.h>
+
 #include "dwarfs/block_cache.h"
 #include "dwarfs/block_compressor.h"
 #include "dwarfs/block_data.h"
+#include "dwarfs/checksum.h"
 #include "dwarfs/error.h"
 #include "dwarfs/filesystem_v2.h"
 #include "dwarfs/filesystem_writer.h"
@@ -45,6 +52,7 @@
 #include "dwarfs/options.h"
 #include "dwarfs/performance_monitor.h"
 #include "dwarfs/progress.h"
+#include "dwarfs/util.h"
 #include "dwarfs/worker_group.h"
 
 namespace dwarfs {
@@ -248,6 +256,31 @@ class filesystem_parser {
 
 using section_map = std::unordered_map<section_type, fs_section>;
 
+std::string compute_image_checksum(filesystem_parser& parser) {
+  if (!parser.has_checksums()) {
+    DWARFS_THROW(runtime_error, "image has no section checksums");
+  }
+
+  checksum cs(checksum::algorithm::SHA2_512_256);
+
+  parser.rewind();
+
+  while (auto s = parser.next_section()) {
+    if (s->type() == section_type::BLOCK) {
+      auto digest = s->sha2_512_256_digest();
+      cs.update(digest.data(), digest.size());
+    }
+  }
+
+  std::string rv(cs.digest_size(), '\0');
+
+  if (!cs.finalize(rv.data())) {
+    DWARFS_THROW(runtime_error, "failed to compute image checksum");
+  }
+
+  return rv;
+}
+
 size_t
 get_uncompressed_section_size(std::shared_ptr<mmif> mm, fs_section const& sec) {
   std::vector<uint8_t> tmp;
@@ -327,6 +360,7 @@ class filesystem_ final : public filesystem_v2::impl {
   filesystem_(logger& lgr, std::shared_ptr<mmif> mm,
               const filesystem_options& options, int inode_offset,
               std::shared_ptr<performance_monitor const> perfmon);
+  ~filesystem_() override;
 
   void dump(std::ostream& os, int detail_level) const override;
   folly::dynamic metadata_as_dynamic() const override;
@@ -355,16 +389,39 @@ class filesystem_ final : public filesystem_v2::impl {
                 file_off_t offset) const override;
   folly::Expected<std::vector<std::future<block_range>>, int>
   readv(uint32_t inode, size_t size, file_off_t offset) const override;
+  void read_batch(std::span<read_request const> requests,
+                  read_batch_callback const& cb) const override;
   std::optional<std::span<uint8_t const>> header() const override;
   void set_num_workers(size_t num) override { ir_.set_num_workers(num); }
+  void start_background_init() override;
   void set_cache_tidy_config(cache_tidy_config const& cfg) override {
     ir_.set_cache_tidy_config(cfg);
   }
+  block_cache_stats get_cache_stats() const override {
+    return ir_.get_cache_stats();
+  }
   size_t num_blocks() const override { return ir_.num_blocks(); }
   bool has_symlinks() const override { return meta_.has_symlinks(); }
+  std::optional<chunk_range> get_chunks(int inode) const override {
+    return meta_.get_chunks(inode);
+  }
+  void copy_blocks(filesystem_writer& writer,
+                   std::span<size_t const> blocks) const override;
+  std::string image_checksum() const override;
+  std::vector<base_image_info> base_images() const override {
+    return meta_.base_images();
+  }
+  std::vector<std::string> block_compression() const override {
+    return meta_.block_compression();
+  }
 
  private:
   filesystem_info const& get_info() const;
+  void add_base_blocks(block_cache& cache,
+                       std::vector<base_image_info> const& bases,
+                       std::vector<std::shared_ptr<mmif>> const& candidates);
+  void check_metadata_in_background(fs_section const& section);
+  void check_metadata_intact() const;
 
   LOG_PROXY_DECL(LoggerPolicy);
   std::shared_ptr<mmif> mm_;
@@ -375,6 +432,10 @@ class filesystem_ final : public filesystem_v2::impl {
   std::vector<uint8_t> meta_buffer_;
   std::optional<std::span<uint8_t const>> header_;
   mutable std::unique_ptr<filesystem_info const> fsinfo_;
+  mutable std::optional<std::string> image_checksum_;
+  std::optional<fs_section> deferred_check_;
+  std::thread metadata_check_thread_;
+  std::atomic<bool> metadata_corrupt_{false};
   PERFMON_CLS_PROXY_DECL
   PERFMON_CLS_TIMER_DECL(find_path)
   PERFMON_CLS_TIMER_DECL(find_inode)
@@ -391,6 +452,7 @@ class filesystem_ final : public filesystem_v2::impl {
   PERFMON_CLS_TIMER_DECL(read)
   PERFMON_CLS_TIMER_DECL(readv_iovec)
   PERFMON_CLS_TIMER_DECL(readv_future)
+  PERFMON_CLS_TIMER_DECL(read_batch)
 };
 
 template <typename LoggerPolicy>
@@ -444,8 +506,11 @@ filesystem_<LoggerPolicy>::filesystem_(
     PERFMON_CLS_TIMER_INIT(open)
     PERFMON_CLS_TIMER_INIT(read)
     PERFMON_CLS_TIMER_INIT(readv_iovec)
-    PERFMON_CLS_TIMER_INIT(readv_future) { // clang-format on
-  block_cache cache(lgr, mm_, options.block_cache);
+    PERFMON_CLS_TIMER_INIT(readv_future)
+    PERFMON_CLS_TIMER_INIT(read_batch) { // clang-format on
+  auto ti_total = LOG_TIMED_DEBUG;
+
+  block_cache cache(lgr, mm_, options.block_cache, perfmon);
 
   if (parser_.has_index()) {
     LOG_DEBUG << "found valid section index";
@@ -454,28 +519,82 @@ filesystem_<LoggerPolicy>::filesystem_(
   header_ = parser_.header();
 
   section_map sections;
+  std::vector<fs_section> blocks;
 
-  while (auto s = parser_.next_section()) {
-    LOG_DEBUG << "section " << s->name() << " @ " << s->start() << " ["
-              << s->length() << " bytes]";
-    if (s->type() == section_type::BLOCK) {
-      cache.insert(*s);
-    } else {
-      if (!s->check_fast(*mm_)) {
-        DWARFS_THROW(runtime_error, "checksum error in section: " + s->name());
-      }
+  {
+    auto ti = LOG_TIMED_DEBUG;
 
-      if (!sections.emplace(s->type(), *s).second) {
-        DWARFS_THROW(runtime_error, "duplicate section: " + s->name());
+    while (auto s = parser_.next_section()) {
+      LOG_DEBUG << "section " << s->name() << " @ " << s->start() << " ["
+                << s->length() << " bytes]";
+      if (s->type() == section_type::BLOCK) {
+        blocks.push_back(*s);
+      } else {
+        // Checksumming uncompressed metadata would page in all of it,
+        // which is exactly what demand paging is meant to avoid.
+        if (options.metadata.demand_paged &&
+            s->type() == section_type::METADATA_V2 &&
+            s->compression() == compression_type::NONE) {
+          deferred_check_ = *s;
+        } else if (!s->check_fast(*mm_)) {
+          DWARFS_THROW(runtime_error,
+                       "checksum error in section: " + s->name());
+        }
+
+        if (!sections.emplace(s->type(), *s).second) {
+          DWARFS_THROW(runtime_error, "duplicate section: " + s->name());
+        }
       }
     }
+
+    ti << "startup: read " << sections.size() << " metadata and "
+       << blocks.size() << " block sections";
   }
 
   std::vector<uint8_t> schema_buffer;
 
-  meta_ = make_metadata(lgr, mm_, sections, schema_buffer, meta_buffer_,
-                        options.metadata, inode_offset, false,
-                        options.lock_mode, !parser_.has_checksums());
+  {
+    auto ti = LOG_TIMED_DEBUG;
+
+    meta_ = make_metadata(lgr, mm_, sections, schema_buffer, meta_buffer_,
+                          options.metadata, inode_offset, false,
+                          options.lock_mode, !parser_.has_checksums());
+
+    ti << "startup: initialized " << size_with_unit(meta_.size())
+       << " of metadata" << (options.metadata.lazy_init ? " (lazy)" : "");
+  }
+
+  if (options.metadata.demand_paged) {
+    if (auto it = sections.find(section_type::METADATA_V2);
+        it != sections.end() &&
+        it->second.compression() != compression_type::NONE) {
+      LOG_WARN << "metadata is compressed and cannot be demand-paged, "
+                  "rebuild the image with `--metadata-compression=null`";
+    } else if (options.lock_mode != mlock_mode::NONE) {
+      LOG_WARN << "demand paging is ineffective with locked metadata";
+    } else {
+      // Drop everything we touched during initialization; only the
+      // parts of the metadata that are actually used will be paged in
+      // again.
+      auto const& meta_section = sections.at(section_type::METADATA_V2);
+      if (auto ec = mm_->release(meta_section.start(), meta_section.length())) {
+        LOG_INFO << "madvise() failed: " << ec.message();
+      }
+    }
+  }
+
+  // The blocks of all base images precede our own blocks, so they must
+  // be inserted into the cache first.
+  if (auto bases = meta_.base_images(); !bases.empty()) {
+    auto ti = LOG_TIMED_DEBUG;
+    add_base_blocks(cache, bases, options.base_images);
+    ti << "startup: added " << cache.block_count() << " blocks from "
+       << bases.size() << " base images";
+  }
+
+  for (auto const& b : blocks) {
+    cache.insert(b);
+  }
 
   LOG_DEBUG << "read " << cache.block_count() << " blocks and " << meta_.size()
             << " bytes of metadata";
@@ -483,6 +602,124 @@ filesystem_<LoggerPolicy>::filesystem_(
   cache.set_block_size(meta_.block_size());
 
   ir_ = inode_reader_v2(lgr, std::move(cache), perfmon);
+
+  ti_total << "startup: filesystem initialized";
+}
+
+template <typename LoggerPolicy>
+filesystem_<LoggerPolicy>::~filesystem_() {
+  if (metadata_check_thread_.joinable()) {
+    metadata_check_thread_.join();
+  }
+}
+
+template <typename LoggerPolicy>
+void filesystem_<LoggerPolicy>::start_background_init() {
+  meta_.start_background_init();
+
+  if (deferred_check_ && !metadata_check_thread_.joinable()) {
+    check_metadata_in_background(*deferred_check_);
+  }
+}
+
+template <typename LoggerPolicy>
+void filesystem_<LoggerPolicy>::check_metadata_in_background(
+    fs_section const& section) {
+  metadata_check_thread_ = std::thread([this, section] {
+    folly::setThreadName("metacheck");
+
+    if (section.check_fast(*mm_)) {
+      LOG_DEBUG << "verified " << size_with_unit(section.length())
+                << " of metadata";
+    } else {
+      LOG_ERROR << "checksum error in section: " << section.name()
+                << ", the file system is corrupt";
+      metadata_corrupt_ = true;
+    }
+
+    if (auto ec = mm_->release(section.start(), section.length())) {
+      LOG_INFO << "madvise() failed: " << ec.message();
+    }
+  });
+}
+
+/**
+ * Once the deferred check has failed, none of the metadata can be
+ * trusted; following its offsets could even crash the process.
+ */
+template <typename LoggerPolicy>
+void filesystem_<LoggerPolicy>::check_metadata_intact() const {
+  if (metadata_corrupt_) {
+    DWARFS_THROW(system_error, "file system metadata is corrupt", EIO);
+  }
+}
+
+template <typename LoggerPolicy>
+void filesystem_<LoggerPolicy>::add_base_blocks(
+    block_cache& cache, std::vector<base_image_info> const& bases,
+    std::vector<std::shared_ptr<mmif>> const& candidates) {
+  struct candidate {
+    std::shared_ptr<mmif> mm;
+    std::vector<fs_section> blocks;
+    std::string checksum;
+  };
+
+  std::vector<candidate> cands;
+
+  for (auto const& mm : candidates) {
+    filesystem_parser parser(mm, filesystem_options::IMAGE_OFFSET_AUTO);
+
+    if (!parser.has_checksums()) {
+      LOG_WARN << "ignoring base image candidate without checksums";
+      continue;
+    }
+
+    auto& c = cands.emplace_back();
+    c.mm = mm;
+    c.checksum = compute_image_checksum(parser);
+
+    parser.rewind();
+
+    while (auto s = parser.next_section()) {
+      if (s->type() == section_type::BLOCK) {
+        c.blocks.push_back(*s);
+      }
+    }
+  }
+
+  for (auto const& base : bases) {
+    auto it = std::find_if(cands.begin(), cands.end(), [&](auto const& c) {
+      return c.checksum == base.checksum;
+    });
+
+    if (it == cands.end()) {
+      DWARFS_THROW(runtime_error,
+                   fmt::format("base image {} not found",
+                               folly::hexlify(base.checksum)));
+    }
+
+    if (it->blocks.size() != base.block_count) {
+      DWARFS_THROW(runtime_error,
+                   fmt::format("base image {} has {} blocks, expected {}",
+                               folly::hexlify(base.checksum),
+                               it->blocks.size(), base.block_count));
+    }
+
+    for (auto const& b : it->blocks) {
+      cache.insert(b, it->mm);
+    }
+  }
+}
+
+template <typename LoggerPolicy>
+std::string filesystem_<LoggerPolicy>::image_checksum() const {
+  std::lock_guard lock(mx_);
+
+  if (!image_checksum_) {
+    image_checksum_ = compute_image_checksum(parser_);
+  }
+
+  return *image_checksum_;
 }
 
 template <typename LoggerPolicy>
@@ -499,6 +736,43 @@ void filesystem_<LoggerPolicy>::dump(std::ostream& os, int detail_level) const {
              });
 }
 
+template <typename LoggerPolicy>
+void filesystem_<LoggerPolicy>::copy_blocks(
+    filesystem_writer& writer, std::span<size_t const> blocks) const {
+  DWARFS_CHECK(std::is_sorted(blocks.begin(), blocks.end()),
+               "blocks must be sorted");
+
+  std::lock_guard lock(mx_);
+
+  parser_.rewind();
+
+  size_t block_no = 0;
+  auto it = blocks.begin();
+
+  while (it != blocks.end()) {
+    auto s = parser_.next_section();
+
+    if (!s) {
+      DWARFS_THROW(runtime_error, fmt::format("block {} not found", *it));
+    }
+
+    if (s->type() == section_type::BLOCK) {
+      if (block_no == *it) {
+        if (!s->check_fast(*mm_)) {
+          DWARFS_THROW(runtime_error,
+                       "checksum error in section: " + s->name());
+        }
+
+        writer.write_compressed_section(s->type(), s->compression(),
+                                        s->data(*mm_));
+        ++it;
+      }
+
+      ++block_no;
+    }
+  }
+}
+
 template <typename LoggerPolicy>
 folly::dynamic filesystem_<LoggerPolicy>::metadata_as_dynamic() const {
   return meta_.as_dynamic();
@@ -526,12 +800,14 @@ template <typename LoggerPolicy>
 std::optional<inode_view>
 filesystem_<LoggerPolicy>::find(const char* path) const {
   PERFMON_CLS_SCOPED_SECTION(find_path)
+  check_metadata_intact();
   return meta_.find(path);
 }
 
 template <typename LoggerPolicy>
 std::optional<inode_view> filesystem_<LoggerPolicy>::find(int inode) const {
   PERFMON_CLS_SCOPED_SECTION(find_inode)
+  check_metadata_intact();
   return meta_.find(inode);
 }
 
@@ -539,6 +815,7 @@ template <typename LoggerPolicy>
 std::optional<inode_view>
 filesystem_<LoggerPolicy>::find(int inode, const char* name) const {
   PERFMON_CLS_SCOPED_SECTION(find_inode_name)
+  check_metadata_intact();
   return meta_.find(inode, name);
 }
 
@@ -546,6 +823,7 @@ template <typename LoggerPolicy>
 int filesystem_<LoggerPolicy>::getattr(inode_view entry,
                                        file_stat* stbuf) const {
   PERFMON_CLS_SCOPED_SECTION(getattr)
+  check_metadata_intact();
   return meta_.getattr(entry, stbuf);
 }
 
@@ -553,6 +831,7 @@ template <typename LoggerPolicy>
 int filesystem_<LoggerPolicy>::access(inode_view entry, int mode, uid_t uid,
                                       gid_t gid) const {
   PERFMON_CLS_SCOPED_SECTION(access)
+  check_metadata_intact();
   return meta_.access(entry, mode, uid, gid);
 }
 
@@ -560,6 +839,7 @@ template <typename LoggerPolicy>
 std::optional<directory_view>
 filesystem_<LoggerPolicy>::opendir(inode_view entry) const {
   PERFMON_CLS_SCOPED_SECTION(opendir)
+  check_metadata_intact();
   return meta_.opendir(entry);
 }
 
@@ -567,12 +847,14 @@ template <typename LoggerPolicy>
 std::optional<std::pair<inode_view, std::string>>
 filesystem_<LoggerPolicy>::readdir(directory_view dir, size_t offset) const {
   PERFMON_CLS_SCOPED_SECTION(readdir)
+  check_metadata_intact();
   return meta_.readdir(dir, offset);
 }
 
 template <typename LoggerPolicy>
 size_t filesystem_<LoggerPolicy>::dirsize(directory_view dir) const {
   PERFMON_CLS_SCOPED_SECTION(dirsize)
+  check_metadata_intact();
   return meta_.dirsize(dir);
 }
 
@@ -580,6 +862,7 @@ template <typename LoggerPolicy>
 int filesystem_<LoggerPolicy>::readlink(inode_view entry, std::string* buf,
                                         readlink_mode mode) const {
   PERFMON_CLS_SCOPED_SECTION(readlink)
+  check_metadata_intact();
   return meta_.readlink(entry, buf, mode);
 }
 
@@ -588,12 +871,16 @@ folly::Expected<std::string, int>
 filesystem_<LoggerPolicy>::readlink(inode_view entry,
                                     readlink_mode mode) const {
   PERFMON_CLS_SCOPED_SECTION(readlink_expected)
+  if (metadata_corrupt_) {
+    return folly::makeUnexpected(-EIO);
+  }
   return meta_.readlink(entry, mode);
 }
 
 template <typename LoggerPolicy>
 int filesystem_<LoggerPolicy>::statvfs(vfs_stat* stbuf) const {
   PERFMON_CLS_SCOPED_SECTION(statvfs)
+  check_metadata_intact();
   // TODO: not sure if that's the right abstraction...
   return meta_.statvfs(stbuf);
 }
@@ -601,6 +888,7 @@ int filesystem_<LoggerPolicy>::statvfs(vfs_stat* stbuf) const {
 template <typename LoggerPolicy>
 int filesystem_<LoggerPolicy>::open(inode_view entry) const {
   PERFMON_CLS_SCOPED_SECTION(open)
+  check_metadata_intact();
   return meta_.open(entry);
 }
 
@@ -608,6 +896,9 @@ template <typename LoggerPolicy>
 ssize_t filesystem_<LoggerPolicy>::read(uint32_t inode, char* buf, size_t size,
                                         file_off_t offset) const {
   PERFMON_CLS_SCOPED_SECTION(read)
+  if (metadata_corrupt_) {
+    return -EIO;
+  }
   if (auto chunks = meta_.get_chunks(inode)) {
     return ir_.read(buf, inode, size, offset, *chunks);
   }
@@ -618,6 +909,9 @@ template <typename LoggerPolicy>
 ssize_t filesystem_<LoggerPolicy>::readv(uint32_t inode, iovec_read_buf& buf,
                                          size_t size, file_off_t offset) const {
   PERFMON_CLS_SCOPED_SECTION(readv_iovec)
+  if (metadata_corrupt_) {
+    return -EIO;
+  }
   if (auto chunks = meta_.get_chunks(inode)) {
     return ir_.readv(buf, inode, size, offset, *chunks);
   }
@@ -629,12 +923,29 @@ folly::Expected<std::vector<std::future<block_range>>, int>
 filesystem_<LoggerPolicy>::readv(uint32_t inode, size_t size,
                                  file_off_t offset) const {
   PERFMON_CLS_SCOPED_SECTION(readv_future)
+  if (metadata_corrupt_) {
+    return folly::makeUnexpected(-EIO);
+  }
   if (auto chunks = meta_.get_chunks(inode)) {
     return ir_.readv(inode, size, offset, *chunks);
   }
   return folly::makeUnexpected(-EBADF);
 }
 
+template <typename LoggerPolicy>
+void filesystem_<LoggerPolicy>::read_batch(
+    std::span<read_request const> requests,
+    read_batch_callback const& cb) const {
+  PERFMON_CLS_SCOPED_SECTION(read_batch)
+  check_metadata_intact();
+  std::vector<std::optional<chunk_range>> chunks;
+  chunks.reserve(requests.size());
+  for (auto const& req : requests) {
+    chunks.push_back(meta_.get_chunks(req.inode));
+  }
+  ir_.read_batch(requests, chunks, cb);
+}
+
 template <typename LoggerPolicy>
 std::optional<std::span<uint8_t const>>
 filesystem_<LoggerPolicy>::header() const {
@@ -694,8 +1005,13 @@ void filesystem_v2::rewrite(logger& lgr, progress& prog,
   std::vector<uint8_t> meta_raw;
 
   // force metadata check
-  make_metadata(lgr, mm, sections, schema_raw, meta_raw, metadata_options(), 0,
-                true, mlock_mode::NONE, !parser.has_checksums());
+  auto meta = make_metadata(lgr, mm, sections, schema_raw, meta_raw,
+                            metadata_options(), 0, true, mlock_mode::NONE,
+                            !parser.has_checksums());
+
+  if (!meta.base_images().empty()) {
+    writer.set_delta_image();
+  }
 
   parser.rewind();
 
@@ -728,10 +1044,10 @@ void filesystem_v2::rewrite(logger& lgr, progress& prog,
   writer.flush();
 }
 
-int filesystem_v2::identify(logger& lgr, std::shared_ptr<mmif> mm,
-                            std::ostream& os, int detail_level,
-                            size_t num_readers, bool check_integrity,
-                            file_off_t image_offset) {
+int filesystem_v2::identify(
+    logger& lgr, std::shared_ptr<mmif> mm, std::ostream& os, int detail_level,
+    size_t num_readers, bool check_integrity, file_off_t image_offset,
+    std::vector<std::shared_ptr<mmif>> const& base_images) {
   // TODO:
   LOG_PROXY(debug_logger_policy, lgr);
   filesystem_parser parser(mm, image_offset);
@@ -751,15 +1067,16 @@ int filesystem_v2::identify(logger& lgr, std::shared_ptr<mmif> mm,
     LOG_DEBUG << "section " << sp->description() << " @ " << sp->start() << " ["
               << sp->length() << " bytes]";
     std::packaged_task<fs_section()> task{[&, s = *sp] {
-      if (!s.check_fast(*mm)) {
+      if (check_integrity) {
+        // single pass over the section data for both hashes
+        if (!s.check_and_verify(*mm)) {
+          DWARFS_THROW(runtime_error,
+                       "integrity check error in section: " + s.name());
+        }
+      } else if (!s.check_fast(*mm)) {
         DWARFS_THROW(runtime_error, "checksum error in section: " + s.name());
       }
 
-      if (check_integrity and !s.verify(*mm)) {
-        DWARFS_THROW(runtime_error,
-                     "integrity check error in section: " + s.name());
-      }
-
       return s;
     }};
 
@@ -800,6 +1117,7 @@ int filesystem_v2::identify(logger& lgr, std::shared_ptr<mmif> mm,
     fsopts.metadata.check_consistency = true;
     fsopts.metadata.enable_nlink = true;
     fsopts.image_offset = image_offset;
+    fsopts.base_images = base_images;
     filesystem_v2(lgr, mm, fsopts).dump(os, detail_level);
   }
 
@@ -19,20 +19,32 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <cstdint>
 #include <cstring>
 #include <deque>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <optional>
+#include <string>
 #include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fmt/format.h>
 
 #include <folly/system/ThreadName.h>
 
 #include "dwarfs/block_compressor.h"
 #include "dwarfs/block_data.h"
+#include "dwarfs/categorizer.h"
 #include "dwarfs/checksum.h"
+#include "dwarfs/compression_level_controller.h"
+#include "dwarfs/error.h"
 #include "dwarfs/filesystem_writer.h"
 #include "dwarfs/fstypes.h"
 #include "dwarfs/logger.h"
@@ -44,10 +56,40 @@ namespace dwarfs {
 
 namespace {
 
+/**
+ * Number of sections that are queued for or undergoing compression
+ *
+ * Once there are fewer of these than compression workers, e.g. at the
+ * end of the run or when compressing the metadata, the idle workers'
+ * share of the CPU can be handed to the compressor of each remaining
+ * block for intra-block multithreading.
+ */
+class compression_load {
+ public:
+  explicit compression_load(worker_group& wg)
+      : wg_{wg} {}
+
+  void add() { ++active_; }
+  void remove() { --active_; }
+
+  size_t active() const { return active_.load(); }
+  size_t workers() const { return wg_.size(); }
+
+  size_t threads_per_block() const {
+    auto const active = std::max<size_t>(active_.load(), 1);
+    return std::max<size_t>(wg_.size() / active, 1);
+  }
+
+ private:
+  worker_group& wg_;
+  std::atomic<size_t> active_{0};
+};
+
 class fsblock {
  public:
   fsblock(section_type type, block_compressor const& bc,
-          std::shared_ptr<block_data>&& data, uint32_t number);
+          std::shared_ptr<block_data>&& data, uint32_t number,
+          progress& prog, compression_load& load);
 
   fsblock(section_type type, compression_type compression,
           std::span<uint8_t const> data, uint32_t number);
@@ -87,30 +129,31 @@ class fsblock {
 class raw_fsblock : public fsblock::impl {
  public:
   raw_fsblock(section_type type, const block_compressor& bc,
-              std::shared_ptr<block_data>&& data, uint32_t number)
+              std::shared_ptr<block_data>&& data, uint32_t number,
+              progress& prog, compression_load& load)
       : type_{type}
       , bc_{bc}
       , uncompressed_size_{data->size()}
       , data_{std::move(data)}
       , number_{number}
+      , prog_{prog}
+      , load_{load}
       , comp_type_{bc_.type()} {}
 
   void compress(worker_group& wg) override {
     std::promise<void> prom;
     future_ = prom.get_future();
 
+    load_.add();
+
     wg.add_job([this, prom = std::move(prom)]() mutable {
-      try {
-        auto tmp = std::make_shared<block_data>(bc_.compress(data_->vec()));
-
-        {
-          std::lock_guard lock(mx_);
-          data_.swap(tmp);
-        }
-      } catch (bad_compression_ratio_error const&) {
-        comp_type_ = compression_type::NONE;
+      // no need to copy the data just to leave it uncompressed
+      if (comp_type_ != compression_type::NONE) {
+        compress_data();
       }
 
+      load_.remove();
+
       fsblock::build_section_header(header_, *this);
 
       prom.set_value();
@@ -137,6 +180,38 @@ class raw_fsblock : public fsblock::impl {
   section_header_v2 const& header() const override { return header_; }
 
  private:
+  void compress_data() {
+    auto const start = std::chrono::steady_clock::now();
+    bool bad_ratio = false;
+
+    try {
+      auto tmp = std::make_shared<block_data>(
+          bc_.compress(data_->vec(), load_.threads_per_block()));
+
+      {
+        std::lock_guard lock(mx_);
+        data_.swap(tmp);
+      }
+    } catch (bad_compression_ratio_error const&) {
+      comp_type_ = compression_type::NONE;
+      bad_ratio = true;
+    }
+
+    if (type_ == section_type::BLOCK) {
+      auto const elapsed = std::chrono::steady_clock::now() - start;
+
+      prog_.compressor_input_bytes += uncompressed_size_;
+      prog_.compressor_time_ns +=
+          std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+              .count();
+
+      if (bad_ratio) {
+        ++prog_.bad_compression_blocks;
+        prog_.bad_compression_bytes += uncompressed_size_;
+      }
+    }
+  }
+
   const section_type type_;
   block_compressor const& bc_;
   const size_t uncompressed_size_;
@@ -144,6 +219,8 @@ class raw_fsblock : public fsblock::impl {
   std::shared_ptr<block_data> data_;
   std::future<void> future_;
   uint32_t const number_;
+  progress& prog_;
+  compression_load& load_;
   section_header_v2 header_;
   compression_type comp_type_;
 };
@@ -191,8 +268,10 @@ class compressed_fsblock : public fsblock::impl {
 };
 
 fsblock::fsblock(section_type type, block_compressor const& bc,
-                 std::shared_ptr<block_data>&& data, uint32_t number)
-    : impl_(std::make_unique<raw_fsblock>(type, bc, std::move(data), number)) {}
+                 std::shared_ptr<block_data>&& data, uint32_t number,
+                 progress& prog, compression_load& load)
+    : impl_(std::make_unique<raw_fsblock>(type, bc, std::move(data), number,
+                                          prog, load)) {}
 
 fsblock::fsblock(section_type type, compression_type compression,
                  std::span<uint8_t const> data, uint32_t number)
@@ -205,7 +284,7 @@ void fsblock::build_section_header(section_header_v2& sh,
 
   ::memcpy(&sh.magic[0], "DWARFS", 6);
   sh.major = MAJOR_VERSION;
-  sh.minor = MINOR_VERSION;
+  sh.minor = MINOR_VERSION_NO_DELTA;
   sh.number = fsb.number();
   sh.type = static_cast<uint16_t>(fsb.type());
   sh.compression = static_cast<uint16_t>(fsb.compression());
@@ -236,7 +315,24 @@ class filesystem_writer_ final : public filesystem_writer::impl {
   ~filesystem_writer_() noexcept override;
 
   void copy_header(std::span<uint8_t const> header) override;
-  void write_block(std::shared_ptr<block_data>&& data) override;
+  void set_delta_image() override;
+  void configure(std::vector<fragment_category> const& categories) override;
+  void add_category_compressor(fragment_category cat,
+                               block_compressor bc) override;
+  void
+  set_adaptive_compression(std::vector<std::string> const& specs) override;
+  void inode_dispatched(fragment_category cat) override;
+  void inode_processed(fragment_category cat) override;
+  void write_block(fragment_category cat,
+                   std::shared_ptr<block_data>&& data) override;
+  void write_uncompressed_block(fragment_category cat,
+                                std::shared_ptr<block_data>&& data) override;
+  void finish_category(fragment_category cat) override;
+  size_t get_physical_block(fragment_category cat,
+                            size_t index) const override;
+  std::vector<fragment_category> get_block_categories() const override;
+  std::vector<std::string> get_adaptive_compression() const override;
+  std::vector<uint32_t> get_block_compression_levels() const override;
   void write_metadata_v2_schema(std::shared_ptr<block_data>&& data) override;
   void write_metadata_v2(std::shared_ptr<block_data>&& data) override;
   void write_compressed_section(section_type type, compression_type compression,
@@ -246,6 +342,33 @@ class filesystem_writer_ final : public filesystem_writer::impl {
   int queue_fill() const override { return static_cast<int>(wg_.queue_size()); }
 
  private:
+  struct pending_block {
+    size_t key;
+    std::shared_ptr<block_data> data;
+    block_compressor const* bc;
+  };
+
+  struct merge_source {
+    std::deque<size_t> inodes;
+    std::deque<pending_block> pending;
+    size_t pending_bytes{0};
+    std::vector<size_t> physical_blocks;
+    bool finished{false};
+  };
+
+  block_compressor const& category_compressor(fragment_category cat) const;
+  size_t adaptive_level_index(size_t block_size);
+  void log_adaptive_stats() const;
+  void add_block(fragment_category cat, std::shared_ptr<block_data>&& data,
+                 block_compressor const& bc);
+  merge_source* next_mergeable_block(fragment_category& cat);
+  void merge_blocks(std::unique_lock<std::mutex>& lock);
+  void release_block(fragment_category cat, merge_source& src,
+                     std::shared_ptr<block_data>&& data,
+                     block_compressor const& bc);
+  void wait_for_queue_space(std::unique_lock<std::mutex>& lock);
+  void push_section(section_type type, std::shared_ptr<block_data>&& data,
+                    block_compressor const& bc);
   void write_section(section_type type, std::shared_ptr<block_data>&& data,
                      block_compressor const& bc);
   void write(fsblock const& fsb);
@@ -262,17 +385,35 @@ class filesystem_writer_ final : public filesystem_writer::impl {
   std::istream* header_;
   worker_group& wg_;
   progress& prog_;
+  compression_load load_;
   const block_compressor& bc_;
   const block_compressor& schema_bc_;
   const block_compressor& metadata_bc_;
+  block_compressor const null_bc_{"null"};
   const filesystem_writer_options options_;
   LOG_PROXY_DECL(LoggerPolicy);
   std::deque<std::unique_ptr<fsblock>> queue_;
   mutable std::mutex mx_;
   std::condition_variable cond_;
+  std::condition_variable merge_cond_;
+  std::unordered_map<fragment_category, block_compressor> category_bc_;
+  struct adaptive_level {
+    std::string spec;
+    block_compressor bc;
+    size_t blocks{0};
+  };
+  std::vector<adaptive_level> adaptive_;
+  std::optional<compression_level_controller> adaptive_ctl_;
+  std::vector<uint32_t> block_levels_;
+  std::map<fragment_category, merge_source> sources_;
+  std::vector<fragment_category> block_categories_;
+  size_t inodes_dispatched_{0};
+  bool merging_{false};
+  bool merge_in_progress_{false};
   volatile bool flush_;
   std::thread writer_thread_;
   uint32_t section_number_{0};
+  uint8_t minor_version_{MINOR_VERSION_NO_DELTA};
   std::vector<uint64_t> section_index_;
   std::ostream::pos_type header_size_{0};
 };
@@ -287,6 +428,7 @@ filesystem_writer_<LoggerPolicy>::filesystem_writer_(
     , header_(header)
     , wg_(wg)
     , prog_(prog)
+    , load_(wg)
     , bc_(bc)
     , schema_bc_(schema_bc)
     , metadata_bc_(metadata_bc)
@@ -339,7 +481,7 @@ void filesystem_writer_<LoggerPolicy>::writer_thread() {
       queue_.pop_front();
     }
 
-    cond_.notify_one();
+    cond_.notify_all();
 
     fsb->wait_until_compressed();
 
@@ -386,7 +528,12 @@ void filesystem_writer_<LoggerPolicy>::write(fsblock const& fsb) {
     push_section_index(fsb.type());
   }
 
-  write(fsb.header());
+  // the version isn't covered by the checksums, so it can be changed
+  // without rebuilding the header
+  auto sh = fsb.header();
+  sh.minor = minor_version_;
+
+  write(sh);
   write(fsb.data());
 
   if (fsb.type() == section_type::BLOCK) {
@@ -394,26 +541,345 @@ void filesystem_writer_<LoggerPolicy>::write(fsblock const& fsb) {
   }
 }
 
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::wait_for_queue_space(
+    std::unique_lock<std::mutex>& lock) {
+  while (mem_used() > options_.max_queue_size) {
+    cond_.wait(lock);
+  }
+}
+
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::push_section(
+    section_type type, std::shared_ptr<block_data>&& data,
+    block_compressor const& bc) {
+  auto fsb = std::make_unique<fsblock>(type, bc, std::move(data),
+                                       section_number_++, prog_, load_);
+
+  fsb->compress(wg_);
+
+  queue_.push_back(std::move(fsb));
+}
+
 template <typename LoggerPolicy>
 void filesystem_writer_<LoggerPolicy>::write_section(
     section_type type, std::shared_ptr<block_data>&& data,
     block_compressor const& bc) {
   {
     std::unique_lock lock(mx_);
+    wait_for_queue_space(lock);
+    push_section(type, std::move(data), bc);
+  }
+
+  cond_.notify_all();
+}
+
+template <typename LoggerPolicy>
+block_compressor const&
+filesystem_writer_<LoggerPolicy>::category_compressor(
+    fragment_category cat) const {
+  if (auto it = category_bc_.find(cat); it != category_bc_.end()) {
+    return it->second;
+  }
+  return bc_;
+}
+
+/**
+ * Adaptive Compression
+ *
+ * The number of sections waiting for or undergoing compression tells
+ * us which side of the pipeline is the bottleneck; the level is picked
+ * by a compression_level_controller. The queue capacity passed to the
+ * controller is based on the size of the current block, as the queue
+ * is limited by memory rather than by the number of sections.
+ */
+template <typename LoggerPolicy>
+size_t
+filesystem_writer_<LoggerPolicy>::adaptive_level_index(size_t block_size) {
+  auto const prev = adaptive_ctl_->level();
+  auto const index = adaptive_ctl_->update(
+      load_.active(), load_.workers(),
+      options_.max_queue_size / std::max<size_t>(block_size, 1));
+
+  if (index != prev) {
+    LOG_DEBUG << "average compression load "
+              << fmt::format("{:.1f}", adaptive_ctl_->last_average())
+              << " with " << load_.workers() << " workers, switching from "
+              << adaptive_[prev].spec << " to " << adaptive_[index].spec;
+  }
+
+  ++adaptive_[index].blocks;
+
+  return index;
+}
+
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::log_adaptive_stats() const {
+  for (auto const& level : adaptive_) {
+    if (level.blocks > 0) {
+      LOG_INFO << "adaptive compression: " << level.blocks << " blocks with "
+               << level.spec;
+    }
+  }
+}
+
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::release_block(
+    fragment_category cat, merge_source& src,
+    std::shared_ptr<block_data>&& data, block_compressor const& bc) {
+  src.physical_blocks.push_back(block_categories_.size());
+  block_categories_.push_back(cat);
+
+  auto const* block_bc = &bc;
+
+  if (adaptive_ctl_) {
+    auto level = adaptive_.size();
+
+    if (&bc == &bc_) {
+      level = adaptive_level_index(data->size());
+      block_bc = &adaptive_[level].bc;
+    }
+
+    block_levels_.push_back(level);
+  }
+
+  push_section(section_type::BLOCK, std::move(data), *block_bc);
+}
+
+/**
+ * Block Merging
+ *
+ * When writing blocks from multiple categories, each category is fed
+ * by its own block manager running in its own thread. To make sure the
+ * order of blocks in the image is reproducible, blocks are not written
+ * as soon as they are ready, but merged in a deterministic order.
+ *
+ * Each inode is assigned an index in the order it is dispatched to one
+ * of the block managers. Each block is keyed by the index of the inode
+ * that was being processed when the block was completed (or by the total
+ * number of inodes for blocks completed when finishing a category). The
+ * blocks are written ordered by key, then by category. A block can be
+ * written as soon as no other category can produce a block that would
+ * have to be written before it. For a category without pending blocks,
+ * this is determined by the index of the next inode it will process.
+ */
+template <typename LoggerPolicy>
+auto filesystem_writer_<LoggerPolicy>::next_mergeable_block(
+    fragment_category& cat) -> merge_source* {
+  merge_source* best = nullptr;
+  size_t key = 0;
+
+  // sources_ is ordered by category, so this will pick the lowest
+  // category in case of equal keys
+  for (auto& [c, src] : sources_) {
+    if (!src.pending.empty() && (!best || src.pending.front().key < key)) {
+      best = &src;
+      key = src.pending.front().key;
+      cat = c;
+    }
+  }
+
+  if (!best) {
+    return nullptr;
+  }
+
+  for (auto& [c, src] : sources_) {
+    if (&src == best || src.finished || !src.pending.empty()) {
+      continue;
+    }
+
+    auto next = src.inodes.empty() ? inodes_dispatched_ : src.inodes.front();
+
+    if (next < key || (next == key && c < cat)) {
+      return nullptr;
+    }
+  }
 
-    while (mem_used() > options_.max_queue_size) {
+  return best;
+}
+
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::merge_blocks(
+    std::unique_lock<std::mutex>& lock) {
+  // Only one thread at a time can merge blocks, otherwise blocks could
+  // end up in the queue in a different order than they were numbered.
+  // Whoever is merging will pick up any blocks that become ready in the
+  // meantime.
+  if (merge_in_progress_) {
+    return;
+  }
+
+  merge_in_progress_ = true;
+
+  for (;;) {
+    fragment_category cat;
+    auto src = next_mergeable_block(cat);
+
+    if (!src) {
+      break;
+    }
+
+    if (mem_used() > options_.max_queue_size) {
       cond_.wait(lock);
+      continue;
     }
 
-    auto fsb =
-        std::make_unique<fsblock>(type, bc, std::move(data), section_number_++);
+    auto blk = std::move(src->pending.front());
+    src->pending.pop_front();
+    src->pending_bytes -= blk.data->size();
 
-    fsb->compress(wg_);
+    release_block(cat, *src, std::move(blk.data), *blk.bc);
 
-    queue_.push_back(std::move(fsb));
+    cond_.notify_all();
+    merge_cond_.notify_all();
+  }
+
+  merge_in_progress_ = false;
+}
+
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::add_block(
+    fragment_category cat, std::shared_ptr<block_data>&& data,
+    block_compressor const& bc) {
+  {
+    std::unique_lock lock(mx_);
+
+    if (!merging_) {
+      wait_for_queue_space(lock);
+      release_block(cat, sources_[cat], std::move(data), bc);
+    } else {
+      auto it = sources_.find(cat);
+
+      DWARFS_CHECK(it != sources_.end(),
+                   fmt::format("unexpected block category {}", cat));
+
+      auto& src = it->second;
+      auto const max_pending = options_.max_queue_size / sources_.size();
+
+      // The category that is holding up the merge never has pending
+      // blocks, so this can't deadlock.
+      merge_cond_.wait(lock, [&] {
+        return src.pending_bytes == 0 ||
+               src.pending_bytes + data->size() <= max_pending;
+      });
+
+      auto key = src.inodes.empty() ? inodes_dispatched_ : src.inodes.front();
+
+      src.pending_bytes += data->size();
+      src.pending.push_back({key, std::move(data), &bc});
+
+      merge_blocks(lock);
+    }
+  }
+
+  cond_.notify_all();
+}
+
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::configure(
+    std::vector<fragment_category> const& categories) {
+  std::lock_guard lock(mx_);
+
+  DWARFS_CHECK(!merging_ && sources_.empty(),
+               "filesystem_writer configured after writing blocks");
+
+  for (auto cat : categories) {
+    sources_[cat];
+  }
+
+  merging_ = true;
+}
+
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::add_category_compressor(
+    fragment_category cat, block_compressor bc) {
+  std::lock_guard lock(mx_);
+  category_bc_.emplace(cat, std::move(bc));
+}
+
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::set_adaptive_compression(
+    std::vector<std::string> const& specs) {
+  std::lock_guard lock(mx_);
+
+  DWARFS_CHECK(block_categories_.empty(),
+               "adaptive compression configured after writing blocks");
+
+  adaptive_.clear();
+
+  for (auto const& spec : specs) {
+    adaptive_.push_back({spec, block_compressor(spec)});
+  }
+
+  adaptive_ctl_.reset();
+
+  if (!adaptive_.empty()) {
+    adaptive_ctl_.emplace(adaptive_.size());
+  }
+}
+
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::inode_dispatched(
+    fragment_category cat) {
+  std::unique_lock lock(mx_);
+
+  if (merging_) {
+    sources_.at(cat).inodes.push_back(inodes_dispatched_++);
+    merge_blocks(lock);
+  }
+}
+
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::inode_processed(fragment_category cat) {
+  std::unique_lock lock(mx_);
+
+  if (merging_) {
+    sources_.at(cat).inodes.pop_front();
+    merge_blocks(lock);
+  }
+}
+
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::finish_category(fragment_category cat) {
+  std::unique_lock lock(mx_);
+
+  if (merging_) {
+    sources_.at(cat).finished = true;
+    merge_blocks(lock);
+  }
+}
+
+template <typename LoggerPolicy>
+size_t
+filesystem_writer_<LoggerPolicy>::get_physical_block(fragment_category cat,
+                                                     size_t index) const {
+  std::lock_guard lock(mx_);
+  return sources_.at(cat).physical_blocks.at(index);
+}
+
+template <typename LoggerPolicy>
+std::vector<fragment_category>
+filesystem_writer_<LoggerPolicy>::get_block_categories() const {
+  std::lock_guard lock(mx_);
+  return block_categories_;
+}
+
+template <typename LoggerPolicy>
+std::vector<std::string>
+filesystem_writer_<LoggerPolicy>::get_adaptive_compression() const {
+  std::lock_guard lock(mx_);
+  std::vector<std::string> specs;
+  for (auto const& level : adaptive_) {
+    specs.push_back(level.spec);
   }
+  return specs;
+}
 
-  cond_.notify_one();
+template <typename LoggerPolicy>
+std::vector<uint32_t>
+filesystem_writer_<LoggerPolicy>::get_block_compression_levels() const {
+  std::lock_guard lock(mx_);
+  return block_levels_;
 }
 
 template <typename LoggerPolicy>
@@ -423,6 +889,15 @@ void filesystem_writer_<LoggerPolicy>::write_compressed_section(
   {
     std::lock_guard lock(mx_);
 
+    if (type == section_type::BLOCK) {
+      // blocks copied from another image always use the default category
+      block_categories_.push_back(categorizer_manager::default_category);
+
+      if (adaptive_ctl_) {
+        block_levels_.push_back(adaptive_.size());
+      }
+    }
+
     auto fsb =
         std::make_unique<fsblock>(type, compression, data, section_number_++);
 
@@ -431,7 +906,7 @@ void filesystem_writer_<LoggerPolicy>::write_compressed_section(
     queue_.push_back(std::move(fsb));
   }
 
-  cond_.notify_one();
+  cond_.notify_all();
 }
 
 template <typename LoggerPolicy>
@@ -447,10 +922,24 @@ void filesystem_writer_<LoggerPolicy>::copy_header(
   }
 }
 
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::set_delta_image() {
+  std::lock_guard lock(mx_);
+  DWARFS_CHECK(section_number_ == 0,
+               "delta image must be set up before writing any sections");
+  minor_version_ = MINOR_VERSION;
+}
+
 template <typename LoggerPolicy>
 void filesystem_writer_<LoggerPolicy>::write_block(
-    std::shared_ptr<block_data>&& data) {
-  write_section(section_type::BLOCK, std::move(data), bc_);
+    fragment_category cat, std::shared_ptr<block_data>&& data) {
+  add_block(cat, std::move(data), category_compressor(cat));
+}
+
+template <typename LoggerPolicy>
+void filesystem_writer_<LoggerPolicy>::write_uncompressed_block(
+    fragment_category cat, std::shared_ptr<block_data>&& data) {
+  add_block(cat, std::move(data), null_bc_);
 }
 
 template <typename LoggerPolicy>
@@ -474,16 +963,23 @@ void filesystem_writer_<LoggerPolicy>::flush() {
       return;
     }
 
+    for (auto const& [cat, src] : sources_) {
+      DWARFS_CHECK(src.pending.empty(),
+                   fmt::format("unwritten blocks in category {}", cat));
+    }
+
     flush_ = true;
   }
 
-  cond_.notify_one();
+  cond_.notify_all();
 
   writer_thread_.join();
 
   if (!options_.no_section_index) {
     write_section_index();
   }
+
+  log_adaptive_stats();
 }
 
 template <typename LoggerPolicy>
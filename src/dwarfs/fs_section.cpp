@@ -19,6 +19,7 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <cstddef>
 #include <mutex>
 
@@ -90,11 +91,14 @@ class fs_section_v1 : public fs_section::impl {
 
   bool check_fast(mmif const&) const override { return true; }
   bool verify(mmif const&) const override { return true; }
+  bool check_and_verify(mmif const&) const override { return true; }
 
   std::span<uint8_t const> data(mmif const& mm) const override {
     return mm.span(start_, hdr_.length);
   }
 
+  std::span<uint8_t const> sha2_512_256_digest() const override { return {}; }
+
  private:
   size_t start_;
   section_header hdr_;
@@ -140,10 +144,41 @@ class fs_section_v2 : public fs_section::impl {
                             sizeof(hdr_.sha2_512_256));
   }
 
+  bool check_and_verify(mmif const& mm) const override {
+    // Feed both hashes from the same cache-sized chunk so the section data
+    // only has to be pulled from memory (or disk) once.
+    static constexpr size_t kChunkSize{64 << 10};
+
+    auto hdr_cs_len =
+        sizeof(section_header_v2) - offsetof(section_header_v2, number);
+    auto hdr_sha_len =
+        sizeof(section_header_v2) - offsetof(section_header_v2, xxh3_64);
+
+    checksum xxh(checksum::algorithm::XXH3_64);
+    checksum sha(checksum::algorithm::SHA2_512_256);
+
+    sha.update(mm.as<void>(start_ - hdr_sha_len), hdr_sha_len - hdr_cs_len);
+
+    auto data = mm.span(start_ - hdr_cs_len, hdr_.length + hdr_cs_len);
+
+    for (size_t offset = 0; offset < data.size(); offset += kChunkSize) {
+      auto chunk =
+          data.subspan(offset, std::min(kChunkSize, data.size() - offset));
+      xxh.update(chunk.data(), chunk.size());
+      sha.update(chunk.data(), chunk.size());
+    }
+
+    return xxh.verify(&hdr_.xxh3_64) && sha.verify(&hdr_.sha2_512_256);
+  }
+
   std::span<uint8_t const> data(mmif const& mm) const override {
     return mm.span(start_, hdr_.length);
   }
 
+  std::span<uint8_t const> sha2_512_256_digest() const override {
+    return hdr_.sha2_512_256;
+  }
+
  private:
   size_t start_;
   section_header_v2 hdr_;
@@ -173,10 +208,18 @@ class fs_section_v2_lazy : public fs_section::impl {
 
   bool verify(mmif const& mm) const override { return section().verify(mm); }
 
+  bool check_and_verify(mmif const& mm) const override {
+    return section().check_and_verify(mm);
+  }
+
   std::span<uint8_t const> data(mmif const& mm) const override {
     return section().data(mm);
   }
 
+  std::span<uint8_t const> sha2_512_256_digest() const override {
+    return section().sha2_512_256_digest();
+  }
+
  private:
   fs_section::impl const& section() const;
 
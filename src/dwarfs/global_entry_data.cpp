@@ -19,14 +19,23 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+
 #include <folly/gen/Base.h>
 
 #include "dwarfs/error.h"
 #include "dwarfs/global_entry_data.h"
 #include "dwarfs/options.h"
+#include "dwarfs/worker_group.h"
 
 namespace dwarfs {
 
+namespace {
+
+constexpr size_t const kMinIndexRunSize{1 << 16};
+
+} // namespace
+
 template <typename T, typename U>
 std::vector<T> global_entry_data::get_vector(map_type<T, U> const& map) const {
   using namespace folly::gen;
@@ -48,17 +57,72 @@ auto global_entry_data::get_modes() const -> std::vector<mode_type> {
 }
 
 auto global_entry_data::get_names() const -> std::vector<std::string> {
-  return get_vector(names_);
+  return get_indexed_vector(names_);
 }
 
 auto global_entry_data::get_symlinks() const -> std::vector<std::string> {
-  return get_vector(symlinks_);
+  return get_indexed_vector(symlinks_);
 }
 
-void global_entry_data::index(map_type<std::string, uint32_t>& map) {
-  using namespace folly::gen;
-  uint32_t ix = 0;
-  from(map) | get<0>() | order | [&](std::string const& s) { map[s] = ix++; };
+std::vector<std::string> global_entry_data::get_indexed_vector(
+    map_type<std::string, uint32_t> const& map) {
+  // the indices are a permutation after index(), no need to sort again
+  std::vector<std::string> vec(map.size());
+  for (auto const& [str, ix] : map) {
+    vec[ix] = str;
+  }
+  return vec;
+}
+
+void global_entry_data::index(map_type<std::string, uint32_t>& map,
+                              worker_group* wg) {
+  using entry_type = map_type<std::string, uint32_t>::value_type;
+
+  std::vector<entry_type*> entries;
+  entries.reserve(map.size());
+
+  for (auto& e : map) {
+    entries.push_back(&e);
+  }
+
+  auto less = [](entry_type const* a, entry_type const* b) {
+    return a->first < b->first;
+  };
+
+  // Sort runs in parallel, then merge them pairwise. As all keys are
+  // unique, the result doesn't depend on the number of runs.
+  size_t const run_size =
+      wg ? std::max<size_t>(kMinIndexRunSize,
+                            (entries.size() + wg->size() - 1) / wg->size())
+         : entries.size();
+  size_t const num_runs =
+      run_size > 0 ? (entries.size() + run_size - 1) / run_size : 0;
+
+  auto run_begin = [&](size_t run) {
+    return entries.begin() + std::min(run * run_size, entries.size());
+  };
+
+  if (num_runs > 1) {
+    wg->parallel_for(num_runs, [&](size_t run) {
+      std::sort(run_begin(run), run_begin(run + 1), less);
+    });
+
+    for (size_t width = 1; width < num_runs; width *= 2) {
+      wg->parallel_for((num_runs + 2 * width - 1) / (2 * width),
+                       [&](size_t pair) {
+                         auto first = 2 * width * pair;
+                         std::inplace_merge(run_begin(first),
+                                            run_begin(first + width),
+                                            run_begin(first + 2 * width), less);
+                       });
+    }
+  } else {
+    std::sort(entries.begin(), entries.end(), less);
+  }
+
+  for (size_t ix = 0; ix < entries.size(); ++ix) {
+    entries[ix]->second = ix;
+  }
 }
 
 uint64_t global_entry_data::get_time_offset(uint64_t time) const {
@@ -20,31 +20,37 @@
  */
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <deque>
 #include <fstream>
+#include <future>
+#include <iterator>
 #include <limits>
 #include <numeric>
+#include <span>
 #include <string>
 #include <vector>
 
+#include <folly/small_vector.h>
+
 #include <fmt/format.h>
 
+#include "dwarfs/access_profile.h"
 #include "dwarfs/compiler.h"
 #include "dwarfs/entry.h"
 #include "dwarfs/error.h"
 #include "dwarfs/inode.h"
 #include "dwarfs/inode_manager.h"
 #include "dwarfs/logger.h"
-#include "dwarfs/mmif.h"
 #include "dwarfs/nilsimsa.h"
 #include "dwarfs/options.h"
 #include "dwarfs/progress.h"
 #include "dwarfs/script.h"
-#include "dwarfs/similarity.h"
+#include "dwarfs/worker_group.h"
 
 #include "dwarfs/gen-cpp2/metadata_types.h"
 
@@ -87,6 +93,156 @@ DWARFS_FIND_SIMILAR_INODE_IMPL;
 
 namespace {
 
+/**
+ * Multi-index over 256-bit nilsimsa hashes
+ *
+ * Each hash is split into 16 substrings of 16 bits. Two hashes that differ
+ * in less than 16 bits are guaranteed to share at least one substring, and
+ * hashes of similar files are still very likely to share one. For each
+ * substring, all entries are bucketed by substring value and kept in entry
+ * order within each bucket. Near neighbours can then be found by looking at
+ * a handful of small buckets rather than scanning all entries.
+ *
+ * Entries can be removed from the index. Removed entries are skipped and
+ * buckets are compacted once at least half of their entries are gone.
+ */
+class nilsimsa_index {
+ public:
+  static constexpr size_t num_tables = 16;
+  static constexpr size_t num_buckets = size_t(1) << 16;
+  static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+
+  explicit nilsimsa_index(std::vector<uint64_t const*>&& hashes)
+      : hashes_{std::move(hashes)}
+      , removed_(hashes_.size(), false) {}
+
+  size_t size() const { return hashes_.size(); }
+
+  uint64_t const* hash(uint32_t i) const { return hashes_[i]; }
+
+  bool removed(uint32_t i) const { return removed_[i]; }
+
+  // This can safely be called concurrently for different tables
+  void build_table(size_t t) {
+    auto& tab = tables_[t];
+
+    tab.begin.assign(num_buckets + 1, 0);
+
+    for (auto h : hashes_) {
+      ++tab.begin[key(h, t) + 1];
+    }
+
+    std::partial_sum(tab.begin.begin(), tab.begin.end(), tab.begin.begin());
+
+    tab.end.assign(tab.begin.begin(), tab.begin.end() - 1);
+    tab.dead.assign(num_buckets, 0);
+    tab.entries.resize(hashes_.size());
+
+    for (uint32_t i = 0; i < hashes_.size(); ++i) {
+      tab.entries[tab.end[key(hashes_[i], t)]++] = i;
+    }
+  }
+
+  // Calls `f` for up to `window` entries around `i` in each bucket that `i`
+  // belongs to; stops as soon as `f` returns false
+  template <typename F>
+  void for_each_candidate(uint32_t i, size_t window, F&& f) const {
+    for (size_t t = 0; t < num_tables; ++t) {
+      auto const& tab = tables_[t];
+      auto b = key(hashes_[i], t);
+      auto first = tab.entries.begin() + tab.begin[b];
+      auto last = tab.entries.begin() + tab.end[b];
+
+      if (static_cast<size_t>(std::distance(first, last)) > window) {
+        auto pos = std::lower_bound(first, last, i);
+        auto before = std::min<ptrdiff_t>(std::distance(first, pos),
+                                          static_cast<ptrdiff_t>(window / 2));
+        first = std::min(pos - before, last - window);
+        last = first + window;
+      }
+
+      for (; first != last; ++first) {
+        if (*first != i && !f(*first)) {
+          return;
+        }
+      }
+    }
+  }
+
+  // Stores up to `out.size()` most similar entries, best first, padded
+  // with `none`. This is safe to call concurrently.
+  void nearest(uint32_t i, size_t window, std::span<uint32_t> out) const {
+    using candidate = std::pair<int, uint32_t>;
+
+    auto better = [i](candidate const& a, candidate const& b) {
+      if (a.first != b.first) {
+        return a.first > b.first;
+      }
+      auto da = a.second > i ? a.second - i : i - a.second;
+      auto db = b.second > i ? b.second - i : i - b.second;
+      return da < db || (da == db && a.second < b.second);
+    };
+
+    folly::small_vector<candidate, 32> best;
+    auto const* ref = hashes_[i];
+    auto const k = out.size();
+
+    for_each_candidate(i, window, [&](uint32_t j) {
+      candidate c{nilsimsa::similarity(ref, hashes_[j]), j};
+
+      if (best.size() < k || better(c, best.back())) {
+        if (std::none_of(best.begin(), best.end(),
+                         [j](auto const& b) { return b.second == j; })) {
+          best.insert(std::upper_bound(best.begin(), best.end(), c, better),
+                      c);
+          if (best.size() > k) {
+            best.pop_back();
+          }
+        }
+      }
+
+      return true;
+    });
+
+    std::fill(out.begin(), out.end(), none);
+    std::transform(best.begin(), best.end(), out.begin(),
+                   [](auto const& c) { return c.second; });
+  }
+
+  void remove(uint32_t i) {
+    removed_[i] = true;
+
+    for (size_t t = 0; t < num_tables; ++t) {
+      auto& tab = tables_[t];
+      auto b = key(hashes_[i], t);
+
+      if (2 * ++tab.dead[b] > tab.end[b] - tab.begin[b]) {
+        auto first = tab.entries.begin() + tab.begin[b];
+        auto last = std::remove_if(first, tab.entries.begin() + tab.end[b],
+                                   [this](uint32_t j) { return removed_[j]; });
+        tab.end[b] = tab.begin[b] + std::distance(first, last);
+        tab.dead[b] = 0;
+      }
+    }
+  }
+
+ private:
+  struct table {
+    std::vector<uint32_t> begin;
+    std::vector<uint32_t> end;
+    std::vector<uint32_t> dead;
+    std::vector<uint32_t> entries;
+  };
+
+  static uint32_t key(uint64_t const* h, size_t t) {
+    return (h[t / 4] >> (16 * (t % 4))) & 0xFFFF;
+  }
+
+  std::vector<uint64_t const*> hashes_;
+  std::vector<bool> removed_;
+  std::array<table, num_tables> tables_;
+};
+
 class inode_ : public inode {
  public:
   using chunk_type = thrift::metadata::chunk;
@@ -103,6 +259,14 @@ class inode_ : public inode {
 
   uint32_t num() const override { return num_.value(); }
 
+  void set_category(fragment_category cat) override { category_ = cat; }
+
+  fragment_category category() const override { return category_; }
+
+  void set_reused() override { reused_ = true; }
+
+  bool reused() const override { return reused_; }
+
   uint32_t similarity_hash() const override {
     assert(similarity_valid_);
     if (files_.empty()) {
@@ -137,51 +301,20 @@ class inode_ : public inode {
 #endif
   }
 
-  void scan(mmif* mm, inode_options const& opts) override {
+  void set_similarity_hash(uint32_t hash) override {
     assert(!similarity_valid_);
-    assert(!nilsimsa_valid_);
-
-    similarity sc;
-    nilsimsa nc;
-
-    if (mm) {
-      auto update_hashes = [&](uint8_t const* data, size_t size) {
-        if (opts.with_similarity) {
-          sc.update(data, size);
-        }
-
-        if (opts.with_nilsimsa) {
-          nc.update(data, size);
-        }
-      };
-
-      constexpr size_t chunk_size = 32 << 20;
-      size_t offset = 0;
-      size_t size = mm->size();
-
-      while (size >= chunk_size) {
-        update_hashes(mm->as<uint8_t>(offset), chunk_size);
-        mm->release_until(offset);
-        offset += chunk_size;
-        size -= chunk_size;
-      }
-
-      update_hashes(mm->as<uint8_t>(offset), size);
-    }
-
-    if (opts.with_similarity) {
-      similarity_hash_ = sc.finalize();
+    similarity_hash_ = hash;
 #ifndef NDEBUG
-      similarity_valid_ = true;
+    similarity_valid_ = true;
 #endif
-    }
+  }
 
-    if (opts.with_nilsimsa) {
-      nc.finalize(nilsimsa_similarity_hash_);
+  void set_nilsimsa_similarity_hash(nilsimsa::hash_type const& hash) override {
+    assert(!nilsimsa_valid_);
+    nilsimsa_similarity_hash_ = hash;
 #ifndef NDEBUG
-      nilsimsa_valid_ = true;
+    nilsimsa_valid_ = true;
 #endif
-    }
   }
 
   void add_chunk(size_t block, size_t offset, size_t size) override {
@@ -210,6 +343,8 @@ class inode_ : public inode {
  private:
   std::optional<uint32_t> num_;
   uint32_t similarity_hash_{0};
+  fragment_category category_{0};
+  bool reused_{false};
   files_vector files_;
   std::vector<chunk_type> chunks_;
   nilsimsa::hash_type nilsimsa_similarity_hash_;
@@ -224,9 +359,10 @@ class inode_ : public inode {
 template <typename LoggerPolicy>
 class inode_manager_ final : public inode_manager::impl {
  public:
-  inode_manager_(logger& lgr, progress& prog)
+  inode_manager_(logger& lgr, progress& prog, worker_group& wg)
       : LOG_PROXY_INIT(lgr)
-      , prog_(prog) {}
+      , prog_(prog)
+      , wg_(wg) {}
 
   std::shared_ptr<inode> create_inode() override {
     auto ino = std::make_shared<inode_>();
@@ -255,6 +391,10 @@ class inode_manager_ final : public inode_manager::impl {
   }
 
  private:
+  void order_new_inodes(std::shared_ptr<script> scr,
+                        file_order_options const& file_order,
+                        inode_manager::order_cb const& fn);
+
   void order_inodes_by_path() {
     std::vector<std::string> paths;
     std::vector<size_t> index(inodes_.size());
@@ -293,21 +433,56 @@ class inode_manager_ final : public inode_manager::impl {
         });
   }
 
+  void order_inodes_by_profile(inode_manager::order_cb const& fn,
+                               file_order_options const& file_order);
+
   void presort_index(std::vector<std::shared_ptr<inode>>& inodes,
                      std::vector<uint32_t>& index);
 
   void order_inodes_by_nilsimsa(inode_manager::order_cb const& fn,
                                 file_order_options const& file_order);
 
+  void order_inodes_by_nilsimsa_index(
+      std::vector<std::shared_ptr<inode>> const& inodes,
+      std::vector<uint32_t> const& index, file_order_options const& file_order,
+      std::function<void(uint32_t)> const& finalize);
+
   std::vector<std::shared_ptr<inode>> inodes_;
   LOG_PROXY_DECL(LoggerPolicy);
   progress& prog_;
+  worker_group& wg_;
 };
 
 template <typename LoggerPolicy>
 void inode_manager_<LoggerPolicy>::order_inodes(
     std::shared_ptr<script> scr, file_order_options const& file_order,
     inode_manager::order_cb const& fn) {
+  // Inodes reused from a base image already refer to existing blocks,
+  // so they are neither ordered nor passed on to `fn`.
+  auto first_reused =
+      std::stable_partition(inodes_.begin(), inodes_.end(),
+                            [](auto const& ino) { return !ino->reused(); });
+
+  std::vector<std::shared_ptr<inode>> reused(
+      std::make_move_iterator(first_reused),
+      std::make_move_iterator(inodes_.end()));
+
+  inodes_.erase(first_reused, inodes_.end());
+
+  if (!reused.empty()) {
+    LOG_INFO << "skipping " << reused.size() << " reused inodes";
+  }
+
+  order_new_inodes(std::move(scr), file_order, fn);
+
+  inodes_.insert(inodes_.end(), std::make_move_iterator(reused.begin()),
+                 std::make_move_iterator(reused.end()));
+}
+
+template <typename LoggerPolicy>
+void inode_manager_<LoggerPolicy>::order_new_inodes(
+    std::shared_ptr<script> scr, file_order_options const& file_order,
+    inode_manager::order_cb const& fn) {
   switch (file_order.mode) {
   case file_order_mode::NONE:
     LOG_INFO << "keeping inode order";
@@ -340,7 +515,8 @@ void inode_manager_<LoggerPolicy>::order_inodes(
     break;
   }
 
-  case file_order_mode::NILSIMSA: {
+  case file_order_mode::NILSIMSA:
+  case file_order_mode::NILSIMSA_INDEX: {
     LOG_INFO << "ordering " << count()
              << " inodes using nilsimsa similarity...";
     auto ti = LOG_CPU_TIMED_INFO;
@@ -348,6 +524,17 @@ void inode_manager_<LoggerPolicy>::order_inodes(
     ti << count() << " inodes ordered";
     return;
   }
+
+  case file_order_mode::PROFILE: {
+    if (!file_order.profile) {
+      DWARFS_THROW(runtime_error, "no access profile for profile ordering");
+    }
+    LOG_INFO << "ordering " << count() << " inodes using access profile...";
+    auto ti = LOG_CPU_TIMED_INFO;
+    order_inodes_by_profile(fn, file_order);
+    ti << count() << " inodes ordered";
+    return;
+  }
   }
 
   LOG_INFO << "assigning file inodes...";
@@ -356,6 +543,68 @@ void inode_manager_<LoggerPolicy>::order_inodes(
   }
 }
 
+template <typename LoggerPolicy>
+void inode_manager_<LoggerPolicy>::order_inodes_by_profile(
+    inode_manager::order_cb const& fn, file_order_options const& file_order) {
+  auto const& prof = *file_order.profile;
+  constexpr auto unranked = std::numeric_limits<size_t>::max();
+  std::vector<size_t> rank;
+
+  rank.reserve(inodes_.size());
+
+  // An inode is ranked by the earliest access of any of its files
+  for (auto const& ino : inodes_) {
+    auto r = unranked;
+    for (auto const& f : ino->files()) {
+      if (auto pr = prof.rank(f->unix_relpath()); pr && *pr < r) {
+        r = *pr;
+      }
+    }
+    rank.push_back(r);
+  }
+
+  std::vector<size_t> index(inodes_.size());
+  std::iota(index.begin(), index.end(), size_t(0));
+
+  auto first_unranked = std::stable_partition(
+      index.begin(), index.end(), [&](auto i) { return rank[i] != unranked; });
+
+  std::sort(index.begin(), first_unranked,
+            [&](auto a, auto b) { return rank[a] < rank[b]; });
+
+  std::vector<std::shared_ptr<inode>> profiled;
+  std::vector<std::shared_ptr<inode>> rest;
+
+  profiled.reserve(std::distance(index.begin(), first_unranked));
+  rest.reserve(std::distance(first_unranked, index.end()));
+
+  for (auto it = index.begin(); it != first_unranked; ++it) {
+    profiled.push_back(std::move(inodes_[*it]));
+  }
+
+  for (auto it = first_unranked; it != index.end(); ++it) {
+    rest.push_back(std::move(inodes_[*it]));
+  }
+
+  LOG_INFO << "found " << profiled.size() << " of " << prof.size()
+           << " profiled files, ordering " << rest.size()
+           << " remaining inodes using nilsimsa similarity";
+
+  for (auto const& ino : profiled) {
+    fn(ino);
+  }
+
+  inodes_.swap(rest);
+
+  auto nilsimsa_order = file_order;
+  nilsimsa_order.mode = file_order_mode::NILSIMSA;
+  order_inodes_by_nilsimsa(fn, nilsimsa_order);
+
+  profiled.insert(profiled.end(), std::make_move_iterator(inodes_.begin()),
+                  std::make_move_iterator(inodes_.end()));
+  inodes_.swap(profiled);
+}
+
 template <typename LoggerPolicy>
 void inode_manager_<LoggerPolicy>::presort_index(
     std::vector<std::shared_ptr<inode>>& inodes, std::vector<uint32_t>& index) {
@@ -463,6 +712,17 @@ void inode_manager_<LoggerPolicy>::order_inodes_by_nilsimsa(
     }
   }
 
+  if (!index.empty() && file_order.mode == file_order_mode::NILSIMSA_INDEX) {
+    presort_index(inodes, index);
+
+    order_inodes_by_nilsimsa_index(inodes, index, file_order, [&](uint32_t i) {
+      inodes_.push_back(std::move(inodes[index[i]]));
+      fn(inodes_.back());
+    });
+
+    index.clear();
+  }
+
   if (!index.empty()) {
     const int_fast32_t max_depth = file_order.nilsimsa_depth;
     const int_fast32_t min_depth =
@@ -512,8 +772,140 @@ void inode_manager_<LoggerPolicy>::order_inodes_by_nilsimsa(
   }
 }
 
-inode_manager::inode_manager(logger& lgr, progress& prog)
+template <typename LoggerPolicy>
+void inode_manager_<LoggerPolicy>::order_inodes_by_nilsimsa_index(
+    std::vector<std::shared_ptr<inode>> const& inodes,
+    std::vector<uint32_t> const& index, file_order_options const& file_order,
+    std::function<void(uint32_t)> const& finalize) {
+  auto const count = index.size();
+  auto const window = std::max<size_t>(
+      file_order.nilsimsa_depth / nilsimsa_index::num_tables, 1);
+  auto const num_neighbours =
+      static_cast<size_t>(std::max(file_order.nilsimsa_neighbours, 1));
+  int const limit = file_order.nilsimsa_limit;
+
+  LOG_INFO << "nilsimsa index: window=" << window
+           << ", neighbours=" << num_neighbours << ", limit=" << limit;
+
+  auto run_parallel = [this](size_t num_jobs, auto const& job) {
+    std::vector<std::future<void>> futures;
+    futures.reserve(num_jobs);
+
+    for (size_t i = 0; i < num_jobs; ++i) {
+      std::packaged_task<void()> task([&job, i] { job(i); });
+      futures.emplace_back(task.get_future());
+      wg_.add_job(std::move(task));
+    }
+
+    for (auto& f : futures) {
+      f.get();
+    }
+  };
+
+  std::vector<uint64_t const*> hashes;
+  hashes.reserve(count);
+
+  for (auto i : index) {
+    hashes.push_back(inodes[i]->nilsimsa_similarity_hash().data());
+  }
+
+  nilsimsa_index idx(std::move(hashes));
+
+  {
+    auto ti = LOG_TIMED_INFO;
+    run_parallel(nilsimsa_index::num_tables,
+                 [&idx](size_t t) { idx.build_table(t); });
+    ti << "built nilsimsa index for " << count << " inodes";
+  }
+
+  // Neighbours for all inodes are computed up front and in parallel, so
+  // the (inherently serial) greedy walk below is typically reduced to
+  // picking the first unused entry from a short list.
+  std::vector<uint32_t> neighbours(count * num_neighbours);
+
+  {
+    constexpr size_t batch_size = 4096;
+    auto ti = LOG_TIMED_INFO;
+    run_parallel((count + batch_size - 1) / batch_size, [&](size_t batch) {
+      auto first = batch * batch_size;
+      auto last = std::min(first + batch_size, count);
+      for (auto i = first; i < last; ++i) {
+        idx.nearest(i, window,
+                    std::span(neighbours)
+                        .subspan(i * num_neighbours, num_neighbours));
+      }
+    });
+    ti << "found up to " << num_neighbours << " neighbours for " << count
+       << " inodes";
+  }
+
+  size_t num_graph = 0;
+  size_t num_search = 0;
+  size_t num_fallback = 0;
+  size_t fallback = count;
+
+  auto next_inode = [&](uint32_t cur) {
+    auto nn = std::span(neighbours).subspan(cur * num_neighbours,
+                                            num_neighbours);
+
+    for (auto j : nn) {
+      if (j == nilsimsa_index::none) {
+        break;
+      }
+      if (!idx.removed(j)) {
+        ++num_graph;
+        return j;
+      }
+    }
+
+    auto const* ref = idx.hash(cur);
+    int max_sim = 0;
+    uint32_t max_sim_ix = nilsimsa_index::none;
+
+    idx.for_each_candidate(cur, window, [&](uint32_t j) {
+      if (!idx.removed(j)) {
+        if (int sim = nilsimsa::similarity(ref, idx.hash(j)); sim > max_sim) {
+          max_sim = sim;
+          max_sim_ix = j;
+        }
+      }
+      return max_sim < limit;
+    });
+
+    if (max_sim_ix != nilsimsa_index::none) {
+      ++num_search;
+      return max_sim_ix;
+    }
+
+    while (idx.removed(fallback - 1)) {
+      --fallback;
+    }
+
+    ++num_fallback;
+
+    return static_cast<uint32_t>(fallback - 1);
+  };
+
+  uint32_t cur = count - 1;
+
+  for (size_t n = 0; n < count; ++n) {
+    if (n > 0) {
+      cur = next_inode(cur);
+    }
+
+    LOG_TRACE << "nilsimsa index: " << n << " -> " << cur;
+
+    idx.remove(cur);
+    finalize(cur);
+  }
+
+  LOG_DEBUG << "nilsimsa index: " << num_graph << " from neighbours, "
+            << num_search << " from index search, " << num_fallback
+            << " fallbacks";
+}
+
+inode_manager::inode_manager(logger& lgr, progress& prog, worker_group& wg)
     : impl_(make_unique_logging_object<impl, inode_manager_, logger_policies>(
-          lgr, prog)) {}
+          lgr, prog, wg)) {}
 
 } // namespace dwarfs
@@ -19,6 +19,7 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <cerrno>
 #include <cstdint>
 #include <cstring>
@@ -98,7 +99,10 @@ class inode_reader_ final : public inode_reader_v2::impl {
       PERFMON_CLS_PROXY_INIT(perfmon, "inode_reader_v2")
       PERFMON_CLS_TIMER_INIT(read)
       PERFMON_CLS_TIMER_INIT(readv_iovec)
-      PERFMON_CLS_TIMER_INIT(readv_future) // clang-format on
+      PERFMON_CLS_TIMER_INIT(readv_future)
+      PERFMON_CLS_TIMER_INIT(read_batch)
+      PERFMON_CLS_TIMER_INIT(walk_chunks)
+      PERFMON_CLS_TIMER_INIT(wait_ranges) // clang-format on
       , offset_cache_{offset_cache_size}
       , iovec_sizes_(1, 0, 256) {}
 
@@ -120,6 +124,9 @@ class inode_reader_ final : public inode_reader_v2::impl {
   folly::Expected<std::vector<std::future<block_range>>, int>
   readv(uint32_t inode, size_t size, file_off_t offset,
         chunk_range chunks) const override;
+  void read_batch(std::span<read_request const> requests,
+                  std::span<std::optional<chunk_range> const> chunks,
+                  read_batch_callback const& cb) const override;
   void dump(std::ostream& os, const std::string& indent,
             chunk_range chunks) const override;
   void set_num_workers(size_t num) override { cache_.set_num_workers(num); }
@@ -127,6 +134,9 @@ class inode_reader_ final : public inode_reader_v2::impl {
     cache_.set_tidy_config(cfg);
   }
   size_t num_blocks() const override { return cache_.block_count(); }
+  block_cache_stats get_cache_stats() const override {
+    return cache_.get_stats();
+  }
 
  private:
   using offset_cache_type =
@@ -134,6 +144,10 @@ class inode_reader_ final : public inode_reader_v2::impl {
                          offset_cache_chunk_index_interval,
                          offset_cache_updater_max_inline_offsets>;
 
+  template <typename RangeFunc>
+  int walk_chunks(uint32_t inode, size_t size, file_off_t offset,
+                  chunk_range chunks, RangeFunc const& func) const;
+
   folly::Expected<std::vector<std::future<block_range>>, int>
   read_internal(uint32_t inode, size_t size, file_off_t offset,
                 chunk_range chunks) const;
@@ -148,6 +162,9 @@ class inode_reader_ final : public inode_reader_v2::impl {
   PERFMON_CLS_TIMER_DECL(read)
   PERFMON_CLS_TIMER_DECL(readv_iovec)
   PERFMON_CLS_TIMER_DECL(readv_future)
+  PERFMON_CLS_TIMER_DECL(read_batch)
+  PERFMON_CLS_TIMER_DECL(walk_chunks)
+  PERFMON_CLS_TIMER_DECL(wait_ranges)
   mutable offset_cache_type offset_cache_;
   mutable folly::Histogram<size_t> iovec_sizes_;
   mutable std::mutex iovec_sizes_mutex_;
@@ -163,20 +180,23 @@ void inode_reader_<LoggerPolicy>::dump(std::ostream& os,
   }
 }
 
+/**
+ * Call `func(block, offset, size)` for each block range that is part of
+ * the request, in file order. Returns 0 on success or a negative error.
+ */
 template <typename LoggerPolicy>
-folly::Expected<std::vector<std::future<block_range>>, int>
-inode_reader_<LoggerPolicy>::read_internal(uint32_t inode, size_t const size,
-                                           file_off_t offset,
-                                           chunk_range chunks) const {
+template <typename RangeFunc>
+int inode_reader_<LoggerPolicy>::walk_chunks(uint32_t inode,
+                                             size_t const size,
+                                             file_off_t offset,
+                                             chunk_range chunks,
+                                             RangeFunc const& func) const {
   if (offset < 0) {
-    return folly::makeUnexpected(-EINVAL);
+    return -EINVAL;
   }
 
-  // request ranges from block cache
-  std::vector<std::future<block_range>> ranges;
-
   if (size == 0 || chunks.empty()) {
-    return ranges;
+    return 0;
   }
 
   auto it = chunks.begin();
@@ -215,7 +235,7 @@ inode_reader_<LoggerPolicy>::read_internal(uint32_t inode, size_t const size,
 
   if (it == end) {
     // offset beyond EOF; TODO: check if this should rather be -EINVAL
-    return ranges;
+    return 0;
   }
 
   size_t num_read = 0;
@@ -227,14 +247,14 @@ inode_reader_<LoggerPolicy>::read_internal(uint32_t inode, size_t const size,
 
     if (copysize == 0) {
       LOG_ERROR << "invalid zero-sized chunk";
-      return folly::makeUnexpected(-EIO);
+      return -EIO;
     }
 
     if (num_read + copysize > size) {
       copysize = size - num_read;
     }
 
-    ranges.emplace_back(cache_.get(it->block(), copyoff, copysize));
+    func(it->block(), copyoff, copysize);
 
     num_read += copysize;
 
@@ -254,6 +274,30 @@ inode_reader_<LoggerPolicy>::read_internal(uint32_t inode, size_t const size,
     oc_upd.add_offset(++it_index, it_offset);
   }
 
+  return 0;
+}
+
+template <typename LoggerPolicy>
+folly::Expected<std::vector<std::future<block_range>>, int>
+inode_reader_<LoggerPolicy>::read_internal(uint32_t inode, size_t const size,
+                                           file_off_t offset,
+                                           chunk_range chunks) const {
+  PERFMON_CLS_SCOPED_SECTION(walk_chunks)
+
+  // request ranges from block cache
+  std::vector<std::future<block_range>> ranges;
+
+  auto err =
+      walk_chunks(inode, size, offset, chunks,
+                  [&](size_t block, size_t block_offset, size_t block_size) {
+                    ranges.emplace_back(
+                        cache_.get(block, block_offset, block_size));
+                  });
+
+  if (err != 0) {
+    return folly::makeUnexpected(err);
+  }
+
   return ranges;
 }
 
@@ -271,6 +315,8 @@ inode_reader_<LoggerPolicy>::read_internal(uint32_t inode, size_t size,
   }
 
   try {
+    PERFMON_CLS_SCOPED_SECTION(wait_ranges)
+
     // now fill the buffer
     size_t num_read = 0;
     for (auto& r : ranges.value()) {
@@ -330,6 +376,135 @@ ssize_t inode_reader_<LoggerPolicy>::readv(iovec_read_buf& buf, uint32_t inode,
   return rv;
 }
 
+template <typename LoggerPolicy>
+void inode_reader_<LoggerPolicy>::read_batch(
+    std::span<read_request const> requests,
+    std::span<std::optional<chunk_range> const> chunks,
+    read_batch_callback const& cb) const {
+  PERFMON_CLS_SCOPED_SECTION(read_batch)
+
+  struct piece {
+    size_t block;
+    size_t offset;
+    size_t size;
+    size_t request;
+    size_t index;
+  };
+
+  struct result {
+    std::vector<block_range> ranges;
+    size_t pending{0};
+    int error{0};
+  };
+
+  std::vector<piece> pieces;
+  std::vector<result> results(requests.size());
+
+  for (size_t i = 0; i < requests.size(); ++i) {
+    auto const& req = requests[i];
+    auto& res = results[i];
+
+    if (!chunks[i]) {
+      res.error = -EBADF;
+      continue;
+    }
+
+    auto first = pieces.size();
+
+    res.error = walk_chunks(
+        req.inode, req.size, req.offset, *chunks[i],
+        [&](size_t block, size_t block_offset, size_t block_size) {
+          pieces.push_back({block, block_offset, block_size, i, res.pending++});
+        });
+
+    if (res.error != 0) {
+      pieces.resize(first);
+      res.pending = 0;
+    } else {
+      res.ranges.resize(res.pending);
+    }
+  }
+
+  auto complete = [&](size_t i) {
+    auto& res = results[i];
+    if (res.error != 0) {
+      cb(i, folly::makeUnexpected(res.error));
+    } else {
+      cb(i, std::move(res.ranges));
+    }
+  };
+
+  // Request exactly one range per block, covering all pieces from that
+  // block. As blocks are always decompressed from the start, this never
+  // decompresses more than requesting the individual pieces would.
+  std::sort(pieces.begin(), pieces.end(), [](auto const& a, auto const& b) {
+    return a.block < b.block || (a.block == b.block && a.offset < b.offset);
+  });
+
+  struct block_job {
+    size_t begin_piece;
+    size_t end_piece;
+    size_t offset;
+    std::future<block_range> future;
+  };
+
+  std::vector<block_job> jobs;
+
+  for (size_t p = 0; p < pieces.size();) {
+    auto block = pieces[p].block;
+    auto offset = pieces[p].offset;
+    size_t range_end = 0;
+    auto q = p;
+
+    for (; q < pieces.size() && pieces[q].block == block; ++q) {
+      range_end = std::max(range_end, pieces[q].offset + pieces[q].size);
+    }
+
+    jobs.push_back(
+        {p, q, offset, cache_.get(block, offset, range_end - offset)});
+
+    p = q;
+  }
+
+  LOG_DEBUG << "read batch: " << requests.size() << " requests, "
+            << pieces.size() << " ranges, " << jobs.size() << " blocks";
+
+  // Complete all requests that don't need any block data
+  for (size_t i = 0; i < results.size(); ++i) {
+    if (results[i].pending == 0) {
+      complete(i);
+    }
+  }
+
+  for (auto& job : jobs) {
+    auto const first = pieces.begin() + job.begin_piece;
+    auto const last = pieces.begin() + job.end_piece;
+
+    try {
+      auto br = job.future.get();
+
+      for (auto it = first; it != last; ++it) {
+        results[it->request].ranges[it->index] =
+            br.subrange(it->offset - job.offset, it->size);
+      }
+    } catch (runtime_error const& e) {
+      LOG_ERROR << e.what();
+      std::for_each(first, last,
+                    [&](auto const& p) { results[p.request].error = -EIO; });
+    } catch (...) {
+      LOG_ERROR << folly::exceptionStr(std::current_exception());
+      std::for_each(first, last,
+                    [&](auto const& p) { results[p.request].error = -EIO; });
+    }
+
+    for (auto it = first; it != last; ++it) {
+      if (--results[it->request].pending == 0) {
+        complete(it->request);
+      }
+    }
+  }
+}
+
 } // namespace
 
 inode_reader_v2::inode_reader_v2(
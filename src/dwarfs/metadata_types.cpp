@@ -517,21 +517,21 @@ check_metadata(logger& lgr, global_metadata::Meta const* meta, bool check) {
 global_metadata::global_metadata(logger& lgr, Meta const* meta,
                                  bool check_consistency)
     : meta_{check_metadata(lgr, meta, check_consistency)}
-    , directories_storage_{unpack_directories(lgr, meta_)}
-    , directories_{directories_storage_.empty() ? nullptr
-                                                : directories_storage_.data()}
+    , directories_{[&lgr, meta] { return unpack_directories(lgr, meta); }}
     , names_{meta_->compact_names()
                  ? string_table(lgr, "names", *meta_->compact_names())
                  : string_table(meta_->names())} {}
 
 uint32_t global_metadata::first_dir_entry(uint32_t ino) const {
-  return directories_ ? directories_[ino].first_entry().value()
-                      : meta_->directories()[ino].first_entry();
+  auto const& dirs = directories();
+  return !dirs.empty() ? dirs[ino].first_entry().value()
+                       : meta_->directories()[ino].first_entry();
 }
 
 uint32_t global_metadata::parent_dir_entry(uint32_t ino) const {
-  return directories_ ? directories_[ino].parent_entry().value()
-                      : meta_->directories()[ino].parent_entry();
+  auto const& dirs = directories();
+  return !dirs.empty() ? dirs[ino].parent_entry().value()
+                       : meta_->directories()[ino].parent_entry();
 }
 
 auto inode_view::mode() const -> mode_type {
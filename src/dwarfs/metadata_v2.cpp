@@ -28,6 +28,7 @@
 #include <filesystem>
 #include <numeric>
 #include <ostream>
+#include <thread>
 
 #include <boost/algorithm/string.hpp>
 
@@ -37,15 +38,18 @@
 
 #include <fmt/format.h>
 
+#include <folly/String.h>
 #include <folly/container/F14Set.h>
 #include <folly/portability/Stdlib.h>
 #include <folly/portability/Unistd.h>
+#include <folly/system/ThreadName.h>
 
 #include <fsst.h>
 
 #include "dwarfs/error.h"
 #include "dwarfs/file_stat.h"
 #include "dwarfs/fstypes.h"
+#include "dwarfs/lazy_value.h"
 #include "dwarfs/logger.h"
 #include "dwarfs/metadata_v2.h"
 #include "dwarfs/options.h"
@@ -313,15 +317,10 @@ class metadata_ final : public metadata_v2::impl {
       , dev_inode_offset_(find_inode_offset(inode_rank::INO_DEV))
       , inode_count_(meta_.dir_entries() ? meta_.inodes().size()
                                          : meta_.entry_table_v2_2().size())
-      , nlinks_(build_nlinks(options))
-      , chunk_table_(unpack_chunk_table())
-      , shared_files_(decompress_shared_files())
-      , unique_files_(dev_inode_offset_ - file_inode_offset_ -
-                      (shared_files_.empty()
-                           ? meta_.shared_files_table()
-                                 ? meta_.shared_files_table()->size()
-                                 : 0
-                           : shared_files_.size()))
+      , nlinks_([this] { return build_nlinks(); })
+      , chunk_table_([this] { return unpack_chunk_table(); })
+      , shared_files_([this] { return decompress_shared_files(); })
+      , unique_files_(count_unique_files())
       , options_(options)
       , symlinks_(meta_.compact_symlinks()
                       ? string_table(lgr, "symlinks", *meta_.compact_symlinks())
@@ -373,6 +372,31 @@ class metadata_ final : public metadata_v2::impl {
                         other_offset - dev_inode_offset_));
       }
     }
+
+    if (!options_.lazy_init) {
+      init_derived_tables();
+    }
+  }
+
+  ~metadata_() override {
+    if (init_thread_.joinable()) {
+      init_thread_.join();
+    }
+  }
+
+  void start_background_init() override {
+    if (options_.lazy_init && !init_thread_.joinable()) {
+      // Requests that need a derived table before the background thread
+      // got to it will simply compute it themselves (or wait for it).
+      init_thread_ = std::thread([this] {
+        folly::setThreadName("metainit");
+        try {
+          init_derived_tables();
+        } catch (std::exception const& e) {
+          LOG_ERROR << "failed to initialize metadata tables: " << e.what();
+        }
+      });
+    }
   }
 
   void dump(std::ostream& os, int detail_level, filesystem_info const& fsinfo,
@@ -430,6 +454,29 @@ class metadata_ final : public metadata_v2::impl {
 
   bool has_symlinks() const override { return !meta_.symlink_table().empty(); }
 
+  std::vector<base_image_info> base_images() const override {
+    std::vector<base_image_info> rv;
+    if (auto bases = meta_.base_images()) {
+      for (auto const& b : *bases) {
+        rv.push_back({std::string(b.checksum()), b.block_count()});
+      }
+    }
+    return rv;
+  }
+
+  std::vector<std::string> block_compression() const override {
+    std::vector<std::string> rv;
+    if (auto specs = meta_.adaptive_compression()) {
+      if (auto levels = meta_.block_compression_levels()) {
+        for (auto level : *levels) {
+          rv.push_back(level < specs->size() ? std::string((*specs)[level])
+                                             : std::string());
+        }
+      }
+    }
+    return rv;
+  }
+
  private:
   template <typename K>
   using set_type = folly::F14ValueSet<K>;
@@ -549,7 +596,8 @@ class metadata_ final : public metadata_v2::impl {
   std::string modestring(uint16_t mode) const;
 
   uint32_t chunk_table_lookup(uint32_t ino) const {
-    return chunk_table_.empty() ? meta_.chunk_table()[ino] : chunk_table_[ino];
+    auto const& chunk_table = chunk_table_.get();
+    return chunk_table.empty() ? meta_.chunk_table()[ino] : chunk_table[ino];
   }
 
   int file_inode_to_chunk_index(int inode) const {
@@ -558,9 +606,10 @@ class metadata_ final : public metadata_v2::impl {
     if (inode >= unique_files_) {
       inode -= unique_files_;
 
-      if (!shared_files_.empty()) {
-        if (inode < static_cast<int>(shared_files_.size())) {
-          inode = shared_files_[inode] + unique_files_;
+      if (auto const& shared_files = shared_files_.get();
+          !shared_files.empty()) {
+        if (inode < static_cast<int>(shared_files.size())) {
+          inode = shared_files[inode] + unique_files_;
         }
       } else if (auto sfp = meta_.shared_files_table()) {
         if (inode < static_cast<int>(sfp->size())) {
@@ -713,10 +762,10 @@ class metadata_ final : public metadata_v2::impl {
     return decompressed;
   }
 
-  std::vector<uint32_t> build_nlinks(metadata_options const& options) const {
+  std::vector<uint32_t> build_nlinks() const {
     std::vector<uint32_t> nlinks;
 
-    if (options.enable_nlink) {
+    if (options_.enable_nlink) {
       auto ti = LOG_TIMED_DEBUG;
 
       nlinks.resize(dev_inode_offset_ - file_inode_offset_);
@@ -744,6 +793,36 @@ class metadata_ final : public metadata_v2::impl {
     return nlinks;
   }
 
+  int count_unique_files() const {
+    int num_files = dev_inode_offset_ - file_inode_offset_;
+
+    if (auto sfp = meta_.shared_files_table()) {
+      if (auto opts = meta_.options();
+          opts and opts->packed_shared_files_table()) {
+        // Each packed entry represents one shared chunk list, and the
+        // chunk table has one entry per unique or shared chunk list, so
+        // we don't need to decompress the table just to get its size.
+        return static_cast<int>(meta_.chunk_table().size() - 1 -
+                                sfp->size());
+      }
+
+      return num_files - static_cast<int>(sfp->size());
+    }
+
+    return num_files;
+  }
+
+  void init_derived_tables() const {
+    auto ti = LOG_TIMED_DEBUG;
+
+    global_.directories();
+    nlinks_.get();
+    chunk_table_.get();
+    shared_files_.get();
+
+    ti << "initialized derived metadata tables";
+  }
+
   std::span<uint8_t const> data_;
   MappedFrozen<thrift::metadata::metadata> meta_;
   const global_metadata global_;
@@ -754,12 +833,13 @@ class metadata_ final : public metadata_v2::impl {
   const int file_inode_offset_;
   const int dev_inode_offset_;
   const int inode_count_;
-  const std::vector<uint32_t> nlinks_;
-  const std::vector<uint32_t> chunk_table_;
-  const std::vector<uint32_t> shared_files_;
+  concurrent_lazy_value<std::vector<uint32_t>> const nlinks_;
+  concurrent_lazy_value<std::vector<uint32_t>> const chunk_table_;
+  concurrent_lazy_value<std::vector<uint32_t>> const shared_files_;
   const int unique_files_;
   const metadata_options options_;
   const string_table symlinks_;
+  std::thread init_thread_;
 };
 
 template <typename LoggerPolicy>
@@ -854,6 +934,12 @@ void metadata_<LoggerPolicy>::dump(
   if (detail_level > 0) {
     os << "block size: " << size_with_unit(stbuf.bsize) << "\n";
     os << "block count: " << fsinfo.block_count << "\n";
+    if (auto bases = meta_.base_images()) {
+      for (auto const& b : *bases) {
+        os << "base image: " << folly::hexlify(std::string(b.checksum()))
+           << " (" << b.block_count() << " blocks)\n";
+      }
+    }
     os << "inode count: " << stbuf.files << "\n";
     if (auto ps = meta_.preferred_path_separator()) {
       os << "preferred path separator: " << static_cast<char>(*ps) << "\n";
@@ -897,6 +983,43 @@ void metadata_<LoggerPolicy>::dump(
         os << "time resolution: " << *res << " seconds\n";
       }
     }
+    if (auto names = meta_.category_names()) {
+      if (auto cats = meta_.block_categories()) {
+        std::vector<size_t> count(names->size());
+        for (auto cat : *cats) {
+          ++count.at(cat);
+        }
+        std::vector<std::string> categories;
+        for (size_t i = 0; i < count.size(); ++i) {
+          if (count[i] > 0) {
+            categories.push_back(
+                fmt::format("{} ({} blocks)", std::string((*names)[i]),
+                            count[i]));
+          }
+        }
+        os << "categories: " << boost::join(categories, "\n            ")
+           << "\n";
+      }
+    }
+    if (auto specs = meta_.adaptive_compression()) {
+      if (auto levels = meta_.block_compression_levels()) {
+        std::vector<size_t> count(specs->size() + 1);
+        for (auto level : *levels) {
+          ++count.at(std::min<size_t>(level, specs->size()));
+        }
+        std::vector<std::string> adaptive;
+        for (size_t i = 0; i < count.size(); ++i) {
+          if (count[i] > 0) {
+            adaptive.push_back(fmt::format(
+                "{} ({} blocks)",
+                i < specs->size() ? std::string((*specs)[i]) : "other",
+                count[i]));
+          }
+        }
+        os << "adaptive compression: "
+           << boost::join(adaptive, "\n                      ") << "\n";
+      }
+    }
   }
 
   if (detail_level > 1) {
@@ -927,7 +1050,8 @@ void metadata_<LoggerPolicy>::dump(
     if (auto sfp = meta_.shared_files_table()) {
       if (meta_.options()->packed_shared_files_table()) {
         os << "packed shared_files_table: " << sfp->size() << "\n";
-        os << "unpacked shared_files_table: " << shared_files_.size() << "\n";
+        os << "unpacked shared_files_table: " << shared_files_.get().size()
+           << "\n";
       } else {
         os << "shared_files_table: " << sfp->size() << "\n";
       }
@@ -1035,13 +1159,13 @@ thrift::metadata::metadata metadata_<LoggerPolicy>::unpack_metadata() const {
 
   if (auto opts = meta.options()) {
     if (opts->packed_chunk_table().value()) {
-      meta.chunk_table() = chunk_table_;
+      meta.chunk_table() = chunk_table_.get();
     }
     if (opts->packed_directories().value()) {
       meta.directories() = global_.directories();
     }
     if (opts->packed_shared_files_table().value()) {
-      meta.shared_files_table() = shared_files_;
+      meta.shared_files_table() = shared_files_.get();
     }
     if (auto const& names = global_.names(); names.is_packed()) {
       meta.names() = names.unpack();
@@ -1298,9 +1422,10 @@ int metadata_<LoggerPolicy>::getattr(inode_view iv, file_stat* stbuf) const {
     stbuf->atime = resolution * (timebase + iv.atime_offset());
     stbuf->ctime = resolution * (timebase + iv.ctime_offset());
   }
-  stbuf->nlink = options_.enable_nlink && stbuf->is_regular_file()
-                     ? DWARFS_NOTHROW(nlinks_.at(inode - file_inode_offset_))
-                     : 1;
+  stbuf->nlink =
+      options_.enable_nlink && stbuf->is_regular_file()
+          ? DWARFS_NOTHROW(nlinks_.get().at(inode - file_inode_offset_))
+          : 1;
 
   if (stbuf->is_device()) {
     stbuf->rdev = get_device_id(inode);
@@ -1435,6 +1560,14 @@ metadata_<LoggerPolicy>::get_chunks(int inode) const {
   return get_chunk_range(inode - inode_offset_);
 }
 
+std::vector<base_image_info> metadata_v2::base_images() const {
+  return impl_->base_images();
+}
+
+std::vector<std::string> metadata_v2::block_compression() const {
+  return impl_->block_compression();
+}
+
 std::pair<std::vector<uint8_t>, std::vector<uint8_t>>
 metadata_v2::freeze(const thrift::metadata::metadata& data) {
   return freeze_to_buffer(data);
@@ -0,0 +1,288 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <fmt/format.h>
+
+#include <folly/system/ThreadName.h>
+
+#include "dwarfs/error.h"
+#include "dwarfs/logger.h"
+#include "dwarfs/metrics_server.h"
+#include "dwarfs/openmetrics.h"
+
+namespace dwarfs {
+
+namespace {
+
+#ifndef _WIN32
+
+constexpr size_t const kMaxRequestSize{8192};
+constexpr int const kClientTimeoutSec{2};
+
+void close_fd(int& fd) {
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+}
+
+std::string
+http_response(std::string_view status, std::string_view content_type,
+              std::string_view body) {
+  return fmt::format("HTTP/1.0 {}\r\n"
+                     "Content-Type: {}\r\n"
+                     "Content-Length: {}\r\n"
+                     "Connection: close\r\n"
+                     "\r\n"
+                     "{}",
+                     status, content_type, body.size(), body);
+}
+
+#endif
+
+template <typename LoggerPolicy>
+class metrics_server_ final : public metrics_server::impl {
+ public:
+  metrics_server_(logger& lgr, std::filesystem::path const& socket_path,
+                  metrics_server::metrics_function func)
+      : LOG_PROXY_INIT(lgr)
+      , socket_path_{socket_path}
+      , func_{std::move(func)} {
+#ifdef _WIN32
+    DWARFS_THROW(runtime_error, "metrics server not supported on Windows");
+#else
+    struct ::sockaddr_un addr;
+    auto path = socket_path_.string();
+
+    if (path.size() >= sizeof(addr.sun_path)) {
+      DWARFS_THROW(runtime_error, "metrics socket path too long: " + path);
+    }
+
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.data(), path.size());
+
+    if (struct ::stat st; ::lstat(path.c_str(), &st) == 0 &&
+                          S_ISSOCK(st.st_mode)) {
+      remove_stale_socket(addr);
+    }
+
+    listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (listen_fd_ < 0) {
+      DWARFS_THROW(system_error, "socket()");
+    }
+
+    if (::bind(listen_fd_, reinterpret_cast<struct ::sockaddr*>(&addr),
+               sizeof(addr)) != 0) {
+      auto err = errno;
+      close_fd(listen_fd_);
+      DWARFS_THROW(system_error, "bind(" + path + ")", err);
+    }
+
+    if (::listen(listen_fd_, 8) != 0 || ::pipe(stop_pipe_.data()) != 0) {
+      auto err = errno;
+      cleanup();
+      DWARFS_THROW(system_error, "listen()/pipe()", err);
+    }
+
+    thread_ = std::thread([this] { run(); });
+
+    LOG_INFO << "serving metrics on " << path;
+#endif
+  }
+
+  ~metrics_server_() override {
+#ifndef _WIN32
+    if (thread_.joinable()) {
+      char c = 0;
+      if (::write(stop_pipe_[1], &c, 1) != 1) {
+        LOG_ERROR << "failed to stop metrics server: "
+                  << std::strerror(errno);
+      }
+      thread_.join();
+    }
+    cleanup();
+#endif
+  }
+
+  std::filesystem::path const& socket_path() const override {
+    return socket_path_;
+  }
+
+ private:
+#ifndef _WIN32
+  // Only remove a socket left behind by a previous instance if nobody is
+  // listening on it anymore; if another instance is still running, bind()
+  // will fail instead of silently taking over its socket.
+  void remove_stale_socket(struct ::sockaddr_un const& addr) {
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+      DWARFS_THROW(system_error, "socket()");
+    }
+
+    auto rv = ::connect(fd, reinterpret_cast<struct ::sockaddr const*>(&addr),
+                        sizeof(addr));
+    auto err = errno;
+
+    close_fd(fd);
+
+    if (rv != 0 && err == ECONNREFUSED) {
+      LOG_DEBUG << "removing stale socket " << addr.sun_path;
+      ::unlink(addr.sun_path);
+    }
+  }
+
+  void cleanup() {
+    if (listen_fd_ >= 0) {
+      close_fd(listen_fd_);
+      ::unlink(socket_path_.string().c_str());
+    }
+    close_fd(stop_pipe_[0]);
+    close_fd(stop_pipe_[1]);
+  }
+
+  void run() {
+    folly::setThreadName("metrics");
+
+    for (;;) {
+      std::array<struct ::pollfd, 2> fds;
+      fds[0] = {listen_fd_, POLLIN, 0};
+      fds[1] = {stop_pipe_[0], POLLIN, 0};
+
+      if (::poll(fds.data(), fds.size(), -1) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        LOG_ERROR << "poll() failed: " << std::strerror(errno);
+        break;
+      }
+
+      if (fds[1].revents != 0) {
+        break;
+      }
+
+      if (fds[0].revents & POLLIN) {
+        int client = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+
+        if (client < 0) {
+          LOG_WARN << "accept() failed: " << std::strerror(errno);
+          continue;
+        }
+
+        handle_client(client);
+        close_fd(client);
+      }
+    }
+  }
+
+  void handle_client(int fd) {
+    struct ::timeval tv {
+      kClientTimeoutSec, 0
+    };
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    std::string request;
+    std::array<char, 1024> buf;
+
+    while (request.find("\r\n\r\n") == std::string::npos &&
+           request.size() < kMaxRequestSize) {
+      auto rv = ::read(fd, buf.data(), buf.size());
+      if (rv <= 0) {
+        if (rv < 0 && errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      request.append(buf.data(), rv);
+    }
+
+    LOG_DEBUG << "metrics request: "
+              << request.substr(0, request.find_first_of("\r\n"));
+
+    std::string response;
+
+    if (request.starts_with("GET ")) {
+      try {
+        response = http_response("200 OK", openmetrics_writer::content_type,
+                                 func_());
+      } catch (std::exception const& e) {
+        LOG_ERROR << "failed to collect metrics: " << e.what();
+        response = http_response("500 Internal Server Error", "text/plain",
+                                 "failed to collect metrics\n");
+      }
+    } else {
+      response = http_response("405 Method Not Allowed", "text/plain",
+                               "only GET is supported\n");
+    }
+
+    std::string_view rem{response};
+
+    while (!rem.empty()) {
+      auto rv = ::send(fd, rem.data(), rem.size(), MSG_NOSIGNAL);
+      if (rv < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        LOG_WARN << "failed to send metrics: " << std::strerror(errno);
+        break;
+      }
+      rem.remove_prefix(rv);
+    }
+  }
+
+#endif
+
+  LOG_PROXY_DECL(LoggerPolicy);
+  std::filesystem::path const socket_path_;
+  metrics_server::metrics_function func_;
+#ifndef _WIN32
+  int listen_fd_{-1};
+  std::array<int, 2> stop_pipe_{-1, -1};
+  std::thread thread_;
+#endif
+};
+
+} // namespace
+
+metrics_server::metrics_server(logger& lgr,
+                               std::filesystem::path const& socket_path,
+                               metrics_function func)
+    : impl_(make_unique_logging_object<metrics_server::impl, metrics_server_,
+                                       logger_policies>(lgr, socket_path,
+                                                        std::move(func))) {}
+
+} // namespace dwarfs
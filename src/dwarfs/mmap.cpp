@@ -128,6 +128,43 @@ std::error_code mmap::release_until(file_off_t offset [[maybe_unused]]) {
   return ec;
 }
 
+std::error_code mmap::advise(advice adv [[maybe_unused]],
+                             file_off_t offset [[maybe_unused]],
+                             size_t size [[maybe_unused]]) {
+  std::error_code ec;
+
+#ifndef _WIN32
+  auto misalign = offset % page_size_;
+
+  offset -= misalign;
+  size += misalign;
+
+  auto data = const_cast<char*>(mf_.const_data() + offset);
+
+  int native = MADV_NORMAL;
+
+  switch (adv) {
+  case advice::NORMAL:
+    break;
+  case advice::RANDOM:
+    native = MADV_RANDOM;
+    break;
+  case advice::SEQUENTIAL:
+    native = MADV_SEQUENTIAL;
+    break;
+  case advice::WILLNEED:
+    native = MADV_WILLNEED;
+    break;
+  }
+
+  if (::madvise(data, size, native) != 0) {
+    ec.assign(errno, std::generic_category());
+  }
+#endif
+
+  return ec;
+}
+
 void const* mmap::addr() const { return mf_.const_data(); }
 
 size_t mmap::size() const { return mf_.size(); }
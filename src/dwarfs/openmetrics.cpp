@@ -0,0 +1,137 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <ostream>
+
+#include <fmt/format.h>
+
+#include "dwarfs/openmetrics.h"
+
+namespace dwarfs {
+
+namespace {
+
+constexpr std::string_view const kPrefix{"dwarfs_"};
+
+void write_escaped(std::ostream& os, std::string_view str) {
+  for (auto c : str) {
+    switch (c) {
+    case '\\':
+      os << "\\\\";
+      break;
+    case '"':
+      os << "\\\"";
+      break;
+    case '\n':
+      os << "\\n";
+      break;
+    default:
+      os << c;
+      break;
+    }
+  }
+}
+
+} // namespace
+
+openmetrics_writer::openmetrics_writer(std::ostream& os)
+    : os_{os} {}
+
+void openmetrics_writer::family(std::string_view name, std::string_view type,
+                                std::string_view help, std::string_view unit) {
+  family_ = kPrefix;
+  family_ += name;
+
+  os_ << "# TYPE " << family_ << " " << type << "\n";
+  if (!unit.empty()) {
+    os_ << "# UNIT " << family_ << " " << unit << "\n";
+  }
+  os_ << "# HELP " << family_ << " ";
+  write_escaped(os_, help);
+  os_ << "\n";
+}
+
+void openmetrics_writer::write_name_and_labels(std::string_view suffix,
+                                               label_list const& labels) {
+  os_ << family_ << suffix;
+
+  if (!labels.empty()) {
+    char sep = '{';
+    for (auto const& [key, value] : labels) {
+      os_ << sep << key << "=\"";
+      write_escaped(os_, value);
+      os_ << '"';
+      sep = ',';
+    }
+    os_ << '}';
+  }
+}
+
+void openmetrics_writer::sample(std::string_view suffix,
+                                label_list const& labels, uint64_t value) {
+  write_name_and_labels(suffix, labels);
+  os_ << " " << value << "\n";
+}
+
+void openmetrics_writer::sample(std::string_view suffix,
+                                label_list const& labels, double value) {
+  write_name_and_labels(suffix, labels);
+  os_ << " " << format_value(value) << "\n";
+}
+
+void openmetrics_writer::counter(std::string_view name, std::string_view help,
+                                 uint64_t value, std::string_view unit) {
+  family(name, "counter", help, unit);
+  sample("_total", {}, value);
+}
+
+void openmetrics_writer::counter(std::string_view name, std::string_view help,
+                                 double value, std::string_view unit) {
+  family(name, "counter", help, unit);
+  sample("_total", {}, value);
+}
+
+void openmetrics_writer::gauge(std::string_view name, std::string_view help,
+                               uint64_t value, std::string_view unit) {
+  family(name, "gauge", help, unit);
+  sample("", {}, value);
+}
+
+void openmetrics_writer::gauge(std::string_view name, std::string_view help,
+                               double value, std::string_view unit) {
+  family(name, "gauge", help, unit);
+  sample("", {}, value);
+}
+
+void openmetrics_writer::finish() { os_ << "# EOF\n"; }
+
+std::string openmetrics_writer::format_value(double value) {
+  if (std::isnan(value)) {
+    return "NaN";
+  }
+  if (std::isinf(value)) {
+    return value > 0 ? "+Inf" : "-Inf";
+  }
+  return fmt::format("{}", value);
+}
+
+} // namespace dwarfs
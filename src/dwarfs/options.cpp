@@ -48,6 +48,12 @@ std::ostream& operator<<(std::ostream& os, file_order_mode mode) {
   case file_order_mode::NILSIMSA:
     modestr = "nilsimsa";
     break;
+  case file_order_mode::NILSIMSA_INDEX:
+    modestr = "nilsimsa-index";
+    break;
+  case file_order_mode::PROFILE:
+    modestr = "profile";
+    break;
   default:
     break;
   }
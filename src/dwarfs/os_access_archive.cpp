@@ -0,0 +1,488 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+// This is required to avoid Windows.h being pulled in by libarchive
+// and polluting our environment with all sorts of shit.
+#if _WIN32
+#include <folly/portability/Windows.h>
+#endif
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#include <fmt/format.h>
+
+#include <folly/ScopeGuard.h>
+#include <folly/portability/Unistd.h>
+
+#include "dwarfs/error.h"
+#include "dwarfs/logger.h"
+#include "dwarfs/mmap.h"
+#include "dwarfs/os_access_archive.h"
+#include "dwarfs/util.h"
+
+namespace dwarfs {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+struct archive_node {
+  file_stat stat;
+  std::string link;
+  std::vector<uint8_t> data;
+  file_off_t spool_offset{0};
+  std::vector<std::string> children;
+};
+
+class archive_dir_reader final : public dir_reader {
+ public:
+  archive_dir_reader(fs::path const& path,
+                     std::shared_ptr<archive_node const> node)
+      : path_{path}
+      , node_{std::move(node)} {}
+
+  bool read(fs::path& name) override {
+    if (index_ < node_->children.size()) {
+      name = path_ / string_to_u8string(node_->children[index_++]);
+      return true;
+    }
+
+    return false;
+  }
+
+ private:
+  fs::path const path_;
+  std::shared_ptr<archive_node const> const node_;
+  size_t index_{0};
+};
+
+/**
+ * A view of a file's data, either held in memory or in the spool file
+ */
+class archive_file final : public mmif {
+ public:
+  archive_file(std::shared_ptr<void const> owner, void const* addr,
+               size_t size, fs::path const& path)
+      : owner_{std::move(owner)}
+      , addr_{addr}
+      , size_{size}
+      , path_{path} {}
+
+  void const* addr() const override { return addr_; }
+
+  size_t size() const override { return size_; }
+
+  std::error_code lock(file_off_t, size_t) override {
+    return std::error_code();
+  }
+  std::error_code release(file_off_t, size_t) override {
+    return std::error_code();
+  }
+  std::error_code release_until(file_off_t) override {
+    return std::error_code();
+  }
+  std::error_code advise(advice, file_off_t, size_t) override {
+    return std::error_code();
+  }
+
+  fs::path const& path() const override { return path_; }
+
+ private:
+  std::shared_ptr<void const> const owner_;
+  void const* const addr_;
+  size_t const size_;
+  fs::path const path_;
+};
+
+std::string normalize_path(fs::path const& path) {
+  auto p = u8string_to_string(
+      path.lexically_normal().relative_path().generic_u8string());
+
+  while (!p.empty() && p.back() == '/') {
+    p.pop_back();
+  }
+
+  if (p == ".") {
+    p.clear();
+  }
+
+  return p;
+}
+
+std::string parent_path(std::string const& path) {
+  auto pos = path.rfind('/');
+  return pos == std::string::npos ? std::string() : path.substr(0, pos);
+}
+
+std::string file_name(std::string const& path) {
+  auto pos = path.rfind('/');
+  return pos == std::string::npos ? path : path.substr(pos + 1);
+}
+
+[[noreturn]] void throw_errno(int err, fs::path const& path) {
+  throw std::system_error(err, std::generic_category(),
+                          u8string_to_string(path.u8string()));
+}
+
+} // namespace
+
+class os_access_archive::impl {
+ public:
+  impl(logger& lgr, fs::path const& archive,
+       os_access_archive_options const& opts);
+  ~impl();
+
+  std::shared_ptr<archive_node const> get(fs::path const& path) const {
+    auto it = nodes_.find(normalize_path(path));
+    if (it == nodes_.end()) {
+      throw_errno(ENOENT, path);
+    }
+    return it->second;
+  }
+
+  bool exists(fs::path const& path) const {
+    return nodes_.find(normalize_path(path)) != nodes_.end();
+  }
+
+  std::shared_ptr<mmif> map(fs::path const& path,
+                            std::shared_ptr<archive_node const> node,
+                            size_t size) const {
+    if (spool_) {
+      return std::make_shared<archive_file>(
+          spool_, spool_->as<uint8_t>(node->spool_offset), size, path);
+    }
+    auto addr = node->data.data();
+    return std::make_shared<archive_file>(std::move(node), addr, size, path);
+  }
+
+ private:
+  archive_node& add_node(std::string const& path, file_stat const& st);
+  archive_node& get_dir(std::string const& path);
+  void read_data(struct ::archive* a, struct ::archive_entry* ae,
+                 archive_node& node);
+  void check_result(struct ::archive* a, int res);
+
+  LOG_PROXY_DECL(debug_logger_policy);
+  std::unordered_map<std::string, std::shared_ptr<archive_node>> nodes_;
+  file_stat::ino_type next_ino_{1};
+  std::ofstream spool_os_;
+  fs::path spool_path_;
+  file_off_t spool_size_{0};
+  std::shared_ptr<mmif> spool_;
+};
+
+os_access_archive::impl::impl(logger& lgr, fs::path const& archive,
+                              os_access_archive_options const& opts)
+    : LOG_PROXY_INIT(lgr) {
+  auto ti = LOG_TIMED_INFO;
+
+  if (opts.spool_dir) {
+    spool_path_ = *opts.spool_dir /
+                  fmt::format("dwarfs-spool-{}-{}", ::getpid(),
+                              reinterpret_cast<uintptr_t>(this));
+    spool_os_.open(spool_path_, std::ios::binary | std::ios::trunc);
+    if (!spool_os_) {
+      throw_errno(errno, spool_path_);
+    }
+  }
+
+  auto a = ::archive_read_new();
+
+  SCOPE_EXIT { ::archive_read_free(a); };
+
+  check_result(a, ::archive_read_support_filter_all(a));
+  check_result(a, ::archive_read_support_format_all(a));
+
+  if (archive == "-") {
+    check_result(a, ::archive_read_open_fd(a, 0, 1 << 20));
+  } else {
+#ifdef _WIN32
+    check_result(
+        a, ::archive_read_open_filename_w(a, archive.wstring().c_str(), 1 << 20));
+#else
+    check_result(
+        a, ::archive_read_open_filename(a, archive.string().c_str(), 1 << 20));
+#endif
+  }
+
+  file_stat root_st{};
+  root_st.mode = posix_file_type::directory | 0755;
+  root_st.nlink = 1;
+  add_node(std::string(), root_st);
+
+  size_t num_entries = 0;
+  struct ::archive_entry* ae;
+
+  for (;;) {
+    auto res = ::archive_read_next_header(a, &ae);
+
+    if (res == ARCHIVE_EOF) {
+      break;
+    }
+
+    check_result(a, res);
+
+    char const* name = ::archive_entry_pathname_utf8(ae);
+    if (!name) {
+      name = ::archive_entry_pathname(ae);
+    }
+
+    auto path = normalize_path(fs::path(string_to_u8string(name)));
+
+    if (path == ".." || path.starts_with("../")) {
+      LOG_WARN << "skipping entry outside of archive root: " << name;
+      continue;
+    }
+
+    ++num_entries;
+
+    if (auto hardlink = ::archive_entry_hardlink(ae)) {
+      auto target = normalize_path(fs::path(string_to_u8string(hardlink)));
+      auto it = nodes_.find(target);
+
+      if (it == nodes_.end() || !it->second->stat.is_regular_file()) {
+        LOG_WARN << "skipping hardlink to unknown file: " << name << " -> "
+                 << hardlink;
+        continue;
+      }
+
+      if (nodes_.contains(path)) {
+        LOG_WARN << "skipping hardlink to existing path: " << name << " -> "
+                 << hardlink;
+        continue;
+      }
+
+      auto node = it->second;
+      ++node->stat.nlink;
+      nodes_.emplace(path, node);
+      get_dir(parent_path(path)).children.push_back(file_name(path));
+      continue;
+    }
+
+    file_stat st{};
+    st.mode = ::archive_entry_mode(ae);
+    st.uid = ::archive_entry_uid(ae);
+    st.gid = ::archive_entry_gid(ae);
+    st.rdev = ::archive_entry_rdev(ae);
+    st.nlink = 1;
+    st.mtime = ::archive_entry_mtime(ae);
+    st.atime =
+        ::archive_entry_atime_is_set(ae) ? ::archive_entry_atime(ae) : st.mtime;
+    st.ctime =
+        ::archive_entry_ctime_is_set(ae) ? ::archive_entry_ctime(ae) : st.mtime;
+
+    if (path.empty()) {
+      if (st.is_directory()) {
+        auto& root = *nodes_.at(path);
+        st.ino = root.stat.ino;
+        root.stat = st;
+      }
+      continue;
+    }
+
+    auto& node = add_node(path, st);
+
+    if (st.is_symlink()) {
+      char const* link = ::archive_entry_symlink_utf8(ae);
+      if (!link) {
+        link = ::archive_entry_symlink(ae);
+      }
+      node.link = link ? link : "";
+      node.stat.size = node.link.size();
+    } else if (st.is_regular_file()) {
+      read_data(a, ae, node);
+    }
+  }
+
+  if (spool_os_.is_open()) {
+    spool_os_.close();
+
+    if (!spool_os_) {
+      throw_errno(errno, spool_path_);
+    }
+
+    if (spool_size_ > 0) {
+      spool_ = std::make_shared<mmap>(spool_path_);
+    }
+  }
+
+  ti << "read " << num_entries << " entries with "
+     << size_with_unit(spool_size_) << " of file data from archive";
+}
+
+os_access_archive::impl::~impl() {
+  if (!spool_path_.empty()) {
+    spool_.reset();
+    std::error_code ec;
+    fs::remove(spool_path_, ec);
+  }
+}
+
+archive_node&
+os_access_archive::impl::add_node(std::string const& path,
+                                  file_stat const& st) {
+  auto& node = nodes_[path];
+
+  if (node && node->stat.is_directory() && st.is_directory()) {
+    // an explicit entry for an implicitly created directory
+    auto ino = node->stat.ino;
+    node->stat = st;
+    node->stat.ino = ino;
+    return *node;
+  }
+
+  bool const is_new = !node;
+
+  node = std::make_shared<archive_node>();
+  node->stat = st;
+  node->stat.ino = next_ino_++;
+
+  if (is_new && !path.empty()) {
+    get_dir(parent_path(path)).children.push_back(file_name(path));
+  }
+
+  return *node;
+}
+
+archive_node& os_access_archive::impl::get_dir(std::string const& path) {
+  if (auto it = nodes_.find(path); it != nodes_.end()) {
+    if (!it->second->stat.is_directory()) {
+      DWARFS_THROW(runtime_error,
+                   fmt::format("archive entry is not a directory: {}", path));
+    }
+    return *it->second;
+  }
+
+  file_stat st{};
+  st.mode = posix_file_type::directory | 0755;
+  st.nlink = 1;
+
+  return add_node(path, st);
+}
+
+void os_access_archive::impl::read_data(struct ::archive* a,
+                                        struct ::archive_entry* ae,
+                                        archive_node& node) {
+  bool const spool = spool_os_.is_open();
+  std::vector<uint8_t> buf(1 << 20);
+  file_off_t size = 0;
+
+  if (spool) {
+    node.spool_offset = spool_size_;
+  } else if (::archive_entry_size_is_set(ae)) {
+    node.data.reserve(::archive_entry_size(ae));
+  }
+
+  for (;;) {
+    auto rv = ::archive_read_data(a, buf.data(), buf.size());
+
+    if (rv <= 0) {
+      if (rv < 0) {
+        check_result(a, static_cast<int>(rv));
+      }
+      break;
+    }
+
+    if (spool) {
+      spool_os_.write(reinterpret_cast<char const*>(buf.data()), rv);
+      if (!spool_os_) {
+        throw_errno(errno, spool_path_);
+      }
+    } else {
+      node.data.insert(node.data.end(), buf.begin(), buf.begin() + rv);
+    }
+
+    size += rv;
+  }
+
+  node.stat.size = size;
+  spool_size_ += size;
+}
+
+void os_access_archive::impl::check_result(struct ::archive* a, int res) {
+  switch (res) {
+  case ARCHIVE_OK:
+    break;
+  case ARCHIVE_WARN:
+    LOG_WARN << std::string(archive_error_string(a));
+    break;
+  case ARCHIVE_RETRY:
+  case ARCHIVE_FAILED:
+  case ARCHIVE_FATAL:
+    DWARFS_THROW(runtime_error, std::string(archive_error_string(a)));
+  }
+}
+
+os_access_archive::os_access_archive(logger& lgr, fs::path const& archive,
+                                     os_access_archive_options const& opts)
+    : impl_{std::make_unique<impl>(lgr, archive, opts)} {}
+
+os_access_archive::~os_access_archive() = default;
+
+std::shared_ptr<dir_reader>
+os_access_archive::opendir(fs::path const& path) const {
+  auto node = impl_->get(path);
+  if (!node->stat.is_directory()) {
+    throw_errno(ENOTDIR, path);
+  }
+  return std::make_shared<archive_dir_reader>(path, std::move(node));
+}
+
+file_stat os_access_archive::symlink_info(fs::path const& path) const {
+  return impl_->get(path)->stat;
+}
+
+fs::path os_access_archive::read_symlink(fs::path const& path) const {
+  auto node = impl_->get(path);
+  if (!node->stat.is_symlink()) {
+    throw_errno(EINVAL, path);
+  }
+  return string_to_u8string(node->link);
+}
+
+std::shared_ptr<mmif>
+os_access_archive::map_file(fs::path const& path, size_t size) const {
+  auto node = impl_->get(path);
+  if (!node->stat.is_regular_file() ||
+      size > static_cast<size_t>(node->stat.size)) {
+    throw_errno(EINVAL, path);
+  }
+  return impl_->map(path, std::move(node), size);
+}
+
+int os_access_archive::access(fs::path const& path, int) const {
+  if (impl_->exists(path)) {
+    return 0;
+  }
+  errno = ENOENT;
+  return -1;
+}
+
+} // namespace dwarfs
@@ -22,8 +22,13 @@
 #include <algorithm>
 #include <atomic>
 #include <deque>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <ostream>
 #include <string_view>
+#include <utility>
+#include <vector>
 
 #ifdef _WIN32
 #include <folly/portability/Windows.h>
@@ -31,9 +36,8 @@
 #include <sys/time.h>
 #endif
 
-#include <folly/lang/Bits.h>
-#include <folly/stats/Histogram.h>
-
+#include "dwarfs/latency_histogram.h"
+#include "dwarfs/openmetrics.h"
 #include "dwarfs/performance_monitor.h"
 #include "dwarfs/util.h"
 
@@ -43,70 +47,164 @@ namespace {
 
 class single_timer {
  public:
-  static constexpr uint64_t const histogram_interval = 1;
+  // Exported OpenMetrics buckets end just below powers of two. With a
+  // nanosecond timebase, going up to 2^39 ticks covers latencies up to
+  // ~9 minutes.
+  static constexpr unsigned const max_exported_log2 = 39;
 
   single_timer(std::string const& name_space, std::string const& name)
-      : log_hist_{1, 0, 64}
-      , namespace_{name_space}
-      , name_{name} {
-    total_time_.store(0);
+      : namespace_{name_space}
+      , name_{name} {}
+
+  latency_histogram* add_thread_histogram() {
+    std::lock_guard lock(mx_);
+    if (!unused_.empty()) {
+      auto h = unused_.back();
+      unused_.pop_back();
+      return h;
+    }
+    return histograms_.emplace_back(std::make_unique<latency_histogram>())
+        .get();
   }
 
-  void add_sample(uint64_t elapsed) {
-    total_time_.fetch_add(elapsed);
+  // The samples in the histogram are kept, it is only handed to the next
+  // thread that needs one, so memory is bounded by the number of threads
+  // using the timer concurrently rather than by all threads ever created.
+  void release_thread_histogram(latency_histogram* h) {
+    std::lock_guard lock(mx_);
+    unused_.push_back(h);
+  }
 
-    if ((samples_.fetch_add(1) % histogram_interval) == 0) {
-      auto log_time = folly::findLastSet(elapsed);
-      std::lock_guard lock(log_hist_mutex_);
-      log_hist_.addValue(log_time);
+  latency_histogram::snapshot get_snapshot() const {
+    latency_histogram::snapshot snap;
+    std::lock_guard lock(mx_);
+    for (auto const& h : histograms_) {
+      snap.merge(*h);
     }
+    return snap;
   }
 
   std::string_view get_namespace() const { return namespace_; }
 
   std::string_view name() const { return name_; }
 
-  uint64_t total_latency() const { return total_time_.load(); }
+  void summarize(std::ostream& os, latency_histogram::snapshot const& snap,
+                 double timebase) const {
+    auto samples = snap.count();
 
-  void summarize(std::ostream& os, double timebase) const {
-    if (samples_.load() == 0) {
+    if (samples == 0) {
       return;
     }
 
-    size_t log_p50, log_p90, log_p99;
-    {
-      std::lock_guard lock(log_hist_mutex_);
-      log_p50 = log_hist_.getPercentileEstimate(0.5);
-      log_p90 = log_hist_.getPercentileEstimate(0.9);
-      log_p99 = log_hist_.getPercentileEstimate(0.99);
-    }
-    auto samples = samples_.load();
-    auto total_time = total_time_.load();
-
-    auto tot = timebase * total_time;
+    auto tot = timebase * snap.sum();
     auto avg = tot / samples;
-    auto p50 = timebase * (UINT64_C(1) << log_p50);
-    auto p90 = timebase * (UINT64_C(1) << log_p90);
-    auto p99 = timebase * (UINT64_C(1) << log_p99);
 
     os << "[" << namespace_ << "." << name_ << "]\n";
     os << "      samples: " << samples << "\n";
     os << "      overall: " << time_with_unit(tot) << "\n";
     os << "  avg latency: " << time_with_unit(avg) << "\n";
-    os << "  p50 latency: " << time_with_unit(p50) << "\n";
-    os << "  p90 latency: " << time_with_unit(p90) << "\n";
-    os << "  p99 latency: " << time_with_unit(p99) << "\n\n";
+    os << "  p50 latency: "
+       << time_with_unit(timebase * snap.percentile(0.5)) << "\n";
+    os << "  p90 latency: "
+       << time_with_unit(timebase * snap.percentile(0.9)) << "\n";
+    os << "  p99 latency: "
+       << time_with_unit(timebase * snap.percentile(0.99)) << "\n";
+    os << " p999 latency: "
+       << time_with_unit(timebase * snap.percentile(0.999)) << "\n";
+    os << "  max latency: " << time_with_unit(timebase * snap.max())
+       << "\n\n";
+  }
+
+  void write_openmetrics(openmetrics_writer& w, double timebase) const {
+    auto snap = get_snapshot();
+    openmetrics_writer::label_list labels{{"namespace", namespace_},
+                                          {"section", name_}};
+
+    // `le` is an inclusive bound, and the histogram can only tell apart
+    // samples below and at or above a power of two
+    for (unsigned i = 0; i <= max_exported_log2; ++i) {
+      labels.emplace_back(
+          "le", openmetrics_writer::format_value(
+                    timebase * static_cast<double>((UINT64_C(1) << i) - 1)));
+      w.sample("_bucket", labels, snap.count_below_pow2(i));
+      labels.pop_back();
+    }
+
+    labels.emplace_back("le", "+Inf");
+    w.sample("_bucket", labels, snap.count());
+    labels.pop_back();
+    w.sample("_count", labels, snap.count());
+    w.sample("_sum", labels, timebase * snap.sum());
   }
 
  private:
-  std::atomic<uint64_t> samples_;
-  std::atomic<uint64_t> total_time_;
-  folly::Histogram<size_t> log_hist_;
-  std::mutex mutable log_hist_mutex_;
+  std::vector<std::unique_ptr<latency_histogram>> histograms_;
+  std::vector<latency_histogram*> unused_;
+  std::mutex mutable mx_;
   std::string const namespace_;
   std::string const name_;
 };
 
+struct timer_registry {
+  std::deque<single_timer> timers;
+  std::mutex mx;
+};
+
+/**
+ * Per-thread histograms of all monitors used by a thread
+ *
+ * When the thread exits, its histograms are returned to the timers of
+ * all monitors that are still alive. Entries of monitors that have gone
+ * away are dropped whenever a new monitor is first used by the thread.
+ */
+class thread_histogram_cache {
+ public:
+  thread_histogram_cache() = default;
+  thread_histogram_cache(thread_histogram_cache const&) = delete;
+  thread_histogram_cache& operator=(thread_histogram_cache const&) = delete;
+
+  ~thread_histogram_cache() {
+    for (auto& e : entries_) {
+      if (auto reg = e.registry.lock()) {
+        for (size_t id = 0; id < e.hists.size(); ++id) {
+          if (e.hists[id]) {
+            reg->timers[id].release_thread_histogram(e.hists[id]);
+          }
+        }
+      }
+    }
+  }
+
+  std::vector<latency_histogram*>&
+  get(uint64_t instance, std::shared_ptr<timer_registry> const& reg) {
+    auto it = std::find_if(entries_.begin(), entries_.end(), [=](auto& e) {
+      return e.instance == instance;
+    });
+
+    if (it != entries_.end()) {
+      return it->hists;
+    }
+
+    std::erase_if(entries_,
+                  [](auto const& e) { return e.registry.expired(); });
+
+    return entries_.emplace_back(entry{instance, reg, {}}).hists;
+  }
+
+ private:
+  struct entry {
+    uint64_t instance;
+    std::weak_ptr<timer_registry> registry;
+    std::vector<latency_histogram*> hists;
+  };
+
+  std::vector<entry> entries_;
+};
+
+std::atomic<uint64_t> next_monitor_instance{1};
+
+thread_local std::shared_ptr<performance_monitor::trace> current_thread_trace;
+
 } // namespace
 
 class performance_monitor_impl : public performance_monitor {
@@ -114,16 +212,26 @@ class performance_monitor_impl : public performance_monitor {
   using timer_id = performance_monitor::timer_id;
   using time_type = performance_monitor::time_type;
 
-  explicit performance_monitor_impl(
-      std::unordered_set<std::string> enabled_namespaces)
-      : timebase_{get_timebase()}
-      , enabled_namespaces_{std::move(enabled_namespaces)} {}
+  // only the most recent slow requests are kept
+  static constexpr size_t const max_slow_traces = 32;
+
+  performance_monitor_impl(
+      std::unordered_set<std::string> enabled_namespaces,
+      std::optional<std::chrono::nanoseconds> trace_threshold)
+      : instance_{next_monitor_instance.fetch_add(1)}
+      , timebase_{get_timebase()}
+      , enabled_namespaces_{std::move(enabled_namespaces)} {
+    if (trace_threshold) {
+      std::chrono::duration<double> threshold = *trace_threshold;
+      trace_threshold_ = static_cast<time_type>(threshold.count() / timebase_);
+    }
+  }
 
   timer_id
   setup_timer(std::string const& ns, std::string const& name) const override {
-    std::lock_guard lock(timers_mx_);
-    timer_id rv = timers_.size();
-    timers_.emplace_back(ns, name);
+    std::lock_guard lock(registry_->mx);
+    timer_id rv = registry_->timers.size();
+    registry_->timers.emplace_back(ns, name);
     return rv;
   }
 
@@ -140,35 +248,123 @@ class performance_monitor_impl : public performance_monitor {
   }
 
   void add_sample(timer_id id, time_type start) const override {
-    auto elapsed = now() - start;
-    // No need to acquire the mutex here as existing timers
-    // never move in the deque.
-    timers_[id].add_sample(elapsed);
+    auto end = now();
+    thread_histogram(id).add(end - start);
+    if (auto const& t = current_thread_trace) {
+      t->add_event(id, start, end);
+    }
+  }
+
+  std::shared_ptr<trace> start_trace() const override {
+    if (!trace_threshold_) {
+      return nullptr;
+    }
+    return std::make_shared<trace>(next_request_id_.fetch_add(1), now());
+  }
+
+  void finish_trace(std::shared_ptr<trace> t) const override {
+    if (now() - t->start() < *trace_threshold_) {
+      return;
+    }
+
+    std::lock_guard lock(traces_mx_);
+    ++slow_requests_;
+    slow_traces_.push_back(std::move(t));
+    if (slow_traces_.size() > max_slow_traces) {
+      slow_traces_.pop_front();
+    }
+  }
+
+  void dump_traces(std::ostream& os) const override {
+    std::deque<std::shared_ptr<trace>> traces;
+    size_t slow_requests;
+
+    {
+      std::lock_guard lock(traces_mx_);
+      traces = slow_traces_;
+      slow_requests = slow_requests_;
+    }
+
+    if (!trace_threshold_) {
+      os << "request tracing is disabled\n";
+      return;
+    }
+
+    os << "slow requests: " << slow_requests << " (showing "
+       << traces.size() << ", threshold "
+       << time_with_unit(timebase_ * *trace_threshold_) << ")\n";
+
+    for (auto const& t : traces) {
+      auto events = t->events();
+
+      // outer sections first, as they start earlier or end later
+      std::sort(events.begin(), events.end(), [](auto const& a, auto const& b) {
+        return a.start < b.start || (a.start == b.start && a.end > b.end);
+      });
+
+      time_type end = t->start();
+      for (auto const& e : events) {
+        end = std::max(end, e.end);
+      }
+
+      os << "\nrequest " << t->request_id() << ": "
+         << time_with_unit(timebase_ * (end - t->start())) << "\n";
+
+      for (auto const& e : events) {
+        auto const& timer = registry_->timers[e.id];
+        os << "  +" << time_with_unit(timebase_ * (e.start - t->start()))
+           << " " << time_with_unit(timebase_ * (e.end - e.start)) << " "
+           << timer.get_namespace() << "." << timer.name() << "\n";
+      }
+    }
   }
 
   void summarize(std::ostream& os) const override {
-    int count;
+    size_t count;
 
     {
-      std::lock_guard lock(timers_mx_);
-      count = timers_.size();
+      std::lock_guard lock(registry_->mx);
+      count = registry_->timers.size();
     }
 
-    std::vector<std::tuple<std::string_view, uint64_t, int>> ts;
+    auto const& timers = registry_->timers;
+    std::vector<latency_histogram::snapshot> snaps;
+    std::vector<size_t> order;
+
+    snaps.reserve(count);
+    order.reserve(count);
 
-    for (int i = 0; i < count; ++i) {
-      auto& t = timers_[i];
-      ts.emplace_back(t.get_namespace(), t.total_latency(), i);
+    for (size_t i = 0; i < count; ++i) {
+      snaps.push_back(timers[i].get_snapshot());
+      order.push_back(i);
     }
 
-    std::sort(ts.begin(), ts.end(), [](auto const& a, auto const& b) {
-      return std::get<0>(a) < std::get<0>(b) ||
-             (std::get<0>(a) == std::get<0>(b) &&
-              std::get<1>(a) > std::get<1>(b));
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      auto ns_a = timers[a].get_namespace();
+      auto ns_b = timers[b].get_namespace();
+      return ns_a < ns_b || (ns_a == ns_b && snaps[a].sum() > snaps[b].sum());
     });
 
-    for (auto const& t : ts) {
-      timers_[std::get<2>(t)].summarize(os, timebase_);
+    for (auto i : order) {
+      timers[i].summarize(os, snaps[i], timebase_);
+    }
+  }
+
+  void write_openmetrics(openmetrics_writer& w) const override {
+    size_t count;
+
+    {
+      std::lock_guard lock(registry_->mx);
+      count = registry_->timers.size();
+    }
+
+    w.family("perfmon_latency_seconds", "histogram",
+             "Latency of instrumented code sections", "seconds");
+
+    auto const& timers = registry_->timers;
+
+    for (size_t i = 0; i < count; ++i) {
+      timers[i].write_openmetrics(w, timebase_);
     }
   }
 
@@ -177,6 +373,30 @@ class performance_monitor_impl : public performance_monitor {
   }
 
  private:
+  // Each thread records samples into its own histogram per timer, so the
+  // hot path neither takes a lock nor touches shared cache lines. The
+  // histograms are owned by the timers and thus outlive their threads,
+  // which hand them back for reuse when they exit.
+  // Monitor instances are identified by a unique number rather than by
+  // address, so a stale cache entry can never be mistaken for a new one.
+  latency_histogram& thread_histogram(timer_id id) const {
+    thread_local thread_histogram_cache cache;
+
+    auto& hists = cache.get(instance_, registry_);
+
+    if (id >= hists.size()) {
+      hists.resize(id + 1, nullptr);
+    }
+
+    if (!hists[id]) {
+      // No need to acquire the mutex here as existing timers
+      // never move in the deque.
+      hists[id] = registry_->timers[id].add_thread_histogram();
+    }
+
+    return *hists[id];
+  }
+
   static double get_timebase() {
 #ifdef _WIN32
     ::LARGE_INTEGER freq;
@@ -187,12 +407,47 @@ class performance_monitor_impl : public performance_monitor {
 #endif
   }
 
-  std::deque<single_timer> mutable timers_;
-  std::mutex mutable timers_mx_;
+  std::shared_ptr<timer_registry> const registry_{
+      std::make_shared<timer_registry>()};
+  uint64_t const instance_;
   double const timebase_;
   std::unordered_set<std::string> const enabled_namespaces_;
+  std::optional<time_type> trace_threshold_;
+  std::atomic<uint64_t> mutable next_request_id_{1};
+  std::deque<std::shared_ptr<trace>> mutable slow_traces_;
+  size_t mutable slow_requests_{0};
+  std::mutex mutable traces_mx_;
 };
 
+performance_monitor::scoped_trace::scoped_trace(performance_monitor const* mon)
+    : trace_{mon->start_trace()} {
+  if (trace_) {
+    mon_ = mon;
+    prev_ = std::exchange(current_thread_trace, trace_);
+  }
+}
+
+performance_monitor::scoped_trace::scoped_trace(std::shared_ptr<trace> t)
+    : trace_{std::move(t)} {
+  if (trace_) {
+    prev_ = std::exchange(current_thread_trace, trace_);
+  }
+}
+
+performance_monitor::scoped_trace::~scoped_trace() {
+  if (trace_) {
+    current_thread_trace = std::move(prev_);
+    if (mon_) {
+      mon_->finish_trace(std::move(trace_));
+    }
+  }
+}
+
+std::shared_ptr<performance_monitor::trace> const&
+performance_monitor::current_trace() {
+  return current_thread_trace;
+}
+
 performance_monitor_proxy::performance_monitor_proxy(
     std::shared_ptr<performance_monitor const> mon,
     std::string const& mon_namespace)
@@ -200,11 +455,12 @@ performance_monitor_proxy::performance_monitor_proxy(
     , namespace_{mon_namespace} {}
 
 std::unique_ptr<performance_monitor> performance_monitor::create(
-    std::unordered_set<std::string> const& enabled_namespaces) {
+    std::unordered_set<std::string> const& enabled_namespaces,
+    std::optional<std::chrono::nanoseconds> trace_threshold) {
   return enabled_namespaces.empty()
              ? nullptr
              : std::make_unique<performance_monitor_impl>(
-                   std::move(enabled_namespaces));
+                   std::move(enabled_namespaces), trace_threshold);
 }
 
 } // namespace dwarfs
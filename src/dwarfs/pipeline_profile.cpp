@@ -0,0 +1,276 @@
+/* vim:set ts=2 sw=2 sts=2 et: */
+/**
+ * \author     Marcus Holland-Moritz (github@mhxnet.de)
+ * \copyright  Copyright (c) Marcus Holland-Moritz
+ *
+ * This file is part of dwarfs.
+ *
+ * dwarfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dwarfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <array>
+#include <ctime>
+#include <ostream>
+
+#include <folly/json.h>
+#include <folly/portability/Windows.h>
+#include <folly/system/ThreadName.h>
+
+#include "dwarfs/pipeline_profile.h"
+#include "dwarfs/progress.h"
+#include "dwarfs/worker_group.h"
+
+namespace dwarfs {
+
+namespace {
+
+struct profile_counter {
+  char const* name;
+  uint64_t (*get)(progress const&);
+};
+
+#define DWARFS_PROFILE_COUNTER(n)                                              \
+  profile_counter {                                                            \
+    #n, [](progress const& p) -> uint64_t { return p.n; }                      \
+  }
+
+std::array const profile_counters{
+    DWARFS_PROFILE_COUNTER(files_scanned),
+    DWARFS_PROFILE_COUNTER(duplicate_files),
+    DWARFS_PROFILE_COUNTER(original_size),
+    DWARFS_PROFILE_COUNTER(hash_bytes_read),
+    DWARFS_PROFILE_COUNTER(similarity_bytes_read),
+    DWARFS_PROFILE_COUNTER(fused_bytes_read),
+    DWARFS_PROFILE_COUNTER(saved_by_deduplication),
+    DWARFS_PROFILE_COUNTER(inodes_written),
+    DWARFS_PROFILE_COUNTER(total_bytes_read),
+    DWARFS_PROFILE_COUNTER(saved_by_segmentation),
+    DWARFS_PROFILE_COUNTER(block_count),
+    DWARFS_PROFILE_COUNTER(compressor_input_bytes),
+    DWARFS_PROFILE_COUNTER(blocks_written),
+    DWARFS_PROFILE_COUNTER(compressed_size),
+    DWARFS_PROFILE_COUNTER(filesystem_size),
+};
+
+#undef DWARFS_PROFILE_COUNTER
+
+double get_process_cpu_time() {
+#ifdef _WIN32
+  FILETIME t_create, t_exit, t_sys, t_user;
+  if (::GetProcessTimes(::GetCurrentProcess(), &t_create, &t_exit, &t_sys,
+                        &t_user)) {
+    uint64_t sys = (static_cast<uint64_t>(t_sys.dwHighDateTime) << 32) +
+                   t_sys.dwLowDateTime;
+    uint64_t user = (static_cast<uint64_t>(t_user.dwHighDateTime) << 32) +
+                    t_user.dwLowDateTime;
+    return 1e-7 * (sys + user);
+  }
+#else
+  struct ::timespec ts;
+  if (::clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) == 0) {
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+  }
+#endif
+  return 0.0;
+}
+
+} // namespace
+
+pipeline_profile::pipeline_profile(progress const& prog,
+                                   std::chrono::milliseconds interval)
+    : prog_{prog}
+    , interval_{interval}
+    , start_{clock_type::now()}
+    , cpu_time_start_{get_process_cpu_time()}
+    , samples_{folly::dynamic::array}
+    , thread_{[this] { run(); }} {}
+
+pipeline_profile::~pipeline_profile() noexcept {
+  try {
+    stop();
+  } catch (...) {
+  }
+}
+
+void pipeline_profile::add_worker_group(std::string name,
+                                        worker_group const& wg) {
+  auto cpu = wg.get_cpu_time();
+  std::lock_guard lock(mx_);
+  worker_groups_.push_back({std::move(name), &wg, cpu, cpu});
+}
+
+void pipeline_profile::begin_stage(std::string_view name) {
+  std::lock_guard lock(mx_);
+  end_stage_locked();
+  auto& st = stages_.emplace_back();
+  st.name = name;
+  st.start = elapsed();
+  st.cpu_time = get_process_cpu_time();
+  st.counters_begin = read_counters();
+  current_stage_ = stages_.size() - 1;
+}
+
+void pipeline_profile::end_stage() {
+  std::lock_guard lock(mx_);
+  end_stage_locked();
+}
+
+void pipeline_profile::add_stage_value(std::string_view key, double value) {
+  std::lock_guard lock(mx_);
+  if (current_stage_) {
+    stages_[*current_stage_].values.emplace_back(key, value);
+  }
+}
+
+void pipeline_profile::stop() {
+  {
+    std::lock_guard lock(mx_);
+    if (!running_) {
+      return;
+    }
+    end_stage_locked();
+    sample_locked();
+    wall_time_ = elapsed();
+    cpu_time_ = get_process_cpu_time() - cpu_time_start_;
+    for (auto& twg : worker_groups_) {
+      twg.cpu_time_last = twg.wg->get_cpu_time();
+    }
+    running_ = false;
+  }
+
+  cond_.notify_all();
+  thread_.join();
+}
+
+double pipeline_profile::elapsed() const {
+  return std::chrono::duration<double>(clock_type::now() - start_).count();
+}
+
+auto pipeline_profile::read_counters() const -> counters {
+  counters c;
+  c.values.reserve(profile_counters.size());
+  for (auto const& pc : profile_counters) {
+    c.values.push_back(pc.get(prog_));
+  }
+  return c;
+}
+
+void pipeline_profile::end_stage_locked() {
+  if (current_stage_) {
+    auto& st = stages_[*current_stage_];
+    st.wall_time = elapsed() - st.start;
+    st.cpu_time = get_process_cpu_time() - st.cpu_time;
+    st.counters_end = read_counters();
+    current_stage_.reset();
+  }
+}
+
+void pipeline_profile::sample_locked() {
+  auto now = elapsed();
+  auto dt = now - last_sample_;
+
+  folly::dynamic sample = folly::dynamic::object("time", now)(
+      "blockify_queue", prog_.blockify_queue.load())(
+      "compress_queue", prog_.compress_queue.load());
+
+  if (current_stage_) {
+    sample["stage"] = stages_[*current_stage_].name;
+  }
+
+  folly::dynamic util = folly::dynamic::object;
+
+  for (auto& twg : worker_groups_) {
+    auto cpu = twg.wg->get_cpu_time();
+    if (dt > 0.0) {
+      util[twg.name] = (cpu - twg.cpu_time_last) / (dt * twg.wg->size());
+    }
+    twg.cpu_time_last = cpu;
+  }
+
+  sample["worker_utilisation"] = std::move(util);
+
+  folly::dynamic ctr = folly::dynamic::object;
+  for (auto const& pc : profile_counters) {
+    ctr[pc.name] = pc.get(prog_);
+  }
+
+  sample["counters"] = std::move(ctr);
+
+  samples_.push_back(std::move(sample));
+  last_sample_ = now;
+}
+
+void pipeline_profile::run() {
+  folly::setThreadName("profile");
+
+  std::unique_lock lock(mx_);
+
+  while (running_) {
+    if (!cond_.wait_for(lock, interval_, [this] { return !running_; })) {
+      sample_locked();
+    }
+  }
+}
+
+folly::dynamic pipeline_profile::as_dynamic() const {
+  std::lock_guard lock(mx_);
+
+  folly::dynamic stages = folly::dynamic::array;
+
+  for (auto const& st : stages_) {
+    folly::dynamic ctr = folly::dynamic::object;
+
+    if (!st.counters_end.values.empty()) {
+      for (size_t i = 0; i < profile_counters.size(); ++i) {
+        ctr[profile_counters[i].name] =
+            st.counters_end.values[i] - st.counters_begin.values[i];
+      }
+    }
+
+    folly::dynamic stage = folly::dynamic::object("name", st.name)(
+        "start", st.start)("wall_time", st.wall_time)("cpu_time", st.cpu_time)(
+        "counters", std::move(ctr));
+
+    if (!st.values.empty()) {
+      folly::dynamic values = folly::dynamic::object;
+      for (auto const& [k, v] : st.values) {
+        values[k] = v;
+      }
+      stage["values"] = std::move(values);
+    }
+
+    stages.push_back(std::move(stage));
+  }
+
+  folly::dynamic groups = folly::dynamic::object;
+
+  for (auto const& twg : worker_groups_) {
+    auto cpu = twg.cpu_time_last - twg.cpu_time_begin;
+    auto threads = twg.wg->size();
+    groups[twg.name] = folly::dynamic::object("threads", threads)(
+        "cpu_time", cpu)("utilisation", wall_time_ > 0.0
+                                            ? cpu / (wall_time_ * threads)
+                                            : 0.0);
+  }
+
+  return folly::dynamic::object("version", 1)("wall_time", wall_time_)(
+      "cpu_time", cpu_time_)("stages", std::move(stages))(
+      "worker_groups", std::move(groups))("samples", samples_);
+}
+
+void pipeline_profile::write_json(std::ostream& os) const {
+  os << folly::toPrettyJson(as_dynamic()) << "\n";
+}
+
+} // namespace dwarfs
@@ -25,6 +25,7 @@
 #include <ctime>
 #include <deque>
 #include <iterator>
+#include <map>
 #include <numeric>
 #include <stdexcept>
 #include <string>
@@ -36,11 +37,14 @@
 
 #include <fmt/format.h>
 
+#include "dwarfs/base_image.h"
 #include "dwarfs/block_data.h"
+#include "dwarfs/categorizer.h"
 #include "dwarfs/entry.h"
 #include "dwarfs/error.h"
 #include "dwarfs/file_scanner.h"
 #include "dwarfs/filesystem_writer.h"
+#include "dwarfs/fstypes.h"
 #include "dwarfs/global_entry_data.h"
 #include "dwarfs/inode.h"
 #include "dwarfs/inode_manager.h"
@@ -48,6 +52,7 @@
 #include "dwarfs/metadata_v2.h"
 #include "dwarfs/options.h"
 #include "dwarfs/os_access.h"
+#include "dwarfs/pipeline_profile.h"
 #include "dwarfs/progress.h"
 #include "dwarfs/scanner.h"
 #include "dwarfs/script.h"
@@ -565,7 +570,19 @@ void scanner_<LoggerPolicy>::scan(
 
   prog.set_status_function(status_string);
 
-  inode_manager im(lgr_, prog);
+  if (auto const& base = options_.inode.base; base && !base->layers().empty()) {
+    fsw.set_delta_image();
+  }
+
+  auto stage = [this](char const* name) {
+    if (auto const& profile = options_.profile) {
+      profile->begin_stage(name);
+    }
+  };
+
+  stage("scan");
+
+  inode_manager im(lgr_, prog, wg_);
   detail::file_scanner fs(wg_, *os_, im, options_.inode,
                           options_.file_hash_algorithm, prog);
 
@@ -576,6 +593,12 @@ void scanner_<LoggerPolicy>::scan(
     return;
   }
 
+  if (auto const& base = options_.inode.base) {
+    LOG_INFO << "checking for reusable files in base image...";
+    fs.reuse_base_files();
+    base->copy_blocks(fsw);
+  }
+
   if (options_.remove_empty_dirs) {
     LOG_INFO << "removing empty directories...";
     auto d = dynamic_cast<dir*>(root.get());
@@ -593,11 +616,27 @@ void scanner_<LoggerPolicy>::scan(
   root->accept(lsiv, true);
 
   LOG_INFO << "waiting for background scanners...";
+  stage("hash");
   wg_.wait();
 
   LOG_INFO << "scanning CPU time: " << time_with_unit(wg_.get_cpu_time());
 
+  LOG_INFO << "scanning read " << size_with_unit(prog.hash_bytes_read)
+           << " for hashing, " << size_with_unit(prog.similarity_bytes_read)
+           << " for similarity, " << size_with_unit(prog.fused_bytes_read)
+           << " for both in " << prog.fused_scans << " fused scans";
+
+  if (prog.tree_hash_scans > 0) {
+    LOG_INFO << "hashed " << prog.tree_hash_scans
+             << " large files using tree hashing";
+  }
+
+  if (options_.profile) {
+    options_.profile->add_stage_value("scanner_cpu_time", wg_.get_cpu_time());
+  }
+
   LOG_INFO << "finalizing file inodes...";
+  stage("finalize");
   uint32_t first_device_inode = first_file_inode;
   fs.finalize(first_device_inode);
 
@@ -629,7 +668,7 @@ void scanner_<LoggerPolicy>::scan(
     names_and_symlinks_visitor nlv(ge_data);
     root->accept(nlv);
 
-    ge_data.index();
+    ge_data.index(wg_);
 
     LOG_INFO << "updating name and link indices...";
     root->walk([&](entry* ep) {
@@ -643,29 +682,70 @@ void scanner_<LoggerPolicy>::scan(
   });
 
   LOG_INFO << "building blocks...";
-  block_manager bm(lgr_, prog, cfg_, os_, fsw);
+  stage("order");
+
+  auto const& catmgr = options_.inode.categorizer_mgr;
+
+  // Each category gets its own block manager, running in its own thread.
+  // The filesystem writer takes care of merging the blocks.
+  std::map<fragment_category, block_manager> block_managers;
+  std::map<fragment_category, worker_group> blockify;
 
   {
-    worker_group blockify("blockify", 1, 1 << 20);
+    std::vector<fragment_category> categories;
+
+    if (catmgr) {
+      for (size_t i = 0; i < catmgr->num_categories(); ++i) {
+        categories.push_back(i);
+      }
+      fsw.configure(categories);
+    } else {
+      categories.push_back(categorizer_manager::default_category);
+    }
+
+    for (auto cat : categories) {
+      block_managers.try_emplace(cat, lgr_, prog, cfg_, os_, fsw, cat);
+      blockify.try_emplace(cat, "blockify", 1, 1 << 20);
+    }
+  }
 
+  {
     {
       worker_group ordering("ordering", 1);
 
       ordering.add_job([&] {
-        im.order_inodes(script_, options_.file_order,
-                        [&](std::shared_ptr<inode> const& ino) {
-                          blockify.add_job([&] {
-                            prog.current.store(ino.get());
-                            bm.add_inode(ino);
-                            prog.inodes_written++;
-                          });
-                          auto queued_files = blockify.queue_size();
-                          auto queued_blocks = fsw.queue_fill();
-                          prog.blockify_queue = queued_files;
-                          prog.compress_queue = queued_blocks;
-                          return INT64_C(500) * queued_blocks +
-                                 static_cast<int64_t>(queued_files);
-                        });
+        im.order_inodes(
+            script_, options_.file_order,
+            [&, ordered = false](std::shared_ptr<inode> const& ino) mutable {
+              if (!ordered) {
+                // ordering is done once the first inode is emitted
+                stage("blockify");
+                ordered = true;
+              }
+
+              auto cat = ino->category();
+              auto& bm = block_managers.at(cat);
+              auto& bwg = blockify.at(cat);
+
+              fsw.inode_dispatched(cat);
+
+              bwg.add_job([&, cat] {
+                prog.current.store(ino.get());
+                bm.add_inode(ino);
+                fsw.inode_processed(cat);
+                prog.inodes_written++;
+              });
+
+              size_t queued_files = 0;
+              for (auto const& [c, wg] : blockify) {
+                queued_files += wg.queue_size();
+              }
+              auto queued_blocks = fsw.queue_fill();
+              prog.blockify_queue = queued_files;
+              prog.compress_queue = queued_blocks;
+              return INT64_C(500) * queued_blocks +
+                     static_cast<int64_t>(queued_files);
+            });
       });
 
       ordering.wait();
@@ -673,13 +753,31 @@ void scanner_<LoggerPolicy>::scan(
 
     LOG_INFO << "waiting for segmenting/blockifying to finish...";
 
-    blockify.wait();
+    // Finishing the blocks must happen in the blockify threads, as a
+    // block manager may be waiting for other categories to finish before
+    // it can write more blocks.
+    for (auto& [cat, bwg] : blockify) {
+      bwg.add_job([&bm = block_managers.at(cat)] { bm.finish_blocks(); });
+    }
+
+    double blockify_cpu_time = 0.0;
+
+    for (auto& [cat, bwg] : blockify) {
+      bwg.wait();
+      blockify_cpu_time += bwg.get_cpu_time();
+    }
 
     LOG_INFO << "segmenting/blockifying CPU time: "
-             << time_with_unit(blockify.get_cpu_time());
+             << time_with_unit(blockify_cpu_time);
+
+    if (options_.profile) {
+      options_.profile->add_stage_value("blockify_cpu_time",
+                                        blockify_cpu_time);
+    }
+
+    LOG_INFO << "segmenting read " << size_with_unit(prog.total_bytes_read);
   }
 
-  bm.finish_blocks();
   wg_.wait();
 
   prog.set_status_function([](progress const&, size_t) {
@@ -688,18 +786,58 @@ void scanner_<LoggerPolicy>::scan(
   prog.sync([&] { prog.current.store(nullptr); });
 
   // this is actually needed
-  root->set_name(std::string());
+  root->clear_name();
+
+  stage("metadata");
 
   LOG_INFO << "saving chunks...";
   mv2.chunk_table()->resize(im.count() + 1);
 
   // TODO: we should be able to start this once all blocks have been
   //       submitted for compression
+  std::vector<thrift::metadata::chunk> chunks;
+
+  // in a delta image, our own blocks follow those of the base images
+  auto const& base = options_.inode.base;
+  uint32_t const block_offset = base ? base->block_offset() : 0;
+
   im.for_each_inode_in_order([&](std::shared_ptr<inode> const& ino) {
     DWARFS_NOTHROW(mv2.chunk_table()->at(ino->num())) = mv2.chunks()->size();
-    ino->append_chunks_to(mv2.chunks().value());
+    chunks.clear();
+    ino->append_chunks_to(chunks);
+    if (!ino->reused()) {
+      block_managers.at(ino->category()).map_logical_blocks(chunks);
+      if (block_offset > 0) {
+        for (auto& c : chunks) {
+          c.block() = c.block().value() + block_offset;
+        }
+      }
+    }
+    mv2.chunks()->insert(mv2.chunks()->end(), chunks.begin(), chunks.end());
   });
 
+  if (catmgr) {
+    auto block_categories = fsw.get_block_categories();
+    std::map<fragment_category, size_t> blocks_per_category;
+
+    for (auto cat : block_categories) {
+      ++blocks_per_category[cat];
+    }
+
+    for (auto [cat, count] : blocks_per_category) {
+      LOG_INFO << "category " << catmgr->category_name(cat) << ": " << count
+               << " blocks";
+    }
+
+    mv2.category_names() = catmgr->category_names();
+    mv2.block_categories() = std::move(block_categories);
+  }
+
+  if (auto levels = fsw.get_block_compression_levels(); !levels.empty()) {
+    mv2.adaptive_compression() = fsw.get_adaptive_compression();
+    mv2.block_compression_levels() = std::move(levels);
+  }
+
   // insert dummy inode to help determine number of chunks per inode
   DWARFS_NOTHROW(mv2.chunk_table()->at(im.count())) = mv2.chunks()->size();
 
@@ -756,9 +894,10 @@ void scanner_<LoggerPolicy>::scan(
   } else {
     auto ti = LOG_TIMED_INFO;
     mv2.compact_names() = string_table::pack(
-        ge_data.get_names(), string_table::pack_options(
-                                 options_.pack_names, options_.pack_names_index,
-                                 options_.force_pack_string_tables));
+        wg_, ge_data.get_names(),
+        string_table::pack_options(options_.pack_names,
+                                   options_.pack_names_index,
+                                   options_.force_pack_string_tables));
     ti << "saving names table...";
   }
 
@@ -767,7 +906,7 @@ void scanner_<LoggerPolicy>::scan(
   } else {
     auto ti = LOG_TIMED_INFO;
     mv2.compact_symlinks() = string_table::pack(
-        ge_data.get_symlinks(),
+        wg_, ge_data.get_symlinks(),
         string_table::pack_options(options_.pack_symlinks,
                                    options_.pack_symlinks_index,
                                    options_.force_pack_string_tables));
@@ -789,15 +928,48 @@ void scanner_<LoggerPolicy>::scan(
   mv2.preferred_path_separator() =
       static_cast<uint32_t>(std::filesystem::path::preferred_separator);
 
+  if (base) {
+    if (auto layers = base->layers(); !layers.empty()) {
+      std::vector<thrift::metadata::base_image_ref> refs;
+      for (auto const& l : layers) {
+        auto& ref = refs.emplace_back();
+        ref.checksum() = l.checksum;
+        ref.block_count() = l.block_count;
+      }
+      mv2.base_images() = std::move(refs);
+    }
+  }
+
   auto [schema, data] = metadata_v2::freeze(mv2);
 
   fsw.write_metadata_v2_schema(std::make_shared<block_data>(std::move(schema)));
   fsw.write_metadata_v2(std::make_shared<block_data>(std::move(data)));
 
   LOG_INFO << "waiting for compression to finish...";
+  stage("compress");
 
   fsw.flush();
 
+  if (prog.incompressible_files > 0) {
+    LOG_INFO << "stored " << size_with_unit(prog.incompressible_bytes)
+             << " from " << prog.incompressible_files
+             << " incompressible files in " << prog.incompressible_blocks
+             << " uncompressed blocks";
+
+    if (prog.compressor_input_bytes > 0) {
+      auto sec_per_byte = 1e-9 * prog.compressor_time_ns /
+                          prog.compressor_input_bytes;
+      LOG_INFO << "estimated compression time saved: "
+               << time_with_unit(sec_per_byte * prog.incompressible_bytes);
+    }
+  }
+
+  if (prog.bad_compression_blocks > 0) {
+    LOG_INFO << prog.bad_compression_blocks << " blocks ("
+             << size_with_unit(prog.bad_compression_bytes)
+             << ") did not compress well and were stored uncompressed";
+  }
+
   LOG_INFO << "compressed " << size_with_unit(prog.original_size) << " to "
            << size_with_unit(prog.compressed_size) << " (ratio="
            << static_cast<double>(prog.compressed_size) / prog.original_size
@@ -29,6 +29,7 @@
 #include "dwarfs/error.h"
 #include "dwarfs/logger.h"
 #include "dwarfs/string_table.h"
+#include "dwarfs/worker_group.h"
 
 namespace dwarfs {
 
@@ -183,17 +184,30 @@ string_table::string_table(logger& lgr, std::string_view name,
                            PackedTableView v)
     : impl_{build_string_table(lgr, name, v)} {}
 
+namespace {
+
+// Strings are compressed in shards of a fixed number of strings. This
+// allows for the shards to be compressed in parallel while ensuring that
+// the output is identical no matter how many threads are used.
+constexpr size_t const kPackShardSize{1 << 16};
+
+struct fsst_shard {
+  std::string buffer;
+  size_t num_compressed{0};
+};
+
+} // namespace
+
 template <typename T>
 thrift::metadata::string_table
 string_table::pack_generic(std::span<T const> input,
-                           pack_options const& options) {
+                           pack_options const& options, worker_group* wg) {
   auto size = input.size();
   bool pack_data = options.pack_data;
   size_t total_input_size = 0;
   std::string buffer;
   std::string symtab;
   std::vector<size_t> out_len_vec;
-  std::vector<unsigned char*> out_ptr_vec;
 
   if (input.empty()) {
     pack_data = false;
@@ -213,6 +227,8 @@ string_table::pack_generic(std::span<T const> input,
       total_input_size += s.size();
     }
 
+    // FSST only trains its symbol table on a small, deterministic sample
+    // of the input, so this is cheap even for huge tables.
     std::unique_ptr<::fsst_encoder_t, decltype(&::fsst_destroy)> enc{
         ::fsst_create(size, len_vec.data(), ptr_vec.data(), 0),
         &::fsst_destroy};
@@ -224,27 +240,81 @@ string_table::pack_generic(std::span<T const> input,
     symtab.resize(symtab_size);
 
     if (symtab.size() < total_input_size or options.force_pack_data) {
+      auto num_shards = (size + kPackShardSize - 1) / kPackShardSize;
+      std::vector<fsst_shard> shards(num_shards);
+
       out_len_vec.resize(size);
-      out_ptr_vec.resize(size);
 
-      buffer.resize(options.force_pack_data ? total_input_size
-                                            : total_input_size - symtab.size());
-      size_t num_compressed = 0;
+      auto compress_shard = [&](size_t shard_index) {
+        auto& shard = shards[shard_index];
+        auto first = shard_index * kPackShardSize;
+        auto count = std::min(kPackShardSize, size - first);
+        auto shard_input_size =
+            std::accumulate(len_vec.begin() + first,
+                            len_vec.begin() + first + count, size_t(0));
+        std::vector<unsigned char*> out_ptr_vec(count);
+
+        // each thread needs its own encoder, which shares the symbol table
+        std::unique_ptr<::fsst_encoder_t, decltype(&::fsst_destroy)> shard_enc{
+            ::fsst_duplicate(enc.get()), &::fsst_destroy};
+
+        shard.buffer.resize(shard_input_size + 16);
+
+        for (;;) {
+          shard.num_compressed = ::fsst_compress(
+              shard_enc.get(), count, len_vec.data() + first,
+              ptr_vec.data() + first, shard.buffer.size(),
+              reinterpret_cast<unsigned char*>(shard.buffer.data()),
+              out_len_vec.data() + first, out_ptr_vec.data());
+
+          if (shard.num_compressed == count) {
+            break;
+          }
+
+          shard.buffer.resize(2 * shard.buffer.size());
+        }
+
+        size_t compressed_size =
+            (out_ptr_vec.back() - out_ptr_vec.front()) +
+            out_len_vec[first + count - 1];
 
-      do {
-        num_compressed = ::fsst_compress(
-            enc.get(), size, len_vec.data(), ptr_vec.data(), buffer.size(),
-            reinterpret_cast<unsigned char*>(buffer.data()), out_len_vec.data(),
-            out_ptr_vec.data());
+        DWARFS_CHECK(reinterpret_cast<char*>(out_ptr_vec.front()) ==
+                         shard.buffer.data(),
+                     "string table compression pointer mismatch");
 
-        if (num_compressed == size) {
-          break;
+        shard.buffer.resize(compressed_size);
+      };
+
+      if (wg) {
+        wg->parallel_for(num_shards, compress_shard);
+      } else {
+        for (size_t i = 0; i < num_shards; ++i) {
+          compress_shard(i);
         }
+      }
 
-        buffer.resize(2 * buffer.size());
-      } while (options.force_pack_data);
+      size_t compressed_size = 0;
 
-      pack_data = num_compressed == size;
+      for (auto const& shard : shards) {
+        compressed_size += shard.buffer.size();
+      }
+
+      // TODO: only enable this in debug mode
+      DWARFS_CHECK(compressed_size == std::accumulate(out_len_vec.begin(),
+                                                      out_len_vec.end(),
+                                                      static_cast<size_t>(0)),
+                   "string table compression pointer mismatch");
+
+      pack_data = options.force_pack_data ||
+                  compressed_size + symtab.size() <= total_input_size;
+
+      if (pack_data) {
+        buffer.reserve(compressed_size);
+        for (auto& shard : shards) {
+          buffer += shard.buffer;
+          std::string().swap(shard.buffer);
+        }
+      }
     } else {
       pack_data = false;
     }
@@ -258,18 +328,6 @@ string_table::pack_generic(std::span<T const> input,
 
   if (pack_data) {
     // store compressed
-    size_t compressed_size =
-        (out_ptr_vec.back() - out_ptr_vec.front()) + out_len_vec.back();
-
-    DWARFS_CHECK(reinterpret_cast<char*>(out_ptr_vec.front()) == buffer.data(),
-                 "string table compression pointer mismatch");
-    // TODO: only enable this in debug mode
-    DWARFS_CHECK(compressed_size == std::accumulate(out_len_vec.begin(),
-                                                    out_len_vec.end(),
-                                                    static_cast<size_t>(0)),
-                 "string table compression pointer mismatch");
-
-    buffer.resize(compressed_size);
     output.buffer()->swap(buffer);
     output.symtab() = std::move(symtab);
     output.index()->resize(size);
@@ -298,13 +356,25 @@ string_table::pack_generic(std::span<T const> input,
 thrift::metadata::string_table
 string_table::pack(std::span<std::string const> input,
                    pack_options const& options) {
-  return pack_generic(input, options);
+  return pack_generic(input, options, nullptr);
 }
 
 thrift::metadata::string_table
 string_table::pack(std::span<std::string_view const> input,
                    pack_options const& options) {
-  return pack_generic(input, options);
+  return pack_generic(input, options, nullptr);
+}
+
+thrift::metadata::string_table
+string_table::pack(worker_group& wg, std::span<std::string const> input,
+                   pack_options const& options) {
+  return pack_generic(input, options, &wg);
+}
+
+thrift::metadata::string_table
+string_table::pack(worker_group& wg, std::span<std::string_view const> input,
+                   pack_options const& options) {
+  return pack_generic(input, options, &wg);
 }
 
 } // namespace dwarfs
@@ -31,6 +31,13 @@
 #endif
 
 #include <folly/String.h>
+#include <folly/portability/Windows.h>
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
 
 #include "dwarfs/error.h"
 #include "dwarfs/util.h"
@@ -201,4 +208,23 @@ bool getenv_is_enabled(char const* var) {
   return false;
 }
 
+std::optional<size_t> peak_rss() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS pmc;
+  if (::GetProcessMemoryInfo(::GetCurrentProcess(), &pmc, sizeof(pmc))) {
+    return pmc.PeakWorkingSetSize;
+  }
+#else
+  struct ::rusage ru;
+  if (::getrusage(RUSAGE_SELF, &ru) == 0) {
+#ifdef __APPLE__
+    return ru.ru_maxrss;
+#else
+    return static_cast<size_t>(ru.ru_maxrss) * 1024;
+#endif
+  }
+#endif
+  return std::nullopt;
+}
+
 } // namespace dwarfs
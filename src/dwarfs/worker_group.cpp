@@ -20,13 +20,20 @@
  */
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <cstdint>
 #include <cstring>
 #include <ctime>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <latch>
 #include <mutex>
 #include <queue>
+#include <set>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <type_traits>
 #include <vector>
@@ -46,11 +53,13 @@
 #endif
 
 #include <folly/Conv.h>
+#include <folly/String.h>
 #include <folly/portability/PThread.h>
 #include <folly/portability/Windows.h>
 #include <folly/system/ThreadName.h>
 
 #include "dwarfs/error.h"
+#include "dwarfs/logger.h"
 #include "dwarfs/semaphore.h"
 #include "dwarfs/util.h"
 #include "dwarfs/worker_group.h"
@@ -125,15 +134,219 @@ double get_thread_cpu_time(std::thread const& t) {
 
 #endif
 
+void set_thread_niceness(int niceness) {
+  if (niceness > 0) {
+#ifdef _WIN32
+    auto hthr = ::GetCurrentThread();
+    int priority =
+        niceness > 5 ? THREAD_PRIORITY_LOWEST : THREAD_PRIORITY_BELOW_NORMAL;
+    ::SetThreadPriority(hthr, priority);
+#else
+    // XXX:
+    // According to POSIX, the nice value is a per-process setting. However,
+    // under the current Linux/NPTL implementation of POSIX threads, the nice
+    // value is a per-thread attribute: different threads in the same process
+    // can have different nice values. Portable applications should avoid
+    // relying on the Linux behavior, which may be made standards conformant
+    // in the future.
+    auto rv [[maybe_unused]] = ::nice(niceness);
+#endif
+  }
+}
+
+void set_thread_affinity(logger* lgr [[maybe_unused]],
+                         std::vector<int> const& cpus [[maybe_unused]]) {
+#ifdef __linux__
+  if (!cpus.empty()) {
+    ::cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto cpu : cpus) {
+      CPU_SET(cpu, &set);
+    }
+    // This runs inside the worker thread, where an exception would
+    // terminate the program, and the thread is still perfectly usable
+    // without the affinity anyway.
+    if (auto rv = ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+        rv != 0 && lgr) {
+      LOG_PROXY(debug_logger_policy, *lgr);
+      LOG_WARN << "failed to set worker thread affinity: "
+               << std::strerror(rv);
+    }
+  }
+#endif
+}
+
+void run_job(worker_group::job_t& job, bool is_background [[maybe_unused]]) {
+#ifdef _WIN32
+  auto hthr = ::GetCurrentThread();
+  if (is_background) {
+    ::SetThreadPriority(hthr, THREAD_MODE_BACKGROUND_BEGIN);
+  }
+#endif
+  job();
+#ifdef _WIN32
+  if (is_background) {
+    ::SetThreadPriority(hthr, THREAD_MODE_BACKGROUND_END);
+  }
+#endif
+}
+
+// Parse a Linux CPU list, e.g. "0-3,8,10-11"
+std::vector<int> parse_cpu_list(std::string_view list) {
+  std::vector<int> cpus;
+  std::vector<std::string_view> ranges;
+
+  folly::split(',', folly::trimWhitespace(list), ranges);
+
+  for (auto r : ranges) {
+    if (r.empty()) {
+      continue;
+    }
+
+    std::string_view first, last;
+
+    if (folly::split('-', r, first, last)) {
+      auto a = folly::to<int>(first);
+      auto b = folly::to<int>(last);
+      for (int cpu = a; cpu <= b; ++cpu) {
+        cpus.push_back(cpu);
+      }
+    } else {
+      cpus.push_back(folly::to<int>(r));
+    }
+  }
+
+  return cpus;
+}
+
+std::vector<int>
+get_worker_cpus(worker_group_options const& options [[maybe_unused]]) {
+  std::vector<int> cpus;
+
+#ifdef __linux__
+  if (options.numa_node) {
+    auto path = folly::to<std::string>("/sys/devices/system/node/node",
+                                       *options.numa_node, "/cpulist");
+    std::ifstream ifs(path);
+    std::string list;
+
+    if (!ifs || !std::getline(ifs, list)) {
+      DWARFS_THROW(runtime_error,
+                   folly::to<std::string>("cannot read CPUs of NUMA node ",
+                                          *options.numa_node));
+    }
+
+    cpus = parse_cpu_list(list);
+
+    if (!options.cpus.empty()) {
+      std::set<int> allowed(options.cpus.begin(), options.cpus.end());
+      std::erase_if(cpus, [&](int cpu) { return allowed.count(cpu) == 0; });
+    }
+
+    if (cpus.empty()) {
+      DWARFS_THROW(runtime_error, "no usable CPUs for worker group");
+    }
+  } else {
+    cpus = options.cpus;
+  }
+#endif
+
+  return cpus;
+}
+
+/**
+ * Bounded single-owner work-stealing deque
+ *
+ * This is the Chase-Lev deque as described in "Correct and Efficient
+ * Work-Stealing for Weak Memory Models" (Le et al., PPoPP 2013), but
+ * with a fixed capacity. The owner pushes and pops at the bottom
+ * without taking any locks, thieves steal from the top.
+ */
+template <typename T>
+class work_stealing_deque {
+ public:
+  explicit work_stealing_deque(size_t capacity)
+      : buffer_(capacity)
+      , mask_(capacity - 1) {
+    DWARFS_CHECK((capacity & mask_) == 0, "capacity must be a power of two");
+  }
+
+  // owner only
+  bool push(T* item) {
+    auto b = bottom_.load(std::memory_order_relaxed);
+    auto t = top_.load(std::memory_order_acquire);
+
+    if (b - t >= static_cast<int64_t>(buffer_.size())) {
+      return false;
+    }
+
+    buffer_[b & mask_].store(item, std::memory_order_relaxed);
+    bottom_.store(b + 1, std::memory_order_release);
+
+    return true;
+  }
+
+  // owner only
+  T* pop() {
+    auto b = bottom_.load(std::memory_order_relaxed) - 1;
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto t = top_.load(std::memory_order_relaxed);
+
+    T* item = nullptr;
+
+    if (t <= b) {
+      item = buffer_[b & mask_].load(std::memory_order_relaxed);
+
+      if (t == b) {
+        // last item, race against thieves
+        if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                          std::memory_order_relaxed)) {
+          item = nullptr;
+        }
+        bottom_.store(b + 1, std::memory_order_relaxed);
+      }
+    } else {
+      bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+
+    return item;
+  }
+
+  // any thread
+  T* steal() {
+    auto t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto b = bottom_.load(std::memory_order_acquire);
+
+    if (t < b) {
+      T* item = buffer_[t & mask_].load(std::memory_order_relaxed);
+
+      if (top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed)) {
+        return item;
+      }
+    }
+
+    return nullptr;
+  }
+
+ private:
+  std::vector<std::atomic<T*>> buffer_;
+  size_t const mask_;
+  alignas(64) std::atomic<int64_t> top_{0};
+  alignas(64) std::atomic<int64_t> bottom_{0};
+};
+
 } // namespace
 
 template <typename Policy>
 class basic_worker_group final : public worker_group::impl, private Policy {
  public:
   template <typename... Args>
-  basic_worker_group(const char* group_name, size_t num_workers,
+  basic_worker_group(logger* lgr, const char* group_name, size_t num_workers,
                      size_t max_queue_len, int niceness [[maybe_unused]],
-                     Args&&... args)
+                     std::vector<int> const& cpus, Args&&... args)
       : Policy(std::forward<Args>(args)...)
       , running_(true)
       , pending_(0)
@@ -147,9 +360,10 @@ class basic_worker_group final : public worker_group::impl, private Policy {
     }
 
     for (size_t i = 0; i < num_workers; ++i) {
-      workers_.emplace_back([this, niceness, group_name, i] {
+      workers_.emplace_back([this, lgr, niceness, group_name, i, cpus] {
         folly::setThreadName(folly::to<std::string>(group_name, i + 1));
         set_thread_niceness(niceness);
+        set_thread_affinity(lgr, cpus);
         do_work(niceness > 10);
       });
     }
@@ -259,31 +473,7 @@ class basic_worker_group final : public worker_group::impl, private Policy {
  private:
   using jobs_t = std::queue<worker_group::job_t>;
 
-  // TODO: move out of this class
-  static void set_thread_niceness(int niceness) {
-    if (niceness > 0) {
-#ifdef _WIN32
-      auto hthr = ::GetCurrentThread();
-      int priority =
-          niceness > 5 ? THREAD_PRIORITY_LOWEST : THREAD_PRIORITY_BELOW_NORMAL;
-      ::SetThreadPriority(hthr, priority);
-#else
-      // XXX:
-      // According to POSIX, the nice value is a per-process setting. However,
-      // under the current Linux/NPTL implementation of POSIX threads, the nice
-      // value is a per-thread attribute: different threads in the same process
-      // can have different nice values. Portable applications should avoid
-      // relying on the Linux behavior, which may be made standards conformant
-      // in the future.
-      auto rv [[maybe_unused]] = ::nice(niceness);
-#endif
-    }
-  }
-
-  void do_work(bool is_background [[maybe_unused]]) {
-#ifdef _WIN32
-    auto hthr = ::GetCurrentThread();
-#endif
+  void do_work(bool is_background) {
     for (;;) {
       worker_group::job_t job;
 
@@ -309,17 +499,7 @@ class basic_worker_group final : public worker_group::impl, private Policy {
 
       {
         typename Policy::task task(this);
-#ifdef _WIN32
-        if (is_background) {
-          ::SetThreadPriority(hthr, THREAD_MODE_BACKGROUND_BEGIN);
-        }
-#endif
-        job();
-#ifdef _WIN32
-        if (is_background) {
-          ::SetThreadPriority(hthr, THREAD_MODE_BACKGROUND_END);
-        }
-#endif
+        run_job(job, is_background);
       }
 
       {
@@ -343,6 +523,327 @@ class basic_worker_group final : public worker_group::impl, private Policy {
   const size_t max_queue_len_;
 };
 
+/**
+ * Work stealing worker group
+ *
+ * Each worker owns a lock-free deque for jobs submitted from within
+ * that worker and a small locked inbox for jobs submitted from other
+ * threads. External jobs are distributed round-robin across the
+ * inboxes. A worker first looks at its own deque and inbox and then
+ * tries to steal from its peers, so there's no single lock that all
+ * threads are contending for. Idle workers go to sleep and are only
+ * woken up if there are any sleeping workers at all.
+ */
+template <typename Policy>
+class work_stealing_worker_group final : public worker_group::impl,
+                                         private Policy {
+ public:
+  template <typename... Args>
+  work_stealing_worker_group(logger* lgr, const char* group_name,
+                             size_t num_workers, size_t max_queue_len,
+                             int niceness, std::vector<int> const& cpus,
+                             Args&&... args)
+      : Policy(std::forward<Args>(args)...)
+      , running_(true)
+      , max_queue_len_(max_queue_len) {
+    if (num_workers < 1) {
+      DWARFS_THROW(runtime_error, "invalid number of worker threads");
+    }
+
+    if (!group_name) {
+      group_name = "worker";
+    }
+
+    for (size_t i = 0; i < num_workers; ++i) {
+      queues_.emplace_back(std::make_unique<worker_queue>());
+    }
+
+    for (size_t i = 0; i < num_workers; ++i) {
+      workers_.emplace_back([this, lgr, niceness, group_name, i, cpus] {
+        folly::setThreadName(folly::to<std::string>(group_name, i + 1));
+        set_thread_niceness(niceness);
+        set_thread_affinity(lgr, cpus);
+        do_work(i, niceness > 10);
+      });
+    }
+  }
+
+  work_stealing_worker_group(const work_stealing_worker_group&) = delete;
+  work_stealing_worker_group&
+  operator=(const work_stealing_worker_group&) = delete;
+
+  ~work_stealing_worker_group() noexcept override {
+    try {
+      stop();
+    } catch (...) {
+    }
+  }
+
+  void stop() override {
+    if (running_) {
+      {
+        std::lock_guard lock(sleep_mx_);
+        running_ = false;
+      }
+
+      sleep_cv_.notify_all();
+
+      {
+        std::lock_guard lock(mx_);
+      }
+
+      space_.notify_all();
+
+      for (auto& w : workers_) {
+        w.join();
+      }
+    }
+  }
+
+  void wait() override {
+    if (running_) {
+      std::unique_lock lock(mx_);
+      wait_.wait(lock, [&] { return pending_ == 0; });
+    }
+  }
+
+  bool running() const override { return running_; }
+
+  bool add_job(worker_group::job_t&& job) override {
+    if (!running_) {
+      return false;
+    }
+
+    if (!reserve_slot()) {
+      bool reserved = false;
+
+      std::unique_lock lock(mx_);
+      ++blocked_;
+      space_.wait(lock, [this, &reserved] {
+        return !running_ || (reserved = reserve_slot());
+      });
+      --blocked_;
+
+      if (!reserved) {
+        return false;
+      }
+    }
+
+    ++pending_;
+
+    if (current_group == this) {
+      auto p = std::make_unique<worker_group::job_t>(std::move(job));
+      if (queues_[current_index]->local.push(p.get())) {
+        p.release();
+      } else {
+        push_inbox(current_index, std::move(*p));
+      }
+    } else {
+      push_inbox(next_queue_++ % queues_.size(), std::move(job));
+    }
+
+    if (sleepers_ > 0) {
+      {
+        std::lock_guard lock(sleep_mx_);
+      }
+      sleep_cv_.notify_one();
+    }
+
+    return true;
+  }
+
+  size_t size() const override { return workers_.size(); }
+
+  size_t queue_size() const override { return queued_; }
+
+  double get_cpu_time() const override {
+    double t = 0.0;
+
+    for (auto const& w : workers_) {
+      t += get_thread_cpu_time(w);
+    }
+
+    return t;
+  }
+
+ private:
+  static constexpr size_t local_queue_capacity = 1024;
+  static constexpr std::chrono::microseconds retry_backoff{50};
+
+  struct worker_queue {
+    worker_queue()
+        : local(local_queue_capacity) {}
+
+    work_stealing_deque<worker_group::job_t> local;
+    std::mutex mx;
+    std::deque<worker_group::job_t> inbox;
+    std::atomic<size_t> inbox_size{0};
+  };
+
+  void push_inbox(size_t index, worker_group::job_t&& job) {
+    auto& q = *queues_[index];
+    std::lock_guard lock(q.mx);
+    q.inbox.emplace_back(std::move(job));
+    ++q.inbox_size;
+  }
+
+  static bool pop_inbox(worker_queue& q, std::unique_lock<std::mutex>& lock,
+                        worker_group::job_t& job) {
+    if (lock.owns_lock() && !q.inbox.empty()) {
+      job = std::move(q.inbox.front());
+      q.inbox.pop_front();
+      --q.inbox_size;
+      return true;
+    }
+    return false;
+  }
+
+  static bool take_local(worker_group::job_t* p, worker_group::job_t& job) {
+    if (p) {
+      std::unique_ptr<worker_group::job_t> owned(p);
+      job = std::move(*owned);
+      return true;
+    }
+    return false;
+  }
+
+  bool try_get_job(size_t index, worker_group::job_t& job) {
+    auto& own = *queues_[index];
+
+    if (take_local(own.local.pop(), job)) {
+      return true;
+    }
+
+    if (own.inbox_size > 0) {
+      std::unique_lock lock(own.mx);
+      if (pop_inbox(own, lock, job)) {
+        return true;
+      }
+    }
+
+    worker_queue* contended = nullptr;
+
+    for (size_t i = 1; i < queues_.size(); ++i) {
+      auto& victim = *queues_[(index + i) % queues_.size()];
+
+      if (take_local(victim.local.steal(), job)) {
+        return true;
+      }
+
+      if (victim.inbox_size > 0) {
+        std::unique_lock lock(victim.mx, std::try_to_lock);
+        if (pop_inbox(victim, lock, job)) {
+          return true;
+        }
+        if (!lock.owns_lock() && !contended) {
+          contended = &victim;
+        }
+      }
+    }
+
+    // We've only found work in an inbox that was locked at the time. The
+    // lock is only ever held for a push or pop, so rather than going round
+    // in circles, just wait for it.
+    if (contended) {
+      std::unique_lock lock(contended->mx);
+      return pop_inbox(*contended, lock, job);
+    }
+
+    return false;
+  }
+
+  // Concurrent producers may all see a free slot, so the slot has to
+  // be taken in the same atomic step as the check.
+  bool reserve_slot() {
+    auto n = queued_.load();
+
+    while (n < max_queue_len_) {
+      if (queued_.compare_exchange_weak(n, n + 1)) {
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  void do_work(size_t index, bool is_background) {
+    current_group = this;
+    current_index = index;
+
+    for (;;) {
+      worker_group::job_t job;
+
+      if (try_get_job(index, job)) {
+        if (--queued_ < max_queue_len_ && blocked_ > 0) {
+          {
+            std::lock_guard lock(mx_);
+          }
+          space_.notify_one();
+        }
+
+        {
+          typename Policy::task task(this);
+          run_job(job, is_background);
+        }
+
+        if (--pending_ == 0) {
+          {
+            std::lock_guard lock(mx_);
+          }
+          wait_.notify_all();
+        }
+
+        continue;
+      }
+
+      // Nothing to do right now. If there are still queued jobs, we were
+      // just unlucky and lost a race (e.g. a job has been counted, but not
+      // yet pushed), so back off briefly and try again. Otherwise, sleep
+      // until new jobs are added.
+      std::unique_lock lock(sleep_mx_);
+
+      if (!running_ && queued_ == 0) {
+        break;
+      }
+
+      ++sleepers_;
+      if (queued_ > 0) {
+        sleep_cv_.wait_for(lock, retry_backoff);
+      } else {
+        sleep_cv_.wait(lock, [this] { return queued_ > 0 || !running_; });
+      }
+      --sleepers_;
+    }
+
+    current_group = nullptr;
+  }
+
+  static thread_local work_stealing_worker_group const* current_group;
+  static thread_local size_t current_index;
+
+  std::vector<std::thread> workers_;
+  std::vector<std::unique_ptr<worker_queue>> queues_;
+  std::mutex mx_;
+  std::condition_variable space_;
+  std::condition_variable wait_;
+  std::mutex sleep_mx_;
+  std::condition_variable sleep_cv_;
+  std::atomic<bool> running_;
+  std::atomic<size_t> pending_{0};
+  std::atomic<size_t> queued_{0};
+  std::atomic<size_t> sleepers_{0};
+  std::atomic<size_t> blocked_{0};
+  std::atomic<size_t> next_queue_{0};
+  const size_t max_queue_len_;
+};
+
+template <typename Policy>
+thread_local work_stealing_worker_group<Policy> const*
+    work_stealing_worker_group<Policy>::current_group{nullptr};
+
+template <typename Policy>
+thread_local size_t work_stealing_worker_group<Policy>::current_index{0};
+
 class no_policy {
  public:
   class task {
@@ -354,6 +855,76 @@ class no_policy {
 worker_group::worker_group(const char* group_name, size_t num_workers,
                            size_t max_queue_len, int niceness)
     : impl_{std::make_unique<basic_worker_group<no_policy>>(
-          group_name, num_workers, max_queue_len, niceness)} {}
+          nullptr, group_name, num_workers, max_queue_len, niceness,
+          std::vector<int>())} {}
+
+worker_group::worker_group(logger& lgr, const char* group_name,
+                           size_t num_workers, size_t max_queue_len,
+                           int niceness, worker_group_options const& options) {
+  auto cpus = get_worker_cpus(options);
+
+  switch (options.scheduler) {
+  case worker_group_scheduler::SHARED_QUEUE:
+    impl_ = std::make_unique<basic_worker_group<no_policy>>(
+        &lgr, group_name, num_workers, max_queue_len, niceness, cpus);
+    break;
+
+  case worker_group_scheduler::WORK_STEALING:
+    impl_ = std::make_unique<work_stealing_worker_group<no_policy>>(
+        &lgr, group_name, num_workers, max_queue_len, niceness, cpus);
+    break;
+  }
+}
+
+void worker_group::parallel_for(size_t count,
+                                std::function<void(size_t)> const& fn) {
+  if (count == 0) {
+    return;
+  }
+
+  struct state {
+    explicit state(size_t count)
+        : done(count) {}
+
+    std::atomic<size_t> next{0};
+    std::latch done;
+    std::mutex mx;
+    std::exception_ptr error;
+  };
+
+  // Helper jobs may only get to run after we've returned, so everything
+  // they touch without having claimed an index must be kept alive by them.
+  auto st = std::make_shared<state>(count);
+
+  auto run = [st, count, &fn] {
+    size_t i;
+    while ((i = st->next.fetch_add(1)) < count) {
+      try {
+        fn(i);
+      } catch (...) {
+        std::lock_guard lock(st->mx);
+        if (!st->error) {
+          st->error = std::current_exception();
+        }
+      }
+      st->done.count_down();
+    }
+  };
+
+  if (impl_) {
+    auto workers = std::min(size(), count);
+    for (size_t i = 1; i < workers; ++i) {
+      add_job(run);
+    }
+  }
+
+  run();
+
+  st->done.wait();
+
+  if (st->error) {
+    std::rethrow_exception(st->error);
+  }
+}
 
 } // namespace dwarfs
@@ -21,7 +21,9 @@
 
 #include <array>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -63,6 +65,7 @@
 #define DWARFS_FSP_COMPAT
 #endif
 
+#include "dwarfs/access_profile.h"
 #include "dwarfs/error.h"
 #include "dwarfs/file_stat.h"
 #include "dwarfs/filesystem_v2.h"
@@ -70,7 +73,9 @@
 #include "dwarfs/iovec_read_buf.h"
 #include "dwarfs/logger.h"
 #include "dwarfs/metadata_v2.h"
+#include "dwarfs/metrics_server.h"
 #include "dwarfs/mmap.h"
+#include "dwarfs/openmetrics.h"
 #include "dwarfs/options.h"
 #include "dwarfs/performance_monitor.h"
 #include "dwarfs/tool.h"
@@ -93,6 +98,12 @@ using native_off_t = ::off_t;
 
 namespace dwarfs {
 
+#ifdef _WIN32
+constexpr char const base_image_separator{';'};
+#else
+constexpr char const base_image_separator{':'};
+#endif
+
 struct options {
   std::filesystem::path progname;
   std::filesystem::path fsimage;
@@ -106,10 +117,16 @@ struct options {
   char const* cache_tidy_strategy_str{nullptr}; // TODO: const?? -> use string?
   char const* cache_tidy_interval_str{nullptr}; // TODO: const?? -> use string?
   char const* cache_tidy_max_age_str{nullptr};  // TODO: const?? -> use string?
+  char const* metrics_socket_str{nullptr};      // TODO: const?? -> use string?
+  char const* base_images_str{nullptr};         // TODO: const?? -> use string?
+  char const* access_profile_str{nullptr};      // TODO: const?? -> use string?
 #if DWARFS_PERFMON_ENABLED
   char const* perfmon_enabled_str{nullptr}; // TODO: const?? -> use string?
+  char const* perfmon_trace_str{nullptr};   // TODO: const?? -> use string?
 #endif
   int enable_nlink{0};
+  int lazy_init{0};
+  int demand_paged{0};
   int readonly{0};
   int cache_image{0};
   int cache_files{0};
@@ -118,9 +135,11 @@ struct options {
   mlock_mode lock_mode{mlock_mode::NONE};
   double decompress_ratio{0.0};
   logger::level_type debuglevel{logger::level_type::ERROR};
+  std::filesystem::path access_profile;
   cache_tidy_strategy block_cache_tidy_strategy{cache_tidy_strategy::NONE};
   std::chrono::milliseconds block_cache_tidy_interval{std::chrono::minutes(5)};
   std::chrono::milliseconds block_cache_tidy_max_age{std::chrono::minutes{10}};
+  std::optional<std::chrono::milliseconds> perfmon_trace_threshold;
 };
 
 struct dwarfs_userdata {
@@ -131,6 +150,8 @@ struct dwarfs_userdata {
   stream_logger lgr;
   filesystem_v2 fs;
   std::shared_ptr<performance_monitor> perfmon;
+  std::unique_ptr<metrics_server> metrics;
+  std::unique_ptr<access_recorder> recorder;
   PERFMON_EXT_PROXY_DECL
   PERFMON_EXT_TIMER_DECL(op_init)
   PERFMON_EXT_TIMER_DECL(op_lookup)
@@ -139,6 +160,7 @@ struct dwarfs_userdata {
   PERFMON_EXT_TIMER_DECL(op_readlink)
   PERFMON_EXT_TIMER_DECL(op_open)
   PERFMON_EXT_TIMER_DECL(op_read)
+  PERFMON_EXT_TIMER_DECL(op_read_reply)
   PERFMON_EXT_TIMER_DECL(op_readdir)
   PERFMON_EXT_TIMER_DECL(op_statfs)
   PERFMON_EXT_TIMER_DECL(op_getxattr)
@@ -161,7 +183,12 @@ constexpr struct ::fuse_opt dwarfs_opts[] = {
     DWARFS_OPT("tidy_strategy=%s", cache_tidy_strategy_str, 0),
     DWARFS_OPT("tidy_interval=%s", cache_tidy_interval_str, 0),
     DWARFS_OPT("tidy_max_age=%s", cache_tidy_max_age_str, 0),
+    DWARFS_OPT("metrics_socket=%s", metrics_socket_str, 0),
+    DWARFS_OPT("base_images=%s", base_images_str, 0),
+    DWARFS_OPT("access_profile=%s", access_profile_str, 0),
     DWARFS_OPT("enable_nlink", enable_nlink, 1),
+    DWARFS_OPT("lazy_init", lazy_init, 1),
+    DWARFS_OPT("demand_paged", demand_paged, 1),
     DWARFS_OPT("readonly", readonly, 1),
     DWARFS_OPT("cache_image", cache_image, 1),
     DWARFS_OPT("no_cache_image", cache_image, 0),
@@ -169,6 +196,7 @@ constexpr struct ::fuse_opt dwarfs_opts[] = {
     DWARFS_OPT("no_cache_files", cache_files, 0),
 #if DWARFS_PERFMON_ENABLED
     DWARFS_OPT("perfmon=%s", perfmon_enabled_str, 0),
+    DWARFS_OPT("perfmon_trace=%s", perfmon_trace_str, 0),
 #endif
     FUSE_OPT_END};
 
@@ -183,6 +211,76 @@ namespace {
 
 constexpr std::string_view pid_xattr{"user.dwarfs.driver.pid"};
 constexpr std::string_view perfmon_xattr{"user.dwarfs.driver.perfmon"};
+constexpr std::string_view perfmon_traces_xattr{
+    "user.dwarfs.driver.perfmon_traces"};
+constexpr std::string_view metrics_xattr{"user.dwarfs.driver.metrics"};
+
+std::string get_metrics(dwarfs_userdata const& userdata) {
+  std::ostringstream oss;
+  openmetrics_writer w(oss);
+
+#if DWARFS_PERFMON_ENABLED
+  if (userdata.perfmon) {
+    userdata.perfmon->write_openmetrics(w);
+  }
+#endif
+
+  auto st = userdata.fs.get_cache_stats();
+  auto hits = st.active_hits_fast + st.active_hits_slow + st.cache_hits_fast +
+              st.cache_hits_slow;
+
+  w.counter("block_cache_requests", "Block ranges requested from the cache",
+            st.range_requests);
+  w.family("block_cache_hits", "counter",
+           "Block range requests satisfied without a new decompression");
+  w.sample("_total", {{"state", "active"}, {"path", "fast"}},
+           st.active_hits_fast);
+  w.sample("_total", {{"state", "active"}, {"path", "slow"}},
+           st.active_hits_slow);
+  w.sample("_total", {{"state", "cached"}, {"path", "fast"}},
+           st.cache_hits_fast);
+  w.sample("_total", {{"state", "cached"}, {"path", "slow"}},
+           st.cache_hits_slow);
+  w.gauge("block_cache_hit_ratio",
+          "Fraction of block range requests served without decompression",
+          st.range_requests > 0
+              ? static_cast<double>(hits) / st.range_requests
+              : 0.0,
+          "ratio");
+  w.counter("block_cache_blocks_created", "Blocks opened for decompression",
+            st.blocks_created);
+  w.counter("block_cache_blocks_evicted", "Blocks evicted from the cache",
+            st.blocks_evicted);
+  w.counter("block_cache_blocks_verified",
+            "Blocks whose checksum was verified on first load",
+            st.blocks_verified);
+  w.counter("block_cache_blocks_tidied", "Blocks removed by cache tidying",
+            st.blocks_tidied);
+  w.counter("block_cache_partially_decompressed",
+            "Blocks evicted before being fully decompressed",
+            st.partially_decompressed);
+  w.counter("block_cache_decompressed_bytes", "Bytes decompressed",
+            st.bytes_decompressed, "bytes");
+  w.gauge("block_cache_cached_blocks", "Blocks currently in the cache",
+          st.cached_blocks);
+  w.gauge("block_cache_max_cached_blocks", "Maximum number of cached blocks",
+          st.max_cached_blocks);
+  w.gauge("block_cache_active_blocks", "Blocks currently being decompressed",
+          st.active_blocks);
+  w.gauge("block_cache_shards", "Number of block cache shards in use",
+          st.num_shards);
+  w.gauge("block_cache_queue_depth", "Decompression jobs waiting for a worker",
+          st.queue_depth);
+  w.gauge("block_cache_workers", "Number of decompression worker threads",
+          st.num_workers);
+  w.counter("block_cache_worker_cpu_seconds",
+            "CPU time consumed by decompression workers", st.worker_cpu_time,
+            "seconds");
+
+  w.finish();
+
+  return oss.str();
+}
 
 } // namespace
 
@@ -206,6 +304,9 @@ void op_init_common(void* data) {
   // we must do this *after* the fuse driver has forked into background
   userdata->fs.set_num_workers(userdata->opts.workers);
 
+  // same here, this may start background threads
+  userdata->fs.start_background_init();
+
   cache_tidy_config tidy;
   tidy.strategy = userdata->opts.block_cache_tidy_strategy;
   tidy.interval = userdata->opts.block_cache_tidy_interval;
@@ -213,6 +314,17 @@ void op_init_common(void* data) {
 
   // we must do this *after* the fuse driver has forked into background
   userdata->fs.set_cache_tidy_config(tidy);
+
+  if (userdata->opts.metrics_socket_str) {
+    try {
+      // we must do this *after* the fuse driver has forked into background
+      userdata->metrics = std::make_unique<metrics_server>(
+          userdata->lgr, userdata->opts.metrics_socket_str,
+          [userdata] { return get_metrics(*userdata); });
+    } catch (std::exception const& e) {
+      LOG_ERROR << "failed to start metrics server: " << e.what();
+    }
+  }
 }
 
 #if DWARFS_FUSE_LOWLEVEL
@@ -530,6 +642,7 @@ template <typename LoggerPolicy>
 void op_read(fuse_req_t req, fuse_ino_t ino, size_t size, file_off_t off,
              struct fuse_file_info* fi) {
   dUSERDATA;
+  PERFMON_EXT_SCOPED_TRACE(*userdata)
   PERFMON_EXT_SCOPED_SECTION(*userdata, op_read)
   LOG_PROXY(LoggerPolicy, userdata->lgr);
 
@@ -539,6 +652,10 @@ void op_read(fuse_req_t req, fuse_ino_t ino, size_t size, file_off_t off,
 
   try {
     if (FUSE_ROOT_ID + fi->fh == ino) {
+      if (userdata->recorder) {
+        userdata->recorder->record(fi->fh);
+      }
+
       iovec_read_buf buf;
       ssize_t rv = userdata->fs.readv(ino, buf, size, off);
 
@@ -546,8 +663,13 @@ void op_read(fuse_req_t req, fuse_ino_t ino, size_t size, file_off_t off,
                 << rv << " [size = " << buf.buf.size() << "]";
 
       if (rv >= 0) {
-        int frv = fuse_reply_iov(req, buf.buf.empty() ? nullptr : &buf.buf[0],
-                                 buf.buf.size());
+        int frv;
+
+        {
+          PERFMON_EXT_SCOPED_SECTION(*userdata, op_read_reply)
+          frv = fuse_reply_iov(req, buf.buf.empty() ? nullptr : &buf.buf[0],
+                               buf.buf.size());
+        }
 
         if (frv == 0) {
           return;
@@ -575,6 +697,7 @@ template <typename LoggerPolicy>
 int op_read(char const* path, char* buf, size_t size, native_off_t off,
             struct fuse_file_info* fi) {
   dUSERDATA;
+  PERFMON_EXT_SCOPED_TRACE(*userdata)
   PERFMON_EXT_SCOPED_SECTION(*userdata, op_read)
   LOG_PROXY(LoggerPolicy, userdata->lgr);
 
@@ -583,6 +706,10 @@ int op_read(char const* path, char* buf, size_t size, native_off_t off,
   int err = -ENOENT;
 
   try {
+    if (userdata->recorder) {
+      userdata->recorder->record(fi->fh);
+    }
+
     ssize_t rv = userdata->fs.read(fi->fh, buf, size, off);
 
     LOG_DEBUG << "read(" << path << " [" << fi->fh << "], " << size << ", "
@@ -828,6 +955,20 @@ void op_getxattr(fuse_req_t req, fuse_ino_t ino, char const* name,
 #else
         oss << "no performance monitor support\n";
 #endif
+      } else if (name == perfmon_traces_xattr) {
+#if DWARFS_PERFMON_ENABLED
+        if (userdata->perfmon) {
+          userdata->perfmon->dump_traces(oss);
+          extra_size = 65536;
+        } else {
+          oss << "performance monitor is disabled\n";
+        }
+#else
+        oss << "no performance monitor support\n";
+#endif
+      } else if (name == metrics_xattr) {
+        oss << get_metrics(*userdata);
+        extra_size = 4096;
       }
     }
 
@@ -887,6 +1028,8 @@ void op_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
     if (ino == FUSE_ROOT_ID) {
       oss << pid_xattr << '\0';
       oss << perfmon_xattr << '\0';
+      oss << perfmon_traces_xattr << '\0';
+      oss << metrics_xattr << '\0';
     }
 
     auto xattrs = oss.str();
@@ -952,6 +1095,8 @@ void usage(std::filesystem::path const& progname) {
       << "    -o decratio=NUM        ratio for full decompression (0.8)\n"
       << "    -o offset=NUM|auto     filesystem image offset in bytes (0)\n"
       << "    -o enable_nlink        show correct hardlink numbers\n"
+      << "    -o lazy_init           build derived metadata in background\n"
+      << "    -o demand_paged        page in uncompressed metadata on demand\n"
       << "    -o readonly            show read-only file system\n"
       << "    -o (no_)cache_image    (don't) keep image in kernel cache\n"
       << "    -o (no_)cache_files    (don't) keep files in kernel cache\n"
@@ -959,8 +1104,13 @@ void usage(std::filesystem::path const& progname) {
       << "    -o tidy_strategy=NAME  (none)|time|swap\n"
       << "    -o tidy_interval=TIME  interval for cache tidying (5m)\n"
       << "    -o tidy_max_age=TIME   tidy blocks after this time (10m)\n"
+      << "    -o metrics_socket=PATH serve OpenMetrics on this unix socket\n"
+      << "    -o base_images=PATH[" << base_image_separator
+      << "PATH...]  base images of a delta image\n"
+      << "    -o access_profile=FILE write file access order on unmount\n"
 #if DWARFS_PERFMON_ENABLED
       << "    -o perfmon=name[,...]  enable performance monitor\n"
+      << "    -o perfmon_trace=TIME  keep breakdown of slower read requests\n"
 #endif
       << "\n";
 
@@ -1145,6 +1295,32 @@ int run_fuse(struct fuse_args& args, char* mountpoint, int mt, int fg,
 
 #endif
 
+void save_access_profile(dwarfs_userdata& userdata) {
+  LOG_PROXY(prod_logger_policy, userdata.lgr);
+  auto const& path = userdata.opts.access_profile;
+
+  try {
+    auto prof = userdata.recorder->profile(userdata.fs);
+    std::ofstream ofs{path};
+
+    if (!ofs) {
+      DWARFS_THROW(runtime_error, "failed to open " + path.string());
+    }
+
+    prof.write(ofs);
+    ofs.close();
+
+    if (!ofs) {
+      DWARFS_THROW(runtime_error, "failed to write " + path.string());
+    }
+
+    LOG_INFO << "wrote access profile with " << prof.size() << " files to "
+             << path;
+  } catch (std::exception const& e) {
+    LOG_ERROR << "failed to save access profile: " << e.what();
+  }
+}
+
 template <typename LoggerPolicy>
 void load_filesystem(dwarfs_userdata& userdata) {
   LOG_PROXY(LoggerPolicy, userdata.lgr);
@@ -1159,6 +1335,8 @@ void load_filesystem(dwarfs_userdata& userdata) {
   fsopts.block_cache.mm_release = !opts.cache_image;
   fsopts.block_cache.init_workers = false;
   fsopts.metadata.enable_nlink = bool(opts.enable_nlink);
+  fsopts.metadata.lazy_init = bool(opts.lazy_init);
+  fsopts.metadata.demand_paged = bool(opts.demand_paged);
   fsopts.metadata.readonly = bool(opts.readonly);
 
   if (opts.image_offset_str) {
@@ -1173,6 +1351,15 @@ void load_filesystem(dwarfs_userdata& userdata) {
     }
   }
 
+  if (opts.base_images_str) {
+    std::vector<std::string> paths;
+    folly::split(base_image_separator, opts.base_images_str, paths, true);
+    for (auto const& p : paths) {
+      fsopts.base_images.push_back(
+          std::make_shared<mmap>(std::filesystem::path(p)));
+    }
+  }
+
   constexpr int inode_offset =
 #ifdef FUSE_ROOT_ID
       FUSE_ROOT_ID
@@ -1190,7 +1377,8 @@ void load_filesystem(dwarfs_userdata& userdata) {
   }
 #endif
 
-  userdata.perfmon = performance_monitor::create(perfmon_enabled);
+  userdata.perfmon = performance_monitor::create(perfmon_enabled,
+                                                 opts.perfmon_trace_threshold);
 
   PERFMON_EXT_PROXY_SETUP(userdata, userdata.perfmon, "fuse")
   PERFMON_EXT_TIMER_SETUP(userdata, op_init)
@@ -1200,6 +1388,7 @@ void load_filesystem(dwarfs_userdata& userdata) {
   PERFMON_EXT_TIMER_SETUP(userdata, op_readlink)
   PERFMON_EXT_TIMER_SETUP(userdata, op_open)
   PERFMON_EXT_TIMER_SETUP(userdata, op_read)
+  PERFMON_EXT_TIMER_SETUP(userdata, op_read_reply)
   PERFMON_EXT_TIMER_SETUP(userdata, op_readdir)
   PERFMON_EXT_TIMER_SETUP(userdata, op_statfs)
   PERFMON_EXT_TIMER_SETUP(userdata, op_getxattr)
@@ -1209,6 +1398,12 @@ void load_filesystem(dwarfs_userdata& userdata) {
       filesystem_v2(userdata.lgr, std::make_shared<mmap>(opts.fsimage), fsopts,
                     inode_offset, userdata.perfmon);
 
+  if (!opts.access_profile.empty()) {
+    vfs_stat st;
+    userdata.fs.statvfs(&st);
+    userdata.recorder = std::make_unique<access_recorder>(st.files);
+  }
+
   ti << "file system initialized";
 }
 
@@ -1293,6 +1488,11 @@ int dwarfs_main(int argc, sys_char** argv) {
                                 ? folly::to<double>(opts.decompress_ratio_str)
                                 : 0.8;
 
+    if (opts.access_profile_str) {
+      // make this absolute *before* the driver changes its working directory
+      opts.access_profile = std::filesystem::absolute(opts.access_profile_str);
+    }
+
     if (opts.cache_tidy_strategy_str) {
       if (auto it = cache_tidy_strategy_map.find(opts.cache_tidy_strategy_str);
           it != cache_tidy_strategy_map.end()) {
@@ -1313,6 +1513,13 @@ int dwarfs_main(int argc, sys_char** argv) {
             parse_time_with_unit(opts.cache_tidy_max_age_str);
       }
     }
+
+#if DWARFS_PERFMON_ENABLED
+    if (opts.perfmon_trace_str) {
+      opts.perfmon_trace_threshold =
+          parse_time_with_unit(opts.perfmon_trace_str);
+    }
+#endif
   } catch (runtime_error const& e) {
     std::cerr << "error: " << e.what() << "\n";
     return 1;
@@ -1352,6 +1559,12 @@ int dwarfs_main(int argc, sys_char** argv) {
     }
   };
 
+  SCOPE_EXIT {
+    if (userdata.recorder) {
+      save_access_profile(userdata);
+    }
+  };
+
 #if FUSE_USE_VERSION >= 30
 #if DWARFS_FUSE_LOWLEVEL
   return run_fuse(args, fuse_opts, userdata);
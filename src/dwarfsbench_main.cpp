@@ -19,10 +19,25 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <exception>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <variant>
+#include <vector>
 
 #include <boost/program_options.hpp>
 
+#include <fmt/format.h>
+
 #include <folly/Conv.h>
 #include <folly/String.h>
 
@@ -41,11 +56,286 @@ namespace po = boost::program_options;
 
 namespace dwarfs {
 
+namespace {
+
+struct read_op {
+  uint32_t inode;
+  file_off_t offset;
+  size_t size;
+};
+
+struct stat_op {
+  std::string path;
+};
+
+struct readdir_op {
+  inode_view dir;
+};
+
+using bench_op = std::variant<read_op, stat_op, readdir_op>;
+
+struct file_info {
+  inode_view inode;
+  size_t size;
+};
+
+struct bench_config {
+  std::string workload;
+  size_t num_ops;
+  size_t read_size;
+  double zipf_exponent;
+  uint64_t seed;
+  std::string trace_file;
+};
+
+class zipf_distribution {
+ public:
+  zipf_distribution(size_t n, double exponent)
+      : cdf_(n) {
+    double sum = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+      sum += 1.0 / std::pow(static_cast<double>(i + 1), exponent);
+      cdf_[i] = sum;
+    }
+    for (auto& v : cdf_) {
+      v /= sum;
+    }
+  }
+
+  template <typename RNG>
+  size_t operator()(RNG& rng) {
+    auto u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+    auto it = std::lower_bound(cdf_.begin(), cdf_.end(), u);
+    return std::min<size_t>(std::distance(cdf_.begin(), it), cdf_.size() - 1);
+  }
+
+ private:
+  std::vector<double> cdf_;
+};
+
+std::vector<file_info> get_regular_files(filesystem_v2 const& fs) {
+  std::vector<file_info> files;
+
+  fs.walk([&](auto entry) {
+    auto iv = entry.inode();
+    if (iv.is_regular_file()) {
+      file_stat st;
+      if (fs.getattr(iv, &st) == 0 && st.size > 0) {
+        files.push_back({iv, static_cast<size_t>(st.size)});
+      }
+    }
+  });
+
+  return files;
+}
+
+read_op make_read_op(file_info const& fi, size_t read_size,
+                     std::mt19937_64& rng) {
+  auto size = std::min(read_size, fi.size);
+  auto offset = std::uniform_int_distribution<size_t>(0, fi.size - size)(rng);
+  return {fi.inode.inode_num(), static_cast<file_off_t>(offset), size};
+}
+
+std::vector<bench_op>
+make_sequential_ops(filesystem_v2 const& fs, bench_config const& cfg) {
+  std::vector<bench_op> ops;
+
+  for (auto const& fi : get_regular_files(fs)) {
+    auto chunk = cfg.read_size > 0 ? cfg.read_size : fi.size;
+    for (size_t offset = 0; offset < fi.size; offset += chunk) {
+      ops.emplace_back(read_op{fi.inode.inode_num(),
+                               static_cast<file_off_t>(offset),
+                               std::min(chunk, fi.size - offset)});
+    }
+  }
+
+  return ops;
+}
+
+std::vector<bench_op>
+make_random_ops(filesystem_v2 const& fs, bench_config const& cfg) {
+  std::mt19937_64 rng(cfg.seed);
+  auto files = get_regular_files(fs);
+  std::vector<bench_op> ops;
+
+  if (files.empty()) {
+    return ops;
+  }
+
+  auto read_size = cfg.read_size > 0 ? cfg.read_size : 64 * 1024;
+
+  ops.reserve(cfg.num_ops);
+
+  if (cfg.workload == "zipf") {
+    // decouple popularity from the order of files in the image
+    std::shuffle(files.begin(), files.end(), rng);
+    zipf_distribution dist(files.size(), cfg.zipf_exponent);
+    for (size_t i = 0; i < cfg.num_ops; ++i) {
+      ops.emplace_back(make_read_op(files[dist(rng)], read_size, rng));
+    }
+  } else {
+    std::uniform_int_distribution<size_t> dist(0, files.size() - 1);
+    for (size_t i = 0; i < cfg.num_ops; ++i) {
+      ops.emplace_back(make_read_op(files[dist(rng)], read_size, rng));
+    }
+  }
+
+  return ops;
+}
+
+std::vector<bench_op>
+make_metadata_ops(filesystem_v2 const& fs, bench_config const& cfg) {
+  std::mt19937_64 rng(cfg.seed);
+  std::vector<std::string> paths;
+  std::vector<inode_view> dirs;
+  std::vector<bench_op> ops;
+
+  fs.walk([&](auto entry) {
+    paths.push_back(entry.unix_path());
+    if (auto iv = entry.inode(); iv.is_directory()) {
+      dirs.push_back(iv);
+    }
+  });
+
+  std::uniform_int_distribution<size_t> path_dist(0, paths.size() - 1);
+  std::uniform_int_distribution<size_t> dir_dist(0, dirs.size() - 1);
+
+  ops.reserve(cfg.num_ops);
+
+  // roughly one readdir for every four lookups, like a typical `ls -l`
+  for (size_t i = 0; i < cfg.num_ops; ++i) {
+    if (i % 5 == 4 && !dirs.empty()) {
+      ops.emplace_back(readdir_op{dirs[dir_dist(rng)]});
+    } else {
+      ops.emplace_back(stat_op{paths[path_dist(rng)]});
+    }
+  }
+
+  return ops;
+}
+
+// Each line of the trace is `<path> <offset> <size>`, where the path
+// may contain whitespace as the last two fields are always numeric.
+std::vector<bench_op>
+make_replay_ops(filesystem_v2 const& fs, bench_config const& cfg) {
+  std::ifstream ifs(cfg.trace_file);
+
+  if (!ifs) {
+    DWARFS_THROW(runtime_error, "cannot open trace file: " + cfg.trace_file);
+  }
+
+  std::vector<bench_op> ops;
+  std::unordered_map<std::string, std::optional<uint32_t>> inodes;
+  std::string line;
+  size_t lineno = 0;
+  size_t missing = 0;
+
+  while (std::getline(ifs, line)) {
+    ++lineno;
+
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+
+    auto size_pos = line.find_last_of(" \t");
+    auto offset_pos = size_pos == std::string::npos
+                          ? std::string::npos
+                          : line.find_last_of(" \t", size_pos - 1);
+
+    if (offset_pos == std::string::npos || offset_pos == 0) {
+      DWARFS_THROW(runtime_error,
+                   fmt::format("{}:{}: invalid trace line", cfg.trace_file,
+                               lineno));
+    }
+
+    auto path = line.substr(0, offset_pos);
+    auto offset = folly::tryTo<file_off_t>(
+        line.substr(offset_pos + 1, size_pos - offset_pos - 1));
+    auto size = folly::tryTo<size_t>(line.substr(size_pos + 1));
+
+    if (!offset || !size) {
+      DWARFS_THROW(runtime_error,
+                   fmt::format("{}:{}: invalid offset or size", cfg.trace_file,
+                               lineno));
+    }
+
+    auto [it, inserted] = inodes.emplace(path, std::nullopt);
+
+    if (inserted) {
+      if (auto iv = fs.find(path.c_str()); iv && iv->is_regular_file()) {
+        it->second = iv->inode_num();
+      }
+    }
+
+    if (it->second) {
+      ops.emplace_back(read_op{*it->second, *offset, *size});
+    } else {
+      ++missing;
+    }
+  }
+
+  if (missing > 0) {
+    std::cerr << "warning: skipped " << missing
+              << " trace entries referring to missing files\n";
+  }
+
+  return ops;
+}
+
+struct op_runner {
+  filesystem_v2 const& fs;
+
+  size_t operator()(read_op const& op) {
+    buf.resize(std::max(buf.size(), op.size));
+    auto rv = fs.read(op.inode, buf.data(), op.size, op.offset);
+    if (rv < 0) {
+      DWARFS_THROW(runtime_error, fmt::format("read({}) failed", op.inode));
+    }
+    return rv;
+  }
+
+  size_t operator()(stat_op const& op) {
+    file_stat st;
+    auto iv = fs.find(op.path.c_str());
+    if (!iv || fs.getattr(*iv, &st) != 0) {
+      DWARFS_THROW(runtime_error, "lookup failed: " + op.path);
+    }
+    return 0;
+  }
+
+  size_t operator()(readdir_op const& op) {
+    file_stat st;
+    if (auto dir = fs.opendir(op.dir)) {
+      auto count = fs.dirsize(*dir);
+      for (size_t i = 0; i < count; ++i) {
+        if (auto res = fs.readdir(*dir, i)) {
+          fs.getattr(res->first, &st);
+        }
+      }
+    }
+    return 0;
+  }
+
+  std::vector<char> buf;
+};
+
+double percentile(std::vector<uint64_t> const& sorted, double p) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  auto rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+  return 1e-9 * sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+} // namespace
+
 int dwarfsbench_main(int argc, sys_char** argv) {
   std::string filesystem, cache_size_str, lock_mode_str, decompress_ratio_str,
-      log_level;
+      log_level, read_size_str;
+  std::vector<std::string> base_images;
   size_t num_workers;
   size_t num_readers;
+  bench_config cfg;
 
   // clang-format off
   po::options_description opts("Command line options");
@@ -53,6 +343,9 @@ int dwarfsbench_main(int argc, sys_char** argv) {
     ("filesystem,f",
         po::value<std::string>(&filesystem),
         "path to filesystem")
+    ("base-image",
+        po::value<std::vector<std::string>>(&base_images)->composing(),
+        "base image of a delta image")
     ("num-workers,n",
         po::value<size_t>(&num_workers)->default_value(1),
         "number of worker threads")
@@ -68,6 +361,24 @@ int dwarfsbench_main(int argc, sys_char** argv) {
     ("decompress-ratio,r",
         po::value<std::string>(&decompress_ratio_str)->default_value("0.8"),
         "block cache size")
+    ("workload,w",
+        po::value<std::string>(&cfg.workload)->default_value("sequential"),
+        "workload (sequential, random, zipf, metadata, replay)")
+    ("num-ops,o",
+        po::value<size_t>(&cfg.num_ops)->default_value(100000),
+        "number of operations for random, zipf and metadata workloads")
+    ("read-size,b",
+        po::value<std::string>(&read_size_str)->default_value("0"),
+        "size of each read (0 = whole file / 64k for random reads)")
+    ("zipf-exponent",
+        po::value<double>(&cfg.zipf_exponent)->default_value(1.0),
+        "exponent of the zipf distribution")
+    ("seed",
+        po::value<uint64_t>(&cfg.seed)->default_value(42),
+        "seed for random workloads")
+    ("trace,t",
+        po::value<std::string>(&cfg.trace_file),
+        "trace file for replay workload (lines of: path offset size)")
     ("log-level,l",
         po::value<std::string>(&log_level)->default_value("info"),
         "log level (error, warn, info, debug, trace)")
@@ -100,34 +411,127 @@ int dwarfsbench_main(int argc, sys_char** argv) {
     fsopts.block_cache.decompress_ratio =
         folly::to<double>(decompress_ratio_str);
 
+    for (auto const& base : base_images) {
+      fsopts.base_images.push_back(std::make_shared<dwarfs::mmap>(base));
+    }
+
+    cfg.read_size = parse_size_with_unit(read_size_str);
+
     dwarfs::filesystem_v2 fs(lgr, std::make_shared<dwarfs::mmap>(filesystem),
                              fsopts);
 
+    std::vector<bench_op> ops;
+
+    if (cfg.workload == "sequential") {
+      ops = make_sequential_ops(fs, cfg);
+    } else if (cfg.workload == "random" || cfg.workload == "zipf") {
+      ops = make_random_ops(fs, cfg);
+    } else if (cfg.workload == "metadata") {
+      ops = make_metadata_ops(fs, cfg);
+    } else if (cfg.workload == "replay") {
+      if (cfg.trace_file.empty()) {
+        std::cerr << "error: replay workload requires --trace\n";
+        return 1;
+      }
+      ops = make_replay_ops(fs, cfg);
+    } else {
+      std::cerr << "error: unknown workload: " << cfg.workload << "\n";
+      return 1;
+    }
+
     worker_group wg("reader", num_readers);
+    std::atomic<size_t> next_op{0};
+    std::atomic<size_t> total_bytes{0};
+    std::atomic<size_t> errors{0};
+    std::mutex mx;
+    std::vector<uint64_t> latencies;
+
+    latencies.reserve(ops.size());
+
+    auto stats_before = fs.get_cache_stats();
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < num_readers; ++i) {
+      wg.add_job([&] {
+        op_runner runner{fs, {}};
+        std::vector<uint64_t> local;
+        size_t bytes = 0;
+
+        for (;;) {
+          auto index = next_op.fetch_add(1);
+
+          if (index >= ops.size()) {
+            break;
+          }
+
+          auto t0 = std::chrono::steady_clock::now();
 
-    fs.walk([&](auto entry) {
-      auto inode_data = entry.inode();
-      if (inode_data.is_regular_file()) {
-        wg.add_job([&fs, inode_data] {
           try {
-            file_stat stbuf;
-            if (fs.getattr(inode_data, &stbuf) == 0) {
-              std::vector<char> buf(stbuf.size);
-              int fh = fs.open(inode_data);
-              fs.read(fh, buf.data(), buf.size());
-            }
+            bytes += std::visit(runner, ops[index]);
           } catch (runtime_error const& e) {
             std::cerr << "error: " << e.what() << "\n";
+            ++errors;
           } catch (...) {
             std::cerr << "error: "
                       << folly::exceptionStr(std::current_exception()) << "\n";
             dump_exceptions();
+            ++errors;
           }
-        });
-      }
-    });
+
+          local.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::steady_clock::now() - t0)
+                              .count());
+        }
+
+        total_bytes += bytes;
+
+        std::lock_guard lock(mx);
+        latencies.insert(latencies.end(), local.begin(), local.end());
+      });
+    }
 
     wg.wait();
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    auto stats = fs.get_cache_stats();
+
+    std::sort(latencies.begin(), latencies.end());
+
+    auto secs = std::max(elapsed.count(), 1e-9);
+    auto requests = stats.range_requests - stats_before.range_requests;
+    auto hits = (stats.active_hits_fast + stats.active_hits_slow +
+                 stats.cache_hits_fast + stats.cache_hits_slow) -
+                (stats_before.active_hits_fast + stats_before.active_hits_slow +
+                 stats_before.cache_hits_fast + stats_before.cache_hits_slow);
+
+    std::cout << "workload: " << cfg.workload << ", " << ops.size()
+              << " operations, " << num_readers << " readers\n";
+    std::cout << "    elapsed: " << time_with_unit(secs) << "\n";
+    std::cout << " throughput: "
+              << fmt::format("{:.1f}", ops.size() / secs) << " ops/s, "
+              << size_with_unit(static_cast<size_t>(total_bytes / secs))
+              << "/s\n";
+    std::cout << "    latency: p50 "
+              << time_with_unit(percentile(latencies, 0.5)) << ", p90 "
+              << time_with_unit(percentile(latencies, 0.9)) << ", p99 "
+              << time_with_unit(percentile(latencies, 0.99)) << ", p999 "
+              << time_with_unit(percentile(latencies, 0.999)) << ", max "
+              << time_with_unit(percentile(latencies, 1.0)) << "\n";
+    std::cout << "block cache: " << requests << " requests, "
+              << fmt::format("{:.2f}%", requests > 0 ? 100.0 * hits / requests
+                                                     : 0.0)
+              << " hits, "
+              << stats.blocks_created - stats_before.blocks_created
+              << " blocks created, "
+              << size_with_unit(stats.bytes_decompressed -
+                                stats_before.bytes_decompressed)
+              << " decompressed\n";
+
+    if (errors > 0) {
+      std::cerr << "error: " << errors << " operations failed\n";
+      return 1;
+    }
   } catch (runtime_error const& e) {
     std::cerr << "error: " << e.what() << "\n";
     return 1;
@@ -50,6 +50,7 @@ int dwarfsck_main(int argc, sys_char** argv) {
   const size_t num_cpu = std::max(folly::hardware_concurrency(), 1u);
 
   std::string log_level, input, export_metadata, image_offset;
+  std::vector<std::string> base_images;
   size_t num_workers;
   int detail;
   bool json = false;
@@ -68,6 +69,9 @@ int dwarfsck_main(int argc, sys_char** argv) {
     ("image-offset,O",
         po::value<std::string>(&image_offset)->default_value("auto"),
         "filesystem image offset in bytes")
+    ("base-image",
+        po::value<std::vector<std::string>>(&base_images)->composing(),
+        "base image of a delta image")
     ("print-header,H",
         po::value<bool>(&print_header)->zero_tokens(),
         "print filesystem header to stdout and exit")
@@ -129,6 +133,10 @@ int dwarfsck_main(int argc, sys_char** argv) {
       DWARFS_THROW(runtime_error, "failed to parse offset: " + image_offset);
     }
 
+    for (auto const& base : base_images) {
+      fsopts.base_images.push_back(std::make_shared<mmap>(base));
+    }
+
     auto mm = std::make_shared<mmap>(input);
 
     if (!export_metadata.empty()) {
@@ -157,7 +165,8 @@ int dwarfsck_main(int argc, sys_char** argv) {
       }
     } else {
       if (filesystem_v2::identify(lgr, mm, std::cout, detail, num_workers,
-                                  check_integrity, fsopts.image_offset) != 0) {
+                                  check_integrity, fsopts.image_offset,
+                                  fsopts.base_images) != 0) {
         return 1;
       }
     }
@@ -22,6 +22,7 @@
 #include <exception>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include <boost/program_options.hpp>
 
@@ -44,10 +45,11 @@ namespace dwarfs {
 int dwarfsextract_main(int argc, sys_char** argv) {
   std::string filesystem, output, format, cache_size_str, log_level,
       image_offset;
+  std::vector<std::string> base_images;
 #if DWARFS_PERFMON_ENABLED
   std::string perfmon_str;
 #endif
-  size_t num_workers;
+  size_t num_workers, num_disk_writers;
   bool continue_on_error{false}, disable_integrity_check{false},
       stdout_progress{false};
 
@@ -63,6 +65,9 @@ int dwarfsextract_main(int argc, sys_char** argv) {
     ("image-offset,O",
         po::value<std::string>(&image_offset)->default_value("auto"),
         "filesystem image offset in bytes")
+    ("base-image",
+        po::value<std::vector<std::string>>(&base_images)->composing(),
+        "base image of a delta image")
     ("format,f",
         po::value<std::string>(&format),
         "output format")
@@ -78,6 +83,9 @@ int dwarfsextract_main(int argc, sys_char** argv) {
     ("num-workers,n",
         po::value<size_t>(&num_workers)->default_value(4),
         "number of worker threads")
+    ("disk-writers",
+        po::value<size_t>(&num_disk_writers)->default_value(1),
+        "number of threads writing files when extracting to disk")
     ("cache-size,s",
         po::value<std::string>(&cache_size_str)->default_value("512m"),
         "block cache size")
@@ -127,6 +135,10 @@ int dwarfsextract_main(int argc, sys_char** argv) {
     fsopts.block_cache.disable_block_integrity_check = disable_integrity_check;
     fsopts.metadata.enable_nlink = true;
 
+    for (auto const& base : base_images) {
+      fsopts.base_images.push_back(std::make_shared<mmap>(base));
+    }
+
     std::unordered_set<std::string> perfmon_enabled;
 #if DWARFS_PERFMON_ENABLED
     if (!perfmon_str.empty()) {
@@ -159,6 +171,7 @@ int dwarfsextract_main(int argc, sys_char** argv) {
 
     fsx_opts.max_queued_bytes = fsopts.block_cache.max_bytes;
     fsx_opts.continue_on_error = continue_on_error;
+    fsx_opts.num_disk_writers = num_disk_writers;
     int prog{-1};
     if (stdout_progress) {
       fsx_opts.progress = [&prog](std::string_view, uint64_t extracted,
@@ -50,9 +50,12 @@
 
 #include <fmt/format.h>
 
+#include "dwarfs/access_profile.h"
+#include "dwarfs/base_image.h"
 #include "dwarfs/block_compressor.h"
 #include "dwarfs/block_manager.h"
 #include "dwarfs/builtin_script.h"
+#include "dwarfs/categorizer.h"
 #include "dwarfs/chmod_transformer.h"
 #include "dwarfs/console_writer.h"
 #include "dwarfs/entry.h"
@@ -63,7 +66,9 @@
 #include "dwarfs/mmap.h"
 #include "dwarfs/options.h"
 #include "dwarfs/options_interface.h"
+#include "dwarfs/os_access_archive.h"
 #include "dwarfs/os_access_generic.h"
+#include "dwarfs/pipeline_profile.h"
 #include "dwarfs/program_options_helpers.h"
 #include "dwarfs/progress.h"
 #include "dwarfs/scanner.h"
@@ -94,6 +99,7 @@ const std::map<std::string, file_order_mode> order_choices{
     {"path", file_order_mode::PATH},
     {"similarity", file_order_mode::SIMILARITY},
     {"nilsimsa", file_order_mode::NILSIMSA},
+    {"nilsimsa-index", file_order_mode::NILSIMSA_INDEX},
 };
 
 const std::map<std::string, console_writer::progress_mode> progress_modes{
@@ -310,23 +316,29 @@ int mkdwarfs_main(int argc, sys_char** argv) {
   const size_t num_cpu = std::max(folly::hardware_concurrency(), 1u);
 
   block_manager::config cfg;
-  sys_string path_str, output_str;
+  sys_string path_str, output_str, base_str, spool_dir_str;
   std::string memory_limit, script_arg, compression, header, schema_compression,
       metadata_compression, log_level_str, timestamp, time_resolution, order,
       progress_mode, recompress_opts, pack_metadata, file_hash_algo,
-      debug_filter, max_similarity_size, input_list_str, chmod_str;
-  std::vector<sys_string> filter;
+      debug_filter, max_similarity_size, input_list_str, chmod_str, categorize,
+      worker_scheduler, pipeline_profile_file, input_format,
+      tree_hash_min_size, tree_hash_leaf_size, adaptive_level,
+      speculative_scan_size;
+  std::vector<sys_string> filter, base_layers;
+  std::vector<std::string> compression_opts;
   size_t num_workers, num_scanner_workers;
   bool no_progress = false, remove_header = false, no_section_index = false,
-       force_overwrite = false;
+       force_overwrite = false, base_delta = false;
   unsigned level;
-  int compress_niceness;
+  int compress_niceness, numa_node, nilsimsa_neighbours;
+  double incompressible_threshold, base_reuse_threshold;
   uint16_t uid, gid;
 
   scanner_options options;
 
   auto order_desc =
-      "inode order (" + (from(order_choices) | get<0>() | unsplit(", ")) + ")";
+      "inode order (" + (from(order_choices) | get<0>() | unsplit(", ")) +
+      ", profile:FILE)";
 
   auto progress_desc = "progress mode (" +
                        (from(progress_modes) | get<0>() | unsplit(", ")) + ")";
@@ -344,6 +356,11 @@ int mkdwarfs_main(int argc, sys_char** argv) {
   auto file_hash_desc = "choice of file hashing function (none, " +
                         (from(hash_list) | unsplit(", ")) + ")";
 
+  auto categorize_desc =
+      "enable categorizers in the given order (" +
+      (from(categorizer_manager::builtin_categorizers()) | unsplit(", ")) +
+      ")";
+
   // clang-format off
   po::options_description basic_opts("Options");
   basic_opts.add_options()
@@ -353,6 +370,12 @@ int mkdwarfs_main(int argc, sys_char** argv) {
     ("input-list",
         po::value<std::string>(&input_list_str),
         "file containing list of paths relative to root directory")
+    ("input-format",
+        po::value<std::string>(&input_format)->default_value("dir"),
+        "input format (dir, archive)")
+    ("spool-dir",
+        po_sys_value<sys_string>(&spool_dir_str),
+        "spool archive contents to this directory instead of memory")
     ("output,o",
         po_sys_value<sys_string>(&output_str),
         "filesystem output name")
@@ -385,27 +408,64 @@ int mkdwarfs_main(int argc, sys_char** argv) {
     ("num-scanner-workers",
         po::value<size_t>(&num_scanner_workers),
         "number of scanner (hashing) worker threads")
+    ("worker-scheduler",
+        po::value<std::string>(&worker_scheduler)->default_value("shared"),
+        "worker thread scheduler (shared, work-stealing)")
+    ("numa-node",
+        po::value<int>(&numa_node),
+        "restrict worker threads to CPUs of this NUMA node")
     ("memory-limit,L",
         po::value<std::string>(&memory_limit)->default_value("1g"),
         "block manager memory limit")
     ("recompress",
         po::value<std::string>(&recompress_opts)->implicit_value("all"),
         "recompress an existing filesystem (none, block, metadata, all)")
+    ("base",
+        po_sys_value<sys_string>(&base_str),
+        "reuse blocks of unchanged files from an existing filesystem")
+    ("base-reuse-threshold",
+        po::value<double>(&base_reuse_threshold)->default_value(0.9),
+        "minimum fraction of unchanged data for reusing a block")
+    ("delta",
+        po::value<bool>(&base_delta)->zero_tokens(),
+        "reference base image blocks instead of copying them")
+    ("base-layer",
+        po_sys_value<std::vector<sys_string>>(&base_layers)->composing(),
+        "base image of a delta base image")
     ("order",
         po::value<std::string>(&order),
         order_desc.c_str())
+    ("nilsimsa-neighbours",
+        po::value<int>(&nilsimsa_neighbours),
+        "similar inodes to remember per inode for nilsimsa-index order")
     ("max-similarity-size",
         po::value<std::string>(&max_similarity_size),
         "maximum file size to compute similarity")
+    ("categorize",
+        po::value<std::string>(&categorize)->implicit_value(
+            from(categorizer_manager::builtin_categorizers()) | unsplit(",")),
+        categorize_desc.c_str())
     ("file-hash",
         po::value<std::string>(&file_hash_algo)->default_value("xxh3-128"),
         file_hash_desc.c_str())
+    ("speculative-scan-size",
+        po::value<std::string>(&speculative_scan_size)->default_value("256m"),
+        "scan possible duplicates of at least this size for similarity")
+    ("tree-hash-min-size",
+        po::value<std::string>(&tree_hash_min_size),
+        "hash files of at least this size in parallel")
+    ("tree-hash-leaf-size",
+        po::value<std::string>(&tree_hash_leaf_size)->default_value("32m"),
+        "leaf size for parallel file hashing")
     ("progress",
         po::value<std::string>(&progress_mode)->default_value(default_progress_mode),
         progress_desc.c_str())
     ("no-progress",
         po::value<bool>(&no_progress)->zero_tokens(),
         "don't show progress")
+    ("pipeline-profile",
+        po::value<std::string>(&pipeline_profile_file),
+        "write JSON profile of the build pipeline to file")
     ;
 
   po::options_description filesystem_opts("File system options");
@@ -447,14 +507,20 @@ int mkdwarfs_main(int argc, sys_char** argv) {
   po::options_description compressor_opts("Compressor options");
   compressor_opts.add_options()
     ("compression,C",
-        po::value<std::string>(&compression),
-        "block compression algorithm")
+        po::value<std::vector<std::string>>(&compression_opts)->composing(),
+        "block compression algorithm ([category::]algorithm)")
     ("schema-compression",
         po::value<std::string>(&schema_compression),
         "metadata schema compression algorithm")
     ("metadata-compression",
         po::value<std::string>(&metadata_compression),
         "metadata compression algorithm")
+    ("adaptive-level",
+        po::value<std::string>(&adaptive_level),
+        "adapt block compression level to load (min:max)")
+    ("incompressible-threshold",
+        po::value<double>(&incompressible_threshold),
+        "store files with at least this entropy (bits/byte) uncompressed")
     ;
 
   po::options_description filter_opts("Filter options");
@@ -604,10 +670,77 @@ int mkdwarfs_main(int argc, sys_char** argv) {
     cfg.block_size_bits = defaults.block_size_bits;
   }
 
-  if (!vm.count("compression")) {
+  // -C [category::]algorithm
+  std::map<std::string, std::string> category_compression;
+
+  for (auto const& opt : compression_opts) {
+    if (auto pos = opt.find("::"); pos != std::string::npos) {
+      category_compression[opt.substr(0, pos)] = opt.substr(pos + 2);
+    } else {
+      compression = opt;
+    }
+  }
+
+  if (compression.empty()) {
     compression = defaults.data_compression;
   }
 
+  // --adaptive-level=min:max
+  std::vector<std::string> adaptive_specs;
+
+  if (!adaptive_level.empty()) {
+    std::vector<std::string> range;
+    boost::split(range, adaptive_level, boost::is_any_of(":"));
+
+    std::vector<std::string> spec;
+    boost::split(spec, compression, boost::is_any_of(":"));
+
+    bool has_level = false;
+
+    compression_registry::instance().for_each_algorithm(
+        [&](compression_type, compression_info const& info) {
+          if (info.name() == spec.front()) {
+            for (auto const& opt : info.options()) {
+              has_level = has_level || opt.starts_with("level=");
+            }
+          }
+        });
+
+    if (!has_level) {
+      std::cerr << "error: '--adaptive-level' requires a compression "
+                   "algorithm with a 'level' option\n";
+      return 1;
+    }
+
+    auto parse_level = [](std::string const& str) -> std::optional<int> {
+      if (auto v = folly::tryTo<int>(str)) {
+        return *v;
+      }
+      return std::nullopt;
+    };
+
+    std::optional<int> min_level, max_level;
+
+    if (range.size() == 2) {
+      min_level = parse_level(range[0]);
+      max_level = parse_level(range[1]);
+    }
+
+    if (!min_level || !max_level || *min_level > *max_level) {
+      std::cerr << "error: invalid adaptive level range '" << adaptive_level
+                << "'\n";
+      return 1;
+    }
+
+    std::erase_if(spec,
+                  [](auto const& opt) { return opt.starts_with("level="); });
+
+    for (int l = *min_level; l <= *max_level; ++l) {
+      adaptive_specs.push_back(
+          fmt::format("{}:level={}", boost::join(spec, ":"), l));
+    }
+  }
+
   if (!vm.count("schema-compression")) {
     schema_compression = defaults.schema_compression;
   }
@@ -635,8 +768,83 @@ int mkdwarfs_main(int argc, sys_char** argv) {
     return 1;
   }
 
+  std::vector<std::string> categorizers;
+
+  if (!categorize.empty()) {
+    boost::split(categorizers, categorize, boost::is_any_of(","));
+  }
+
+  bool const categorize_incompressible =
+      std::find(categorizers.begin(), categorizers.end(), "incompressible") !=
+      categorizers.end();
+
+  categorizer_options catopts;
+
+  if (vm.count("incompressible-threshold")) {
+    if (incompressible_threshold <= 0.0 || incompressible_threshold > 8.0) {
+      std::cerr << "error: incompressible threshold must be in (0, 8]\n";
+      return 1;
+    }
+    if (categorize_incompressible) {
+      catopts.incompressible_threshold = incompressible_threshold;
+    } else {
+      cfg.incompressible_threshold = incompressible_threshold;
+    }
+  }
+
+  std::shared_ptr<categorizer_manager> catmgr;
+
+  if (!categorizers.empty()) {
+    catmgr = std::make_shared<categorizer_manager>();
+
+    try {
+      for (auto const& name : categorizers) {
+        catmgr->add(categorizer_manager::create_builtin(name, catopts));
+      }
+    } catch (std::exception const& e) {
+      std::cerr << "error: " << e.what() << "\n";
+      return 1;
+    }
+
+    if (categorize_incompressible &&
+        !category_compression.count("incompressible")) {
+      category_compression["incompressible"] = "null";
+    }
+
+    options.inode.categorizer_mgr = catmgr;
+  }
+
+  for (auto const& [cat, spec] : category_compression) {
+    if (!catmgr || !catmgr->category_value(cat)) {
+      std::cerr << "error: unknown category '" << cat << "' in -C " << cat
+                << "::" << spec << "\n";
+      return 1;
+    }
+  }
+
   std::filesystem::path path(path_str);
   std::optional<std::vector<std::filesystem::path>> input_list;
+  std::optional<std::filesystem::path> archive_path;
+
+  if (input_format == "archive") {
+    if (!vm.count("input")) {
+      std::cerr << "error: archive input requires --input\n";
+      return 1;
+    }
+
+    if (vm.count("input-list") && input_list_str == "-" && path == "-") {
+      std::cerr << "error: cannot read both archive and input list from "
+                   "stdin\n";
+      return 1;
+    }
+
+    // the archive contents are scanned starting at the archive root
+    archive_path = path;
+    path = "/";
+  } else if (input_format != "dir") {
+    std::cerr << "error: invalid input format: " << input_format << "\n";
+    return 1;
+  }
 
   if (vm.count("input-list")) {
     if (vm.count("filter")) {
@@ -676,9 +884,16 @@ int mkdwarfs_main(int argc, sys_char** argv) {
     }
   }
 
-  path = canonical_path(path);
+  if (!archive_path) {
+    path = canonical_path(path);
+  }
 
   bool recompress = vm.count("recompress");
+
+  if (recompress && archive_path) {
+    std::cerr << "error: '--recompress' cannot be used with archive input\n";
+    return 1;
+  }
   rewrite_options rw_opts;
   if (recompress) {
     std::unordered_map<std::string, unsigned> const modes{
@@ -699,18 +914,39 @@ int mkdwarfs_main(int argc, sys_char** argv) {
   std::vector<std::string> order_opts;
   boost::split(order_opts, order, boost::is_any_of(":"));
 
-  if (auto it = order_choices.find(order_opts.front());
-      it != order_choices.end()) {
+  if (order_opts.front() == "profile") {
+    if (order_opts.size() < 2 || order_opts[1].empty()) {
+      std::cerr << "error: inode order mode 'profile' requires a file\n";
+      return 1;
+    }
+
+    // the file name may contain colons itself
+    auto profile_path = order.substr(order_opts.front().size() + 1);
+
+    options.file_order.mode = file_order_mode::PROFILE;
+
+    try {
+      options.file_order.profile = std::make_shared<access_profile>(
+          access_profile::load(profile_path));
+    } catch (std::exception const& e) {
+      std::cerr << "error: " << e.what() << "\n";
+      return 1;
+    }
+  } else if (auto it = order_choices.find(order_opts.front());
+             it != order_choices.end()) {
     options.file_order.mode = it->second;
 
     if (order_opts.size() > 1) {
-      if (options.file_order.mode != file_order_mode::NILSIMSA) {
+      if (!options.file_order.needs_nilsimsa()) {
         std::cerr << "error: inode order mode '" << order_opts.front()
                   << "' does not support options\n";
         return 1;
       }
 
-      if (order_opts.size() > 4) {
+      size_t max_opts =
+          options.file_order.mode == file_order_mode::NILSIMSA_INDEX ? 3 : 4;
+
+      if (order_opts.size() > max_opts) {
         std::cerr << "error: too many options for inode order mode '"
                   << order_opts[0] << "'\n";
         return 1;
@@ -744,6 +980,21 @@ int mkdwarfs_main(int argc, sys_char** argv) {
     return 1;
   }
 
+  if (vm.count("nilsimsa-neighbours")) {
+    if (options.file_order.mode != file_order_mode::NILSIMSA_INDEX) {
+      std::cerr << "error: --nilsimsa-neighbours requires "
+                   "--order=nilsimsa-index\n";
+      return 1;
+    }
+
+    if (nilsimsa_neighbours < 1 || nilsimsa_neighbours > 256) {
+      std::cerr << "error: nilsimsa neighbours must be between 1 and 256\n";
+      return 1;
+    }
+
+    options.file_order.nilsimsa_neighbours = nilsimsa_neighbours;
+  }
+
   if (file_hash_algo == "none") {
     options.file_hash_algorithm.reset();
   } else if (checksum::is_available(file_hash_algo)) {
@@ -754,6 +1005,26 @@ int mkdwarfs_main(int argc, sys_char** argv) {
     return 1;
   }
 
+  if (vm.count("tree-hash-min-size")) {
+    auto size = parse_size_with_unit(tree_hash_min_size);
+    if (size > 0) {
+      options.inode.tree_hash_min_size = size;
+    }
+  }
+
+  options.inode.tree_hash_leaf_size = parse_size_with_unit(tree_hash_leaf_size);
+
+  if (options.inode.tree_hash_leaf_size == 0) {
+    std::cerr << "error: tree hash leaf size must not be zero\n";
+    return 1;
+  }
+
+  if (auto size = parse_size_with_unit(speculative_scan_size); size > 0) {
+    options.inode.speculative_scan_min_size = size;
+  } else {
+    options.inode.speculative_scan_min_size.reset();
+  }
+
   if (vm.count("max-similarity-size")) {
     auto size = parse_size_with_unit(max_similarity_size);
     if (size > 0) {
@@ -767,10 +1038,19 @@ int mkdwarfs_main(int argc, sys_char** argv) {
     num_scanner_workers = num_workers;
   }
 
-  worker_group wg_compress("compress", num_workers,
-                           std::numeric_limits<size_t>::max(),
-                           compress_niceness);
-  worker_group wg_scanner("scanner", num_scanner_workers);
+  worker_group_options wgopts;
+
+  if (worker_scheduler == "work-stealing") {
+    wgopts.scheduler = worker_group_scheduler::WORK_STEALING;
+  } else if (worker_scheduler != "shared") {
+    std::cerr << "error: invalid worker scheduler: " << worker_scheduler
+              << "\n";
+    return 1;
+  }
+
+  if (vm.count("numa-node")) {
+    wgopts.numa_node = numa_node;
+  }
 
   if (vm.count("debug-filter")) {
     if (auto it = debug_filter_modes.find(debug_filter);
@@ -806,6 +1086,12 @@ int mkdwarfs_main(int argc, sys_char** argv) {
                                 : console_writer::NORMAL,
                      log_level >= logger::DEBUG);
 
+  worker_group wg_compress(lgr, "compress", num_workers,
+                           std::numeric_limits<size_t>::max(),
+                           compress_niceness, wgopts);
+  worker_group wg_scanner(lgr, "scanner", num_scanner_workers,
+                          std::numeric_limits<size_t>::max(), 0, wgopts);
+
   std::shared_ptr<script> script;
 
   if (!filter.empty() or vm.count("chmod")) {
@@ -983,6 +1269,52 @@ int mkdwarfs_main(int argc, sys_char** argv) {
              << " blocks with " << num_workers << " threads";
   }
 
+  if (base_str.empty() && (base_delta || !base_layers.empty())) {
+    std::cerr << "error: '--delta' and '--base-layer' require '--base'\n";
+    return 1;
+  }
+
+  if (!base_str.empty()) {
+    if (recompress) {
+      std::cerr << "error: '--base' cannot be used with '--recompress'\n";
+      return 1;
+    }
+
+    if (base_reuse_threshold <= 0.0 || base_reuse_threshold > 1.0) {
+      std::cerr << "error: base reuse threshold must be in (0, 1]\n";
+      return 1;
+    }
+
+    base_image_options bopts;
+    bopts.reuse_threshold = base_reuse_threshold;
+    bopts.time_resolution_sec = options.time_resolution_sec;
+    bopts.delta = base_delta;
+
+    try {
+      for (auto const& layer : base_layers) {
+        bopts.base_images.push_back(
+            std::make_shared<dwarfs::mmap>(std::filesystem::path(layer)));
+      }
+
+      options.inode.base = std::make_shared<base_image>(
+          lgr,
+          std::make_shared<dwarfs::mmap>(std::filesystem::path(base_str)),
+          bopts);
+    } catch (std::exception const& e) {
+      LOG_ERROR << "cannot open base image: " << e.what();
+      return 1;
+    }
+
+    if (options.inode.base->block_size() !=
+        (UINT64_C(1) << cfg.block_size_bits)) {
+      LOG_ERROR << "block size of base image ("
+                << size_with_unit(options.inode.base->block_size())
+                << ") does not match block size ("
+                << size_with_unit(UINT64_C(1) << cfg.block_size_bits) << ")";
+      return 1;
+    }
+  }
+
   std::filesystem::path output(output_str);
 
   std::unique_ptr<std::ostream> os;
@@ -1011,22 +1343,54 @@ int mkdwarfs_main(int argc, sys_char** argv) {
   filesystem_writer fsw(*os, lgr, wg_compress, prog, bc, schema_bc, metadata_bc,
                         fswopts, header_ifs.get());
 
+  for (auto const& [cat, spec] : category_compression) {
+    fsw.add_category_compressor(catmgr->category_value(cat).value(),
+                                block_compressor(spec));
+  }
+
+  if (!adaptive_specs.empty()) {
+    fsw.set_adaptive_compression(adaptive_specs);
+  }
+
+  std::shared_ptr<pipeline_profile> profile;
+
+  if (!pipeline_profile_file.empty()) {
+    profile = std::make_shared<pipeline_profile>(prog);
+    profile->add_worker_group("scanner", wg_scanner);
+    profile->add_worker_group("compress", wg_compress);
+    options.profile = profile;
+  }
+
   auto ti = LOG_TIMED_INFO;
 
   try {
     if (recompress) {
+      if (profile) {
+        profile->begin_stage("rewrite");
+      }
       filesystem_v2::rewrite(lgr, prog, std::make_shared<dwarfs::mmap>(path),
                              fsw, rw_opts);
       wg_compress.wait();
     } else {
       options.inode.with_similarity =
           options.file_order.mode == file_order_mode::SIMILARITY;
-      options.inode.with_nilsimsa =
-          options.file_order.mode == file_order_mode::NILSIMSA;
+      options.inode.with_nilsimsa = options.file_order.needs_nilsimsa();
 
-      scanner s(lgr, wg_scanner, cfg, entry_factory::create(),
-                std::make_shared<os_access_generic>(), std::move(script),
-                options);
+      std::shared_ptr<os_access> os;
+
+      if (archive_path) {
+        os_access_archive_options archive_opts;
+        if (!spool_dir_str.empty()) {
+          archive_opts.spool_dir = spool_dir_str;
+        }
+        os = std::make_shared<os_access_archive>(lgr, *archive_path,
+                                                 archive_opts);
+      } else {
+        os = std::make_shared<os_access_generic>();
+      }
+
+      scanner s(lgr, wg_scanner, cfg, entry_factory::create(), std::move(os),
+                std::move(script), options);
 
       if (input_list) {
         s.scan(fsw, path, prog, *input_list);
@@ -1047,6 +1411,20 @@ int mkdwarfs_main(int argc, sys_char** argv) {
              << time_with_unit(wg_compress.get_cpu_time());
   }
 
+  if (profile) {
+    profile->stop();
+
+    std::ofstream ofs(pipeline_profile_file);
+
+    if (!ofs) {
+      LOG_ERROR << "cannot open profile file '" << pipeline_profile_file
+                << "': " << strerror(errno);
+      return 1;
+    }
+
+    profile->write_json(ofs);
+  }
+
   if (auto ofs = dynamic_cast<std::ofstream*>(os.get())) {
     ofs->close();
 
@@ -1080,6 +1458,10 @@ int mkdwarfs_main(int argc, sys_char** argv) {
        << err.str();
   }
 
+  if (auto rss = peak_rss()) {
+    LOG_INFO << "peak memory usage: " << size_with_unit(*rss);
+  }
+
   return prog.errors > 0;
 }
 
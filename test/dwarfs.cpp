@@ -20,31 +20,51 @@
  */
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <filesystem>
+#include <future>
+#include <limits>
 #include <map>
+#include <numeric>
 #include <random>
 #include <regex>
 #include <set>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 #include <gtest/gtest.h>
 
 #include <fmt/format.h>
 
+#include "dwarfs/access_profile.h"
+#include "dwarfs/base_image.h"
 #include "dwarfs/block_compressor.h"
 #include "dwarfs/builtin_script.h"
+#include "dwarfs/categorizer.h"
+#include "dwarfs/compression_level_controller.h"
 #include "dwarfs/entry.h"
 #include "dwarfs/file_stat.h"
 #include "dwarfs/file_type.h"
 #include "dwarfs/filesystem_v2.h"
 #include "dwarfs/filesystem_writer.h"
+#include "dwarfs/fs_section.h"
+#include "dwarfs/fstypes.h"
+#include "dwarfs/latency_histogram.h"
 #include "dwarfs/logger.h"
 #include "dwarfs/mmif.h"
+#include "dwarfs/openmetrics.h"
 #include "dwarfs/options.h"
+#include "dwarfs/performance_monitor.h"
+#include "dwarfs/pipeline_profile.h"
 #include "dwarfs/progress.h"
 #include "dwarfs/scanner.h"
+#include "dwarfs/string_table.h"
 #include "dwarfs/vfs_stat.h"
+#include "dwarfs/worker_group.h"
 
 #include "filter_test_data.h"
 #include "loremipsum.h"
@@ -88,6 +108,68 @@ build_dwarfs(logger& lgr, std::shared_ptr<test::os_access_mock> input,
   return oss.str();
 }
 
+class random_data_source {
+ public:
+  std::string operator()(size_t size) {
+    std::string data;
+    data.resize(size);
+    std::generate(begin(data), end(data), std::ref(rng_));
+    return data;
+  }
+
+ private:
+  std::independent_bits_engine<std::mt19937_64,
+                               std::numeric_limits<uint8_t>::digits, uint16_t>
+      rng_;
+};
+
+// Files with random contents, stored in path order and in small blocks
+// so that changing a file only affects a few blocks
+struct random_file_set {
+  random_file_set() {
+    cfg.blockhash_window_size = 0;
+    cfg.block_size_bits = 16;
+    opts.file_order.mode = file_order_mode::PATH;
+
+    for (int i = 0; i < 100; ++i) {
+      files.emplace(fmt::format("file{:03}", i), random_data(1000 + 37 * i));
+    }
+  }
+
+  std::shared_ptr<test::os_access_mock> make_input() const {
+    auto input = std::make_shared<test::os_access_mock>();
+    input->add_dir("");
+    for (auto const& [name, contents] : files) {
+      input->add_file(name, contents);
+    }
+    return input;
+  }
+
+  void check_contents(filesystem_v2 const& fs) const {
+    for (auto const& [name, contents] : files) {
+      auto entry = fs.find(name.c_str());
+      file_stat st;
+
+      ASSERT_TRUE(entry) << name;
+      EXPECT_EQ(fs.getattr(*entry, &st), 0);
+      EXPECT_EQ(st.size, contents.size());
+
+      int inode = fs.open(*entry);
+      EXPECT_GE(inode, 0);
+
+      std::vector<char> buf(st.size);
+      ssize_t rv = fs.read(inode, &buf[0], st.size, 0);
+      EXPECT_EQ(rv, st.size);
+      EXPECT_EQ(std::string(buf.begin(), buf.end()), contents) << name;
+    }
+  }
+
+  block_manager::config cfg;
+  scanner_options opts;
+  random_data_source random_data;
+  std::map<std::string, std::string> files;
+};
+
 void basic_end_to_end_test(std::string const& compressor,
                            unsigned block_size_bits, file_order_mode file_order,
                            bool with_devices, bool with_specials, bool set_uid,
@@ -110,7 +192,7 @@ void basic_end_to_end_test(std::string const& compressor,
   options.with_devices = with_devices;
   options.with_specials = with_specials;
   options.inode.with_similarity = file_order == file_order_mode::SIMILARITY;
-  options.inode.with_nilsimsa = file_order == file_order_mode::NILSIMSA;
+  options.inode.with_nilsimsa = options.file_order.needs_nilsimsa();
   options.keep_all_times = keep_all_times;
   options.pack_chunk_table = pack_chunk_table;
   options.pack_directories = pack_directories;
@@ -595,6 +677,7 @@ INSTANTIATE_TEST_SUITE_P(
         ::testing::ValuesIn(compressions), ::testing::Values(12, 15, 20, 28),
         ::testing::Values(file_order_mode::NONE, file_order_mode::PATH,
                           file_order_mode::SCRIPT, file_order_mode::NILSIMSA,
+                          file_order_mode::NILSIMSA_INDEX,
                           file_order_mode::SIMILARITY),
         ::testing::Values(std::nullopt, "xxh3-128")));
 
@@ -659,7 +742,23 @@ TEST(block_manager, regression_block_boundary) {
   EXPECT_EQ(fs_blocks_expected, fs_blocks);
 }
 
-class compression_regression : public testing::TestWithParam<std::string> {};
+// Multithreaded compression also depends on how the compression library
+// was built (e.g. zstd without ZSTD_MULTITHREAD), so skip these if they
+// are not supported at runtime.
+void skip_unless_supported(std::string const& compression) {
+  if (compression.find(":mt") != std::string::npos) {
+    try {
+      block_compressor bc(compression);
+    } catch (runtime_error const& e) {
+      GTEST_SKIP() << e.what();
+    }
+  }
+}
+
+class compression_regression : public testing::TestWithParam<std::string> {
+ protected:
+  void SetUp() override { skip_unless_supported(GetParam()); }
+};
 
 TEST_P(compression_regression, github45) {
   auto compressor = GetParam();
@@ -745,9 +844,373 @@ TEST_P(compression_regression, github45) {
   check_file("test", test::loremipsum(file_size));
 }
 
+TEST_P(compression_regression, incompressible_files) {
+  auto compressor = GetParam();
+
+  block_manager::config cfg;
+
+  constexpr size_t block_size_bits = 16;
+  constexpr size_t block_size = 1 << block_size_bits;
+
+  cfg.blockhash_window_size = 0;
+  cfg.block_size_bits = block_size_bits;
+  cfg.incompressible_threshold = 7.5;
+
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 1 << 20;
+  opts.metadata.check_consistency = true;
+
+  test::test_logger lgr;
+
+  std::independent_bits_engine<std::mt19937_64,
+                               std::numeric_limits<uint8_t>::digits, uint16_t>
+      rng;
+
+  std::string random;
+  random.resize(5 * block_size / 2);
+  std::generate(begin(random), end(random), std::ref(rng));
+
+  std::map<std::string, std::string> files{
+      {"a", test::loremipsum(3 * block_size / 2)},
+      {"b", random},
+      {"c", test::loremipsum(block_size)},
+  };
+
+  auto input = std::make_shared<test::os_access_mock>();
+
+  input->add_dir("");
+  for (auto const& [name, contents] : files) {
+    input->add_file(name, contents);
+  }
+
+  progress prog([](const progress&, bool) {}, 1000);
+
+  auto fsdata = build_dwarfs(lgr, input, compressor, cfg, scanner_options(),
+                             &prog);
+
+  EXPECT_EQ(1, prog.incompressible_files);
+  EXPECT_EQ(random.size(), prog.incompressible_bytes);
+  EXPECT_EQ(3, prog.incompressible_blocks);
+
+  auto mm = std::make_shared<test::mmap_mock>(fsdata);
+
+  std::stringstream idss;
+  filesystem_v2::identify(lgr, mm, idss, 3);
+
+  std::string line;
+  std::regex const re("^SECTION num=\\d+, type=BLOCK, compression=(\\w+).*");
+  size_t uncompressed_blocks = 0;
+  while (std::getline(idss, line)) {
+    std::smatch m;
+    if (std::regex_match(line, m, re) && m[1] == "NONE") {
+      ++uncompressed_blocks;
+    }
+  }
+
+  EXPECT_GE(uncompressed_blocks, 3);
+
+  filesystem_v2 fs(lgr, mm, opts);
+
+  for (auto const& [name, contents] : files) {
+    auto entry = fs.find(name.c_str());
+    file_stat st;
+
+    ASSERT_TRUE(entry) << name;
+    EXPECT_EQ(fs.getattr(*entry, &st), 0);
+    EXPECT_EQ(st.size, contents.size());
+
+    int inode = fs.open(*entry);
+    EXPECT_GE(inode, 0);
+
+    std::vector<char> buf(st.size);
+    ssize_t rv = fs.read(inode, &buf[0], st.size, 0);
+    EXPECT_EQ(rv, st.size);
+    EXPECT_EQ(std::string(buf.begin(), buf.end()), contents) << name;
+  }
+}
+
+TEST_P(compression_regression, categorized_files) {
+  auto compressor = GetParam();
+
+  block_manager::config cfg;
+
+  constexpr size_t block_size_bits = 16;
+  constexpr size_t block_size = 1 << block_size_bits;
+
+  cfg.block_size_bits = block_size_bits;
+
+  auto catmgr = std::make_shared<categorizer_manager>();
+  for (auto const& name : categorizer_manager::builtin_categorizers()) {
+    catmgr->add(categorizer_manager::create_builtin(name, {}));
+  }
+
+  scanner_options options;
+  options.inode.categorizer_mgr = catmgr;
+
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 1 << 20;
+  opts.metadata.check_consistency = true;
+
+  test::test_logger lgr;
+
+  std::independent_bits_engine<std::mt19937_64,
+                               std::numeric_limits<uint8_t>::digits, uint16_t>
+      rng;
+
+  std::map<std::string, std::string> files;
+
+  for (int i = 0; i < 20; ++i) {
+    std::string random;
+    random.resize(block_size + 1000 * i);
+    std::generate(begin(random), end(random), std::ref(rng));
+
+    auto elf = random.substr(0, block_size / 4 + 100 * i);
+    elf.replace(0, 4, "\x7f"
+                      "ELF");
+
+    files.emplace(fmt::format("text{:02}", i),
+                  test::loremipsum(block_size / 2 + 777 * i));
+    files.emplace(fmt::format("random{:02}", i), std::move(random));
+    files.emplace(fmt::format("elf{:02}", i), std::move(elf));
+  }
+
+  auto input = std::make_shared<test::os_access_mock>();
+
+  input->add_dir("");
+  for (auto const& [name, contents] : files) {
+    input->add_file(name, contents);
+  }
+
+  auto fsdata = build_dwarfs(lgr, input, compressor, cfg, options);
+
+  // block order must not depend on thread scheduling
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(fsdata, build_dwarfs(lgr, input, compressor, cfg, options));
+  }
+
+  auto mm = std::make_shared<test::mmap_mock>(fsdata);
+
+  filesystem_v2 fs(lgr, mm, opts);
+
+  std::ostringstream dumpss;
+  fs.dump(dumpss, 1);
+
+  auto dump = dumpss.str();
+  for (auto const& name : categorizer_manager::builtin_categorizers()) {
+    EXPECT_NE(dump.find(fmt::format("{} (", name)), std::string::npos)
+        << name;
+  }
+
+  for (auto const& [name, contents] : files) {
+    auto entry = fs.find(name.c_str());
+    file_stat st;
+
+    ASSERT_TRUE(entry) << name;
+    EXPECT_EQ(fs.getattr(*entry, &st), 0);
+    EXPECT_EQ(st.size, contents.size());
+
+    int inode = fs.open(*entry);
+    EXPECT_GE(inode, 0);
+
+    std::vector<char> buf(st.size);
+    ssize_t rv = fs.read(inode, &buf[0], st.size, 0);
+    EXPECT_EQ(rv, st.size);
+    EXPECT_EQ(std::string(buf.begin(), buf.end()), contents) << name;
+  }
+}
+
 INSTANTIATE_TEST_SUITE_P(dwarfs, compression_regression,
                          ::testing::ValuesIn(compressions));
 
+std::vector<std::string> const multithreaded_compressions{
+#ifdef DWARFS_HAVE_LIBZSTD
+    "zstd:level=3:mt",
+#endif
+#ifdef DWARFS_HAVE_LIBLZMA
+    "lzma:level=1:mt:mt_block_size=16",
+#endif
+};
+
+// multithreaded compressors must still produce reproducible images
+INSTANTIATE_TEST_SUITE_P(dwarfs_mt, compression_regression,
+                         ::testing::ValuesIn(multithreaded_compressions));
+
+class multithreaded_compression
+    : public testing::TestWithParam<std::string> {
+ protected:
+  void SetUp() override { skip_unless_supported(GetParam()); }
+};
+
+TEST_P(multithreaded_compression, independent_of_thread_count) {
+  block_compressor bc(GetParam());
+
+  std::mt19937_64 rng{42};
+  auto text = test::loremipsum(6 << 20);
+  std::vector<uint8_t> data(text.begin(), text.end());
+
+  // large enough to be split into several jobs even by zstd
+  data.resize(12 << 20);
+  std::generate(data.begin() + text.size(), data.end(),
+                [&] { return static_cast<uint8_t>(rng() % 64); });
+
+  auto ref = bc.compress(data, 1);
+
+  EXPECT_LT(ref.size(), data.size());
+
+  for (size_t num_threads : {2, 3, 8}) {
+    EXPECT_EQ(ref, bc.compress(data, num_threads)) << num_threads;
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(dwarfs, multithreaded_compression,
+                         ::testing::ValuesIn(multithreaded_compressions));
+
+#ifdef DWARFS_HAVE_LIBZSTD
+TEST(multithreaded_compression, zstd_high_level) {
+  std::string const compression{"zstd:level=19:mt:mt_job_size=21"};
+
+  skip_unless_supported(compression);
+  if (IsSkipped()) {
+    return;
+  }
+
+  block_compressor bc(compression);
+
+  std::mt19937_64 rng{42};
+  auto text = test::loremipsum(8 << 20);
+  std::vector<uint8_t> data(text.begin(), text.end());
+
+  data.resize(16 << 20);
+  std::generate(data.begin() + text.size(), data.end(),
+                [&] { return static_cast<uint8_t>(rng() % 64); });
+
+  auto ref = bc.compress(data, 1);
+
+  EXPECT_EQ(ref, bc.compress(data, 4));
+  EXPECT_EQ(data, block_decompressor::decompress(compression_type::ZSTD,
+                                                 ref.data(), ref.size()));
+
+  // the block must actually be split into several jobs at this level
+  block_compressor single_job("zstd:level=19:mt:mt_job_size=30");
+
+  EXPECT_NE(ref, single_job.compress(data, 4));
+}
+#endif
+
+#ifdef DWARFS_HAVE_LIBZSTD
+TEST(filesystem_writer, adaptive_compression) {
+  test::test_logger lgr(logger::INFO);
+
+  block_manager::config cfg;
+  cfg.block_size_bits = 12;
+
+  auto input = test::os_access_mock::create_test_instance();
+
+  worker_group wg("worker", 2);
+  progress prog([](const progress&, bool) {}, 1000);
+  scanner s(lgr, wg, cfg, entry_factory::create(), input,
+            std::make_shared<test::script_mock>(), scanner_options());
+
+  std::ostringstream oss;
+  block_compressor bc("zstd:level=1");
+  filesystem_writer fsw(oss, lgr, wg, prog, bc);
+
+  fsw.set_adaptive_compression({"zstd:level=1", "zstd:level=3"});
+
+  s.scan(fsw, std::filesystem::path("/"), prog);
+
+  size_t num_adaptive = 0;
+  std::map<std::string, size_t> logged;
+  std::regex const re("^adaptive compression: (\\d+) blocks with (.*)$");
+
+  for (auto const& ent : lgr.get_log()) {
+    std::smatch m;
+    if (std::regex_match(ent.output, m, re)) {
+      num_adaptive += std::stoul(m[1]);
+      logged[m[2]] += std::stoul(m[1]);
+    }
+  }
+
+  auto mm = std::make_shared<test::mmap_mock>(oss.str());
+  filesystem_v2 fs(lgr, mm);
+
+  EXPECT_GT(num_adaptive, 0U);
+  EXPECT_EQ(fs.num_blocks(), num_adaptive);
+
+  // the level of each block is stored in the metadata
+  auto const block_compression = fs.block_compression();
+  std::map<std::string, size_t> stored;
+
+  ASSERT_EQ(fs.num_blocks(), block_compression.size());
+
+  for (auto const& spec : block_compression) {
+    ++stored[spec];
+  }
+
+  EXPECT_EQ(logged, stored);
+
+  std::ostringstream dumpss;
+  fs.dump(dumpss, 1);
+
+  for (auto const& [spec, count] : stored) {
+    EXPECT_NE(dumpss.str().find(fmt::format("{} ({} blocks)", spec, count)),
+              std::string::npos)
+        << dumpss.str();
+  }
+
+  auto iv = fs.find("/foo.pl");
+  ASSERT_TRUE(iv);
+  file_stat st;
+  ASSERT_EQ(0, fs.getattr(*iv, &st));
+  std::string buf(st.size, '\0');
+  EXPECT_EQ(st.size, fs.read(iv->inode_num(), buf.data(), buf.size()));
+}
+#endif
+
+namespace {
+
+size_t feed_load(compression_level_controller& ctl, size_t active,
+                 size_t workers, size_t capacity, size_t periods) {
+  for (size_t i = 0; i < 2 * workers * periods; ++i) {
+    ctl.update(active, workers, capacity);
+  }
+  return ctl.level();
+}
+
+} // namespace
+
+TEST(compression_level_controller, injected_load) {
+  compression_level_controller ctl(4);
+
+  EXPECT_EQ(3, ctl.level());
+
+  // saturated queue: one step down per sampling period
+  EXPECT_EQ(2, feed_load(ctl, 16, 4, 16, 1));
+  EXPECT_DOUBLE_EQ(16.0, ctl.last_average());
+  EXPECT_EQ(1, feed_load(ctl, 16, 4, 16, 1));
+  EXPECT_EQ(0, feed_load(ctl, 16, 4, 16, 1));
+  EXPECT_EQ(0, feed_load(ctl, 16, 4, 16, 1));
+
+  // incomplete sampling period doesn't change the level
+  ctl.update(1, 4, 16);
+  EXPECT_EQ(0, ctl.level());
+
+  // mostly idle workers: back up to the strongest level
+  EXPECT_EQ(3, feed_load(ctl, 1, 4, 16, 4));
+
+  // all workers busy with a moderate backlog: stay put
+  EXPECT_EQ(3, feed_load(ctl, 6, 4, 16, 4));
+
+  // the same backlog fills a small queue, but not a large one
+  EXPECT_EQ(3, feed_load(ctl, 7, 4, 64, 4));
+  EXPECT_EQ(2, feed_load(ctl, 7, 4, 8, 1));
+
+  // a single level can never change
+  compression_level_controller single(1);
+  EXPECT_EQ(0, feed_load(single, 100, 1, 1, 4));
+  EXPECT_EQ(0, feed_load(single, 0, 1, 1, 4));
+}
+
 class file_scanner
     : public testing::TestWithParam<
           std::tuple<file_order_mode, std::optional<std::string>>> {};
@@ -763,7 +1226,7 @@ TEST_P(file_scanner, inode_ordering) {
   opts.file_order.mode = order_mode;
   opts.file_hash_algorithm = file_hash_algo;
   opts.inode.with_similarity = order_mode == file_order_mode::SIMILARITY;
-  opts.inode.with_nilsimsa = order_mode == file_order_mode::NILSIMSA;
+  opts.inode.with_nilsimsa = opts.file_order.needs_nilsimsa();
 
   auto input = std::make_shared<test::os_access_mock>();
   constexpr int dim = 14;
@@ -791,7 +1254,8 @@ TEST_P(file_scanner, inode_ordering) {
 INSTANTIATE_TEST_SUITE_P(
     dwarfs, file_scanner,
     ::testing::Combine(::testing::Values(file_order_mode::PATH,
-                                         file_order_mode::SIMILARITY),
+                                         file_order_mode::SIMILARITY,
+                                         file_order_mode::NILSIMSA_INDEX),
                        ::testing::Values(std::nullopt, "xxh3-128")));
 
 class filter : public testing::TestWithParam<dwarfs::test::filter_test_data> {};
@@ -890,49 +1354,464 @@ TEST(file_scanner, input_list) {
   EXPECT_EQ(expected, got);
 }
 
-TEST(filesystem, uid_gid_32bit) {
+TEST(file_scanner, base_image) {
   test::test_logger lgr;
+  random_file_set fset;
+  auto& files = fset.files;
+  auto& opts = fset.opts;
 
-  auto input = std::make_shared<test::os_access_mock>();
+  auto base_data = build_dwarfs(lgr, fset.make_input(), "null", fset.cfg, opts);
 
-  input->add("", {1, 040755, 1, 0, 0, 10, 42, 0, 0, 0});
-  input->add("foo16.txt", {2, 0100755, 1, 60000, 65535, 5, 42, 0, 0, 0},
-             "hello");
-  input->add("foo32.txt", {3, 0100755, 1, 65536, 4294967295, 5, 42, 0, 0, 0},
-             "world");
+  files["file042"] += "changed";
+  files.erase("file077");
+  files.emplace("new", fset.random_data(12345));
 
-  auto fsimage = build_dwarfs(lgr, input, "null");
+  base_image_options bopts;
+  bopts.reuse_threshold = 0.8;
 
-  auto mm = std::make_shared<test::mmap_mock>(std::move(fsimage));
+  opts.inode.base = std::make_shared<base_image>(
+      lgr, std::make_shared<test::mmap_mock>(base_data), bopts);
 
-  filesystem_v2 fs(lgr, mm);
+  progress prog([](const progress&, bool) {}, 1000);
 
-  auto iv16 = fs.find("/foo16.txt");
-  auto iv32 = fs.find("/foo32.txt");
+  auto fsdata =
+      build_dwarfs(lgr, fset.make_input(), "null", fset.cfg, opts, &prog);
 
-  EXPECT_TRUE(iv16);
-  EXPECT_TRUE(iv32);
+  // only the changed and new files, plus files sharing a block with
+  // the changed or removed file, must be written again
+  EXPECT_GE(prog.inodes_written, 2);
+  EXPECT_LT(prog.inodes_written, 20);
 
-  file_stat st16, st32;
+  filesystem_options fsopts;
+  fsopts.metadata.check_consistency = true;
 
-  EXPECT_EQ(0, fs.getattr(*iv16, &st16));
-  EXPECT_EQ(0, fs.getattr(*iv32, &st32));
+  filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(fsdata), fsopts);
 
-  EXPECT_EQ(60000, st16.uid);
-  EXPECT_EQ(65535, st16.gid);
-  EXPECT_EQ(65536, st32.uid);
-  EXPECT_EQ(4294967295, st32.gid);
+  size_t num_files = 0;
+
+  fs.walk([&](dir_entry_view e) {
+    if (e.inode().is_regular_file()) {
+      ++num_files;
+    }
+  });
+
+  EXPECT_EQ(files.size(), num_files);
+
+  fset.check_contents(fs);
 }
 
-TEST(filesystem, uid_gid_count) {
+TEST(file_scanner, delta_image) {
   test::test_logger lgr;
+  random_file_set fset;
+  auto& files = fset.files;
+  auto& opts = fset.opts;
 
-  auto input = std::make_shared<test::os_access_mock>();
+  auto base_mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, fset.make_input(), "null", fset.cfg, opts));
+  filesystem_v2 base_fs(lgr, base_mm);
 
-  input->add("", {1, 040755, 1, 0, 0, 10, 42, 0, 0, 0});
+  files["file042"] += "changed";
+  files.erase("file077");
+  files.emplace("new", fset.random_data(12345));
 
-  for (uint32_t i = 0; i < 100000; ++i) {
-    input->add(fmt::format("foo{:05d}.txt", i),
+  base_image_options bopts;
+  bopts.delta = true;
+
+  opts.inode.base = std::make_shared<base_image>(lgr, base_mm, bopts);
+
+  auto delta_mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, fset.make_input(), "null", fset.cfg, opts));
+
+  // delta images use a newer minor version so old readers refuse them
+  EXPECT_EQ(MINOR_VERSION_NO_DELTA, base_mm->as<section_header_v2>()->minor);
+  EXPECT_EQ(MINOR_VERSION, delta_mm->as<section_header_v2>()->minor);
+
+  EXPECT_THROW(static_cast<void>(filesystem_v2(lgr, delta_mm)),
+               runtime_error);
+
+  filesystem_options fsopts;
+  fsopts.metadata.check_consistency = true;
+  fsopts.base_images.push_back(base_mm);
+
+  filesystem_v2 delta_fs(lgr, delta_mm, fsopts);
+
+  auto bases = delta_fs.base_images();
+  ASSERT_EQ(1, bases.size());
+  EXPECT_EQ(base_fs.image_checksum(), bases[0].checksum);
+  EXPECT_EQ(base_fs.num_blocks(), bases[0].block_count);
+
+  // only the changed and new files are stored in the delta image
+  auto const delta_blocks = delta_fs.num_blocks() - base_fs.num_blocks();
+  EXPECT_GT(delta_blocks, 0);
+  EXPECT_LT(delta_blocks, base_fs.num_blocks());
+
+  fset.check_contents(delta_fs);
+
+  // a delta image can be used as a base for another delta image
+  files.emplace("newer", fset.random_data(23456));
+
+  bopts.base_images.push_back(base_mm);
+  opts.inode.base = std::make_shared<base_image>(lgr, delta_mm, bopts);
+
+  auto delta2_mm = std::make_shared<test::mmap_mock>(
+      build_dwarfs(lgr, fset.make_input(), "null", fset.cfg, opts));
+
+  fsopts.base_images.push_back(delta_mm);
+
+  filesystem_v2 delta2_fs(lgr, delta2_mm, fsopts);
+
+  bases = delta2_fs.base_images();
+  ASSERT_EQ(2, bases.size());
+  EXPECT_EQ(base_fs.image_checksum(), bases[0].checksum);
+  EXPECT_EQ(delta_fs.image_checksum(), bases[1].checksum);
+  EXPECT_EQ(delta_blocks, bases[1].block_count);
+
+  fset.check_contents(delta2_fs);
+
+  // blocks cannot be copied from a delta image
+  bopts.delta = false;
+  EXPECT_THROW(static_cast<void>(base_image(lgr, delta_mm, bopts)),
+               runtime_error);
+}
+
+TEST(file_scanner, profile_order) {
+  test::test_logger lgr;
+
+  block_manager::config cfg;
+  cfg.blockhash_window_size = 0;
+  cfg.block_size_bits = 16;
+
+  auto opts = scanner_options();
+  opts.file_order.mode = file_order_mode::PATH;
+
+  std::independent_bits_engine<std::mt19937_64,
+                               std::numeric_limits<uint8_t>::digits, uint16_t>
+      rng;
+
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  input->add_dir("sub");
+
+  for (int i = 0; i < 100; ++i) {
+    std::string data;
+    data.resize(1000 + 37 * i);
+    std::generate(begin(data), end(data), std::ref(rng));
+    input->add_file(fmt::format("sub/file{:03}", i), data);
+  }
+
+  std::vector<std::string> const hot{"sub/file090", "sub/file003",
+                                     "sub/file050", "sub/file071",
+                                     "sub/file010"};
+
+  // record a profile the same way the FUSE driver does
+  access_profile prof;
+
+  {
+    auto fsimage = build_dwarfs(lgr, input, "null", cfg, opts);
+    filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(fsimage));
+    vfs_stat st;
+
+    EXPECT_EQ(0, fs.statvfs(&st));
+
+    access_recorder rec(st.files);
+
+    for (auto const& path : hot) {
+      auto iv = fs.find(path.c_str());
+      ASSERT_TRUE(iv) << path;
+      auto inode = fs.open(*iv);
+      std::array<char, 16> buf;
+      EXPECT_EQ(16, fs.read(inode, buf.data(), buf.size(), 0));
+      rec.record(inode);
+      rec.record(inode);
+    }
+
+    std::stringstream ss;
+    rec.profile(fs).write(ss);
+    prof = access_profile::parse(ss);
+  }
+
+  EXPECT_EQ(hot, prof.paths());
+
+  opts.file_order.mode = file_order_mode::PROFILE;
+  opts.file_order.profile = std::make_shared<access_profile>(prof);
+  opts.inode.with_nilsimsa = true;
+
+  auto fsimage = build_dwarfs(lgr, input, "null", cfg, opts);
+  filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(fsimage));
+
+  std::pair<size_t, size_t> prev{0, 0};
+
+  for (auto const& path : hot) {
+    auto iv = fs.find(path.c_str());
+    ASSERT_TRUE(iv) << path;
+    auto chunks = fs.get_chunks(iv->inode_num());
+    ASSERT_TRUE(chunks) << path;
+    ASSERT_FALSE(chunks->empty()) << path;
+    auto const& first = *chunks->begin();
+    std::pair<size_t, size_t> pos{first.block(), first.offset()};
+    EXPECT_EQ(0U, pos.first) << path;
+    EXPECT_LE(prev, pos) << path;
+    prev = pos;
+  }
+}
+
+class tree_hash : public testing::TestWithParam<file_order_mode> {};
+
+TEST_P(tree_hash, dedupe) {
+  test::test_logger lgr;
+
+  auto opts = scanner_options();
+  opts.file_order.mode = GetParam();
+  opts.inode.with_nilsimsa = opts.file_order.needs_nilsimsa();
+  opts.inode.tree_hash_min_size = 4096;
+  opts.inode.tree_hash_leaf_size = 1000;
+
+  random_data_source random_data;
+
+  auto large = random_data(10000);
+  auto large_changed = large;
+  large_changed.back() ^= 1;
+  auto small = random_data(3000);
+
+  std::map<std::string, std::string> files{
+      {"large1", large}, {"large2", large}, {"large3", large_changed},
+      {"large4", large}, {"small1", small}, {"small2", small},
+      {"empty1", ""},    {"empty2", ""},
+  };
+
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  for (auto const& [name, contents] : files) {
+    input->add_file(name, contents);
+  }
+
+  progress prog([](const progress&, bool) {}, 1000);
+
+  auto fsimage = build_dwarfs(lgr, input, "null", block_manager::config(),
+                              opts, &prog);
+
+  EXPECT_EQ(4, prog.duplicate_files);
+  EXPECT_EQ(2 * large.size() + small.size(), prog.saved_by_deduplication);
+  EXPECT_EQ(4, prog.tree_hash_scans);
+
+  filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(fsimage));
+
+  for (auto const& [name, contents] : files) {
+    auto iv = fs.find(name.c_str());
+    ASSERT_TRUE(iv) << name;
+    std::string buf(contents.size(), '\0');
+    EXPECT_EQ(static_cast<ssize_t>(contents.size()),
+              fs.read(iv->inode_num(), buf.data(), buf.size()));
+    EXPECT_EQ(contents, buf) << name;
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(dwarfs, tree_hash,
+                         ::testing::Values(file_order_mode::NONE,
+                                           file_order_mode::NILSIMSA));
+
+class fused_scan : public testing::TestWithParam<bool> {};
+
+// All files have the same size, so duplicates can only be told apart by
+// hashing. With four scanner workers, most files are hashed while the
+// first file of that size is still being scanned for similarity.
+TEST_P(fused_scan, concurrent_same_size) {
+  test::test_logger lgr;
+
+  bool const speculative = GetParam();
+  constexpr size_t file_size = 4096;
+  constexpr size_t num_unique = 16;
+  constexpr size_t copies = 4;
+
+  auto opts = scanner_options();
+  opts.file_order.mode = file_order_mode::NILSIMSA;
+  opts.inode.with_nilsimsa = true;
+  if (speculative) {
+    opts.inode.speculative_scan_min_size = 1;
+  } else {
+    opts.inode.speculative_scan_min_size.reset();
+  }
+
+  std::mt19937_64 rng{42};
+  std::map<std::string, std::string> files;
+  std::vector<std::string> contents;
+
+  for (size_t i = 0; i < num_unique; ++i) {
+    auto& data = contents.emplace_back(file_size, '\0');
+    std::generate(data.begin(), data.end(), [&rng] { return rng() % 64; });
+  }
+
+  std::vector<size_t> order(num_unique * copies);
+  std::iota(order.begin(), order.end(), 0);
+  std::shuffle(order.begin(), order.end(), rng);
+
+  for (size_t i = 0; i < order.size(); ++i) {
+    files.emplace(fmt::format("file{:03d}", i),
+                  contents[order[i] % num_unique]);
+  }
+
+  auto input = std::make_shared<test::os_access_mock>();
+  input->add_dir("");
+  for (auto const& [name, data] : files) {
+    input->add_file(name, data);
+  }
+
+  progress prog([](const progress&, bool) {}, 1000);
+
+  auto fsimage = build_dwarfs(lgr, input, "null", block_manager::config(),
+                              opts, &prog);
+
+  EXPECT_EQ(num_unique * (copies - 1), prog.duplicate_files);
+  EXPECT_EQ(num_unique * (copies - 1) * file_size,
+            prog.saved_by_deduplication);
+
+  auto const bytes_read = prog.hash_bytes_read + prog.similarity_bytes_read +
+                          prog.fused_bytes_read;
+
+  if (speculative) {
+    // every file is read exactly once
+    EXPECT_EQ(files.size() * file_size, bytes_read);
+  } else {
+    // all but the first unique file are read again for similarity
+    EXPECT_EQ((files.size() + num_unique - 1) * file_size, bytes_read);
+  }
+
+  filesystem_v2 fs(lgr, std::make_shared<test::mmap_mock>(fsimage));
+
+  for (auto const& [name, data] : files) {
+    auto iv = fs.find(name.c_str());
+    ASSERT_TRUE(iv) << name;
+    std::string buf(data.size(), '\0');
+    EXPECT_EQ(static_cast<ssize_t>(data.size()),
+              fs.read(iv->inode_num(), buf.data(), buf.size()));
+    EXPECT_EQ(data, buf) << name;
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(dwarfs, fused_scan, ::testing::Bool());
+
+TEST(entry_factory, compact_entries) {
+  auto input = test::os_access_mock::create_test_instance();
+  input->add_dir("otherdir");
+  input->add_file("otherdir/ipsum.py", 100);
+
+  auto ef = entry_factory::create();
+  auto root = ef->create(*input, "/");
+  auto somedir = ef->create(*input, "somedir", root);
+  auto otherdir = ef->create(*input, "otherdir", root);
+  auto a = ef->create(*input, "ipsum.py", somedir);
+  auto b = ef->create(*input, "ipsum.py", otherdir);
+
+  // names are interned
+  EXPECT_EQ("ipsum.py", a->name());
+  EXPECT_EQ(&a->name(), &b->name());
+
+  EXPECT_EQ(somedir.get(), a->parent());
+  EXPECT_EQ(otherdir.get(), b->parent());
+  EXPECT_FALSE(root->has_parent());
+  EXPECT_EQ(std::filesystem::path("/somedir/ipsum.py"), a->fs_path());
+
+  auto st = a->status();
+  EXPECT_EQ(9, st.ino);
+  EXPECT_EQ(1, st.nlink);
+  EXPECT_EQ(posix_file_type::regular | 0644, st.mode);
+  EXPECT_EQ(1000, st.uid);
+  EXPECT_EQ(100, st.gid);
+  EXPECT_EQ(10000, st.size);
+  EXPECT_EQ(6001, st.atime);
+  EXPECT_EQ(6002, st.mtime);
+  EXPECT_EQ(6003, st.ctime);
+
+  a->set_permissions(0600);
+  EXPECT_EQ(posix_file_type::regular | 0600, a->status().mode);
+
+  auto zero = ef->create(*input, "zero", somedir);
+  ASSERT_EQ(entry::E_DEVICE, zero->type());
+  EXPECT_EQ(261, dynamic_cast<device const&>(*zero).device_id());
+  EXPECT_EQ(4000030003, zero->status().ctime);
+}
+
+TEST(pipeline_profile, stages) {
+  test::test_logger lgr;
+
+  auto input = test::os_access_mock::create_test_instance();
+
+  progress prog([](const progress&, bool) {}, 1000);
+
+  auto profile = std::make_shared<pipeline_profile>(
+      prog, std::chrono::milliseconds(1));
+
+  auto opts = scanner_options();
+  opts.profile = profile;
+
+  build_dwarfs(lgr, input, "null", block_manager::config(), opts, &prog);
+
+  profile->stop();
+
+  auto const pd = profile->as_dynamic();
+
+  std::vector<std::string> stages;
+  size_t inodes_written = 0;
+
+  for (auto const& st : pd["stages"]) {
+    stages.push_back(st["name"].asString());
+    EXPECT_GE(st["wall_time"].asDouble(), 0.0);
+    inodes_written += st["counters"]["inodes_written"].asInt();
+  }
+
+  std::vector<std::string> const expected{
+      "scan", "hash", "finalize", "order", "blockify", "metadata", "compress",
+  };
+
+  EXPECT_EQ(expected, stages);
+  EXPECT_EQ(prog.inodes_written, inodes_written);
+  EXPECT_FALSE(pd["samples"].empty());
+  EXPECT_GT(pd["wall_time"].asDouble(), 0.0);
+}
+
+TEST(filesystem, uid_gid_32bit) {
+  test::test_logger lgr;
+
+  auto input = std::make_shared<test::os_access_mock>();
+
+  input->add("", {1, 040755, 1, 0, 0, 10, 42, 0, 0, 0});
+  input->add("foo16.txt", {2, 0100755, 1, 60000, 65535, 5, 42, 0, 0, 0},
+             "hello");
+  input->add("foo32.txt", {3, 0100755, 1, 65536, 4294967295, 5, 42, 0, 0, 0},
+             "world");
+
+  auto fsimage = build_dwarfs(lgr, input, "null");
+
+  auto mm = std::make_shared<test::mmap_mock>(std::move(fsimage));
+
+  filesystem_v2 fs(lgr, mm);
+
+  auto iv16 = fs.find("/foo16.txt");
+  auto iv32 = fs.find("/foo32.txt");
+
+  EXPECT_TRUE(iv16);
+  EXPECT_TRUE(iv32);
+
+  file_stat st16, st32;
+
+  EXPECT_EQ(0, fs.getattr(*iv16, &st16));
+  EXPECT_EQ(0, fs.getattr(*iv32, &st32));
+
+  EXPECT_EQ(60000, st16.uid);
+  EXPECT_EQ(65535, st16.gid);
+  EXPECT_EQ(65536, st32.uid);
+  EXPECT_EQ(4294967295, st32.gid);
+}
+
+TEST(filesystem, uid_gid_count) {
+  test::test_logger lgr;
+
+  auto input = std::make_shared<test::os_access_mock>();
+
+  input->add("", {1, 040755, 1, 0, 0, 10, 42, 0, 0, 0});
+
+  for (uint32_t i = 0; i < 100000; ++i) {
+    input->add(fmt::format("foo{:05d}.txt", i),
                {2 + i, 0100644, 1, 50000 + i, 250000 + i, 10, 42, 0, 0, 0},
                fmt::format("hello{:05d}", i));
   }
@@ -964,3 +1843,783 @@ TEST(filesystem, uid_gid_count) {
   EXPECT_EQ(149999, st99999.uid);
   EXPECT_EQ(349999, st99999.gid);
 }
+
+TEST(filesystem, lazy_init) {
+  test::test_logger lgr;
+
+  scanner_options options;
+  options.pack_chunk_table = true;
+  options.pack_directories = true;
+  options.pack_shared_files_table = true;
+
+  auto fsimage =
+      build_dwarfs(lgr, test::os_access_mock::create_test_instance(), "null",
+                   block_manager::config(), options);
+
+  auto mm = std::make_shared<test::mmap_mock>(std::move(fsimage));
+
+  filesystem_options opts;
+  opts.metadata.enable_nlink = true;
+
+  filesystem_v2 eager(lgr, mm, opts);
+
+  opts.metadata.lazy_init = true;
+
+  filesystem_v2 lazy(lgr, mm, opts);
+  lazy.start_background_init();
+
+  size_t num = 0;
+
+  eager.walk([&](dir_entry_view e) {
+    ++num;
+    auto path = e.unix_path();
+    auto iv = lazy.find(path.c_str());
+    ASSERT_TRUE(iv) << path;
+
+    file_stat st_eager, st_lazy;
+    ASSERT_EQ(0, eager.getattr(e.inode(), &st_eager)) << path;
+    ASSERT_EQ(0, lazy.getattr(*iv, &st_lazy)) << path;
+
+    EXPECT_EQ(st_eager.ino, st_lazy.ino) << path;
+    EXPECT_EQ(st_eager.mode, st_lazy.mode) << path;
+    EXPECT_EQ(st_eager.nlink, st_lazy.nlink) << path;
+    EXPECT_EQ(st_eager.size, st_lazy.size) << path;
+
+    if (st_eager.is_regular_file()) {
+      std::string buf_eager(st_eager.size, '\0');
+      std::string buf_lazy(st_lazy.size, '\0');
+      EXPECT_EQ(st_eager.size, eager.read(e.inode().inode_num(),
+                                          buf_eager.data(), buf_eager.size()));
+      EXPECT_EQ(st_lazy.size,
+                lazy.read(iv->inode_num(), buf_lazy.data(), buf_lazy.size()));
+      EXPECT_EQ(buf_eager, buf_lazy) << path;
+    }
+  });
+
+  EXPECT_GT(num, 10);
+}
+
+TEST(filesystem, demand_paged) {
+  test::test_logger lgr;
+
+  // "null" also leaves the metadata uncompressed
+  auto fsimage =
+      build_dwarfs(lgr, test::os_access_mock::create_test_instance(), "null");
+  auto mm = std::make_shared<test::mmap_mock>(std::move(fsimage));
+
+  filesystem_options opts;
+  filesystem_v2 ref(lgr, mm, opts);
+
+  opts.metadata.demand_paged = true;
+
+  {
+    filesystem_v2 fs(lgr, mm, opts);
+    fs.start_background_init();
+
+    size_t num = 0;
+
+    ref.walk([&](dir_entry_view e) {
+      ++num;
+      auto path = e.unix_path();
+      auto iv = fs.find(path.c_str());
+      ASSERT_TRUE(iv) << path;
+
+      file_stat st_ref, st;
+      ASSERT_EQ(0, ref.getattr(e.inode(), &st_ref)) << path;
+      ASSERT_EQ(0, fs.getattr(*iv, &st)) << path;
+
+      EXPECT_EQ(st_ref.ino, st.ino) << path;
+      EXPECT_EQ(st_ref.mode, st.mode) << path;
+      EXPECT_EQ(st_ref.size, st.size) << path;
+    });
+
+    EXPECT_GT(num, 10);
+  }
+
+  for (auto const& ent : lgr.get_log()) {
+    EXPECT_GT(ent.level, logger::WARN) << ent.output;
+  }
+}
+
+TEST(filesystem, demand_paged_corrupt_metadata) {
+  test::test_logger lgr;
+
+  auto fsimage =
+      build_dwarfs(lgr, test::os_access_mock::create_test_instance(), "null");
+
+  // Changing a name leaves the metadata structurally intact, so only the
+  // checksum can tell that it is corrupt.
+  auto pos = fsimage.rfind("ipsum.txt");
+  ASSERT_NE(std::string::npos, pos);
+  fsimage[pos] = 'I';
+
+  auto mm = std::make_shared<test::mmap_mock>(std::move(fsimage));
+
+  filesystem_options opts;
+  opts.metadata.demand_paged = true;
+
+  filesystem_v2 fs(lgr, mm, opts);
+
+  auto iv = fs.find("/foo.pl");
+  ASSERT_TRUE(iv);
+  auto root = fs.find("/");
+  ASSERT_TRUE(root);
+  auto dir = fs.opendir(*root);
+  ASSERT_TRUE(dir);
+
+  fs.start_background_init();
+
+  auto expect_eio = [](auto&& fn) {
+    try {
+      fn();
+      return false;
+    } catch (dwarfs::system_error const& e) {
+      EXPECT_EQ(EIO, e.get_errno());
+      return true;
+    }
+  };
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+
+  while (!expect_eio([&] { fs.find("/foo.pl"); })) {
+    ASSERT_LT(std::chrono::steady_clock::now(), deadline);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  file_stat st;
+  EXPECT_TRUE(expect_eio([&] { fs.getattr(*iv, &st); }));
+  EXPECT_TRUE(expect_eio([&] { fs.readdir(*dir, 0); }));
+
+  char buf[16];
+  EXPECT_EQ(-EIO, fs.read(iv->inode_num(), buf, sizeof(buf)));
+
+  EXPECT_TRUE(std::any_of(
+      lgr.get_log().begin(), lgr.get_log().end(), [](auto const& ent) {
+        return ent.level == logger::ERROR &&
+               ent.output.find("checksum error") != std::string::npos;
+      }));
+}
+
+TEST(filesystem, cache_stats) {
+  test::test_logger lgr;
+
+  auto fsimage =
+      build_dwarfs(lgr, test::os_access_mock::create_test_instance(), "null");
+  auto mm = std::make_shared<test::mmap_mock>(std::move(fsimage));
+
+  filesystem_v2 fs(lgr, mm);
+
+  auto iv = fs.find("/foo.pl");
+  ASSERT_TRUE(iv);
+
+  file_stat st;
+  ASSERT_EQ(0, fs.getattr(*iv, &st));
+
+  std::string buf(st.size, '\0');
+
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_EQ(st.size, fs.read(iv->inode_num(), buf.data(), buf.size()));
+  }
+
+  auto stats = fs.get_cache_stats();
+
+  EXPECT_GE(stats.range_requests, 2);
+  EXPECT_GE(stats.active_hits_fast + stats.active_hits_slow +
+                stats.cache_hits_fast + stats.cache_hits_slow,
+            1);
+  EXPECT_GE(stats.blocks_created, 1);
+  EXPECT_GE(stats.bytes_decompressed, st.size);
+  EXPECT_GT(stats.num_workers, 0);
+}
+
+#ifdef DWARFS_HAVE_LIBZSTD
+namespace {
+
+// Many small files spread over lots of small blocks, so that reading
+// them all puts the block cache under pressure
+class small_files_image {
+ public:
+  static constexpr unsigned block_size_bits = 12;
+
+  small_files_image(logger& lgr, size_t num_files) {
+    block_manager::config cfg;
+    cfg.blockhash_window_size = 0;
+    cfg.block_size_bits = block_size_bits;
+
+    auto input = std::make_shared<test::os_access_mock>();
+
+    input->add_dir("");
+
+    for (size_t i = 0; i < num_files; ++i) {
+      auto name = fmt::format("file{:02d}", i);
+      auto data = fmt::format("{}\n", i) + test::loremipsum(8192);
+      input->add_file(name, data);
+      files_.emplace("/" + name, std::move(data));
+    }
+
+    image_ = build_dwarfs(lgr, input, "zstd:level=1", cfg);
+  }
+
+  std::string const& image() const { return image_; }
+
+  void read_all(filesystem_v2 const& fs, std::string const& who = "") const {
+    for (auto const& [name, contents] : files_) {
+      auto iv = fs.find(name.c_str());
+      ASSERT_TRUE(iv) << name;
+      std::string buf(contents.size(), '\0');
+      EXPECT_EQ(static_cast<ssize_t>(contents.size()),
+                fs.read(iv->inode_num(), buf.data(), buf.size()))
+          << name << who;
+      EXPECT_EQ(contents, buf) << name << who;
+    }
+  }
+
+ private:
+  std::map<std::string, std::string> files_;
+  std::string image_;
+};
+
+} // namespace
+
+TEST(filesystem, cache_shards) {
+  test::test_logger lgr;
+  small_files_image img(lgr, 64);
+  auto mm = std::make_shared<test::mmap_mock>(img.image());
+
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 10 << small_files_image::block_size_bits;
+  opts.block_cache.num_shards = 4;
+
+  filesystem_v2 fs(lgr, mm, opts);
+
+  auto stats = fs.get_cache_stats();
+
+  // only two shards can hold a reasonable number of blocks
+  EXPECT_EQ(2U, stats.num_shards);
+  EXPECT_EQ(10U, stats.max_cached_blocks);
+
+  std::vector<std::thread> readers;
+
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([&, t] {
+      for (int k = 0; k < 3; ++k) {
+        img.read_all(fs, fmt::format(", reader {}", t));
+      }
+    });
+  }
+
+  for (auto& t : readers) {
+    t.join();
+  }
+
+  stats = fs.get_cache_stats();
+
+  EXPECT_LE(stats.cached_blocks, 10U);
+  EXPECT_GT(stats.blocks_evicted, 0U);
+}
+
+TEST(filesystem, blocks_verified_once) {
+  test::test_logger lgr;
+  small_files_image img(lgr, 16);
+  auto mm = std::make_shared<test::mmap_mock>(img.image());
+
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 2 << small_files_image::block_size_bits;
+
+  filesystem_v2 fs(lgr, mm, opts);
+
+  for (int k = 0; k < 2; ++k) {
+    img.read_all(fs);
+  }
+
+  auto stats = fs.get_cache_stats();
+
+  // evicted blocks are recreated, but never checked again
+  EXPECT_GT(stats.blocks_evicted, 0U);
+  EXPECT_GT(stats.blocks_created, stats.blocks_verified);
+  EXPECT_GT(stats.blocks_verified, 0U);
+}
+
+TEST(fs_section, check_and_verify) {
+  test::test_logger lgr;
+  small_files_image img(lgr, 16);
+  test::mmap_mock mm(img.image());
+
+  std::vector<fs_section> sections;
+
+  for (size_t offset = 0; offset < mm.size();) {
+    auto& s = sections.emplace_back(mm, offset, 2);
+    offset = s.end();
+    EXPECT_TRUE(s.check_and_verify(mm)) << s.description();
+  }
+
+  auto block = std::find_if(sections.begin(), sections.end(), [](auto& s) {
+    return s.type() == section_type::BLOCK;
+  });
+
+  ASSERT_NE(block, sections.end());
+
+  auto corrupt = img.image();
+  corrupt[block->start() + block->length() / 2] ^= 0x01;
+  test::mmap_mock corrupt_mm(corrupt);
+
+  EXPECT_FALSE(block->check_fast(corrupt_mm));
+  EXPECT_FALSE(block->verify(corrupt_mm));
+  EXPECT_FALSE(block->check_and_verify(corrupt_mm));
+}
+#endif
+
+TEST(filesystem, read_batch) {
+  test::test_logger lgr;
+
+  block_manager::config cfg;
+  cfg.block_size_bits = 12;
+
+  auto fsimage = build_dwarfs(lgr, test::os_access_mock::create_test_instance(),
+                              "null", cfg);
+  auto mm = std::make_shared<test::mmap_mock>(std::move(fsimage));
+
+  filesystem_v2 fs(lgr, mm);
+
+  std::vector<read_request> requests;
+
+  fs.walk([&](dir_entry_view e) {
+    auto iv = e.inode();
+    if (iv.is_regular_file()) {
+      file_stat st;
+      ASSERT_EQ(0, fs.getattr(iv, &st));
+      auto size = static_cast<size_t>(st.size);
+      requests.push_back({iv.inode_num(), size, 0});
+      requests.push_back({iv.inode_num(), 100, 17});
+      requests.push_back({iv.inode_num(), 10, st.size + 5});
+    }
+  });
+
+  ASSERT_GT(requests.size(), 10U);
+
+  requests.push_back({0, 10, 0});
+  requests.push_back({requests.front().inode, 10, -1});
+
+  std::vector<int> calls(requests.size(), 0);
+
+  fs.read_batch(requests, [&](size_t i, auto data) {
+    ASSERT_LT(i, requests.size());
+    ++calls[i];
+
+    auto const& req = requests[i];
+
+    if (req.inode == 0) {
+      ASSERT_FALSE(data.hasValue());
+      EXPECT_EQ(-EBADF, data.error());
+      return;
+    }
+
+    if (req.offset < 0) {
+      ASSERT_FALSE(data.hasValue());
+      EXPECT_EQ(-EINVAL, data.error());
+      return;
+    }
+
+    ASSERT_TRUE(data.hasValue()) << i;
+
+    std::string got;
+    for (auto const& br : data.value()) {
+      got.append(reinterpret_cast<char const*>(br.data()), br.size());
+    }
+
+    std::string expected(req.size, '\0');
+    auto rv = fs.read(req.inode, expected.data(), req.size, req.offset);
+    ASSERT_GE(rv, 0);
+    expected.resize(rv);
+
+    EXPECT_EQ(expected, got) << i;
+  });
+
+  EXPECT_TRUE(std::all_of(calls.begin(), calls.end(),
+                          [](int n) { return n == 1; }));
+}
+
+TEST(performance_monitor, percentiles) {
+  auto perfmon = performance_monitor::create({"test"});
+  auto id = perfmon->setup_timer("test", "op");
+
+  std::vector<std::thread> threads;
+
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 1000; ++i) {
+        // one in a hundred samples is a slow outlier
+        auto latency = i % 100 == 99 ? 50'000'000 : 1'000'000;
+        perfmon->add_sample(id, perfmon->now() - latency);
+      }
+    });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  std::ostringstream oss;
+  perfmon->summarize(oss);
+  auto out = oss.str();
+
+  EXPECT_NE(out.find("[test.op]\n"), std::string::npos) << out;
+  EXPECT_NE(out.find("samples: 4000\n"), std::string::npos) << out;
+
+  auto get_ms = [&](std::string const& label) {
+    std::smatch m;
+    std::regex re(label + R"( latency: ([0-9.]+)ms)");
+    EXPECT_TRUE(std::regex_search(out, m, re)) << label << "\n" << out;
+    return m.empty() ? 0.0 : std::stod(m[1].str());
+  };
+
+  // log-linear buckets keep the estimates within ~6% of the true value
+  EXPECT_NEAR(1.0, get_ms("p50"), 0.07);
+  EXPECT_NEAR(1.0, get_ms("p90"), 0.07);
+  EXPECT_NEAR(50.0, get_ms("p999"), 3.5);
+  EXPECT_GE(get_ms("max"), 50.0);
+}
+
+TEST(performance_monitor, short_lived_threads) {
+  auto perfmon = performance_monitor::create({"test"});
+  auto id = perfmon->setup_timer("test", "op");
+
+  // Histograms of exited threads are reused by new threads, but their
+  // samples must not get lost.
+  for (int t = 0; t < 100; ++t) {
+    std::thread([&] {
+      for (int i = 0; i < 10; ++i) {
+        perfmon->add_sample(id, perfmon->now() - 1'000'000);
+      }
+    }).join();
+  }
+
+  // A thread may also outlive the monitor it has been using.
+  std::promise<void> used;
+  std::promise<void> destroyed;
+  std::thread late([&, mon = perfmon.get()] {
+    mon->add_sample(id, mon->now());
+    used.set_value();
+    destroyed.get_future().wait();
+  });
+
+  used.get_future().wait();
+
+  std::ostringstream oss;
+  perfmon->summarize(oss);
+  auto out = oss.str();
+
+  EXPECT_NE(out.find("samples: 1001\n"), std::string::npos) << out;
+
+  perfmon.reset();
+  destroyed.set_value();
+  late.join();
+}
+
+TEST(performance_monitor, slow_request_traces) {
+  using namespace std::chrono_literals;
+
+  auto perfmon = performance_monitor::create({"test"}, 100ms);
+  auto request_id = perfmon->setup_timer("test", "request");
+  auto worker_id = perfmon->setup_timer("test", "worker");
+
+  auto request = [&](bool slow) {
+    performance_monitor::scoped_trace trace(perfmon.get());
+    auto start = perfmon->now();
+
+    // attach the trace to another thread, just like the block cache does
+    std::thread worker([&, t = performance_monitor::current_trace()] {
+      performance_monitor::scoped_trace attach(t);
+      auto worker_start = perfmon->now();
+      if (slow) {
+        std::this_thread::sleep_for(200ms);
+      }
+      perfmon->add_sample(worker_id, worker_start);
+    });
+
+    worker.join();
+    perfmon->add_sample(request_id, start);
+  };
+
+  request(false);
+  request(true);
+  request(false);
+
+  EXPECT_FALSE(performance_monitor::current_trace());
+
+  std::ostringstream oss;
+  perfmon->dump_traces(oss);
+  auto out = oss.str();
+
+  EXPECT_NE(out.find("slow requests: 1 "), std::string::npos) << out;
+  EXPECT_EQ(out.find("request 1: "), std::string::npos) << out;
+  EXPECT_NE(out.find("request 2: "), std::string::npos) << out;
+  EXPECT_EQ(out.find("request 3: "), std::string::npos) << out;
+  EXPECT_NE(out.find(" test.request\n"), std::string::npos) << out;
+  EXPECT_NE(out.find(" test.worker\n"), std::string::npos) << out;
+
+  auto untraced = performance_monitor::create({"test"});
+
+  {
+    performance_monitor::scoped_trace trace(untraced.get());
+    EXPECT_FALSE(performance_monitor::current_trace());
+  }
+
+  oss.str("");
+  untraced->dump_traces(oss);
+  EXPECT_EQ("request tracing is disabled\n", oss.str());
+}
+
+TEST(latency_histogram, pow2_boundary) {
+  for (unsigned i : {3, 10, 20}) {
+    latency_histogram h;
+
+    auto count_below = [&](unsigned log2_value) {
+      latency_histogram::snapshot snap;
+      snap.merge(h);
+      return snap.count_below_pow2(log2_value);
+    };
+
+    h.add((UINT64_C(1) << i) - 1);
+    EXPECT_EQ(1, count_below(i)) << i;
+
+    h.add(UINT64_C(1) << i);
+    EXPECT_EQ(1, count_below(i)) << i;
+    EXPECT_EQ(2, count_below(i + 1)) << i;
+  }
+}
+
+TEST(openmetrics, writer) {
+  auto perfmon = performance_monitor::create({"test"});
+  auto id = perfmon->setup_timer("test", "op");
+
+  for (int i = 0; i < 3; ++i) {
+    perfmon->add_sample(id, perfmon->now());
+  }
+
+  std::ostringstream oss;
+  openmetrics_writer w(oss);
+
+  perfmon->write_openmetrics(w);
+  w.counter("requests", "Requests with \"quotes\"", uint64_t(42));
+  w.gauge("ratio", "A ratio", 0.5, "ratio");
+  w.finish();
+
+  auto out = oss.str();
+
+  EXPECT_TRUE(out.starts_with(
+      "# TYPE dwarfs_perfmon_latency_seconds histogram\n"
+      "# UNIT dwarfs_perfmon_latency_seconds seconds\n"))
+      << out;
+  EXPECT_NE(out.find("dwarfs_perfmon_latency_seconds_bucket"
+                     "{namespace=\"test\",section=\"op\",le=\"+Inf\"} 3\n"),
+            std::string::npos)
+      << out;
+  // bucket bounds are inclusive, so the first bucket only holds samples
+  // of zero ticks
+  EXPECT_NE(out.find("dwarfs_perfmon_latency_seconds_bucket"
+                     "{namespace=\"test\",section=\"op\",le=\"0\"} 0\n"),
+            std::string::npos)
+      << out;
+  EXPECT_NE(out.find("dwarfs_perfmon_latency_seconds_count"
+                     "{namespace=\"test\",section=\"op\"} 3\n"),
+            std::string::npos)
+      << out;
+  EXPECT_NE(out.find("# HELP dwarfs_requests Requests with \\\"quotes\\\"\n"
+                     "dwarfs_requests_total 42\n"),
+            std::string::npos)
+      << out;
+  EXPECT_NE(out.find("dwarfs_ratio 0.5\n"), std::string::npos) << out;
+  EXPECT_TRUE(out.ends_with("\n# EOF\n")) << out;
+
+  uint64_t prev = 0;
+  std::regex bucket_re(R"(_bucket\{[^}]*\} (\d+))");
+  for (std::sregex_iterator it(out.begin(), out.end(), bucket_re), end;
+       it != end; ++it) {
+    auto count = std::stoull((*it)[1].str());
+    EXPECT_GE(count, prev);
+    prev = count;
+  }
+  EXPECT_EQ(3, prev);
+}
+
+TEST(string_table, parallel_pack) {
+  std::mt19937_64 rng{42};
+  std::vector<std::string> input;
+
+  for (size_t i = 0; i < 200000; ++i) {
+    input.emplace_back(fmt::format("file{:x}.{}", rng() % 1000000,
+                                   i % 3 == 0 ? "txt" : "cpp"));
+  }
+
+  auto ref = string_table::pack(input);
+
+  ASSERT_TRUE(ref.symtab().has_value());
+
+  for (size_t num_workers : {1, 3, 8}) {
+    worker_group wg("packer", num_workers);
+    auto packed = string_table::pack(wg, input);
+    EXPECT_EQ(ref.buffer().value(), packed.buffer().value()) << num_workers;
+    EXPECT_EQ(ref.symtab().value(), packed.symtab().value()) << num_workers;
+    EXPECT_EQ(ref.index().value(), packed.index().value()) << num_workers;
+  }
+}
+
+class worker_group_test
+    : public testing::TestWithParam<worker_group_scheduler> {
+ protected:
+  worker_group make_group(size_t num_workers,
+                          size_t max_queue_len =
+                              std::numeric_limits<size_t>::max()) {
+    worker_group_options opts;
+    opts.scheduler = GetParam();
+    return worker_group(lgr, "test", num_workers, max_queue_len, 0, opts);
+  }
+
+  test::test_logger lgr;
+};
+
+TEST_P(worker_group_test, nested_add_job) {
+  auto wg = make_group(4);
+  std::atomic<size_t> count{0};
+
+  for (size_t i = 0; i < 100; ++i) {
+    wg.add_job([&] {
+      for (size_t k = 0; k < 20; ++k) {
+        EXPECT_TRUE(wg.add_job([&] { ++count; }));
+      }
+      ++count;
+    });
+  }
+
+  wg.wait();
+
+  EXPECT_EQ(2100U, count.load());
+  EXPECT_EQ(0U, wg.queue_size());
+}
+
+TEST_P(worker_group_test, wait_is_reusable) {
+  auto wg = make_group(3);
+  std::atomic<size_t> count{0};
+
+  for (size_t round = 1; round <= 5; ++round) {
+    for (size_t i = 0; i < 50; ++i) {
+      wg.add_job([&] {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+        ++count;
+      });
+    }
+
+    wg.wait();
+
+    EXPECT_EQ(50 * round, count.load());
+  }
+}
+
+TEST_P(worker_group_test, back_pressure) {
+  auto wg = make_group(1, 2);
+  std::promise<void> started;
+  std::promise<void> release;
+  auto release_future = release.get_future().share();
+  std::atomic<size_t> count{0};
+
+  wg.add_job([&, release_future] {
+    started.set_value();
+    release_future.wait();
+    ++count;
+  });
+
+  // Once the worker is busy, two more jobs fit into the queue ...
+  started.get_future().wait();
+  wg.add_job([&] { ++count; });
+  wg.add_job([&] { ++count; });
+
+  // ... and the next one must block until there's space again.
+  std::atomic<bool> added{false};
+  std::thread producer([&] {
+    wg.add_job([&] { ++count; });
+    added = true;
+  });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_FALSE(added.load());
+  EXPECT_EQ(2U, wg.queue_size());
+
+  release.set_value();
+  producer.join();
+  wg.wait();
+
+  EXPECT_TRUE(added.load());
+  EXPECT_EQ(4U, count.load());
+}
+
+TEST_P(worker_group_test, back_pressure_concurrent_producers) {
+  static constexpr size_t kMaxQueueLen = 2;
+  static constexpr size_t kNumProducers = 8;
+  static constexpr size_t kJobsPerProducer = 10;
+
+  auto wg = make_group(1, kMaxQueueLen);
+  std::promise<void> started;
+  std::promise<void> release;
+  auto release_future = release.get_future().share();
+  std::atomic<size_t> count{0};
+
+  wg.add_job([&, release_future] {
+    started.set_value();
+    release_future.wait();
+  });
+
+  started.get_future().wait();
+
+  std::vector<std::thread> producers;
+
+  for (size_t i = 0; i < kNumProducers; ++i) {
+    producers.emplace_back([&] {
+      for (size_t k = 0; k < kJobsPerProducer; ++k) {
+        wg.add_job([&] { ++count; });
+      }
+    });
+  }
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(kMaxQueueLen, wg.queue_size());
+
+  release.set_value();
+
+  for (auto& t : producers) {
+    t.join();
+  }
+
+  wg.wait();
+
+  EXPECT_EQ(kNumProducers * kJobsPerProducer, count.load());
+}
+
+TEST_P(worker_group_test, stop) {
+  auto wg = make_group(2);
+  std::atomic<size_t> count{0};
+
+  for (size_t i = 0; i < 200; ++i) {
+    wg.add_job([&] {
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+      ++count;
+    });
+  }
+
+  EXPECT_TRUE(wg.running());
+
+  // stop() runs all jobs that have already been queued ...
+  wg.stop();
+
+  EXPECT_FALSE(wg.running());
+  EXPECT_EQ(200U, count.load());
+
+  // ... but won't accept any new jobs
+  EXPECT_FALSE(wg.add_job([&] { ++count; }));
+  EXPECT_EQ(200U, count.load());
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    dwarfs, worker_group_test,
+    ::testing::Values(worker_group_scheduler::SHARED_QUEUE,
+                      worker_group_scheduler::WORK_STEALING));
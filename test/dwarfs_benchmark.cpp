@@ -19,10 +19,16 @@
  * along with dwarfs.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <atomic>
+#include <limits>
+#include <map>
+#include <mutex>
 #include <sstream>
 
 #include <benchmark/benchmark.h>
 
+#include <fmt/format.h>
+
 #include <thrift/lib/cpp2/frozen/FrozenUtil.h>
 
 #include "dwarfs/block_compressor.h"
@@ -31,6 +37,7 @@
 #include "dwarfs/file_stat.h"
 #include "dwarfs/filesystem_v2.h"
 #include "dwarfs/filesystem_writer.h"
+#include "dwarfs/fs_section.h"
 #include "dwarfs/iovec_read_buf.h"
 #include "dwarfs/logger.h"
 #include "dwarfs/options.h"
@@ -151,6 +158,65 @@ auto make_frozen_legacy_string_table(std::vector<std::string>&& strings) {
   return mapFrozen<std::vector<std::string>>(std::move(tmp));
 }
 
+void WorkerGroupParams(::benchmark::internal::Benchmark* b) {
+  for (auto scheduler : {worker_group_scheduler::SHARED_QUEUE,
+                         worker_group_scheduler::WORK_STEALING}) {
+    for (auto num_workers : {1, 4, 16}) {
+      b->Args({static_cast<int>(scheduler), num_workers});
+    }
+  }
+  b->UseRealTime();
+}
+
+worker_group
+make_worker_group(logger& lgr, ::benchmark::State const& state) {
+  worker_group_options options;
+  options.scheduler = static_cast<worker_group_scheduler>(state.range(0));
+  return worker_group(lgr, "bench", state.range(1),
+                      std::numeric_limits<size_t>::max(), 0, options);
+}
+
+// many tiny jobs submitted from a single external thread
+void worker_group_throughput(::benchmark::State& state) {
+  static constexpr size_t kNumJobs = 10000;
+  stream_logger lgr;
+  auto wg = make_worker_group(lgr, state);
+  std::atomic<size_t> counter{0};
+
+  for (auto _ : state) {
+    for (size_t i = 0; i < kNumJobs; ++i) {
+      wg.add_job(
+          [&counter] { counter.fetch_add(1, std::memory_order_relaxed); });
+    }
+    wg.wait();
+  }
+
+  state.SetItemsProcessed(state.iterations() * kNumJobs);
+}
+
+// jobs that fan out into more jobs from within the worker threads
+void worker_group_nested_throughput(::benchmark::State& state) {
+  static constexpr size_t kNumJobs = 100;
+  static constexpr size_t kFanOut = 100;
+  stream_logger lgr;
+  auto wg = make_worker_group(lgr, state);
+  std::atomic<size_t> counter{0};
+
+  for (auto _ : state) {
+    for (size_t i = 0; i < kNumJobs; ++i) {
+      wg.add_job([&] {
+        for (size_t k = 0; k < kFanOut; ++k) {
+          wg.add_job(
+              [&counter] { counter.fetch_add(1, std::memory_order_relaxed); });
+        }
+      });
+    }
+    wg.wait();
+  }
+
+  state.SetItemsProcessed(state.iterations() * kNumJobs * (kFanOut + 1));
+}
+
 void frozen_legacy_string_table_lookup(::benchmark::State& state) {
   auto data = make_frozen_legacy_string_table(test::test_string_vector());
   string_table table(data);
@@ -190,6 +256,235 @@ void dwarfs_initialize(::benchmark::State& state) {
   }
 }
 
+std::string make_large_filesystem(size_t num_files) {
+  static constexpr size_t kFilesPerDir = 256;
+
+  block_manager::config cfg;
+  scanner_options options;
+
+  cfg.blockhash_window_size = 8;
+  cfg.block_size_bits = 16;
+
+  options.inode.with_similarity = false;
+  options.inode.with_nilsimsa = false;
+  options.pack_chunk_table = true;
+  options.pack_directories = true;
+  options.pack_shared_files_table = true;
+  options.pack_names = true;
+  options.pack_names_index = true;
+
+  auto os = std::make_shared<test::os_access_mock>();
+
+  os->add_dir("");
+
+  for (size_t i = 0; i < num_files; ++i) {
+    auto dir = fmt::format("dir{:05d}", i / kFilesPerDir);
+    if (i % kFilesPerDir == 0) {
+      os->add_dir(dir);
+    }
+    // plenty of duplicates to populate the shared files table
+    os->add_file(fmt::format("{}/file{:08d}", dir, i),
+                 fmt::format("{}", i % (num_files / 4 + 1)));
+  }
+
+  worker_group wg("writer", 4);
+
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+  lgr.set_policy<prod_logger_policy>();
+
+  scanner s(lgr, wg, cfg, entry_factory::create(), os,
+            std::make_shared<test::script_mock>(), options);
+
+  std::ostringstream oss;
+  progress prog([](const progress&, bool) {}, 1000);
+
+  block_compressor bc("null");
+  filesystem_writer fsw(oss, lgr, wg, prog, bc);
+
+  s.scan(fsw, "", prog);
+
+  return oss.str();
+}
+
+// time until a large file system is ready to serve requests
+void dwarfs_initialize_large(::benchmark::State& state) {
+  auto image = make_large_filesystem(state.range(0));
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+  auto mm = std::make_shared<test::mmap_mock>(image);
+  filesystem_options opts;
+  opts.block_cache.max_bytes = 1 << 20;
+  opts.metadata.enable_nlink = true;
+  opts.metadata.lazy_init = state.range(1);
+
+  for (auto _ : state) {
+    auto fs = std::make_unique<filesystem_v2>(lgr, mm, opts);
+    ::benchmark::DoNotOptimize(fs);
+    state.PauseTiming();
+    fs.reset();
+    state.ResumeTiming();
+  }
+}
+
+std::string
+make_compressed_filesystem(size_t num_files,
+                           std::string const& compression = "zstd:level=1") {
+  block_manager::config cfg;
+  scanner_options options;
+
+  cfg.blockhash_window_size = 0;
+  cfg.block_size_bits = 16;
+
+  options.inode.with_similarity = false;
+  options.inode.with_nilsimsa = false;
+
+  auto os = std::make_shared<test::os_access_mock>();
+
+  os->add_dir("");
+
+  for (size_t i = 0; i < num_files; ++i) {
+    std::string data;
+    for (size_t k = 0; data.size() < 16384; ++k) {
+      data += fmt::format("{}:{} ", i, k);
+    }
+    os->add_file(fmt::format("file{:05d}", i), data);
+  }
+
+  worker_group wg("writer", 4);
+
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+  lgr.set_policy<prod_logger_policy>();
+
+  scanner s(lgr, wg, cfg, entry_factory::create(), os,
+            std::make_shared<test::script_mock>(), options);
+
+  std::ostringstream oss;
+  progress prog([](const progress&, bool) {}, 1000);
+
+  block_compressor bc(compression);
+  filesystem_writer fsw(oss, lgr, wg, prog, bc);
+
+  s.scan(fsw, "", prog);
+
+  return oss.str();
+}
+
+// all blocks are cached, so this measures contention in the block cache
+class cached_filesystem {
+ public:
+  static constexpr size_t kNumFiles = 1024;
+
+  explicit cached_filesystem(size_t num_shards)
+      : image_{make_compressed_filesystem(kNumFiles)}
+      , mm_{std::make_shared<test::mmap_mock>(image_)}
+      , lgr_{logss_} {
+    filesystem_options opts;
+    opts.block_cache.max_bytes = size_t(1) << 30;
+    opts.block_cache.num_shards = num_shards;
+    fs_ = std::make_unique<filesystem_v2>(lgr_, mm_, opts);
+
+    fs_->walk([&](dir_entry_view e) {
+      auto iv = e.inode();
+      if (iv.is_regular_file()) {
+        file_stat st;
+        fs_->getattr(iv, &st);
+        inodes_.push_back({iv.inode_num(), static_cast<size_t>(st.size)});
+      }
+    });
+
+    // warm up the cache
+    for (auto const& [inode, size] : inodes_) {
+      iovec_read_buf buf;
+      fs_->readv(inode, buf, size);
+    }
+  }
+
+  static cached_filesystem const& get(size_t num_shards) {
+    static std::mutex mx;
+    static std::map<size_t, std::unique_ptr<cached_filesystem>> instances;
+    std::lock_guard lock(mx);
+    auto& fs = instances[num_shards];
+    if (!fs) {
+      fs = std::make_unique<cached_filesystem>(num_shards);
+    }
+    return *fs;
+  }
+
+  filesystem_v2 const& fs() const { return *fs_; }
+  std::vector<std::pair<uint32_t, size_t>> const& inodes() const {
+    return inodes_;
+  }
+
+ private:
+  std::string image_;
+  std::shared_ptr<mmif> mm_;
+  std::ostringstream logss_;
+  stream_logger lgr_;
+  std::unique_ptr<filesystem_v2> fs_;
+  std::vector<std::pair<uint32_t, size_t>> inodes_;
+};
+
+void block_cache_contention(::benchmark::State& state) {
+  auto const& cfs = cached_filesystem::get(state.range(0));
+  auto const& inodes = cfs.inodes();
+  size_t i = 7919 * state.thread_index();
+
+  for (auto _ : state) {
+    auto const& [inode, size] = inodes[i++ % inodes.size()];
+    auto x = cfs.fs().readv(inode, size);
+    for (auto& f : *x) {
+      auto r = f.get().size();
+      ::benchmark::DoNotOptimize(r);
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+
+std::string const& integrity_image() {
+  static auto const image = make_compressed_filesystem(4096, "null");
+  return image;
+}
+
+void section_integrity_check(::benchmark::State& state) {
+  auto const& image = integrity_image();
+  test::mmap_mock mm(image);
+  std::vector<fs_section> sections;
+
+  for (size_t offset = 0; offset < mm.size();) {
+    auto& s = sections.emplace_back(mm, offset, 2);
+    offset = s.end();
+  }
+
+  bool const single_pass = state.range(0);
+
+  for (auto _ : state) {
+    for (auto const& s : sections) {
+      auto ok = single_pass ? s.check_and_verify(mm)
+                            : s.check_fast(mm) && s.verify(mm);
+      ::benchmark::DoNotOptimize(ok);
+    }
+  }
+
+  state.SetBytesProcessed(state.iterations() * image.size());
+}
+
+void dwarfsck_check_integrity(::benchmark::State& state) {
+  auto const& image = integrity_image();
+  auto mm = std::make_shared<test::mmap_mock>(image);
+  std::ostringstream logss;
+  stream_logger lgr(logss);
+
+  for (auto _ : state) {
+    std::ostringstream oss;
+    filesystem_v2::identify(lgr, mm, oss, 0, state.range(0), true);
+  }
+
+  state.SetBytesProcessed(state.iterations() * image.size());
+}
+
 class filesystem : public ::benchmark::Fixture {
  public:
   static constexpr size_t NUM_ENTRIES = 8;
@@ -258,6 +553,20 @@ class filesystem : public ::benchmark::Fixture {
     }
   }
 
+  std::vector<read_request> all_files_requests() const {
+    std::vector<read_request> requests;
+    fs->walk([&](dir_entry_view e) {
+      auto iv = e.inode();
+      if (iv.is_regular_file()) {
+        file_stat st;
+        fs->getattr(iv, &st);
+        requests.push_back(
+            {iv.inode_num(), static_cast<size_t>(st.size), 0});
+      }
+    });
+    return requests;
+  }
+
   template <size_t N>
   void getattr_bench(::benchmark::State& state,
                      std::array<std::string_view, N> const& paths) {
@@ -453,6 +762,37 @@ BENCHMARK_DEFINE_F(filesystem, readv_future_large)(::benchmark::State& state) {
   readv_future_bench(state, "/ipsum.txt");
 }
 
+BENCHMARK_DEFINE_F(filesystem, read_all_readv)(::benchmark::State& state) {
+  auto requests = all_files_requests();
+
+  for (auto _ : state) {
+    for (auto const& req : requests) {
+      auto x = fs->readv(req.inode, req.size, req.offset);
+      for (auto& f : *x) {
+        auto r = f.get().size();
+        ::benchmark::DoNotOptimize(r);
+      }
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * requests.size());
+}
+
+BENCHMARK_DEFINE_F(filesystem, read_all_batch)(::benchmark::State& state) {
+  auto requests = all_files_requests();
+
+  for (auto _ : state) {
+    fs->read_batch(requests, [](size_t, auto data) {
+      for (auto const& br : *data) {
+        auto r = br.size();
+        ::benchmark::DoNotOptimize(r);
+      }
+    });
+  }
+
+  state.SetItemsProcessed(state.iterations() * requests.size());
+}
+
 } // namespace
 
 BENCHMARK(frozen_legacy_string_table_lookup);
@@ -465,6 +805,28 @@ BENCHMARK(frozen_string_table_lookup)
 
 BENCHMARK(dwarfs_initialize)->Apply(PackParams);
 
+BENCHMARK(dwarfs_initialize_large)
+    ->ArgsProduct({{100000, 1000000}, {false, true}})
+    ->Unit(::benchmark::kMillisecond);
+
+BENCHMARK(worker_group_throughput)->Apply(WorkerGroupParams);
+BENCHMARK(worker_group_nested_throughput)->Apply(WorkerGroupParams);
+
+// a single shard behaves like the unsharded cache
+BENCHMARK(block_cache_contention)
+    ->Arg(1)
+    ->Arg(16)
+    ->ThreadRange(1, 32)
+    ->UseRealTime();
+
+// 0 = separate XXH3 and SHA passes, 1 = single pass for both
+BENCHMARK(section_integrity_check)->Arg(0)->Arg(1);
+
+BENCHMARK(dwarfsck_check_integrity)
+    ->RangeMultiplier(2)
+    ->Range(1, 16)
+    ->UseRealTime();
+
 BENCHMARK_REGISTER_F(filesystem, find_inode)->Apply(PackParams);
 BENCHMARK_REGISTER_F(filesystem, find_inode_name)->Apply(PackParams);
 BENCHMARK_REGISTER_F(filesystem, find_path)->Apply(PackParams);
@@ -487,5 +849,7 @@ BENCHMARK_REGISTER_F(filesystem, readv_small)->Apply(PackParamsNone);
 BENCHMARK_REGISTER_F(filesystem, readv_large)->Apply(PackParamsNone);
 BENCHMARK_REGISTER_F(filesystem, readv_future_small)->Apply(PackParamsNone);
 BENCHMARK_REGISTER_F(filesystem, readv_future_large)->Apply(PackParamsNone);
+BENCHMARK_REGISTER_F(filesystem, read_all_readv)->Apply(PackParamsNone);
+BENCHMARK_REGISTER_F(filesystem, read_all_batch)->Apply(PackParamsNone);
 
 BENCHMARK_MAIN();
@@ -888,6 +888,47 @@ TEST_P(tools_test, end_to_end) {
   EXPECT_EQ(cdr.regular_files.size(), 26) << cdr;
   EXPECT_EQ(cdr.directories.size(), 19) << cdr;
   EXPECT_EQ(cdr.symlinks.size(), 2) << cdr;
+
+  auto extracted_parallel = td / "extracted_parallel";
+
+  ASSERT_TRUE(fs::create_directory(extracted_parallel));
+
+  ASSERT_TRUE(subprocess::check_run(*dwarfsextract_test_bin,
+                                    dwarfsextract_tool_arg, "-i", image, "-o",
+                                    extracted_parallel, "--disk-writers=4"));
+  EXPECT_EQ(3, num_hardlinks(extracted_parallel / "format.sh"));
+  EXPECT_TRUE(fs::is_symlink(extracted_parallel / "foobar"));
+  EXPECT_EQ(fs::read_symlink(extracted_parallel / "foobar"),
+            fs::path("foo") / "bar");
+  ASSERT_TRUE(compare_directories(fsdata_dir, extracted_parallel, &cdr))
+      << cdr;
+  EXPECT_EQ(cdr.regular_files.size(), 26) << cdr;
+  EXPECT_EQ(cdr.directories.size(), 19) << cdr;
+  EXPECT_EQ(cdr.symlinks.size(), 2) << cdr;
+
+  auto tarball = td / "image.tar";
+  auto image_from_tar = td / "image_from_tar.dwarfs";
+
+  ASSERT_TRUE(subprocess::check_run(*dwarfsextract_test_bin,
+                                    dwarfsextract_tool_arg, "-i", image, "-o",
+                                    tarball, "-f", "pax"));
+  ASSERT_TRUE(subprocess::check_run(
+      *mkdwarfs_test_bin, mkdwarfs_tool_arg, "-i", tarball, "-o",
+      image_from_tar, "--input-format=archive", "--spool-dir", td,
+      "--no-progress"));
+
+  ASSERT_TRUE(fs::create_directory(untared));
+
+  ASSERT_TRUE(subprocess::check_run(*dwarfsextract_test_bin,
+                                    dwarfsextract_tool_arg, "-i",
+                                    image_from_tar, "-o", untared));
+  EXPECT_EQ(3, num_hardlinks(untared / "format.sh"));
+  EXPECT_TRUE(fs::is_symlink(untared / "foobar"));
+  EXPECT_EQ(fs::read_symlink(untared / "foobar"), fs::path("foo") / "bar");
+  ASSERT_TRUE(compare_directories(fsdata_dir, untared, &cdr)) << cdr;
+  EXPECT_EQ(cdr.regular_files.size(), 26) << cdr;
+  EXPECT_EQ(cdr.directories.size(), 19) << cdr;
+  EXPECT_EQ(cdr.symlinks.size(), 2) << cdr;
 }
 
 #ifdef _WIN32
@@ -49,6 +49,9 @@ class mmap_mock : public mmif {
   std::error_code release_until(file_off_t) override {
     return std::error_code();
   }
+  std::error_code advise(advice, file_off_t, size_t) override {
+    return std::error_code();
+  }
 
  private:
   std::string const data_;
@@ -167,6 +167,18 @@ struct string_table {
    4: bool packed_index
 }
 
+/**
+ * A base image referenced by a delta image
+ */
+struct base_image_ref {
+   // SHA2-512/256 checksum identifying the base image, computed
+   // over the SHA2-512/256 checksums of all its block sections
+   1: string checksum
+
+   // number of blocks stored in the base image itself
+   2: UInt32 block_count
+}
+
 /**
  * File System Metadata
  *
@@ -352,4 +364,40 @@ struct metadata {
 
    // preferred path separator of original file system
   26: optional UInt32           preferred_path_separator
+
+   // names of all fragment categories, the first one being the
+   // default category
+  27: optional list<string>     category_names
+
+   // category of each block, as an index into `category_names`
+  28: optional list<UInt32>     block_categories
+
+   /**
+    * Base images of a delta image
+    *
+    * The blocks of all base images, in the order given here, are
+    * followed by the blocks of the image itself to form a single
+    * range of block numbers referenced by `chunks`. So if the
+    * base images hold 10 blocks in total, chunks referring to block
+    * 10 refer to the first block stored in this image. Note that
+    * `block_categories` only covers the blocks of the image itself.
+    */
+  29: optional list<base_image_ref> base_images
+
+   // compression used by adaptive compression, ordered from fastest
+   // to strongest
+  30: optional list<string>     adaptive_compression
+
+   /**
+    * Adaptive compression level of each block, as an index into
+    * `adaptive_compression`
+    *
+    * Blocks that were not compressed adaptively, e.g. because their
+    * category uses a different compression, use the number of entries
+    * in `adaptive_compression` as their level. Like `block_categories`,
+    * this only covers the blocks of the image itself. The levels are
+    * those chosen when the image was created, they are not updated when
+    * the image is recompressed.
+    */
+  31: optional list<UInt32>     block_compression_levels
 }